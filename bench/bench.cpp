@@ -0,0 +1,728 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fcntl.h>
+#include <ftw.h>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * The end-to-end benchmark of mirror. It generates a synthetic tree (reproducible for the given parameters
+ * and seed), then runs create-db, verify-dir (quick and full) and merge-dir against it with warm and cold
+ * caches and reports the wall time, the throughput and the peak RSS of each run.
+ */
+namespace
+{
+	const char * const programName = "mirror-bench";
+	const int getopt_tagStartValue = 1000;
+
+	const int fanoutTag = getopt_tagStartValue;
+	const int depthTag = getopt_tagStartValue + 1;
+	const int filesTag = getopt_tagStartValue + 2;
+	const int sizesTag = getopt_tagStartValue + 3;
+	const int nonAsciiTag = getopt_tagStartValue + 4;
+	const int seedTag = getopt_tagStartValue + 5;
+	const int mirrorTag = getopt_tagStartValue + 6;
+	const int dirTag = getopt_tagStartValue + 7;
+	const int repeatTag = getopt_tagStartValue + 8;
+	const int cacheTag = getopt_tagStartValue + 9;
+	const int argsTag = getopt_tagStartValue + 10;
+	const int generateOnlyTag = getopt_tagStartValue + 11;
+
+	static const struct option options[] = {
+		{"help", no_argument, nullptr, 'h'},
+		{"fanout", required_argument, nullptr, fanoutTag},
+		{"depth", required_argument, nullptr, depthTag},
+		{"files", required_argument, nullptr, filesTag},
+		{"sizes", required_argument, nullptr, sizesTag},
+		{"non-ascii", required_argument, nullptr, nonAsciiTag},
+		{"seed", required_argument, nullptr, seedTag},
+		{"mirror", required_argument, nullptr, mirrorTag},
+		{"dir", required_argument, nullptr, dirTag},
+		{"repeat", required_argument, nullptr, repeatTag},
+		{"cache", required_argument, nullptr, cacheTag},
+		{"mirror-args", required_argument, nullptr, argsTag},
+		{"generate-only", no_argument, nullptr, generateOnlyTag},
+		{0}
+	};
+
+	// File sizes are distributed log-uniformly within each bucket, buckets are chosen by their weights.
+	struct SizeBucket
+	{
+		unsigned weight;
+		unsigned long long minSize;
+		unsigned long long maxSize;
+	};
+
+	struct TreeOptions
+	{
+		unsigned fanout = 4;
+		unsigned depth = 3;
+		unsigned files = 16;
+		std::string sizes = "70:0-4K,25:4K-1M,5:1M-8M";
+		std::vector<SizeBucket> sizeBuckets;
+		unsigned nonAsciiPercent = 20;
+		unsigned long long seed = 1;
+	};
+
+	void printUsage(const bool success)
+	{
+		using std::operator<<;
+
+		if (!success) {
+			std::cout << "Try '" << programName << " --help' for more information." << std::endl;
+			return;
+		}
+		std::cout <<
+"Usage: " << programName << " [OPTION]...\n\
+\n\
+Generates a synthetic tree and runs create-db, verify-dir (quick and full) and\n\
+merge-dir against it, reporting the wall time, files/s, MB/s and peak RSS.\n\
+\n\
+      --mirror=PATH       the mirror binary to benchmark (build/mirror by default)\n\
+      --dir=DIR           the work directory (build/bench by default); the tree is\n\
+                          generated in DIR/tree and reused while its parameters\n\
+                          are the same\n\
+      --mirror-args=ARGS  extra options passed to each mirror run, separated by\n\
+                          spaces (e.g. '-j4 --read-buffer=4M')\n\
+      --repeat=N          run each scenario N times and report the median (3)\n\
+      --cache=MODES       'warm', 'cold' or 'warm,cold' (the default)\n\
+      --generate-only     generate the tree and exit\n\
+\n\
+Tree parameters:\n\
+      --fanout=N          subdirectories per directory (4 by default)\n\
+      --depth=N           levels of subdirectories below the root (3 by default)\n\
+      --files=N           regular files per directory (16 by default)\n\
+      --sizes=SPEC        the file size distribution: comma-separated buckets\n\
+                          WEIGHT:MIN-MAX with sizes log-uniform within a bucket\n\
+                          ('70:0-4K,25:4K-1M,5:1M-8M' by default)\n\
+      --non-ascii=P       P% of names contain non-ASCII characters (20 by default)\n\
+      --seed=N            the seed of the generator (1 by default)\n\
+\n\
+Caches are dropped with /proc/sys/vm/drop_caches if it is writable (as root).\n\
+Otherwise only the file data is evicted, with posix_fadvise(POSIX_FADV_DONTNEED).\n\
+SIZE is a number optionally followed by K, M or G (powers of 1024)." << std::endl;
+	}
+
+	bool parseUnsigned(const char * const str, unsigned long long &dest)
+	{
+		char *end;
+		errno = 0;
+		dest = std::strtoull(str, &end, 10);
+		return errno == 0 && end != str && *end == '\0';
+	}
+
+	bool parseUnsigned(const char * const str, const unsigned long long max, unsigned &dest)
+	{
+		unsigned long long val;
+		if (!parseUnsigned(str, val) || val > max) {
+			return false;
+		}
+		dest = static_cast<unsigned>(val);
+		return true;
+	}
+
+	// Parses the size and moves str past it.
+	bool parseSize(const char *&str, unsigned long long &dest)
+	{
+		char *end;
+		errno = 0;
+		const unsigned long long val = std::strtoull(str, &end, 10);
+		if (errno != 0 || end == str) {
+			return false;
+		}
+		unsigned shift = 0;
+		switch (*end) {
+		case 'K':
+			shift = 10;
+			++end;
+			break;
+		case 'M':
+			shift = 20;
+			++end;
+			break;
+		case 'G':
+			shift = 30;
+			++end;
+			break;
+		}
+		if (val > (~0ULL >> shift)) {
+			return false;
+		}
+		dest = val << shift;
+		str = end;
+		return true;
+	}
+
+	bool parseSizeBuckets(const char *str, std::vector<SizeBucket> &dest)
+	{
+		dest.clear();
+		for (;;) {
+			SizeBucket bucket;
+			char *end;
+			errno = 0;
+			const unsigned long weight = std::strtoul(str, &end, 10);
+			if (errno != 0 || end == str || *end != ':' || weight == 0 || weight > 1000000) {
+				return false;
+			}
+			bucket.weight = static_cast<unsigned>(weight);
+			str = end + 1;
+			if (!parseSize(str, bucket.minSize) || *str++ != '-' || !parseSize(str, bucket.maxSize) ||
+					bucket.minSize > bucket.maxSize) {
+				return false;
+			}
+			dest.push_back(bucket);
+			if (*str == '\0') {
+				return true;
+			}
+			if (*str++ != ',') {
+				return false;
+			}
+		}
+	}
+
+	// SplitMix64, so that the tree depends on the seed only, not on the standard library.
+	class Random
+	{
+	public:
+		explicit Random(const std::uint64_t seed) noexcept : m_state(seed) {}
+
+		std::uint64_t next() noexcept
+		{
+			std::uint64_t z = (m_state += 0x9e3779b97f4a7c15ULL);
+			z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+			z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+			return z ^ (z >> 31);
+		}
+
+		// In [0, 1).
+		double nextDouble() noexcept { return static_cast<double>(next() >> 11) * (1.0 / 9007199254740992.0); }
+
+		unsigned nextBelow(const unsigned n) noexcept { return static_cast<unsigned>(next() % n); }
+	private:
+		std::uint64_t m_state;
+	};
+
+	// Name stems in several scripts, so that the encoding conversion and the UTF-8 ordering are exercised.
+	const char * const nonAsciiStems[] = {
+		u8"файл", // Cyrillic
+		u8"文件", // CJK
+		u8"ファイル", // Katakana
+		u8"αρχείο", // Greek
+		u8"café naïve", // Latin-1 with a space
+		u8"\U0001F600", // an emoji (4 UTF-8 bytes)
+	};
+
+	std::string makeName(Random &random, const unsigned nonAsciiPercent, const char * const prefix,
+			const unsigned index)
+	{
+		char numBuf[16];
+		std::snprintf(numBuf, sizeof(numBuf), "%04u", index);
+		std::string name;
+		if (random.nextBelow(100) < nonAsciiPercent) {
+			name = nonAsciiStems[random.nextBelow(sizeof(nonAsciiStems) / sizeof(nonAsciiStems[0]))];
+			name += '_';
+		}
+		name += prefix;
+		name += numBuf;
+		return name;
+	}
+
+	unsigned long long nextFileSize(Random &random, const std::vector<SizeBucket> &buckets)
+	{
+		unsigned long long totalWeight = 0;
+		for (const SizeBucket &bucket : buckets) {
+			totalWeight += bucket.weight;
+		}
+		unsigned long long w = random.next() % totalWeight;
+		const SizeBucket *bucket = &buckets.back();
+		for (const SizeBucket &b : buckets) {
+			if (w < b.weight) {
+				bucket = &b;
+				break;
+			}
+			w -= b.weight;
+		}
+		// Log-uniform in [minSize + 1, maxSize + 1), shifted back by one so that empty files are possible.
+		const double lo = std::log(static_cast<double>(bucket->minSize) + 1);
+		const double hi = std::log(static_cast<double>(bucket->maxSize) + 1);
+		const double size = std::exp(lo + (hi - lo) * random.nextDouble()) - 1;
+		return std::min(bucket->maxSize, static_cast<unsigned long long>(size));
+	}
+
+	struct TreeSummary
+	{
+		unsigned long long files = 0;
+		unsigned long long dirs = 0;
+		unsigned long long bytes = 0;
+	};
+
+	[[noreturn]] void fail(const char * const what, const std::string &path)
+	{
+		std::fprintf(stderr, "%s: %s '%s': %s\n", programName, what, path.c_str(), std::strerror(errno));
+		std::exit(1);
+	}
+
+	void writeFile(const std::string &path, unsigned long long size, Random &random, unsigned char * const buf,
+			const std::size_t bufSize)
+	{
+		const int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+		if (fd == -1) {
+			fail("Unable to create", path);
+		}
+		while (size > 0) {
+			const std::size_t n = static_cast<std::size_t>(std::min<unsigned long long>(size, bufSize));
+			// The content is random so that neither the file system nor the page cache can compress it.
+			for (std::size_t i = 0; i < n; i += 8) {
+				const std::uint64_t val = random.next();
+				std::memcpy(buf + i, &val, std::min<std::size_t>(8, n - i));
+			}
+			for (std::size_t written = 0; written < n;) {
+				const ssize_t m = write(fd, buf + written, n - written);
+				if (m == -1) {
+					fail("Unable to write", path);
+				}
+				written += static_cast<std::size_t>(m);
+			}
+			size -= n;
+		}
+		if (close(fd) != 0) {
+			fail("Unable to write", path);
+		}
+	}
+
+	void generateDir(std::string &path, const unsigned level, const TreeOptions &options, Random &random,
+			unsigned char * const buf, const std::size_t bufSize, TreeSummary &summary)
+	{
+		if (mkdir(path.c_str(), 0755) != 0) {
+			fail("Unable to create", path);
+		}
+		const std::size_t pathSize = path.size();
+		for (unsigned i = 0; i < options.files; ++i) {
+			path += '/';
+			path += makeName(random, options.nonAsciiPercent, "f", i);
+			const unsigned long long size = nextFileSize(random, options.sizeBuckets);
+			writeFile(path, size, random, buf, bufSize);
+			++summary.files;
+			summary.bytes += size;
+			path.resize(pathSize);
+		}
+		if (level == options.depth) {
+			return;
+		}
+		for (unsigned i = 0; i < options.fanout; ++i) {
+			path += '/';
+			path += makeName(random, options.nonAsciiPercent, "d", i);
+			++summary.dirs;
+			generateDir(path, level + 1, options, random, buf, bufSize, summary);
+			path.resize(pathSize);
+		}
+	}
+
+	int removeEntry(const char * const path, const struct stat *, int, struct FTW *)
+	{
+		return remove(path);
+	}
+
+	void removeTree(const std::string &path)
+	{
+		if (access(path.c_str(), F_OK) == 0 && nftw(path.c_str(), removeEntry, 64, FTW_DEPTH | FTW_PHYS) != 0) {
+			fail("Unable to remove", path);
+		}
+	}
+
+	TreeSummary *countedTree;
+
+	int countEntry(const char *, const struct stat * const fileStat, const int type, struct FTW *)
+	{
+		if (type == FTW_F && S_ISREG(fileStat->st_mode)) {
+			++countedTree->files;
+			countedTree->bytes += static_cast<unsigned long long>(fileStat->st_size);
+		} else if (type == FTW_D) {
+			++countedTree->dirs;
+		}
+		return 0;
+	}
+
+	std::string describeTree(const TreeOptions &options)
+	{
+		char buf[256];
+		std::snprintf(buf, sizeof(buf), "fanout=%u depth=%u files=%u sizes=%s non-ascii=%u seed=%llu\n",
+				options.fanout, options.depth, options.files, options.sizes.c_str(), options.nonAsciiPercent,
+				options.seed);
+		return buf;
+	}
+
+	std::string readFile(const std::string &path)
+	{
+		std::string result;
+		std::FILE * const f = std::fopen(path.c_str(), "r");
+		if (f != nullptr) {
+			char buf[512];
+			std::size_t n;
+			while ((n = std::fread(buf, 1, sizeof(buf), f)) > 0) {
+				result.append(buf, n);
+			}
+			std::fclose(f);
+		}
+		return result;
+	}
+
+	// The tree is regenerated only if its parameters have changed. They are kept outside of the tree.
+	TreeSummary prepareTree(const std::string &dir, const TreeOptions &options)
+	{
+		const std::string treeDir = dir + "/tree";
+		const std::string paramsFile = dir + "/tree.params";
+		const std::string params = describeTree(options);
+
+		TreeSummary summary;
+		if (readFile(paramsFile) == params) {
+			countedTree = &summary;
+			if (nftw(treeDir.c_str(), countEntry, 64, FTW_PHYS) != 0) {
+				fail("Unable to read", treeDir);
+			}
+			--summary.dirs; // The root directory.
+			return summary;
+		}
+
+		std::fprintf(stderr, "Generating the tree: %s", params.c_str());
+		removeTree(treeDir);
+		unlink(paramsFile.c_str());
+
+		constexpr std::size_t bufSize = 1024 * 1024;
+		std::unique_ptr<unsigned char[]> buf(new unsigned char[bufSize]);
+		Random random(options.seed);
+		std::string path = treeDir;
+		generateDir(path, 0, options, random, buf.get(), bufSize, summary);
+
+		std::FILE * const f = std::fopen(paramsFile.c_str(), "w");
+		if (f == nullptr || std::fputs(params.c_str(), f) == EOF || std::fclose(f) != 0) {
+			fail("Unable to write", paramsFile);
+		}
+		return summary;
+	}
+
+	bool dropCachesGlobally()
+	{
+		sync();
+		std::FILE * const f = std::fopen("/proc/sys/vm/drop_caches", "w");
+		if (f == nullptr) {
+			return false;
+		}
+		const bool success = std::fputs("3\n", f) != EOF;
+		return std::fclose(f) == 0 && success;
+	}
+
+	int evictEntry(const char * const path, const struct stat *, const int type, struct FTW *)
+	{
+		if (type == FTW_F) {
+			const int fd = open(path, O_RDONLY | O_NOFOLLOW);
+			if (fd != -1) {
+				posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+				close(fd);
+			}
+		}
+		return 0;
+	}
+
+	// Returns false if only the file data is evicted.
+	bool dropCaches(const std::vector<std::string> &paths)
+	{
+		if (dropCachesGlobally()) {
+			return true;
+		}
+		for (const std::string &path : paths) {
+			if (access(path.c_str(), F_OK) == 0) {
+				nftw(path.c_str(), evictEntry, 64, FTW_PHYS);
+			}
+		}
+		return false;
+	}
+
+	struct RunResult
+	{
+		double seconds;
+		long peakRSSKiB;
+	};
+
+	// The output of the run is written to logFile, so that the mismatches reported by merge-dir are not shown.
+	RunResult runMirror(const std::string &mirror, const std::vector<std::string> &args, const std::string &logFile)
+	{
+		std::vector<char *> argv;
+		argv.push_back(const_cast<char *>(mirror.c_str()));
+		for (const std::string &arg : args) {
+			argv.push_back(const_cast<char *>(arg.c_str()));
+		}
+		argv.push_back(nullptr);
+
+		const auto start = std::chrono::steady_clock::now();
+		const pid_t pid = fork();
+		if (pid == -1) {
+			fail("Unable to run", mirror);
+		}
+		if (pid == 0) {
+			const int log = open(logFile.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+			if (log == -1 || dup2(log, STDOUT_FILENO) == -1 || dup2(log, STDERR_FILENO) == -1) {
+				_exit(127);
+			}
+			execv(mirror.c_str(), argv.data());
+			std::fprintf(stderr, "%s: Unable to run '%s': %s\n", programName, mirror.c_str(), std::strerror(errno));
+			_exit(127);
+		}
+
+		int status;
+		struct rusage usage;
+		while (wait4(pid, &status, 0, &usage) == -1) {
+			if (errno != EINTR) {
+				fail("Unable to wait for", mirror);
+			}
+		}
+		const auto end = std::chrono::steady_clock::now();
+		if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+			std::string commandLine;
+			for (std::size_t i = 0; argv[i] != nullptr; ++i) {
+				commandLine += i == 0 ? "" : " ";
+				commandLine += argv[i];
+			}
+			std::fprintf(stderr, "%s: The run has failed (see '%s'): %s\n", programName, logFile.c_str(),
+					commandLine.c_str());
+			std::exit(1);
+		}
+		return RunResult{std::chrono::duration<double>(end - start).count(), usage.ru_maxrss};
+	}
+
+	struct Scenario
+	{
+		const char *name;
+		// Tells if the scenario reads the data of all files, which is what MB/s is calculated for.
+		bool readsData;
+	};
+
+	const Scenario scenarios[] = {
+		{"create-db", true},
+		{"verify-dir quick", false},
+		{"verify-dir full", true},
+		{"merge-dir", true}
+	};
+
+	std::vector<std::string> scenarioArgs(const std::size_t scenario, const std::string &dir,
+			const std::vector<std::string> &extraArgs)
+	{
+		const std::string db = "--db=" + dir + "/bench.db";
+		const std::string tree = dir + "/tree";
+
+		std::vector<std::string> args;
+		switch (scenario) {
+		case 0:
+			args = {"--tool=create-db", db};
+			break;
+		case 1:
+			args = {"--tool=verify-dir", "--verify=quick", db};
+			break;
+		case 2:
+			args = {"--tool=verify-dir", "--verify=full", db};
+			break;
+		default:
+			args = {"--tool=merge-dir", db};
+			break;
+		}
+		args.insert(args.end(), extraArgs.begin(), extraArgs.end());
+		args.push_back(tree);
+		if (scenario == 3) {
+			args.push_back(dir + "/dest");
+		}
+		return args;
+	}
+
+	// The state each run of the scenario starts from: create-db makes a new DB, merge-dir fills an empty dir.
+	void resetScenario(const std::size_t scenario, const std::string &dir)
+	{
+		if (scenario == 0) {
+			const std::string db = dir + "/bench.db";
+			for (const char * const suffix : {"", "-journal", "-wal", "-shm"}) {
+				unlink((db + suffix).c_str());
+			}
+		} else if (scenario == 3) {
+			const std::string dest = dir + "/dest";
+			removeTree(dest);
+			if (mkdir(dest.c_str(), 0755) != 0) {
+				fail("Unable to create", dest);
+			}
+		}
+	}
+
+	std::vector<std::string> splitArgs(const char *str)
+	{
+		std::vector<std::string> result;
+		for (;;) {
+			while (*str == ' ') {
+				++str;
+			}
+			if (*str == '\0') {
+				return result;
+			}
+			const char * const start = str;
+			while (*str != ' ' && *str != '\0') {
+				++str;
+			}
+			result.emplace_back(start, str);
+		}
+	}
+}
+
+int main(const int argc, char * const argv[])
+{
+	TreeOptions treeOptions;
+	std::string mirror = "build/mirror";
+	std::string dir = "build/bench";
+	std::vector<std::string> extraArgs;
+	unsigned repeat = 3;
+	bool warm = true, cold = true;
+	bool generateOnly = false;
+
+	int c;
+	while ((c = ::getopt_long(argc, argv, "h", options, nullptr)) != -1) {
+		bool valid = true;
+		switch (c) {
+		case 'h':
+			printUsage(true);
+			return 0;
+		case fanoutTag:
+			valid = parseUnsigned(::optarg, 1024, treeOptions.fanout) && treeOptions.fanout > 0;
+			break;
+		case depthTag:
+			valid = parseUnsigned(::optarg, 64, treeOptions.depth);
+			break;
+		case filesTag:
+			valid = parseUnsigned(::optarg, 1000000, treeOptions.files);
+			break;
+		case sizesTag:
+			treeOptions.sizes = ::optarg;
+			break;
+		case nonAsciiTag:
+			valid = parseUnsigned(::optarg, 100, treeOptions.nonAsciiPercent);
+			break;
+		case seedTag:
+			valid = parseUnsigned(::optarg, treeOptions.seed);
+			break;
+		case mirrorTag:
+			mirror = ::optarg;
+			break;
+		case dirTag:
+			dir = ::optarg;
+			break;
+		case repeatTag:
+			valid = parseUnsigned(::optarg, 1000, repeat) && repeat > 0;
+			break;
+		case cacheTag:
+			warm = std::strcmp(::optarg, "warm") == 0 || std::strcmp(::optarg, "warm,cold") == 0;
+			cold = std::strcmp(::optarg, "cold") == 0 || std::strcmp(::optarg, "warm,cold") == 0;
+			valid = warm || cold;
+			break;
+		case argsTag:
+			extraArgs = splitArgs(::optarg);
+			break;
+		case generateOnlyTag:
+			generateOnly = true;
+			break;
+		default:
+			printUsage(false);
+			return 1;
+		}
+		if (!valid) {
+			std::fprintf(stderr, "%s: Invalid value of the option: '%s'.\n", programName, ::optarg);
+			printUsage(false);
+			return 1;
+		}
+	}
+	if (::optind != argc) {
+		std::fprintf(stderr, "%s: Unexpected argument: '%s'.\n", programName, argv[::optind]);
+		printUsage(false);
+		return 1;
+	}
+	if (!parseSizeBuckets(treeOptions.sizes.c_str(), treeOptions.sizeBuckets)) {
+		std::fprintf(stderr, "%s: Invalid file size distribution: '%s'.\n", programName, treeOptions.sizes.c_str());
+		return 1;
+	}
+
+	if (mkdir(dir.c_str(), 0755) != 0 && errno != EEXIST) {
+		fail("Unable to create", dir);
+	}
+	const TreeSummary tree = prepareTree(dir, treeOptions);
+	std::printf("Tree: %llu files, %llu directories, %.1f MiB\n", tree.files, tree.dirs,
+			static_cast<double>(tree.bytes) / (1024 * 1024));
+	if (generateOnly) {
+		return 0;
+	}
+
+	const std::vector<std::string> cachedPaths = {dir};
+	bool globalDrop = true;
+
+	std::printf("%-18s %-5s %10s %12s %10s %14s\n", "scenario", "cache", "wall, s", "files/s", "MB/s",
+			"peak RSS, MiB");
+	for (const bool isCold : {false, true}) {
+		if ((isCold && !cold) || (!isCold && !warm)) {
+			continue;
+		}
+		for (std::size_t scenario = 0; scenario < sizeof(scenarios) / sizeof(scenarios[0]); ++scenario) {
+			const std::vector<std::string> args = scenarioArgs(scenario, dir, extraArgs);
+			std::vector<double> times;
+			long peakRSS = 0;
+			// The warm runs are preceded by an unmeasured one that fills the caches.
+			const unsigned runs = isCold ? repeat : repeat + 1;
+			for (unsigned i = 0; i < runs; ++i) {
+				resetScenario(scenario, dir);
+				if (isCold) {
+					globalDrop &= dropCaches(cachedPaths);
+				}
+				const RunResult result = runMirror(mirror, args, dir + "/mirror.log");
+				if (isCold || i > 0) {
+					times.push_back(result.seconds);
+					peakRSS = std::max(peakRSS, result.peakRSSKiB);
+				}
+			}
+			std::sort(times.begin(), times.end());
+			const double median = times[times.size() / 2];
+
+			char mbps[32] = "-";
+			if (scenarios[scenario].readsData) {
+				std::snprintf(mbps, sizeof(mbps), "%.1f", static_cast<double>(tree.bytes) / 1e6 / median);
+			}
+			std::printf("%-18s %-5s %10.3f %12.0f %10s %14.1f\n", scenarios[scenario].name, isCold ? "cold" : "warm",
+					median, static_cast<double>(tree.files) / median, mbps, static_cast<double>(peakRSS) / 1024);
+			std::fflush(stdout);
+		}
+	}
+	if (cold && !globalDrop) {
+		std::printf("Note: the caches could not be dropped globally, only the file data was evicted.\n");
+	}
+	return 0;
+}
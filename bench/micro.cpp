@@ -0,0 +1,513 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <chrono>
+#include <clocale>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include "mirror/crc64.hpp"
+#include "mirror/digest.hpp"
+#include "mirror/encoding.hpp"
+#include "mirror/FileDB.hpp"
+#include "mirror/hash.hpp"
+#include "mirror/PathHashTable.hpp"
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+/*
+ * Microbenchmarks of the hot kernels: the CRC64 engines, the digest algorithms, PathKey construction and hashing, the path hash
+ * table, the encoding conversion and the FileDB operations used by the walk. Each benchmark is repeated
+ * until it has run for at least the minimum time, and the time per item is reported.
+ */
+namespace
+{
+	const char * const programName = "mirror-microbench";
+	const int minTimeTag = 1000;
+
+	static const struct option options[] = {
+		{"help", no_argument, nullptr, 'h'},
+		{"min-time", required_argument, nullptr, minTimeTag},
+		{0}
+	};
+
+	std::chrono::nanoseconds minTime = std::chrono::milliseconds(300);
+	std::vector<std::string> filters;
+
+	void printUsage(const bool success)
+	{
+		using std::operator<<;
+
+		if (!success) {
+			std::cout << "Try '" << programName << " --help' for more information." << std::endl;
+			return;
+		}
+		std::cout <<
+"Usage: " << programName << " [OPTION]... [FILTER]...\n\
+\n\
+Runs the benchmarks whose names contain any of FILTERs (all of them by default).\n\
+\n\
+      --min-time=MS       run each benchmark for at least MS milliseconds (300)" << std::endl;
+	}
+
+	// Makes the compiler assume that the value is used, so that the computation is not optimised out.
+	template<typename T>
+	inline void keep(const T &val) noexcept
+	{
+		asm volatile("" : : "g"(&val) : "memory");
+	}
+
+	bool selected(const char * const name)
+	{
+		if (filters.empty()) {
+			return true;
+		}
+		for (const std::string &filter : filters) {
+			if (std::strstr(name, filter.c_str()) != nullptr) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	/*
+	 * Runs op (which processes items items of bytes bytes in total) until minTime is reached, and prints
+	 * the time per item and the throughput. The first run is a warm-up, it is not measured.
+	 */
+	template<typename Op>
+	void measure(const char * const name, const std::size_t items, const std::size_t bytes, Op op)
+	{
+		if (!selected(name)) {
+			return;
+		}
+
+		op();
+		std::size_t runs = 0;
+		const auto start = std::chrono::steady_clock::now();
+		std::chrono::nanoseconds elapsed;
+		do {
+			op();
+			++runs;
+			elapsed = std::chrono::steady_clock::now() - start;
+		} while (elapsed < minTime);
+
+		const double seconds = std::chrono::duration<double>(elapsed).count();
+		const double totalItems = static_cast<double>(items) * runs;
+		std::printf("%-36s %12.2f ns/item %12.3f M items/s", name, seconds * 1e9 / totalItems,
+				totalItems / seconds / 1e6);
+		if (bytes > 0) {
+			std::printf(" %10.1f MB/s", static_cast<double>(bytes) * runs / seconds / 1e6);
+		}
+		std::printf("\n");
+		std::fflush(stdout);
+	}
+
+	std::uint64_t randomState = 1;
+
+	inline std::uint64_t nextRandom() noexcept
+	{
+		std::uint64_t z = (randomState += 0x9e3779b97f4a7c15ULL);
+		z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+		z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+		return z ^ (z >> 31);
+	}
+
+	struct PathSet
+	{
+		const char *name;
+		std::vector<std::string> paths;
+		std::size_t bytes;
+	};
+
+	constexpr unsigned pathSetSize = 50000;
+
+	/*
+	 * Path sets modelled after real trees: camera files sharing the prefix and the suffix, source files,
+	 * non-ASCII names and the relative paths of directories (the keys of FileDB::getDirs()).
+	 */
+	std::vector<PathSet> makePathSets()
+	{
+		static const char * const words[] = {"main", "utils", "parser", "FileDB", "io", "hash", "config",
+				"test_runner", "PathHashTable", "x"};
+		static const char * const stems[] = {u8"файл", u8"文件", u8"ファイル", u8"αρχείο", u8"café naïve",
+				u8"\U0001F600"};
+		static const char * const extensions[] = {".cpp", ".hpp", ".c", ".h", ".txt", ".md"};
+
+		std::vector<PathSet> sets(4);
+		sets[0].name = "photos";
+		sets[1].name = "source";
+		sets[2].name = "unicode";
+		sets[3].name = "dirs";
+		char buf[256];
+		for (unsigned i = 0; i < pathSetSize; ++i) {
+			std::snprintf(buf, sizeof(buf), "IMG_%06u.JPG", i);
+			sets[0].paths.emplace_back(buf);
+			std::snprintf(buf, sizeof(buf), "%s_%u%s", words[nextRandom() % 10], i, extensions[nextRandom() % 6]);
+			sets[1].paths.emplace_back(buf);
+			std::snprintf(buf, sizeof(buf), "%s %u", stems[nextRandom() % 6], i);
+			sets[2].paths.emplace_back(buf);
+			std::snprintf(buf, sizeof(buf), "projects/%s/src/module%02u/sub%04u", words[i % 10],
+					static_cast<unsigned>(nextRandom() % 100), i);
+			sets[3].paths.emplace_back(buf);
+		}
+		for (PathSet &set : sets) {
+			set.bytes = 0;
+			for (const std::string &path : set.paths) {
+				set.bytes += path.size();
+			}
+		}
+		return sets;
+	}
+
+	std::string benchName(const char * const kernel, const char * const variant)
+	{
+		return std::string(kernel) + '/' + variant;
+	}
+
+	void benchCRC64()
+	{
+		static const std::size_t chunkSizes[] = {64, 1024, 16 * 1024, 1024 * 1024};
+		static const mirror::CRC64Engine engines[] = {mirror::CRC64Engine::afc, mirror::CRC64Engine::slicingBy16,
+				mirror::CRC64Engine::pclmul, mirror::CRC64Engine::pmull};
+
+		constexpr std::size_t bufSize = 4 * 1024 * 1024;
+		std::unique_ptr<unsigned char[]> buf(new unsigned char[bufSize]);
+		for (std::size_t i = 0; i < bufSize; ++i) {
+			buf[i] = static_cast<unsigned char>(nextRandom());
+		}
+
+		for (const mirror::CRC64Engine engine : engines) {
+			const mirror::crc64Update update = mirror::crc64EngineUpdate(engine);
+			if (update == nullptr) {
+				continue;
+			}
+			for (const std::size_t chunkSize : chunkSizes) {
+				char name[64];
+				std::snprintf(name, sizeof(name), "crc64/%s/%zu", mirror::crc64EngineName(engine), chunkSize);
+				// Each item is a chunk; the whole buffer is digested per run so that the caches are not warm.
+				measure(name, bufSize / chunkSize, bufSize, [&]
+				{
+					std::uint_fast64_t crc = 0;
+					for (std::size_t offset = 0; offset < bufSize; offset += chunkSize) {
+						crc = update(crc, buf.get() + offset, chunkSize);
+					}
+					keep(crc);
+				});
+			}
+		}
+	}
+
+	void benchDigests()
+	{
+		static const std::size_t chunkSizes[] = {64, 1024, 16 * 1024, 1024 * 1024};
+		static const mirror::DigestAlgorithm algorithms[] = {mirror::DigestAlgorithm::crc64,
+				mirror::DigestAlgorithm::xxh3, mirror::DigestAlgorithm::blake3};
+
+		constexpr std::size_t bufSize = 4 * 1024 * 1024;
+		std::unique_ptr<unsigned char[]> buf(new unsigned char[bufSize]);
+		for (std::size_t i = 0; i < bufSize; ++i) {
+			buf[i] = static_cast<unsigned char>(nextRandom());
+		}
+
+		for (const mirror::DigestAlgorithm alg : algorithms) {
+			for (const std::size_t chunkSize : chunkSizes) {
+				char name[64];
+				std::snprintf(name, sizeof(name), "digest/%s/%zu", mirror::digestName(alg), chunkSize);
+				// Each item is a file of chunkSize bytes, so that the setup and the finalisation are measured, too.
+				measure(name, bufSize / chunkSize, bufSize, [&]
+				{
+					for (std::size_t offset = 0; offset < bufSize; offset += chunkSize) {
+						mirror::Digest digest(alg);
+						digest.update(buf.get() + offset, chunkSize);
+						unsigned char result[mirror::maxDigestSize];
+						digest.finish(result);
+						keep(result[0]);
+					}
+				});
+			}
+		}
+	}
+
+	void benchPathKeys(const std::vector<PathSet> &sets)
+	{
+		for (const PathSet &set : sets) {
+			const std::vector<std::string> &paths = set.paths;
+
+			measure(benchName("hashBytes", set.name).c_str(), paths.size(), set.bytes, [&]
+			{
+				for (const std::string &path : paths) {
+					keep(mirror::hashBytes(path.data(), path.size()));
+				}
+			});
+
+			measure(benchName("PathKey/owned", set.name).c_str(), paths.size(), set.bytes, [&]
+			{
+				for (const std::string &path : paths) {
+					const mirror::PathKey key(path.data(), path.size());
+					keep(key.data);
+				}
+			});
+
+			mirror::PathArena arena;
+			measure(benchName("PathKey/arena", set.name).c_str(), paths.size(), set.bytes, [&]
+			{
+				const mirror::PathArena::Mark mark = arena.mark();
+				for (const std::string &path : paths) {
+					const mirror::PathKey key(path.data(), path.size(), arena);
+					keep(key.data);
+				}
+				arena.release(mark);
+			});
+
+			std::vector<mirror::PathKey> keys, copies, others;
+			for (std::size_t i = 0; i < paths.size(); ++i) {
+				keys.emplace_back(paths[i].data(), paths[i].size(), true);
+				copies.emplace_back(paths[i].data(), paths[i].size());
+				// The neighbour differs from the key in a few characters, often with the same size.
+				const std::string &other = paths[(i + 1) % paths.size()];
+				others.emplace_back(other.data(), other.size(), true);
+			}
+			const mirror::PathEquals equals;
+			measure(benchName("PathEquals/equal", set.name).c_str(), keys.size(), set.bytes, [&]
+			{
+				std::size_t n = 0;
+				for (std::size_t i = 0; i < keys.size(); ++i) {
+					n += equals(keys[i], copies[i]);
+				}
+				keep(n);
+			});
+			measure(benchName("PathEquals/different", set.name).c_str(), keys.size(), 0, [&]
+			{
+				std::size_t n = 0;
+				for (std::size_t i = 0; i < keys.size(); ++i) {
+					n += equals(keys[i], others[i]);
+				}
+				keep(n);
+			});
+
+			// A directory is looked up in the map of its DB files once per entry found by the walk.
+			measure(benchName("PathMap/insert", set.name).c_str(), paths.size(), 0, [&]
+			{
+				mirror::PathMap<mirror::FileRecord> map;
+				const mirror::PathArena::Mark mark = arena.mark();
+				for (const std::string &path : paths) {
+					map[mirror::PathKey(path.data(), path.size(), arena)].fileSize = 1;
+				}
+				keep(map.size());
+				arena.release(mark);
+			});
+
+			mirror::PathMap<mirror::FileRecord> map;
+			for (const std::string &path : paths) {
+				map[mirror::PathKey(path.data(), path.size())].fileSize = 1;
+			}
+			measure(benchName("PathMap/find-hit", set.name).c_str(), paths.size(), 0, [&]
+			{
+				std::size_t n = 0;
+				for (const std::string &path : paths) {
+					n += map.find(mirror::PathKey(path.data(), path.size(), true)) != map.end();
+				}
+				keep(n);
+			});
+			measure(benchName("PathMap/find-miss", set.name).c_str(), paths.size(), 0, [&]
+			{
+				std::string missing;
+				std::size_t n = 0;
+				for (const std::string &path : paths) {
+					missing.assign(path).push_back('~');
+					n += map.find(mirror::PathKey(missing.data(), missing.size(), true)) != map.end();
+				}
+				keep(n);
+			});
+		}
+	}
+
+	void benchEncoding(const std::vector<PathSet> &sets)
+	{
+		for (const PathSet &set : sets) {
+			measure(benchName("encoding/nopConverter", set.name).c_str(), set.paths.size(), set.bytes, [&]
+			{
+				for (const std::string &path : set.paths) {
+					const mirror::TextHolder text = mirror::nopConverter(path.data(), path.size());
+					keep(text.value);
+				}
+			});
+			measure(benchName("encoding/trueConvertToUtf8", set.name).c_str(), set.paths.size(), set.bytes, [&]
+			{
+				for (const std::string &path : set.paths) {
+					const mirror::TextHolder text = mirror::trueConvertToUtf8(path.data(), path.size());
+					keep(text.value);
+				}
+			});
+		}
+	}
+
+	// The DB has dirCount directories of filesPerDir files each, named as the photos set.
+	constexpr unsigned dirCount = 500;
+	constexpr unsigned filesPerDir = 200;
+
+	void addFiles(mirror::FileDB &db, const std::vector<std::string> &dirs)
+	{
+		mirror::FileRecord record;
+		record.type = mirror::FileType::file;
+		std::memset(record.digest, 0x5a, sizeof(record.digest));
+		record.lastModifiedTS.setMillis(1500000000000);
+		record.fileSize = 12345;
+
+		char name[32];
+		db.beginBulkLoad(0);
+		db.beginTransaction();
+		for (const std::string &dir : dirs) {
+			for (unsigned i = 0; i < filesPerDir; ++i) {
+				const int n = std::snprintf(name, sizeof(name), "IMG_%06u.JPG", i);
+				db.addFile(name, static_cast<std::size_t>(n), dir.data(), dir.size(), record);
+			}
+		}
+		db.commit();
+		db.endBulkLoad();
+	}
+
+	void benchFileDB()
+	{
+		const bool addSelected = selected("FileDB/addFile");
+		const bool getSelected = selected("FileDB/getFiles");
+		const bool sortedSelected = selected("FileDB/nextSortedFile");
+		if (!addSelected && !getSelected && !sortedSelected) {
+			return;
+		}
+
+		const char * const tmpDir = std::getenv("TMPDIR");
+		std::string dbPath = std::string(tmpDir != nullptr ? tmpDir : "/tmp") + "/mirror-microbench.XXXXXX";
+		const int fd = mkstemp(&dbPath[0]);
+		if (fd == -1) {
+			std::perror("Unable to create the DB");
+			std::exit(1);
+		}
+		close(fd);
+		auto removeDB = [&dbPath]
+		{
+			for (const char * const suffix : {"", "-journal", "-wal", "-shm"}) {
+				unlink((dbPath + suffix).c_str());
+			}
+		};
+
+		std::vector<std::string> dirs;
+		char buf[64];
+		for (unsigned i = 0; i < dirCount; ++i) {
+			std::snprintf(buf, sizeof(buf), "photos/%04u/%02u", 2000 + i / 12, i % 12 + 1);
+			dirs.emplace_back(buf);
+		}
+		const std::size_t fileCount = static_cast<std::size_t>(dirCount) * filesPerDir;
+
+		if (addSelected) {
+			// Each run fills a new DB in the bulk load mode, as create-db does.
+			measure("FileDB/addFile", fileCount, 0, [&]
+			{
+				removeDB();
+				mirror::FileDB db = mirror::FileDB::open(dbPath.c_str(), true);
+				addFiles(db, dirs);
+				db.close();
+			});
+		}
+
+		removeDB();
+		mirror::FileDB db = mirror::FileDB::open(dbPath.c_str(), true);
+		try {
+			addFiles(db, dirs);
+			if (getSelected) {
+				mirror::DirFileMapStack maps;
+				measure("FileDB/getFiles", fileCount, 0, [&]
+				{
+					for (const std::string &dir : dirs) {
+						db.getFiles(dir.data(), dir.size(), maps.push(), &maps.arena());
+						keep(maps.top().size());
+						maps.pop();
+					}
+				});
+			}
+			if (sortedSelected) {
+				// The merge-join engine, export-snapshot and diff-db rely on the files being streamed.
+				const std::string plan = db.sortedFilesPlan();
+				if (plan.find("TEMP B-TREE") != std::string::npos) {
+					std::fprintf(stderr, "%s", plan.c_str());
+					throw "The files are sorted in a temporary B-tree by FileDB::nextSortedFile().";
+				}
+				mirror::FileDB::SortedFile row;
+				measure("FileDB/nextSortedFile", fileCount, 0, [&]
+				{
+					while (db.nextSortedFile(row)) {
+						keep(row.record);
+					}
+				});
+			}
+		}
+		catch (...) {
+			db.close();
+			removeDB();
+			throw;
+		}
+		db.close();
+		removeDB();
+	}
+}
+
+int main(const int argc, char * const argv[])
+try {
+	int c;
+	while ((c = ::getopt_long(argc, argv, "h", options, nullptr)) != -1) {
+		switch (c) {
+		case 'h':
+			printUsage(true);
+			return 0;
+		case minTimeTag: {
+			char *end;
+			const unsigned long ms = std::strtoul(::optarg, &end, 10);
+			if (end == ::optarg || *end != '\0' || ms == 0) {
+				std::fprintf(stderr, "%s: Invalid minimum time: '%s'.\n", programName, ::optarg);
+				return 1;
+			}
+			minTime = std::chrono::milliseconds(ms);
+			break;
+		}
+		default:
+			printUsage(false);
+			return 1;
+		}
+	}
+	for (int i = ::optind; i < argc; ++i) {
+		filters.emplace_back(argv[i]);
+	}
+
+	std::setlocale(LC_ALL, "");
+	mirror::initConverters();
+	mirror::initCRC64();
+
+	const std::vector<PathSet> sets = makePathSets();
+	benchCRC64();
+	benchDigests();
+	benchPathKeys(sets);
+	benchEncoding(sets);
+	benchFileDB();
+	return 0;
+}
+catch (const char * const ex) {
+	std::fprintf(stderr, "%s\n", ex);
+	return 1;
+}
@@ -17,16 +17,29 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/logger.hpp>
 #include <afc/utils.h>
 #include <cassert>
+#include <cerrno>
 #include <clocale>
+#include <cstdio>
+#include <cstdlib>
 #include <cstring>
+#include <ctime>
 #include <exception>
 #include <getopt.h>
 #include <iostream>
+#include <limits>
+#include <memory>
+#include "mirror/crc64.hpp"
+#include "mirror/digest.hpp"
 #include "mirror/encoding.hpp"
 #include "mirror/FileDB.hpp"
+#include "mirror/report.hpp"
+#include "mirror/snapshot.hpp"
+#include "mirror/stats.hpp"
+#include "mirror/throttle.hpp"
 #include "mirror/utils.hpp"
 #include "mirror/version.hpp"
 #include <string>
+#include <sys/types.h>
 
 using afc::operator"" _s;
 
@@ -35,18 +48,75 @@ namespace
 // TODO resolve it dynamically using argv[0]?
 const char * const programName = "mirror";
 const int getopt_tagStartValue = 1000;
+const unsigned long maxJobs = 1024;
+const unsigned long maxProgressInterval = 24 * 60 * 60;
+const unsigned long maxCommitPeriod = 24 * 60 * 60;
+
+const off_t maxOffT = std::numeric_limits<off_t>::max();
+
+const int readBufferTag = getopt_tagStartValue;
+const int mmapThresholdTag = getopt_tagStartValue + 1;
+const int noReadaheadAdviceTag = getopt_tagStartValue + 2;
+const int ioBackendTag = getopt_tagStartValue + 3;
+const int ioDepthTag = getopt_tagStartValue + 4;
+const int verifyTag = getopt_tagStartValue + 5;
+const int commitIntervalTag = getopt_tagStartValue + 6;
+const int verifyEngineTag = getopt_tagStartValue + 7;
+const int walkersTag = getopt_tagStartValue + 8;
+const int statsTag = getopt_tagStartValue + 9;
+const int progressTag = getopt_tagStartValue + 10;
+const int digestTag = getopt_tagStartValue + 11;
+const int hashThreadsTag = getopt_tagStartValue + 12;
+const int shardTag = getopt_tagStartValue + 13;
+const int shardDepthTag = getopt_tagStartValue + 14;
+const int commitPeriodTag = getopt_tagStartValue + 15;
+const int resumeTag = getopt_tagStartValue + 16;
+const int maxReadRateTag = getopt_tagStartValue + 17;
+const int maxWriteRateTag = getopt_tagStartValue + 18;
+const int maxIOPSTag = getopt_tagStartValue + 19;
+const int dropCacheTag = getopt_tagStartValue + 20;
+const int dirBatchTag = getopt_tagStartValue + 21;
+const int reportTag = getopt_tagStartValue + 22;
+const int snapshotTag = getopt_tagStartValue + 23;
+const int fileOrderTag = getopt_tagStartValue + 24;
 
 static const struct option options[] = {
 	{"tool", required_argument, nullptr, 't'},
 	{"help", no_argument, nullptr, 'h'},
 	{"version", no_argument, nullptr, 'v'},
 	{"db", required_argument, nullptr, 'd'},
+	{"jobs", required_argument, nullptr, 'j'},
+	{"read-buffer", required_argument, nullptr, readBufferTag},
+	{"mmap-threshold", required_argument, nullptr, mmapThresholdTag},
+	{"no-readahead-advice", no_argument, nullptr, noReadaheadAdviceTag},
+	{"io-backend", required_argument, nullptr, ioBackendTag},
+	{"io-depth", required_argument, nullptr, ioDepthTag},
+	{"verify", required_argument, nullptr, verifyTag},
+	{"commit-interval", required_argument, nullptr, commitIntervalTag},
+	{"commit-period", required_argument, nullptr, commitPeriodTag},
+	{"resume", no_argument, nullptr, resumeTag},
+	{"max-read-rate", required_argument, nullptr, maxReadRateTag},
+	{"max-write-rate", required_argument, nullptr, maxWriteRateTag},
+	{"max-iops", required_argument, nullptr, maxIOPSTag},
+	{"drop-cache", no_argument, nullptr, dropCacheTag},
+	{"verify-engine", required_argument, nullptr, verifyEngineTag},
+	{"dir-batch", required_argument, nullptr, dirBatchTag},
+	{"report", required_argument, nullptr, reportTag},
+	{"snapshot", required_argument, nullptr, snapshotTag},
+	{"walkers", required_argument, nullptr, walkersTag},
+	{"file-order", required_argument, nullptr, fileOrderTag},
+	{"stats", no_argument, nullptr, statsTag},
+	{"progress", required_argument, nullptr, progressTag},
+	{"digest", required_argument, nullptr, digestTag},
+	{"hash-threads", required_argument, nullptr, hashThreadsTag},
+	{"shard", required_argument, nullptr, shardTag},
+	{"shard-depth", required_argument, nullptr, shardDepthTag},
 	{0}
 };
 
 enum class tool
 {
-	undefined, createDB, verifyDir, mergeDir
+	undefined, createDB, updateDB, verifyDir, mergeDir, mergeDB, exportSnapshot, diffDB
 };
 
 void printUsage(bool success, const char * const programName = ::programName)
@@ -58,11 +128,180 @@ void printUsage(bool success, const char * const programName = ::programName)
 	} else {
 		std::cout <<
 "Usage: " << programName << " --tool=[TOOL TO USE] [OPTION]... SOURCE [DEST]\n\
+  or:  " << programName << " --tool=merge-db [OPTION]... SOURCE_DB...\n\
+  or:  " << programName << " --tool=export-snapshot --db=DB SNAPSHOT\n\
+  or:  " << programName << " --tool=diff-db [OPTION]... FIRST_DB SECOND_DB\n\
+\n\
+  -j, --jobs=N            calculate digests of files in N threads (1 by default)\n\
+      --walkers=N         list directories and stat files in N threads ahead of\n\
+                          the walk, for file systems with slow metadata access such\n\
+                          as NFS (1 by default, which lists them in the walk)\n\
+      --file-order=ORDER  read the files of each directory in ORDER before its\n\
+                          subdirectories: 'directory' (as listed, the default),\n\
+                          'inode' (by inode number) or 'physical' (by the disk offset\n\
+                          reported by FIEMAP), to reduce seeks on rotating disks\n\
+      --digest=ALGORITHM  calculate digests of files with ALGORITHM: 'crc64' (the\n\
+                          default), 'xxh3-128' or 'blake3'; it is stored in the DB\n\
+                          by create-db and update-db while the DB has no files,\n\
+                          the other tools accept only the algorithm of the DB\n\
+      --hash-threads=N    hash each file of 64M or larger in N threads (1 by\n\
+                          default), for 'blake3' digests only\n\
+      --read-buffer=SIZE  read files in blocks of SIZE bytes (1M by default)\n\
+      --mmap-threshold=SIZE\n\
+                          map files of SIZE bytes or larger into memory instead of\n\
+                          reading them (0, the default, disables mapping); a mapped\n\
+                          file that is truncated while it is read kills the process\n\
+      --no-readahead-advice\n\
+                          do not advise the kernel that files are read sequentially\n\
+      --drop-cache        advise the kernel to drop the files hashed or copied from\n\
+                          the page cache, so that the pages of other processes are kept\n\
+      --max-read-rate=SIZE\n\
+                          read at most SIZE bytes of files per second (SIZE can be\n\
+                          followed by K, M or G; 0, the default, means no limit)\n\
+      --max-write-rate=SIZE\n\
+                          write at most SIZE bytes of files per second\n\
+      --max-iops=N        make at most N file read and write requests per second\n\
+      --io-backend=BACKEND\n\
+                          read and copy files with BACKEND: 'sync' (blocking I/O,\n\
+                          the default) or 'io_uring' (falls back to 'sync' if\n\
+                          io_uring is not supported by the kernel)\n\
+      --io-depth=N        keep up to N requests per file in flight with io_uring\n\
+                          (8 by default)\n\
+      --verify=MODE       how verify-dir and merge-dir check files: 'full' (hash all\n\
+                          files, the default), 'quick' (hash only files whose size\n\
+                          or last modified timestamp do not match the DB) or\n\
+                          'sample:P' (as 'quick' and hash P% of the other files,\n\
+                          a different part of them every day)\n\
+      --commit-interval=N commit the DB each N files added by create-db (N can be\n\
+                          followed by K, M or G; 0, the default, means that the DB\n\
+                          is committed once at the end)\n\
+      --commit-period=SECONDS\n\
+                          commit the DB each SECONDS seconds while create-db adds\n\
+                          files (update-db always commits once at the end)\n\
+      --resume            continue create-db that has failed or has been interrupted:\n\
+                          the directories it has added completely are not walked again\n\
+                          (SOURCE and the shard must be the same)\n\
+      --verify-engine=ENGINE\n\
+                          how verify-dir and merge-dir match files with the DB:\n\
+                          'per-dir' (query the DB for each directory, the default)\n\
+                          or 'merge-join' (read the DB once in the sorted order)\n\
+      --dir-batch=N       bound the memory the per-dir engine uses: track the\n\
+                          directories visited in the DB and check the directories\n\
+                          with more than N files in the DB file by file\n\
+      --report=FILE       write the mismatches verify-dir, merge-dir and diff-db find\n\
+                          to FILE ('-' for standard output), one JSON object per\n\
+                          line, instead of logging them\n\
+      --snapshot=FILE     make verify-dir and merge-dir read the files from the\n\
+                          snapshot FILE created by export-snapshot instead of a DB\n\
+      --stats             print the numbers of files, bytes and system calls and the\n\
+                          time spent in each stage to standard error at the end\n\
+      --progress=SECONDS  print the progress to standard error each SECONDS seconds,\n\
+                          one JSON object per line\n\
+      --shard=I/N         process only the I-th of N shards of SOURCE (I starts\n\
+                          with 1): the directories and files at the shard depth are\n\
+                          assigned to the shards by the hash of their paths, the\n\
+                          entries above it belong to the first shard\n\
+      --shard-depth=D     the depth of the entries assigned to the shards: 1 (the\n\
+                          default) for the entries of SOURCE, 2 for the entries\n\
+                          of its subdirectories and so on\n\
+\n\
+TOOL is one of 'create-db', 'update-db' (re-hashes only new files and files\n\
+whose size or last modified timestamp have changed), 'verify-dir', 'merge-dir',\n\
+'merge-db' (adds the files of the SOURCE_DBs, e.g. of the shards, to the DB),\n\
+'export-snapshot' (writes the files of the DB to a read-only SNAPSHOT file) or\n\
+'diff-db' (compares the files of two DBs without reading the file systems).\n\
+SIZE is a number optionally followed by K, M or G (powers of 1024).\n\
 \n\
 Report " << programName << " bugs to dzidzitop@vfemail.net" << std::endl;
 	}
 }
 
+bool parseCount(const char * const str, const unsigned long max, unsigned &dest)
+{
+	char *end;
+	errno = 0;
+	const unsigned long val = std::strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '\0' || val == 0 || val > max) {
+		return false;
+	}
+	dest = static_cast<unsigned>(val);
+	return true;
+}
+
+bool parseSize(const char * const str, unsigned long long &dest)
+{
+	char *end;
+	errno = 0;
+	unsigned long long val = std::strtoull(str, &end, 10);
+	if (errno != 0 || end == str) {
+		return false;
+	}
+	unsigned shift = 0;
+	switch (*end) {
+	case '\0':
+		break;
+	case 'K':
+		shift = 10;
+		break;
+	case 'M':
+		shift = 20;
+		break;
+	case 'G':
+		shift = 30;
+		break;
+	default:
+		return false;
+	}
+	if (shift != 0 && *++end != '\0') {
+		return false;
+	}
+	if (val > (~0ULL >> shift)) {
+		return false;
+	}
+	dest = val << shift;
+	return true;
+}
+
+// Parses I/N, where I starts with 1.
+bool parseShard(const char * const str, mirror::ShardOptions &dest)
+{
+	char *end;
+	errno = 0;
+	const unsigned long index = std::strtoul(str, &end, 10);
+	if (errno != 0 || end == str || *end != '/' || index == 0) {
+		return false;
+	}
+	unsigned count;
+	if (!parseCount(end + 1, mirror::ShardOptions::maxCount, count) || index > count) {
+		return false;
+	}
+	dest.index = static_cast<unsigned>(index - 1);
+	dest.count = count;
+	return true;
+}
+
+bool parseVerifyMode(const char * const str, mirror::VerifyOptions &dest)
+{
+	constexpr auto samplePrefix = "sample:"_s;
+
+	if (std::strcmp(str, "full") == 0) {
+		dest.mode = mirror::VerifyMode::full;
+	} else if (std::strcmp(str, "quick") == 0) {
+		dest.mode = mirror::VerifyMode::quick;
+	} else if (std::strncmp(str, samplePrefix.value(), samplePrefix.size()) == 0) {
+		unsigned percent;
+		if (!parseCount(str + samplePrefix.size(), 100, percent)) {
+			return false;
+		}
+		dest.mode = mirror::VerifyMode::sample;
+		dest.samplePercent = percent;
+		dest.sampleRotation = static_cast<unsigned long>(std::time(nullptr) / (24 * 60 * 60));
+	} else {
+		return false;
+	}
+	return true;
+}
+
 void printVersion()
 {
 	using std::operator<<;
@@ -86,6 +325,23 @@ There is NO WARRANTY, to the extent permitted by law.\n\
 Written by " << authorPtr << '.' << std::endl;
 }
 
+// Runs verify-dir or merge-dir against a DB or a snapshot.
+template<typename DB>
+void checkFiles(const tool t, const char * const src, const char * const dest, DB &db,
+		const mirror::ScanOptions &scanOptions, mirror::ReportWriter * const report)
+{
+	if (t == tool::verifyDir) {
+		mirror::VerifyDirMismatchHandler mismatchHandler(scanOptions.read.digest, report);
+		mirror::checkFileSystem(src, std::strlen(src), db, mismatchHandler, scanOptions);
+		return;
+	}
+
+	assert(t == tool::mergeDir);
+	const std::size_t destSize = std::strlen(dest);
+	mirror::MergeDirMismatchHandler mismatchHandler(src, std::strlen(src), dest, destSize, scanOptions.read, report);
+	mirror::checkFileSystem(dest, destSize, db, mismatchHandler, scanOptions);
+}
+
 }
 
 int main(const int argc, char * const argv[])
@@ -94,6 +350,7 @@ try {
 
 	std::setlocale(LC_ALL, "");
 	mirror::initConverters();
+	mirror::initCRC64();
 
 	tool t = tool::undefined;
 	bool toolDefined = false;
@@ -101,22 +358,222 @@ try {
 	int optionIndex = -1;
 	const char *dbPath;
 	bool dbDefined = false;
-	while ((c = ::getopt_long(argc, argv, "h", options, &optionIndex)) != -1) {
+	mirror::ScanOptions scanOptions;
+	mirror::DigestAlgorithm digest;
+	bool digestDefined = false;
+	bool printStats = false;
+	unsigned progressInterval = 0;
+	mirror::IOLimits ioLimits;
+	const char *reportPath = nullptr;
+	const char *snapshotPath = nullptr;
+	while ((c = ::getopt_long(argc, argv, "hj:", options, &optionIndex)) != -1) {
 		switch (c) {
 		case 'd':
 			dbPath = ::optarg;
 			dbDefined = true;
 			break;
+		case 'j':
+			if (!parseCount(::optarg, maxJobs, scanOptions.jobs)) {
+				std::cerr << "Invalid number of jobs: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case walkersTag:
+			if (!parseCount(::optarg, maxJobs, scanOptions.walkers)) {
+				std::cerr << "Invalid number of walkers: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case digestTag:
+			if (!mirror::parseDigestAlgorithm(::optarg, digest)) {
+				std::cerr << "Invalid digest algorithm: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			digestDefined = true;
+			break;
+		case hashThreadsTag:
+			if (!parseCount(::optarg, mirror::ReadOptions::maxHashThreads, scanOptions.read.hashThreads)) {
+				std::cerr << "Invalid number of hash threads: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case shardTag:
+			if (!parseShard(::optarg, scanOptions.shard)) {
+				std::cerr << "Invalid shard: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case shardDepthTag:
+			if (!parseCount(::optarg, mirror::ShardOptions::maxDepth, scanOptions.shard.depth)) {
+				std::cerr << "Invalid shard depth: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case readBufferTag: {
+			unsigned long long size;
+			if (!parseSize(::optarg, size) || size < mirror::ReadOptions::minBufferSize ||
+					size > mirror::ReadOptions::maxBufferSize || size % mirror::ReadOptions::minBufferSize != 0) {
+				std::cerr << "Invalid read buffer size: '" << ::optarg << "'. It must be a multiple of 4K "
+						"between 4K and 64M." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.read.bufferSize = static_cast<std::size_t>(size);
+			break;
+		}
+		case mmapThresholdTag: {
+			unsigned long long size;
+			if (!parseSize(::optarg, size) || size > static_cast<unsigned long long>(maxOffT)) {
+				std::cerr << "Invalid mmap threshold: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.read.mmapThreshold = static_cast<off_t>(size);
+			break;
+		}
+		case noReadaheadAdviceTag:
+			scanOptions.read.sequentialAdvice = false;
+			break;
+		case dropCacheTag:
+			scanOptions.read.dropCache = true;
+			break;
+		case reportTag:
+			reportPath = ::optarg;
+			break;
+		case snapshotTag:
+			snapshotPath = ::optarg;
+			break;
+		case maxReadRateTag:
+		case maxWriteRateTag:
+		case maxIOPSTag: {
+			unsigned long long limit;
+			if (!parseSize(::optarg, limit)) {
+				std::cerr << "Invalid I/O limit: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			(c == maxReadRateTag ? ioLimits.readRate : c == maxWriteRateTag ? ioLimits.writeRate : ioLimits.iops) =
+					static_cast<std::uint_fast64_t>(limit);
+			break;
+		}
+		case ioBackendTag:
+			if (std::strcmp(::optarg, "sync") == 0) {
+				scanOptions.read.backend = mirror::IOBackend::sync;
+			} else if (std::strcmp(::optarg, "io_uring") == 0) {
+#ifdef MIRROR_IO_URING
+				scanOptions.read.backend = mirror::IOBackend::uring;
+#else
+				std::cerr << "io_uring support is not compiled in." << std::endl;
+				return 1;
+#endif
+			} else {
+				std::cerr << "Invalid I/O backend: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case verifyTag:
+			if (!parseVerifyMode(::optarg, scanOptions.verify)) {
+				std::cerr << "Invalid verification mode: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case verifyEngineTag:
+			if (std::strcmp(::optarg, "per-dir") == 0) {
+				scanOptions.verify.engine = mirror::VerifyEngine::perDir;
+			} else if (std::strcmp(::optarg, "merge-join") == 0) {
+				scanOptions.verify.engine = mirror::VerifyEngine::mergeJoin;
+			} else {
+				std::cerr << "Invalid verify engine: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case fileOrderTag:
+			if (std::strcmp(::optarg, "directory") == 0) {
+				scanOptions.order = mirror::FileOrder::directory;
+			} else if (std::strcmp(::optarg, "inode") == 0) {
+				scanOptions.order = mirror::FileOrder::inode;
+			} else if (std::strcmp(::optarg, "physical") == 0) {
+				scanOptions.order = mirror::FileOrder::physical;
+			} else {
+				std::cerr << "Invalid file order: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case dirBatchTag: {
+			unsigned long long count;
+			if (!parseSize(::optarg, count) || count == 0 || count > std::numeric_limits<std::size_t>::max()) {
+				std::cerr << "Invalid directory batch size: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.verify.dirBatchSize = static_cast<std::size_t>(count);
+			break;
+		}
+		case commitIntervalTag: {
+			unsigned long long count;
+			if (!parseSize(::optarg, count) || count > std::numeric_limits<std::size_t>::max()) {
+				std::cerr << "Invalid commit interval: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			scanOptions.commitInterval = static_cast<std::size_t>(count);
+			break;
+		}
+		case commitPeriodTag:
+			if (!parseCount(::optarg, maxCommitPeriod, scanOptions.commitPeriod)) {
+				std::cerr << "Invalid commit period: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case resumeTag:
+			scanOptions.resume = true;
+			break;
+		case ioDepthTag:
+			if (!parseCount(::optarg, mirror::ReadOptions::maxQueueDepth, scanOptions.read.queueDepth)) {
+				std::cerr << "Invalid I/O queue depth: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
+		case statsTag:
+			printStats = true;
+			break;
+		case progressTag:
+			if (!parseCount(::optarg, maxProgressInterval, progressInterval)) {
+				std::cerr << "Invalid progress interval: '" << ::optarg << "'." << std::endl;
+				printUsage(false);
+				return 1;
+			}
+			break;
 		case 'h':
 			printUsage(true);
 			return 0;
 		case 't':
 			if (std::strcmp(::optarg, "create-db") == 0) {
 				t = tool::createDB;
+			} else if (std::strcmp(::optarg, "update-db") == 0) {
+				t = tool::updateDB;
 			} else if (std::strcmp(::optarg, "verify-dir") == 0) {
 				t = tool::verifyDir;
 			} else if (std::strcmp(::optarg, "merge-dir") == 0) {
 				t = tool::mergeDir;
+			} else if (std::strcmp(::optarg, "merge-db") == 0) {
+				t = tool::mergeDB;
+			} else if (std::strcmp(::optarg, "export-snapshot") == 0) {
+				t = tool::exportSnapshot;
+			} else if (std::strcmp(::optarg, "diff-db") == 0) {
+				t = tool::diffDB;
 			} else {
 				printUsage(false, mirror::PROGRAM_NAME);
 				return 1;
@@ -147,7 +604,7 @@ try {
 		printUsage(false);
 		return 1;
 	}
-	if (optind < argc - 2) {
+	if (t != tool::mergeDB && optind < argc - 2) {
 		std::cerr << "Only SOURCE and DEST files/directories can be specified." << std::endl;
 		printUsage(false);
 		return 1;
@@ -168,7 +625,49 @@ try {
 		printUsage(false);
 		return 1;
 	}
-	if (!dbDefined) {
+	if (scanOptions.resume && t != tool::createDB) {
+		std::cerr << "Only create-db can be resumed." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if ((scanOptions.commitInterval != 0 || scanOptions.commitPeriod != 0) && t == tool::updateDB) {
+		std::cerr << "update-db makes all changes in a single transaction, the commit interval and period"
+				" are supported by create-db only." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (reportPath != nullptr && t != tool::verifyDir && t != tool::mergeDir && t != tool::diffDB) {
+		std::cerr << "Only verify-dir, merge-dir and diff-db write reports." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (scanOptions.verify.dirBatchSize != 0 && scanOptions.verify.engine != mirror::VerifyEngine::perDir) {
+		std::cerr << "The directory batch size is supported by the per-dir verify engine only." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (scanOptions.order != mirror::FileOrder::directory && scanOptions.verify.engine != mirror::VerifyEngine::perDir &&
+			(t == tool::verifyDir || t == tool::mergeDir)) {
+		std::cerr << "The file order is supported by the per-dir verify engine only." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (snapshotPath != nullptr && t != tool::verifyDir && t != tool::mergeDir) {
+		std::cerr << "Only verify-dir and merge-dir read snapshots." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (snapshotPath != nullptr && dbDefined) {
+		std::cerr << "Either a DB or a snapshot can be specified." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (t == tool::diffDB && (optind != argc - 2 || dbDefined)) {
+		std::cerr << "FIRST_DB and SECOND_DB (and no --db) must be specified for diff-db." << std::endl;
+		printUsage(false);
+		return 1;
+	}
+	if (!dbDefined && snapshotPath == nullptr && t != tool::diffDB) {
 		std::cerr << "No DB specified." << std::endl;
 		printUsage(false);
 		return 1;
@@ -176,27 +675,137 @@ try {
 
 	const char * const src = argv[optind];
 	const char * const dest = argv[optind + 1];
+	if (printStats || progressInterval > 0) {
+		mirror::enableStats();
+	}
+	mirror::setIOLimits(ioLimits);
+
+	if (snapshotPath != nullptr) {
+		mirror::Snapshot snapshot = mirror::Snapshot::open(snapshotPath);
+		{
+			std::unique_ptr<mirror::ProgressReporter> progress;
+			if (progressInterval > 0) {
+				progress.reset(new mirror::ProgressReporter(progressInterval, stderr));
+			}
+
+			if (digestDefined && digest != snapshot.digestAlgorithm()) {
+				throw "The snapshot has digests of another algorithm.";
+			}
+			scanOptions.read.digest = snapshot.digestAlgorithm();
+
+			std::unique_ptr<mirror::ReportWriter> report;
+			if (reportPath != nullptr) {
+				report.reset(new mirror::ReportWriter(reportPath, scanOptions.read.digest));
+			}
+
+			checkFiles(t, src, dest, snapshot, scanOptions, report.get());
+
+			if (report != nullptr) {
+				report->close();
+			}
+		}
+
+		if (printStats) {
+			mirror::printStats(stderr);
+		}
+		return 0;
+	}
+
+	if (t == tool::diffDB) {
+		mirror::FileDB first = mirror::FileDB::open(src);
+		try {
+			mirror::FileDB second = mirror::FileDB::open(dest);
+			try {
+				std::unique_ptr<mirror::ReportWriter> report;
+				if (reportPath != nullptr) {
+					report.reset(new mirror::ReportWriter(reportPath, first.digestAlgorithm()));
+				}
+
+				mirror::DiffDBMismatchHandler mismatchHandler(first.digestAlgorithm(), report.get());
+				mirror::diffDB(first, second, mismatchHandler);
+
+				if (report != nullptr) {
+					report->close();
+				}
+			}
+			catch (...) {
+				second.close();
+				throw;
+			}
+			second.close();
+		}
+		catch (...) {
+			first.close();
+			throw;
+		}
+		first.close();
+
+		if (printStats) {
+			mirror::printStats(stderr);
+		}
+		return 0;
+	}
+
 	mirror::FileDB db = mirror::FileDB::open(dbPath, true);
 
 	try {
+		std::unique_ptr<mirror::ProgressReporter> progress;
+		if (progressInterval > 0) {
+			progress.reset(new mirror::ProgressReporter(progressInterval, stderr));
+		}
+
+		/*
+		 * The algorithm is stored in the DB, so it can be changed only while the DB has no files.
+		 * The other tools do not write the DB metadata and require the algorithm of the DB.
+		 */
+		if (digestDefined) {
+			if (t == tool::createDB || t == tool::updateDB) {
+				db.setDigestAlgorithm(digest);
+			} else if (digest != db.digestAlgorithm()) {
+				throw "The DB has digests of another algorithm.";
+			}
+		}
+		scanOptions.read.digest = db.digestAlgorithm();
+
+		std::unique_ptr<mirror::ReportWriter> report;
+		if (reportPath != nullptr) {
+			report.reset(new mirror::ReportWriter(reportPath, scanOptions.read.digest));
+		}
+
 		switch (t) {
 		case tool::createDB:
-			mirror::createDB(src, std::strlen(src), db);
+			mirror::createDB(src, std::strlen(src), db, scanOptions);
 			break;
-		case tool::verifyDir: {
-			mirror::VerifyDirMismatchHandler mismatchHandler;
-			mirror::checkFileSystem(src, std::strlen(src), db, mismatchHandler);
+		case tool::updateDB:
+			mirror::updateDB(src, std::strlen(src), db, scanOptions);
 			break;
-		}
-		case tool::mergeDir: {
-			const std::size_t destSize = std::strlen(dest);
-			mirror::MergeDirMismatchHandler mismatchHandler(src, std::strlen(src), dest, destSize);
-			mirror::checkFileSystem(dest, destSize, db, mismatchHandler);
+		case tool::verifyDir:
+		case tool::mergeDir:
+			checkFiles(t, src, dest, db, scanOptions, report.get());
+			break;
+		case tool::mergeDB:
+			for (int i = optind; i < argc; ++i) {
+				mirror::FileDB srcDB = mirror::FileDB::open(argv[i]);
+				try {
+					mirror::mergeDB(db, srcDB, scanOptions.commitInterval);
+				}
+				catch (...) {
+					srcDB.close();
+					throw;
+				}
+				srcDB.close();
+			}
+			break;
+		case tool::exportSnapshot:
+			mirror::exportSnapshot(db, src);
 			break;
-		}
 		default:
 			assert(false);
 		}
+
+		if (report != nullptr) {
+			report->close();
+		}
 	}
 	catch (...) {
 		db.close();
@@ -206,6 +815,10 @@ try {
 
 	db.close();
 
+	if (printStats) {
+		mirror::printStats(stderr);
+	}
+
 	return 0;
 }
 catch (std::exception &ex) {
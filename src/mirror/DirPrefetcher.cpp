@@ -0,0 +1,355 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "DirPrefetcher.hpp"
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <unistd.h>
+#include <utility>
+#include "utils.hpp"
+
+struct mirror::_helper::DirPrefetcher::ListingBuffers
+{
+	DirReader reader;
+	// The path of the entry being stat'ed, for logging.
+	std::string path;
+};
+
+mirror::_helper::DirPrefetcher::DirPrefetcher(const unsigned threadCount, const ShardOptions &shard,
+		const std::size_t relPathOffset, const FileOrder order)
+		: m_shard(shard), m_relPathOffset(relPathOffset), m_order(order), m_queues(), m_workers(), m_mutex(), m_workCond(), m_doneCond(), m_limitCond(), m_queuedDirs(0),
+		  m_prefetchedEntries(0), m_stopped(false), m_nextQueue(0), m_walkBuffers(new ListingBuffers())
+{
+	assert(threadCount > 0);
+
+	m_queues.reserve(threadCount);
+	for (unsigned i = 0; i < threadCount; ++i) {
+		m_queues.emplace_back(new WorkerQueue());
+	}
+
+	m_workers.reserve(threadCount);
+	try {
+		for (unsigned i = 0; i < threadCount; ++i) {
+			m_workers.emplace_back(&DirPrefetcher::work, this, i);
+		}
+	}
+	catch (...) {
+		stop();
+		throw;
+	}
+}
+
+mirror::_helper::DirPrefetcher::~DirPrefetcher()
+{
+	stop();
+}
+
+std::shared_ptr<mirror::_helper::DirPrefetcher::Dir> mirror::_helper::DirPrefetcher::root(
+		const char * const path, const std::size_t pathSize)
+{
+	return std::make_shared<Dir>(std::string(path, pathSize), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+}
+
+void mirror::_helper::DirPrefetcher::acquire(Dir &dir)
+{
+	int expected = pending;
+	if (dir.state.compare_exchange_strong(expected, claimed)) {
+		list(dir, *m_walkBuffers, m_nextQueue);
+		m_nextQueue = (m_nextQueue + 1) % m_queues.size();
+	} else if (expected != done) {
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_doneCond.wait(lock, [&dir] { return dir.state.load() == done; });
+	}
+
+	if (dir.error != nullptr) {
+		std::rethrow_exception(dir.error);
+	}
+}
+
+void mirror::_helper::DirPrefetcher::release(Dir &dir) noexcept
+{
+	assert(dir.state.load() == done);
+
+	if (!dir.released.exchange(true)) {
+		freeListing(dir);
+	}
+}
+
+void mirror::_helper::DirPrefetcher::freeListing(Dir &dir) noexcept
+{
+	const std::size_t entryCount = dir.entries.size();
+	std::vector<Entry>().swap(dir.entries);
+	std::string().swap(dir.names);
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_prefetchedEntries -= entryCount;
+	}
+	m_limitCond.notify_all();
+}
+
+void mirror::_helper::DirPrefetcher::cancel(Dir &dir) noexcept
+{
+	dir.cancelled.store(true);
+
+	/*
+	 * If the directory is being listed then either the worker sees that it is cancelled once it is done,
+	 * or it is seen here as done.
+	 */
+	if (dir.state.load() == done && !dir.released.exchange(true)) {
+		for (const Entry &entry : dir.entries) {
+			if (entry.subdir != nullptr) {
+				cancel(*entry.subdir);
+			}
+		}
+		freeListing(dir);
+	}
+}
+
+void mirror::_helper::DirPrefetcher::work(const std::size_t workerIndex)
+{
+	ListingBuffers buffers;
+
+	for (;;) {
+		std::shared_ptr<Dir> dir = take(workerIndex);
+		if (dir == nullptr) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_workCond.wait(lock, [this] { return m_stopped || m_queuedDirs > 0; });
+			if (m_stopped) {
+				return;
+			}
+			continue;
+		}
+
+		if (dir->cancelled.load()) {
+			continue;
+		}
+
+		// The directory is not claimed while waiting so that the walk can list it itself if it needs it.
+		{
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_limitCond.wait(lock, [this, &dir]
+			{
+				return m_stopped || m_prefetchedEntries < maxPrefetchedEntries || dir->cancelled.load() ||
+						dir->state.load() != pending;
+			});
+			if (m_stopped) {
+				return;
+			}
+		}
+
+		int expected = pending;
+		if (!dir->cancelled.load() && dir->state.compare_exchange_strong(expected, claimed)) {
+			list(*dir, buffers, workerIndex);
+		}
+	}
+}
+
+std::shared_ptr<mirror::_helper::DirPrefetcher::Dir> mirror::_helper::DirPrefetcher::take(
+		const std::size_t workerIndex)
+{
+	std::shared_ptr<Dir> result;
+
+	{
+		WorkerQueue &own = *m_queues[workerIndex];
+		std::lock_guard<std::mutex> lock(own.mutex);
+		if (!own.dirs.empty()) {
+			result = std::move(own.dirs.back());
+			own.dirs.pop_back();
+		}
+	}
+
+	for (std::size_t i = 1; result == nullptr && i < m_queues.size(); ++i) {
+		WorkerQueue &victim = *m_queues[(workerIndex + i) % m_queues.size()];
+		std::lock_guard<std::mutex> lock(victim.mutex);
+		if (!victim.dirs.empty()) {
+			result = std::move(victim.dirs.front());
+			victim.dirs.pop_front();
+		}
+	}
+
+	if (result != nullptr) {
+		std::lock_guard<std::mutex> lock(m_mutex);
+		--m_queuedDirs;
+	}
+	return result;
+}
+
+void mirror::_helper::DirPrefetcher::push(const std::size_t queueIndex, const Dir &dir)
+{
+	std::size_t subdirCount = 0;
+	{
+		WorkerQueue &queue = *m_queues[queueIndex];
+		std::lock_guard<std::mutex> lock(queue.mutex);
+		// Pushed in the reverse order so that the first subdirectory is taken first by the owner.
+		for (auto it = dir.entries.rbegin(), end = dir.entries.rend(); it != end; ++it) {
+			if (it->subdir != nullptr) {
+				queue.dirs.push_back(it->subdir);
+				++subdirCount;
+			}
+		}
+	}
+
+	if (subdirCount > 0) {
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_queuedDirs += subdirCount;
+		}
+		m_workCond.notify_all();
+	}
+}
+
+void mirror::_helper::DirPrefetcher::list(Dir &dir, ListingBuffers &buffers, const std::size_t queueIndex)
+{
+	try {
+		const int fd = open(dir.path.c_str(), dir.openFlags);
+		if (fd == -1) {
+			handleOpenFileError(errno);
+		}
+		buffers.reader.open(fd);
+
+		std::string &path = buffers.path;
+		path.assign(dir.path);
+		path.push_back('/');
+		const std::size_t dirPathSize = path.size();
+
+		const char *name;
+		unsigned char type;
+		while (buffers.reader.next(name, type)) {
+			if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+				// Either the current dir or the parent dir. Skipping it.
+				continue;
+			}
+
+			const std::size_t nameSize = std::strlen(name);
+			path.resize(dirPathSize);
+			path.append(name, nameSize);
+
+			Entry entry;
+			if (!statDirEntry(buffers.reader.fd(), name, type, path.data(), path.size(), entry.fileStat)) {
+				continue;
+			}
+			entry.nameOffset = dir.names.size();
+			entry.nameSize = nameSize;
+			dir.names.append(name, nameSize + 1);
+			if (S_ISDIR(entry.fileStat.st_mode)) {
+				entry.subdir = std::make_shared<Dir>(std::string(path), O_RDONLY | O_DIRECTORY);
+				// The walk does not enter the subtrees of the other shards.
+				if (m_shard.enabled() && m_shard.match(path.data() + m_relPathOffset,
+						path.size() - m_relPathOffset) == ShardMatch::foreign) {
+					entry.subdir->cancelled.store(true);
+				}
+			}
+			dir.entries.push_back(std::move(entry));
+		}
+
+		if (m_order != FileOrder::directory) {
+			sortFiles(dir, buffers.reader.fd());
+		}
+		buffers.reader.close();
+	}
+	catch (...) {
+		dir.error = std::current_exception();
+		try {
+			buffers.reader.close();
+		}
+		catch (...) {
+			// The first error is reported.
+		}
+	}
+
+	// The walk can release the listing as soon as it is done, so that the subdirectories are pushed before.
+	if (dir.error == nullptr && !dir.cancelled.load()) {
+		push(queueIndex, dir);
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_prefetchedEntries += dir.entries.size();
+		dir.state.store(done);
+	}
+	m_doneCond.notify_all();
+
+	if (dir.cancelled.load()) {
+		cancel(dir);
+	}
+}
+
+void mirror::_helper::DirPrefetcher::sortFiles(Dir &dir, const int dirFd) const
+{
+	std::vector<Entry> &entries = dir.entries;
+	const auto subdirs = std::stable_partition(entries.begin(), entries.end(),
+			[] (const Entry &entry) { return !S_ISDIR(entry.fileStat.st_mode); });
+	const std::size_t fileCount = static_cast<std::size_t>(subdirs - entries.begin());
+	if (fileCount < 2) {
+		return;
+	}
+
+	/*
+	 * The sort keys with the indices of the files. The files with equal offsets (e.g. the ones not allocated
+	 * yet) are in the inode order.
+	 */
+	std::vector<std::pair<std::uint_fast64_t, std::size_t>> keys;
+	keys.reserve(fileCount);
+	bool physical = m_order == FileOrder::physical;
+	for (std::size_t i = 0; i < fileCount; ++i) {
+		std::uint_fast64_t key = entries[i].fileStat.st_ino;
+		if (physical && !physicalOffset(dirFd, dir.name(entries[i]), key)) {
+			// The offsets and the inode numbers are not comparable, so the whole directory is in the inode order.
+			physical = false;
+			for (std::pair<std::uint_fast64_t, std::size_t> &k : keys) {
+				k.first = entries[k.second].fileStat.st_ino;
+			}
+			key = entries[i].fileStat.st_ino;
+		}
+		keys.emplace_back(key, i);
+	}
+	std::sort(keys.begin(), keys.end(), [&entries] (const std::pair<std::uint_fast64_t, std::size_t> &k1,
+			const std::pair<std::uint_fast64_t, std::size_t> &k2)
+			{
+				if (k1.first != k2.first) {
+					return k1.first < k2.first;
+				}
+				const ino_t ino1 = entries[k1.second].fileStat.st_ino, ino2 = entries[k2.second].fileStat.st_ino;
+				return ino1 != ino2 ? ino1 < ino2 : k1.second < k2.second;
+			});
+
+	std::vector<Entry> sorted;
+	sorted.reserve(entries.size());
+	for (const std::pair<std::uint_fast64_t, std::size_t> &k : keys) {
+		sorted.push_back(std::move(entries[k.second]));
+	}
+	std::move(subdirs, entries.end(), std::back_inserter(sorted));
+	entries.swap(sorted);
+}
+
+void mirror::_helper::DirPrefetcher::stop() noexcept
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopped = true;
+	}
+	m_workCond.notify_all();
+	m_limitCond.notify_all();
+	for (std::thread &worker : m_workers) {
+		worker.join();
+	}
+	m_workers.clear();
+}
@@ -0,0 +1,157 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_DIRPREFETCHER_HPP_
+#define MIRROR_DIRPREFETCHER_HPP_
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include "order.hpp"
+#include "shard.hpp"
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		/*
+		 * Lists directories and stats their entries in worker threads ahead of a walk, so that the latency
+		 * of the file system metadata operations is not serialised. The walk itself (and so the event
+		 * handlers) stays in the calling thread and visits the directories in the same order as scanFiles().
+		 *
+		 * Each worker has its own deque of the directories to list. The subdirectories found by a worker are
+		 * pushed to its own deque and are taken in the LIFO order, so that a worker goes deep into a subtree
+		 * (which is where the walk goes next). Idle workers steal the oldest directories from the others,
+		 * which are the roots of the largest untouched subtrees. The number of entries listed ahead is bounded.
+		 */
+		class DirPrefetcher
+		{
+		public:
+			struct Dir;
+
+			struct Entry
+			{
+				std::size_t nameOffset;
+				std::size_t nameSize;
+				struct stat fileStat;
+				// Is set for directories only.
+				std::shared_ptr<Dir> subdir;
+			};
+
+			struct Dir
+			{
+				Dir(std::string &&path, const int openFlags) : path(std::move(path)), openFlags(openFlags),
+						state(pending), cancelled(false), released(false), names(), entries(), error() {}
+
+				const char *name(const Entry &entry) const noexcept { return names.data() + entry.nameOffset; }
+
+				// Is not terminated with a slash.
+				const std::string path;
+				const int openFlags;
+
+				std::atomic<int> state;
+				std::atomic<bool> cancelled;
+				std::atomic<bool> released;
+
+				// System names of the entries, each is terminated with '\0'.
+				std::string names;
+				// Regular files and directories only.
+				std::vector<Entry> entries;
+				std::exception_ptr error;
+			};
+
+			/*
+			 * The subdirectories of the other shards are not listed. relPathOffset is the size of the path
+			 * of the root directory with the trailing slash. Unless the order is FileOrder::directory,
+			 * the regular files of each directory listed are put in this order before its subdirectories,
+			 * which are kept in the order they are listed in.
+			 */
+			DirPrefetcher(unsigned threadCount, const ShardOptions &shard = ShardOptions(),
+					std::size_t relPathOffset = 0, FileOrder order = FileOrder::directory);
+
+			DirPrefetcher(const DirPrefetcher &) = delete;
+			DirPrefetcher(DirPrefetcher &&) = delete;
+			DirPrefetcher &operator=(const DirPrefetcher &) = delete;
+			DirPrefetcher &operator=(DirPrefetcher &&) = delete;
+
+			~DirPrefetcher();
+
+			std::shared_ptr<Dir> root(const char *path, std::size_t pathSize);
+
+			/*
+			 * Waits for the directory to be listed. If no worker has started listing it yet then it is listed
+			 * in the calling thread. The error the listing has failed with is re-thrown.
+			 */
+			void acquire(Dir &dir);
+			// Frees the listing of the directory acquired once the walk exits it.
+			void release(Dir &dir) noexcept;
+			// Tells that the walk does not enter the directory, so that its subtree is not listed.
+			void cancel(Dir &dir) noexcept;
+		private:
+			static constexpr int pending = 0;
+			static constexpr int claimed = 1;
+			static constexpr int done = 2;
+
+			// Workers wait when this number of entries listed are not released by the walk yet.
+			static constexpr std::size_t maxPrefetchedEntries = 256 * 1024;
+
+			struct WorkerQueue
+			{
+				std::mutex mutex;
+				std::deque<std::shared_ptr<Dir>> dirs;
+			};
+
+			struct ListingBuffers;
+
+			void work(std::size_t workerIndex);
+			std::shared_ptr<Dir> take(std::size_t workerIndex);
+			void push(std::size_t queueIndex, const Dir &dir);
+			void list(Dir &dir, ListingBuffers &buffers, std::size_t queueIndex);
+			void sortFiles(Dir &dir, int dirFd) const;
+			void freeListing(Dir &dir) noexcept;
+			void stop() noexcept;
+
+			const ShardOptions m_shard;
+			const std::size_t m_relPathOffset;
+			const FileOrder m_order;
+
+			std::vector<std::unique_ptr<WorkerQueue>> m_queues;
+			std::vector<std::thread> m_workers;
+
+			// Guards the fields below and the states of the directories being waited for.
+			std::mutex m_mutex;
+			std::condition_variable m_workCond;
+			std::condition_variable m_doneCond;
+			std::condition_variable m_limitCond;
+			std::size_t m_queuedDirs;
+			std::size_t m_prefetchedEntries;
+			bool m_stopped;
+
+			// The queue the directories listed by the walk thread push their subdirectories to.
+			std::size_t m_nextQueue;
+			std::unique_ptr<ListingBuffers> m_walkBuffers;
+		};
+	}
+}
+
+#endif // MIRROR_DIRPREFETCHER_HPP_
@@ -17,25 +17,228 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/dateutil.hpp>
 #include <afc/logger.hpp>
 #include <afc/StringRef.hpp>
+#include <algorithm>
 #include <cassert>
 #include "encoding.hpp"
+#include <initializer_list>
 #include <utility>
 
 using afc::operator"" _s;
 using afc::logger::logTrace;
 
+constexpr std::size_t mirror::FileDB::batchFileCount;
+
+namespace
+{
+	/*
+	 * The version of the DB layout stored as user_version. The layout with the relative directory path
+	 * stored with each file has no version set, it is referred to as version 1. Version 2 has no metadata
+	 * table and has the digests (which are always CRC64 there) in the column crc64.
+	 */
+	constexpr int pathLayoutVersion = 1;
+	constexpr int crc64OnlyVersion = 2;
+	constexpr int schemaVersion = 3;
+
+	/*
+	 * The recursive step pops the smallest key from the queue, and the keys of the subdirectories are greater
+	 * than the key of their parent and smaller than the keys of its next siblings, so the directories come
+	 * in the key order without sorting. The queue holds the subdirectories of the directories on the path
+	 * only. The files of each directory are read in the name order through the primary key.
+	 */
+	constexpr auto sortedDirsQuery = u8"with recursive paths (id, key) as (select 0, x'' union all "
+			"select d.id, cast(p.key || x'00' || d.name as blob) from paths p join dirs d on d.parent_id = p.id "
+			"order by 2) select id, key from paths"_s;
+	constexpr auto sortedFilesQuery = u8"select name, type, size, last_modified, digest from files "
+			"where dir_id = ? order by name"_s;
+
+	int readInt(sqlite3 * const conn, const char * const query, int &dest)
+	{
+		sqlite3_stmt *stmt;
+
+		logTrace("Preparing statement: "_s, query);
+		int result = sqlite3_prepare_v2(conn, query, -1, &stmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		result = sqlite3_step(stmt);
+		if (result == SQLITE_ROW) {
+			dest = sqlite3_column_int(stmt, 0);
+			result = SQLITE_OK;
+		}
+		// TODO handle sqlite3_finalize error code.
+		sqlite3_finalize(stmt);
+		return result;
+	}
+
+	// Returns 0 for an empty DB.
+	int readSchemaVersion(sqlite3 * const conn, int &dest)
+	{
+		int result = readInt(conn, u8"pragma user_version", dest);
+		if (result != SQLITE_OK || dest != 0) {
+			return result;
+		}
+
+		int fileTableCount;
+		result = readInt(conn, u8"select count(*) from sqlite_master where type = 'table' and name = 'files'",
+				fileTableCount);
+		if (result == SQLITE_OK && fileTableCount > 0) {
+			dest = pathLayoutVersion;
+		}
+		return result;
+	}
+
+	// Returns SQLITE_NOTFOUND if there is no such key in the metadata table.
+	int readMetadata(sqlite3 * const conn, const char * const key, std::string &dest)
+	{
+		constexpr auto query = u8"select value from metadata where key = ?"_s;
+
+		sqlite3_stmt *stmt;
+
+		logTrace("Preparing statement: "_s, query);
+		int result = sqlite3_prepare_v2(conn, query.value(), query.size(), &stmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		result = sqlite3_bind_text(stmt, 1, key, -1, SQLITE_STATIC);
+		if (result == SQLITE_OK) {
+			result = sqlite3_step(stmt);
+			if (result == SQLITE_ROW) {
+				dest.assign(reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0)), sqlite3_column_bytes(stmt, 0));
+				result = SQLITE_OK;
+			} else if (result == SQLITE_DONE) {
+				result = SQLITE_NOTFOUND;
+			}
+		}
+		// TODO handle sqlite3_finalize error code.
+		sqlite3_finalize(stmt);
+		return result;
+	}
+
+	int bindFile(sqlite3_stmt * const stmt, const int firstParam, const char * const fileNameU8,
+			const std::size_t fileNameSize, const sqlite3_int64 dirId, const mirror::FileRecord &data,
+			const std::size_t digestSize)
+	{
+		using mirror::FileType;
+
+		int result;
+
+		result = sqlite3_bind_text(stmt, firstParam, fileNameU8, fileNameSize, SQLITE_STATIC);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		result = sqlite3_bind_int64(stmt, firstParam + 1, dirId);
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		result = sqlite3_bind_int(stmt, firstParam + 2, static_cast<int>(data.type));
+		if (result != SQLITE_OK) {
+			return result;
+		}
+
+		switch (data.type) {
+		case FileType::file:
+			result = sqlite3_bind_int64(stmt, firstParam + 3, static_cast<sqlite_int64>(data.fileSize));
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			result = sqlite3_bind_int64(stmt, firstParam + 4,
+					static_cast<sqlite_int64>(data.lastModifiedTS.millis() / 1000));
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			return sqlite3_bind_blob(stmt, firstParam + 5, data.digest, digestSize, SQLITE_STATIC);
+		case FileType::dir:
+			result = sqlite3_bind_null(stmt, firstParam + 3);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			result = sqlite3_bind_null(stmt, firstParam + 4);
+			if (result != SQLITE_OK) {
+				return result;
+			}
+			return sqlite3_bind_null(stmt, firstParam + 5);
+		default:
+			assert(false);
+			return SQLITE_MISUSE;
+		}
+	}
+
+	// Reads the columns type, size, last_modified, digest that start with typeColumn.
+	void readFileRecord(sqlite3_stmt * const stmt, const int typeColumn, mirror::FileRecord &dest)
+	{
+		using mirror::FileType;
+
+		assert(sqlite3_column_int(stmt, typeColumn) == FileType::file ||
+				sqlite3_column_int(stmt, typeColumn) == FileType::dir);
+
+		dest.type = static_cast<FileType>(sqlite3_column_int(stmt, typeColumn));
+		if (dest.type == FileType::file) {
+			dest.fileSize = sqlite3_column_int64(stmt, typeColumn + 1);
+			dest.lastModifiedTS.setMillis(sqlite3_column_int64(stmt, typeColumn + 2) * 1000);
+
+			const unsigned char *digest = reinterpret_cast<const unsigned char *>(
+					sqlite3_column_blob(stmt, typeColumn + 3));
+			const std::size_t digestSize = std::min(static_cast<std::size_t>(sqlite3_column_bytes(stmt, typeColumn + 3)),
+					mirror::maxDigestSize);
+			std::fill(std::copy_n(digest, digestSize, dest.digest), dest.digest + mirror::maxDigestSize, 0);
+		}
+	}
+
+	struct StatementHolder
+	{
+		StatementHolder() noexcept : stmt(nullptr) {}
+		~StatementHolder() { sqlite3_finalize(stmt); }
+
+		sqlite3_stmt *stmt;
+	};
+}
+
 mirror::FileDB::FileDB(const char * const dbPathInUtf8)
+		: m_addFilesStmt(nullptr), m_digest(DigestAlgorithm::crc64), m_bulkLoad(false), m_bulkLoadCacheSize(0), m_bulkLoadTempStore(0), m_commitInterval(0), m_uncommittedFiles(0), m_commitPeriod(), m_nextCommitTime(),
+		  m_batch(), m_batchSize(0), m_cachedDirPath(), m_cachedDirEnds(), m_cachedDirIds(), m_sortedDirsStmt(nullptr),
+		  m_sortedFilesStmt(nullptr), m_sortedDirPending(false),
+		  m_completeDirStmt(nullptr), m_trackDirStmt(nullptr), m_trackFileStmt(nullptr), m_untrackedFilesStmt(nullptr),
+		  m_untrackFilesStmt(nullptr), m_untrackedDirsStmt(nullptr), m_getFileBatchStmt(nullptr),
+		  m_trackFileBatchStmt(nullptr), m_trackingTempStore(0)
 {
+	constexpr auto createDirTableQuery = u8"create table if not exists dirs "
+			"(id integer primary key, parent_id integer not null, name text not null, unique (parent_id, name))"_s;
+	// The files of a directory are stored together since the table is clustered by the primary key.
 	constexpr auto createFileTableQuery = u8"create table if not exists files "
-			"(file text not null, dir text not null, type integer not null, size integer, last_modified integer,"
-			"crc64 blob, primary key (file, dir))"_s;
-	constexpr auto createDirIndexQuery = u8"create index if not exists dir_idx on files (dir)"_s;
-	constexpr auto addFileQuery = u8"insert or replace into files (file, dir, type, size, last_modified, crc64) values (?, ?, ?, ?, ?, ?)"_s;
-	constexpr auto getFileQuery = u8"select * from files where file = ? and dir = ?"_s;
-	constexpr auto getDirFilesQuery = u8"select file, type, size, last_modified, crc64 from files where dir = ?"_s;
-	constexpr auto getDirsQuery = u8"select distinct dir from files"_s;
+			"(dir_id integer not null, name text not null, type integer not null, size integer, last_modified integer,"
+			"digest blob, primary key (dir_id, name)) without rowid"_s;
+	// The DBs created before the metadata table is introduced have CRC64 digests.
+	constexpr auto createMetadataTableQuery = u8"create table if not exists metadata "
+			"(key text primary key, value text not null) without rowid; "
+			"insert or ignore into metadata (key, value) values ('digest', 'crc64')"_s;
+	constexpr auto setSchemaVersionQuery = u8"pragma user_version = 3"_s;
+	constexpr auto addFileQuery = u8"insert or replace into files (name, dir_id, type, size, last_modified, digest) values (?, ?, ?, ?, ?, ?)"_s;
+	constexpr auto getFileQuery = u8"select type, size, last_modified, digest from files where name = ? and dir_id = ?"_s;
+	constexpr auto getDirFilesQuery = u8"select name, type, size, last_modified, digest from files where dir_id = ?"_s;
+	constexpr auto getDirsQuery = u8"with recursive paths (id, path) as (select id, name from dirs where parent_id = 0 "
+			"union all select d.id, p.path || '/' || d.name from dirs d join paths p on d.parent_id = p.id) "
+			"select path from paths"_s;
+	constexpr auto removeFileQuery = u8"delete from files where name = ? and dir_id = ?"_s;
+	constexpr auto removeDirFilesQuery = u8"with recursive subdirs (id) as (select ?1 union all "
+			"select d.id from dirs d join subdirs s on d.parent_id = s.id) "
+			"delete from files where dir_id in (select id from subdirs)"_s;
+	constexpr auto removeDirsQuery = u8"with recursive subdirs (id) as (select ?1 union all "
+			"select d.id from dirs d join subdirs s on d.parent_id = s.id) "
+			"delete from dirs where id in (select id from subdirs)"_s;
+	constexpr auto getDirIdQuery = u8"select id from dirs where parent_id = ? and name = ?"_s;
+	constexpr auto addDirQuery = u8"insert into dirs (parent_id, name) values (?, ?)"_s;
 
 	int result;
+	int version;
+	std::string digestName;
 
 	logTrace("Opening connection to the DB "_s, dbPathInUtf8);
 	result = sqlite3_open(dbPathInUtf8, &m_conn);
@@ -45,20 +248,99 @@ mirror::FileDB::FileDB(const char * const dbPathInUtf8)
 		goto error_openConn;
 	}
 
+	logTrace("Reading the DB schema version..."_s);
+	result = readSchemaVersion(m_conn, version);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_initSchema;
+	}
+	logTrace("DB schema version: "_s, version);
+
+	if (version > schemaVersion) {
+		sqlite3_close(m_conn);
+		throw "The DB is created by a newer version of the program.";
+	}
+
+	if (version == pathLayoutVersion) {
+		// The old table is moved aside and the files are copied in migrateFromPathLayout().
+		logTrace("Migrating the DB from the path layout..."_s);
+		result = sqlite3_exec(m_conn, u8"begin transaction; alter table files rename to files_v1",
+				nullptr, nullptr, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			goto error_initSchema;
+		}
+	}
+
+	if (version == crc64OnlyVersion) {
+		// The metadata and the version are written in the same transaction, which is committed below.
+		logTrace("Renaming the digest column..."_s);
+		result = sqlite3_exec(m_conn, u8"begin transaction; alter table files rename column crc64 to digest",
+				nullptr, nullptr, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			goto error_initSchema;
+		}
+	}
+
+	logTrace("Creating the directory table (if missing): "_s, createDirTableQuery);
+	result = sqlite3_exec(m_conn, createDirTableQuery.value(), nullptr, nullptr, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_initSchema;
+	}
+
 	logTrace("Creating the file table (if missing): "_s, createFileTableQuery);
 	result = sqlite3_exec(m_conn, createFileTableQuery.value(), nullptr, nullptr, nullptr);
 	logTrace("Result code: "_s, result);
 
 	if (result != SQLITE_OK) {
-		goto error_initFileTable;
+		goto error_initSchema;
+	}
+
+	// A DB of the current version is not written to when it is opened, so that it can be shared read-only.
+	if (version != schemaVersion) {
+		logTrace("Creating the metadata table (if missing): "_s, createMetadataTableQuery);
+		result = sqlite3_exec(m_conn, createMetadataTableQuery.value(), nullptr, nullptr, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			goto error_initSchema;
+		}
+
+		logTrace("Setting the DB schema version: "_s, setSchemaVersionQuery);
+		result = sqlite3_exec(m_conn, setSchemaVersionQuery.value(), nullptr, nullptr, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			goto error_initSchema;
+		}
+	}
+
+	if (version == crc64OnlyVersion) {
+		logTrace("Committing the migration of the digest column..."_s);
+		result = sqlite3_exec(m_conn, u8"commit", nullptr, nullptr, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			goto error_initSchema;
+		}
 	}
 
-	logTrace("Creating the directory index (if missing): "_s, createDirIndexQuery);
-	result = sqlite3_exec(m_conn, createDirIndexQuery.value(), nullptr, nullptr, nullptr);
+	logTrace("Reading the digest algorithm..."_s);
+	result = readMetadata(m_conn, u8"digest", digestName);
 	logTrace("Result code: "_s, result);
 
 	if (result != SQLITE_OK) {
-		goto error_initDirIndex;
+		goto error_initSchema;
+	}
+	if (!parseDigestAlgorithm(digestName.c_str(), m_digest)) {
+		sqlite3_close(m_conn);
+		throw "The DB uses an unknown digest algorithm.";
 	}
 
 	logTrace("Preparing statement to add a file: "_s, addFileQuery);
@@ -85,7 +367,7 @@ mirror::FileDB::FileDB(const char * const dbPathInUtf8)
 		goto error_getDirFilesStmt;
 	}
 
-	logTrace("Preparing statement to get all dirs: "_s, getDirFilesQuery);
+	logTrace("Preparing statement to get all dirs: "_s, getDirsQuery);
 	result = sqlite3_prepare_v2(m_conn, getDirsQuery.value(), getDirsQuery.size(), &m_getDirsStmt, nullptr);
 	logTrace("Result code: "_s, result);
 
@@ -93,8 +375,70 @@ mirror::FileDB::FileDB(const char * const dbPathInUtf8)
 		goto error_getDirsStmt;
 	}
 
+	logTrace("Preparing statement to remove a file: "_s, removeFileQuery);
+	result = sqlite3_prepare_v2(m_conn, removeFileQuery.value(), removeFileQuery.size(), &m_removeFileStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeFileStmt;
+	}
+
+	logTrace("Preparing statement to remove files of a directory tree: "_s, removeDirFilesQuery);
+	result = sqlite3_prepare_v2(m_conn, removeDirFilesQuery.value(), removeDirFilesQuery.size(),
+			&m_removeDirFilesStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeDirFilesStmt;
+	}
+
+	logTrace("Preparing statement to remove a directory tree: "_s, removeDirsQuery);
+	result = sqlite3_prepare_v2(m_conn, removeDirsQuery.value(), removeDirsQuery.size(), &m_removeDirsStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_removeDirsStmt;
+	}
+
+	logTrace("Preparing statement to get a directory id: "_s, getDirIdQuery);
+	result = sqlite3_prepare_v2(m_conn, getDirIdQuery.value(), getDirIdQuery.size(), &m_getDirIdStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_getDirIdStmt;
+	}
+
+	logTrace("Preparing statement to add a directory: "_s, addDirQuery);
+	result = sqlite3_prepare_v2(m_conn, addDirQuery.value(), addDirQuery.size(), &m_addDirStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		goto error_addDirStmt;
+	}
+
+	if (version == pathLayoutVersion) {
+		try {
+			migrateFromPathLayout();
+		}
+		catch (...) {
+			// The migration is rolled back when the connection is closed.
+			close();
+			throw;
+		}
+	}
+
 	return;
 
+error_addDirStmt:
+	sqlite3_finalize(m_getDirIdStmt);
+error_getDirIdStmt:
+	sqlite3_finalize(m_removeDirsStmt);
+error_removeDirsStmt:
+	sqlite3_finalize(m_removeDirFilesStmt);
+error_removeDirFilesStmt:
+	sqlite3_finalize(m_removeFileStmt);
+error_removeFileStmt:
+	sqlite3_finalize(m_getDirsStmt);
 error_getDirsStmt:
 	sqlite3_finalize(m_getDirFilesStmt);
 error_getDirFilesStmt:
@@ -102,165 +446,271 @@ error_getDirFilesStmt:
 error_getFileStmt:
 	sqlite3_finalize(m_addFileStmt);
 error_addFileStmt:
-error_initFileTable:
-error_initDirIndex:
+error_initSchema:
 	sqlite3_close(m_conn);
 error_openConn:
 	// TODO handle error.
 	throw sqlite3_errstr(result);
 }
 
-void mirror::FileDB::addFile(const char * const fileNameU8, const std::size_t fileNameSize,
-		const char * const dirNameU8, const std::size_t dirNameSize, const FileRecord &data)
+void mirror::FileDB::migrateFromPathLayout(void)
 {
-	assert(m_conn != nullptr);
-	assert(data.type == FileType::file || data.type == FileType::dir);
+	/*
+	 * Each directory that has files or is recorded in its parent directory gets an id. Parent directories
+	 * are sorted before their subdirectories, though getDirId() adds missing parents anyway.
+	 */
+	constexpr auto getOldDirsQuery = u8"select dir from files_v1 union "
+			"select case dir when '' then file else dir || '/' || file end from files_v1 where type = 1 order by 1"_s;
+	constexpr auto addDirIdQuery = u8"insert into dir_ids (path, id) values (?, ?)"_s;
+
+	assert(sqlite3_get_autocommit(m_conn) == 0);
 
+	exec(u8"create temp table dir_ids (path text primary key, id integer not null)");
+
+	StatementHolder getOldDirs, addDirId;
 	int result;
 
-	logTrace("Binding statement param 1..."_s);
-	result = sqlite3_bind_text(m_addFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
+	logTrace("Preparing statement to get old dirs: "_s, getOldDirsQuery);
+	result = sqlite3_prepare_v2(m_conn, getOldDirsQuery.value(), getOldDirsQuery.size(), &getOldDirs.stmt, nullptr);
+	logTrace("Result code: "_s, result);
+
 	if (result != SQLITE_OK) {
-		goto handle_error;
+		throw sqlite3_errstr(result);
 	}
 
-	logTrace("Binding statement param 2..."_s);
-	result = sqlite3_bind_text(m_addFileStmt, 2, dirNameU8, dirNameSize, SQLITE_STATIC);
+	logTrace("Preparing statement to add a dir id: "_s, addDirIdQuery);
+	result = sqlite3_prepare_v2(m_conn, addDirIdQuery.value(), addDirIdQuery.size(), &addDirId.stmt, nullptr);
+	logTrace("Result code: "_s, result);
+
 	if (result != SQLITE_OK) {
-		goto handle_error;
+		throw sqlite3_errstr(result);
 	}
 
-	logTrace("Binding statement param 3..."_s);
-	result = sqlite3_bind_int(m_addFileStmt, 3, static_cast<int>(data.type));
-	if (result != SQLITE_OK) {
-		goto handle_error;
+	for (;;) {
+		result = sqlite3_step(getOldDirs.stmt);
+		if (result == SQLITE_DONE) {
+			break;
+		} else if (result != SQLITE_ROW) {
+			throw sqlite3_errstr(result);
+		}
+
+		const char * const dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(getOldDirs.stmt, 0));
+		const std::size_t dirNameSize = sqlite3_column_bytes(getOldDirs.stmt, 0);
+		const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, true);
+
+		logTrace("Dir '"_s, Utf8ToSystemView(dirNameU8, dirNameSize), "' gets id "_s, dirId);
+
+		result = sqlite3_bind_text(addDirId.stmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+		if (result == SQLITE_OK) {
+			result = sqlite3_bind_int64(addDirId.stmt, 2, dirId);
+		}
+		if (result == SQLITE_OK) {
+			result = sqlite3_step(addDirId.stmt);
+			if (result == SQLITE_DONE) {
+				result = sqlite3_reset(addDirId.stmt);
+			}
+		}
+		if (result != SQLITE_OK) {
+			throw sqlite3_errstr(result);
+		}
+	}
+
+	exec(u8"insert into files (dir_id, name, type, size, last_modified, digest) "
+			"select d.id, f.file, f.type, f.size, f.last_modified, f.crc64 from files_v1 f join dir_ids d on d.path = f.dir");
+	exec(u8"drop table files_v1");
+	exec(u8"drop table temp.dir_ids");
+	commit();
+
+	// The pages of the old table are returned to the file system.
+	exec(u8"vacuum");
+}
+
+sqlite3_int64 mirror::FileDB::getDirId(const char * const dirNameU8, const std::size_t dirNameSize, const bool create)
+{
+	if (dirNameSize == 0) {
+		return 0;
+	}
+
+	// The components of the directory resolved last that the path starts with are reused.
+	const std::size_t maxCommonSize = std::min(dirNameSize, m_cachedDirPath.size());
+	std::size_t commonSize = 0;
+	while (commonSize < maxCommonSize && dirNameU8[commonSize] == m_cachedDirPath[commonSize]) {
+		++commonSize;
+	}
+	std::size_t componentCount = 0;
+	for (; componentCount < m_cachedDirEnds.size(); ++componentCount) {
+		const std::size_t end = m_cachedDirEnds[componentCount];
+		if (end > commonSize || (end < dirNameSize && dirNameU8[end] != '/')) {
+			break;
+		}
+	}
+	m_cachedDirEnds.resize(componentCount);
+	m_cachedDirIds.resize(componentCount);
+	m_cachedDirPath.resize(componentCount == 0 ? 0 : m_cachedDirEnds.back());
+
+	sqlite3_int64 dirId = componentCount == 0 ? 0 : m_cachedDirIds.back();
+	for (std::size_t start = componentCount == 0 ? 0 : m_cachedDirEnds.back() + 1; start < dirNameSize;) {
+		const std::size_t end = std::find(dirNameU8 + start, dirNameU8 + dirNameSize, '/') - dirNameU8;
+
+		dirId = getDirId(dirId, dirNameU8 + start, end - start, create);
+		if (dirId == -1) {
+			return -1;
+		}
+
+		if (start > 0) {
+			m_cachedDirPath.push_back('/');
+		}
+		m_cachedDirPath.append(dirNameU8 + start, end - start);
+		m_cachedDirEnds.push_back(end);
+		m_cachedDirIds.push_back(dirId);
+
+		start = end + 1;
 	}
+	return dirId;
+}
 
-	logTrace("Binding statement param 4..."_s);
-	switch (data.type) {
-	case FileType::file:
-		result = sqlite3_bind_int64(m_addFileStmt, 4, static_cast<sqlite_int64>(data.fileSize));
-		break;
-	case FileType::dir:
-		result = sqlite3_bind_null(m_addFileStmt, 4);
-		break;
-	default:
-		assert(false);
+sqlite3_int64 mirror::FileDB::getDirId(const sqlite3_int64 parentId, const char * const nameU8,
+		const std::size_t nameSize, const bool create)
+{
+	sqlite3_stmt *stmt = m_getDirIdStmt;
+	sqlite3_int64 dirId;
+	int result;
+
+	logTrace("Binding statement params..."_s);
+	result = sqlite3_bind_int64(stmt, 1, parentId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
 	}
+	result = sqlite3_bind_text(stmt, 2, nameU8, nameSize, SQLITE_STATIC);
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
-	logTrace("Binding statement param 5..."_s);
-	switch (data.type) {
-	case FileType::file:
-		result = sqlite3_bind_int64(m_addFileStmt, 5, static_cast<sqlite_int64>(data.lastModifiedTS.millis() / 1000));
-		break;
-	case FileType::dir:
-		result = sqlite3_bind_null(m_addFileStmt, 5);
-		break;
-	default:
-		assert(false);
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(stmt);
+	if (result == SQLITE_ROW) {
+		dirId = sqlite3_column_int64(stmt, 0);
+	} else if (result == SQLITE_DONE) {
+		dirId = -1;
+	} else {
+		goto handle_error;
 	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(stmt);
 	if (result != SQLITE_OK) {
-		goto handle_error;
+		goto handle_reset_error;
+	}
+
+	if (dirId != -1 || !create) {
+		return dirId;
 	}
 
-	logTrace("Binding statement param 6..."_s);
-	switch (data.type) {
-	case FileType::file:
-		result = sqlite3_bind_blob(m_addFileStmt, 6, data.crc64, sizeof(data.crc64), SQLITE_STATIC);
-		break;
-	case FileType::dir:
-		result = sqlite3_bind_null(m_addFileStmt, 6);
-		break;
-	default:
-		assert(false);
+	stmt = m_addDirStmt;
+
+	logTrace("Binding statement params..."_s);
+	result = sqlite3_bind_int64(stmt, 1, parentId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
 	}
+	result = sqlite3_bind_text(stmt, 2, nameU8, nameSize, SQLITE_STATIC);
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
 	logTrace("Executing statement..."_s);
-	result = sqlite3_step(m_addFileStmt);
+	result = sqlite3_step(stmt);
 	if (result != SQLITE_DONE) {
 		goto handle_error;
 	}
 
 	logTrace("Reseting statement..."_s);
-	result = sqlite3_reset(m_addFileStmt);
+	result = sqlite3_reset(stmt);
 	if (result != SQLITE_OK) {
 		goto handle_reset_error;
 	}
 
-	return;
+	return sqlite3_last_insert_rowid(m_conn);
 
 handle_error:
 	// Attempting to reset the statement without overwriting the error code.
 	logTrace("Reseting statement..."_s);
 	// TODO handle sqlite3_reset error code.
-	sqlite3_reset(m_addFileStmt);
+	sqlite3_reset(stmt);
 handle_reset_error:
 	throw sqlite3_errstr(result);
 }
 
-void mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t dirNameSize, mirror::DirFileMap &dest)
+void mirror::FileDB::addFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize, const FileRecord &data)
 {
-	using CRC64View = afc::logger::HexEncodedN<sizeof(mirror::FileRecord::crc64)>;
+	assert(m_conn != nullptr);
+	assert(data.type == FileType::file || data.type == FileType::dir);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, true);
+	if (data.type == FileType::dir) {
+		getDirId(dirId, fileNameU8, fileNameSize, true);
+	}
+
+	if (!m_bulkLoad) {
+		insertFile(fileNameU8, fileNameSize, dirId, data);
+		return;
+	}
 
+	if (m_batchSize == m_batch.size()) {
+		m_batch.emplace_back();
+	}
+	BatchedFile &f = m_batch[m_batchSize++];
+	f.fileNameU8.assign(fileNameU8, fileNameSize);
+	f.dirId = dirId;
+	f.record = data;
+
+	if (m_batchSize == batchFileCount) {
+		flushBatch();
+	}
+
+	const bool intervalReached = m_commitInterval > 0 && ++m_uncommittedFiles >= m_commitInterval;
+	if (intervalReached && sqlite3_get_autocommit(m_conn) == 0) {
+		logTrace("Commit interval is reached, committing..."_s);
+		commit();
+		beginTransaction();
+	} else {
+		commitIfDue();
+	}
+}
+
+void mirror::FileDB::commitIfDue(void)
+{
 	assert(m_conn != nullptr);
+	assert(m_bulkLoad);
 
+	if (m_commitPeriod.count() > 0 && Clock::now() >= m_nextCommitTime && sqlite3_get_autocommit(m_conn) == 0) {
+		logTrace("Commit period is reached, committing..."_s);
+		commit();
+		beginTransaction();
+	}
+}
+
+void mirror::FileDB::insertFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const sqlite3_int64 dirId, const FileRecord &data)
+{
 	int result;
 
-	logTrace("Binding statement param 1..."_s);
-	result = sqlite3_bind_text(m_getDirFilesStmt, 1, dirNameU8, dirNameSize, SQLITE_STATIC);
+	logTrace("Binding statement params..."_s);
+	result = bindFile(m_addFileStmt, 1, fileNameU8, fileNameSize, dirId, data, digestSize(m_digest));
 	if (result != SQLITE_OK) {
 		goto handle_error;
 	}
 
-	// TODO make this code exception-safe.
 	logTrace("Executing statement..."_s);
-	for (;;) {
-		result = sqlite3_step(m_getDirFilesStmt);
-		if (result == SQLITE_ROW) {
-			assert(sqlite3_column_int(m_getDirFilesStmt, 1) == FileType::file ||
-					sqlite3_column_int(m_getDirFilesStmt, 1) == FileType::dir);
-
-			const char * const fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirFilesStmt, 0));
-			std::size_t fileNameU8Size = sqlite3_column_bytes(m_getDirFilesStmt, 0);
-			FileRecord &fileRec = dest[PathKey(fileNameU8, fileNameU8Size)];
-			fileRec.type = static_cast<FileType>(sqlite3_column_int(m_getDirFilesStmt, 1));
-
-			switch (fileRec.type) {
-			case FileType::file: {
-				fileRec.fileSize = sqlite3_column_int64(m_getDirFilesStmt, 2);
-				fileRec.lastModifiedTS.setMillis(sqlite3_column_int64(m_getDirFilesStmt, 3) * 1000);
-
-				const unsigned char *crc64 = reinterpret_cast<const unsigned char *>(sqlite3_column_blob(m_getDirFilesStmt, 4));
-				assert(sqlite3_column_bytes(m_getDirFilesStmt, 4) == sizeof(mirror::FileRecord::crc64));
-				std::copy_n(crc64, sizeof(mirror::FileRecord::crc64), fileRec.crc64);
-
-				logTrace("File found: {'"_s, Utf8ToSystemView(fileNameU8, fileNameU8Size), "', "_s,
-						fileRec.fileSize, ", "_s, afc::ISODateTimeView(fileRec.lastModifiedTS), ", "_s,
-						CRC64View(fileRec.crc64), "}..."_s);
-				break;
-			}
-			case FileType::dir:
-				logTrace("Dir found: {'"_s, Utf8ToSystemView(fileNameU8, fileNameU8Size), "'}..."_s);
-				break;
-			default:
-				assert(false);
-			}
-		} else if (result == SQLITE_DONE) {
-			logTrace("Reading result set done."_s);
-			break;
-		} else {
-			goto handle_error;
-		}
+	result = sqlite3_step(m_addFileStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
 	}
 
 	logTrace("Reseting statement..."_s);
-	result = sqlite3_reset(m_getDirFilesStmt);
+	result = sqlite3_reset(m_addFileStmt);
 	if (result != SQLITE_OK) {
 		goto handle_reset_error;
 	}
@@ -271,38 +721,47 @@ handle_error:
 	// Attempting to reset the statement without overwriting the error code.
 	logTrace("Reseting statement..."_s);
 	// TODO handle sqlite3_reset error code.
-	sqlite3_reset(m_getDirFilesStmt);
+	sqlite3_reset(m_addFileStmt);
 handle_reset_error:
 	throw sqlite3_errstr(result);
 }
 
-void mirror::FileDB::getDirs(mirror::DirSet &dest)
+void mirror::FileDB::flushBatch(void)
 {
-	assert(m_conn != nullptr);
+	assert(m_bulkLoad);
 
-	int result;
+	const std::size_t n = m_batchSize;
+	// The batch is discarded if it cannot be inserted, the transaction is to be rolled back anyway.
+	m_batchSize = 0;
 
-	// TODO make this code exception-safe.
-	logTrace("Executing statement..."_s);
-	for (;;) {
-		result = sqlite3_step(m_getDirsStmt);
-		if (result == SQLITE_ROW) {
-			const char * const dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirsStmt, 0));
-			PathKey key(dirNameU8, false);
+	if (n < batchFileCount) {
+		for (std::size_t i = 0; i < n; ++i) {
+			const BatchedFile &f = m_batch[i];
+			insertFile(f.fileNameU8.data(), f.fileNameU8.size(), f.dirId, f.record);
+		}
+		return;
+	}
 
-			logTrace("Dir found: '"_s, Utf8ToSystemView(key.data, key.size), "'..."_s);
+	int result;
 
-			dest.emplace(std::move(key));
-		} else if (result == SQLITE_DONE) {
-			logTrace("Reading result set done."_s);
-			break;
-		} else {
+	logTrace("Binding statement params for "_s, n, " files..."_s);
+	for (std::size_t i = 0; i < n; ++i) {
+		const BatchedFile &f = m_batch[i];
+		result = bindFile(m_addFilesStmt, static_cast<int>(i * 6 + 1), f.fileNameU8.data(), f.fileNameU8.size(),
+				f.dirId, f.record, digestSize(m_digest));
+		if (result != SQLITE_OK) {
 			goto handle_error;
 		}
 	}
 
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_addFilesStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
 	logTrace("Reseting statement..."_s);
-	result = sqlite3_reset(m_getDirsStmt);
+	result = sqlite3_reset(m_addFilesStmt);
 	if (result != SQLITE_OK) {
 		goto handle_reset_error;
 	}
@@ -313,7 +772,1016 @@ handle_error:
 	// Attempting to reset the statement without overwriting the error code.
 	logTrace("Reseting statement..."_s);
 	// TODO handle sqlite3_reset error code.
-	sqlite3_reset(m_getDirsStmt);
+	sqlite3_reset(m_addFilesStmt);
 handle_reset_error:
 	throw sqlite3_errstr(result);
 }
+
+void mirror::FileDB::exec(const char * const query)
+{
+	logTrace("Executing: "_s, query);
+	const int result = sqlite3_exec(m_conn, query, nullptr, nullptr, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+}
+
+void mirror::FileDB::setDigestAlgorithm(const DigestAlgorithm alg)
+{
+	assert(m_conn != nullptr);
+	assert(m_batchSize == 0);
+
+	if (alg == m_digest) {
+		return;
+	}
+
+	int fileCount;
+	int result = readInt(m_conn, u8"select count(*) from files where type = 0", fileCount);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+	if (fileCount > 0) {
+		throw "The DB has files with digests of another algorithm.";
+	}
+
+	StatementHolder setDigest;
+	constexpr auto setDigestQuery = u8"update metadata set value = ? where key = 'digest'"_s;
+
+	logTrace("Preparing statement to set the digest algorithm: "_s, setDigestQuery);
+	result = sqlite3_prepare_v2(m_conn, setDigestQuery.value(), setDigestQuery.size(), &setDigest.stmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result == SQLITE_OK) {
+		result = sqlite3_bind_text(setDigest.stmt, 1, digestName(alg), -1, SQLITE_STATIC);
+	}
+	if (result == SQLITE_OK) {
+		result = sqlite3_step(setDigest.stmt);
+		if (result == SQLITE_DONE) {
+			result = SQLITE_OK;
+		}
+	}
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+	m_digest = alg;
+}
+
+void mirror::FileDB::beginBulkLoad(const std::size_t commitInterval, const unsigned commitPeriod)
+{
+	constexpr auto addFilesQueryHead =
+			u8"insert or replace into files (name, dir_id, type, size, last_modified, digest) values "_s;
+	constexpr auto addFilesQueryRow = u8"(?, ?, ?, ?, ?, ?)"_s;
+
+	assert(m_conn != nullptr);
+	assert(!m_bulkLoad);
+	assert(sqlite3_get_autocommit(m_conn) != 0);
+
+	if (m_addFilesStmt == nullptr) {
+		std::string query;
+		query.reserve(addFilesQueryHead.size() + batchFileCount * (addFilesQueryRow.size() + 2));
+		query.append(addFilesQueryHead.value(), addFilesQueryHead.size());
+		for (std::size_t i = 0; i < batchFileCount; ++i) {
+			if (i > 0) {
+				query.append(", ");
+			}
+			query.append(addFilesQueryRow.value(), addFilesQueryRow.size());
+		}
+
+		logTrace("Preparing statement to add files: "_s, query.c_str());
+		const int result = sqlite3_prepare_v2(m_conn, query.data(), query.size(), &m_addFilesStmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			throw sqlite3_errstr(result);
+		}
+	}
+
+	// With WAL, commits are not synced in the 'normal' mode and yet a crash cannot corrupt the DB.
+	exec(u8"pragma journal_mode = wal");
+	exec(u8"pragma synchronous = normal");
+	int result = readInt(m_conn, u8"pragma cache_size", m_bulkLoadCacheSize);
+	if (result == SQLITE_OK) {
+		result = readInt(m_conn, u8"pragma temp_store", m_bulkLoadTempStore);
+	}
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+	// A negative value is the cache size in KiB: 64M.
+	exec(u8"pragma cache_size = -65536");
+	exec(u8"pragma temp_store = memory");
+
+	m_batch.reserve(batchFileCount);
+	m_commitInterval = commitInterval;
+	m_uncommittedFiles = 0;
+	m_commitPeriod = std::chrono::seconds(commitPeriod);
+	m_nextCommitTime = Clock::now() + m_commitPeriod;
+	m_bulkLoad = true;
+}
+
+void mirror::FileDB::endBulkLoad(void)
+{
+	assert(m_conn != nullptr);
+	assert(m_bulkLoad);
+	assert(m_batchSize == 0);
+	assert(sqlite3_get_autocommit(m_conn) != 0);
+
+	m_bulkLoad = false;
+
+	// The DB is kept as a single file when it is not written to.
+	exec(u8"pragma journal_mode = delete");
+	exec(u8"pragma synchronous = full");
+	exec(("pragma cache_size = " + std::to_string(m_bulkLoadCacheSize)).c_str());
+	exec(("pragma temp_store = " + std::to_string(m_bulkLoadTempStore)).c_str());
+}
+
+bool mirror::FileDB::getFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize, FileRecord &dest)
+{
+	assert(m_conn != nullptr);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		logTrace("Dir is not in the DB."_s);
+		return false;
+	}
+
+	int result;
+	bool found;
+
+	logTrace("Binding statement params..."_s);
+	result = sqlite3_bind_text(m_getFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_int64(m_getFileStmt, 2, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_getFileStmt);
+	if (result == SQLITE_ROW) {
+		readFileRecord(m_getFileStmt, 0, dest);
+		found = true;
+	} else if (result == SQLITE_DONE) {
+		found = false;
+	} else {
+		goto handle_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_getFileStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return found;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getFileStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::getFiles(const char * const dirNameU8, const std::size_t dirNameSize, mirror::DirFileMap &dest,
+		PathArena * const arena, const std::size_t maxFiles)
+{
+	assert(m_conn != nullptr);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		logTrace("Dir is not in the DB."_s);
+		return true;
+	}
+
+	int result;
+	bool complete = true;
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_int64(m_getDirFilesStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	// TODO make this code exception-safe.
+	logTrace("Executing statement..."_s);
+	for (;;) {
+		result = sqlite3_step(m_getDirFilesStmt);
+		if (result == SQLITE_ROW && maxFiles > 0 && dest.size() == maxFiles) {
+			logTrace("The dir has more than "_s, maxFiles, " files."_s);
+			dest.clear();
+			complete = false;
+			break;
+		}
+		if (result == SQLITE_ROW) {
+			const char * const fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirFilesStmt, 0));
+			std::size_t fileNameU8Size = sqlite3_column_bytes(m_getDirFilesStmt, 0);
+			FileRecord &fileRec = arena == nullptr ? dest[PathKey(fileNameU8, fileNameU8Size)] :
+					dest[PathKey(fileNameU8, fileNameU8Size, *arena)];
+			readFileRecord(m_getDirFilesStmt, 1, fileRec);
+
+			switch (fileRec.type) {
+			case FileType::file: {
+				logTrace("File found: {'"_s, Utf8ToSystemView(fileNameU8, fileNameU8Size), "', "_s,
+						fileRec.fileSize, ", "_s, afc::ISODateTimeView(fileRec.lastModifiedTS), ", "_s,
+						DigestView(fileRec.digest, digestSize(m_digest)), "}..."_s);
+				break;
+			}
+			case FileType::dir:
+				logTrace("Dir found: {'"_s, Utf8ToSystemView(fileNameU8, fileNameU8Size), "'}..."_s);
+				break;
+			default:
+				assert(false);
+			}
+		} else if (result == SQLITE_DONE) {
+			logTrace("Reading result set done."_s);
+			break;
+		} else {
+			goto handle_error;
+		}
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_getDirFilesStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return complete;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirFilesStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::getDirs(mirror::DirSet &dest, PathArena * const arena)
+{
+	assert(m_conn != nullptr);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	if (arena == nullptr) {
+		dest.emplace(PathKey("", false));
+	} else {
+		dest.emplace(PathKey("", 0, *arena));
+	}
+
+	int result;
+
+	// TODO make this code exception-safe.
+	logTrace("Executing statement..."_s);
+	for (;;) {
+		result = sqlite3_step(m_getDirsStmt);
+		if (result == SQLITE_ROW) {
+			const char * const dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_getDirsStmt, 0));
+			const std::size_t dirNameU8Size = sqlite3_column_bytes(m_getDirsStmt, 0);
+			PathKey key = arena == nullptr ? PathKey(dirNameU8, dirNameU8Size) :
+					PathKey(dirNameU8, dirNameU8Size, *arena);
+
+			logTrace("Dir found: '"_s, Utf8ToSystemView(key.data, key.size), "'..."_s);
+
+			dest.emplace(std::move(key));
+		} else if (result == SQLITE_DONE) {
+			logTrace("Reading result set done."_s);
+			break;
+		} else {
+			goto handle_error;
+		}
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_getDirsStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_getDirsStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::removeFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	int result;
+
+	logTrace("Binding statement param 1..."_s);
+	result = sqlite3_bind_text(m_removeFileStmt, 1, fileNameU8, fileNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Binding statement param 2..."_s);
+	result = sqlite3_bind_int64(m_removeFileStmt, 2, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_removeFileStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_removeFileStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_removeFileStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::removeDir(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(dirNameSize > 0);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	// The directory and its subdirectories could be cached.
+	m_cachedDirPath.clear();
+	m_cachedDirEnds.clear();
+	m_cachedDirIds.clear();
+
+	int result;
+	sqlite3_stmt *stmt = m_removeDirFilesStmt;
+
+	// The files are removed first since the directory tree is needed to find them.
+	for (sqlite3_stmt * const s : {m_removeDirFilesStmt, m_removeDirsStmt}) {
+		stmt = s;
+
+		logTrace("Binding statement param 1..."_s);
+		result = sqlite3_bind_int64(stmt, 1, dirId);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+
+		logTrace("Executing statement..."_s);
+		result = sqlite3_step(stmt);
+		if (result != SQLITE_DONE) {
+			goto handle_error;
+		}
+
+		logTrace("Reseting statement..."_s);
+		result = sqlite3_reset(stmt);
+		if (result != SQLITE_OK) {
+			goto handle_reset_error;
+		}
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(stmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::nextSortedFile(SortedFile &dest)
+{
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	assert(m_conn != nullptr);
+
+	int result;
+
+	if (m_sortedDirsStmt == nullptr) {
+		if (m_batchSize > 0) {
+			flushBatch();
+		}
+
+		logTrace("Preparing statement to get all dirs sorted: "_s, sortedDirsQuery);
+		result = sqlite3_prepare_v2(m_conn, sortedDirsQuery.value(), sortedDirsQuery.size(),
+				&m_sortedDirsStmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			m_sortedDirsStmt = nullptr;
+			throw sqlite3_errstr(result);
+		}
+
+		logTrace("Preparing statement to get files from a directory sorted: "_s, sortedFilesQuery);
+		result = sqlite3_prepare_v2(m_conn, sortedFilesQuery.value(), sortedFilesQuery.size(),
+				&m_sortedFilesStmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			sqlite3_finalize(m_sortedDirsStmt);
+			m_sortedDirsStmt = nullptr;
+			m_sortedFilesStmt = nullptr;
+			throw sqlite3_errstr(result);
+		}
+	}
+
+	sqlite3_stmt *stmt;
+
+	for (;;) {
+		if (!m_sortedDirPending) {
+			stmt = m_sortedDirsStmt;
+			result = sqlite3_step(stmt);
+			if (result == SQLITE_DONE) {
+				logTrace("Reading result set done."_s);
+				result = sqlite3_reset(stmt);
+				if (result != SQLITE_OK) {
+					throw sqlite3_errstr(result);
+				}
+				return false;
+			} else if (result != SQLITE_ROW) {
+				goto handle_error;
+			}
+
+			stmt = m_sortedFilesStmt;
+			result = sqlite3_bind_int64(stmt, 1, sqlite3_column_int64(m_sortedDirsStmt, 0));
+			if (result != SQLITE_OK) {
+				goto handle_error;
+			}
+			m_sortedDirPending = true;
+		}
+
+		stmt = m_sortedFilesStmt;
+		result = sqlite3_step(stmt);
+		if (result == SQLITE_ROW) {
+			// The key is valid until the directory row is stepped over.
+			dest.dirKey = static_cast<const char *>(sqlite3_column_blob(m_sortedDirsStmt, 1));
+			dest.dirKeySize = sqlite3_column_bytes(m_sortedDirsStmt, 1);
+			dest.fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+			dest.fileNameSize = sqlite3_column_bytes(stmt, 0);
+			readFileRecord(stmt, 1, dest.record);
+			return true;
+		} else if (result != SQLITE_DONE) {
+			goto handle_error;
+		}
+
+		m_sortedDirPending = false;
+		result = sqlite3_reset(stmt);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+	}
+
+handle_error:
+	// Attempting to reset the statements without overwriting the error code, the next call starts over.
+	logTrace("Reseting statements..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_sortedFilesStmt);
+	sqlite3_reset(m_sortedDirsStmt);
+	m_sortedDirPending = false;
+	throw sqlite3_errstr(result);
+}
+
+std::string mirror::FileDB::sortedFilesPlan()
+{
+	assert(m_conn != nullptr);
+
+	std::string plan;
+	for (const char * const query : {sortedDirsQuery.value(), sortedFilesQuery.value()}) {
+		const std::string explainQuery = std::string(u8"explain query plan ") + query;
+		StatementHolder explain;
+
+		logTrace("Preparing statement: "_s, explainQuery.c_str());
+		int result = sqlite3_prepare_v2(m_conn, explainQuery.data(), explainQuery.size(), &explain.stmt, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			throw sqlite3_errstr(result);
+		}
+
+		for (;;) {
+			result = sqlite3_step(explain.stmt);
+			if (result == SQLITE_DONE) {
+				break;
+			} else if (result != SQLITE_ROW) {
+				throw sqlite3_errstr(result);
+			}
+			// The last column is the description of the step.
+			plan.append(reinterpret_cast<const char *>(sqlite3_column_text(explain.stmt, 3)),
+					sqlite3_column_bytes(explain.stmt, 3));
+			plan.push_back('\n');
+		}
+	}
+	return plan;
+}
+
+void mirror::FileDB::beginCheckpoint(const bool resume)
+{
+	constexpr auto completeDirQuery = u8"insert or ignore into completed_dirs (dir_id) values (?)"_s;
+
+	assert(m_conn != nullptr);
+	assert(m_completeDirStmt == nullptr);
+
+	exec(u8"create table if not exists completed_dirs (dir_id integer primary key)");
+	if (!resume) {
+		exec(u8"delete from completed_dirs");
+	}
+
+	logTrace("Preparing statement to complete a dir: "_s, completeDirQuery);
+	const int result = sqlite3_prepare_v2(m_conn, completeDirQuery.value(), completeDirQuery.size(),
+			&m_completeDirStmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	if (result != SQLITE_OK) {
+		m_completeDirStmt = nullptr;
+		throw sqlite3_errstr(result);
+	}
+}
+
+void mirror::FileDB::completeDir(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_completeDirStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	if (dirNameSize == 0) {
+		return;
+	}
+
+	// The directories that are entered only to reach the entries of the shard can have no records.
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	int result;
+
+	logTrace("Binding statement params..."_s);
+	result = sqlite3_bind_int64(m_completeDirStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	result = sqlite3_step(m_completeDirStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	logTrace("Reseting statement..."_s);
+	result = sqlite3_reset(m_completeDirStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	logTrace("Reseting statement..."_s);
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_completeDirStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::getCompletedDirs(mirror::DirSet &dest, PathArena * const arena)
+{
+	constexpr auto getCompletedDirsQuery = u8"with recursive paths (id, path) as (select id, name from dirs "
+			"where parent_id = 0 union all select d.id, p.path || '/' || d.name from dirs d join paths p "
+			"on d.parent_id = p.id) select p.path from paths p join completed_dirs c on c.dir_id = p.id"_s;
+
+	assert(m_conn != nullptr);
+	assert(m_completeDirStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+
+	StatementHolder getCompletedDirs;
+
+	logTrace("Preparing statement to get the completed dirs: "_s, getCompletedDirsQuery);
+	int result = sqlite3_prepare_v2(m_conn, getCompletedDirsQuery.value(), getCompletedDirsQuery.size(),
+			&getCompletedDirs.stmt, nullptr);
+	logTrace("Result code: "_s, result);
+
+	while (result == SQLITE_OK) {
+		result = sqlite3_step(getCompletedDirs.stmt);
+		if (result == SQLITE_ROW) {
+			const char * const dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(getCompletedDirs.stmt, 0));
+			const std::size_t dirNameU8Size = sqlite3_column_bytes(getCompletedDirs.stmt, 0);
+			PathKey key = arena == nullptr ? PathKey(dirNameU8, dirNameU8Size) :
+					PathKey(dirNameU8, dirNameU8Size, *arena);
+
+			logTrace("Completed dir found: '"_s, Utf8ToSystemView(key.data, key.size), "'..."_s);
+
+			dest.emplace(std::move(key));
+			result = SQLITE_OK;
+		} else if (result == SQLITE_DONE) {
+			logTrace("Reading result set done."_s);
+			return;
+		}
+	}
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::endCheckpoint(void)
+{
+	assert(m_conn != nullptr);
+
+	// TODO handle result code.
+	sqlite3_finalize(m_completeDirStmt);
+	m_completeDirStmt = nullptr;
+
+	exec(u8"drop table if exists completed_dirs");
+}
+
+void mirror::FileDB::beginTracking(void)
+{
+	constexpr auto trackDirQuery = u8"insert or ignore into temp.visited_dirs (id) values (?)"_s;
+	constexpr auto trackFileQuery = u8"insert or ignore into temp.seen_files (dir_id, name) values (?, ?)"_s;
+	constexpr auto untrackedFilesQuery = u8"select f.name, f.type, f.size, f.last_modified, f.digest from files f "
+			"where f.dir_id = ?1 and f.name > ?2 and not exists "
+			"(select 1 from temp.seen_files s where s.dir_id = ?1 and s.name = f.name) order by f.name limit ?3"_s;
+	constexpr auto untrackFilesQuery = u8"delete from temp.seen_files where dir_id = ?"_s;
+	constexpr auto untrackedDirsQuery = u8"with recursive paths (id, path) as (select id, name from dirs "
+			"where parent_id = 0 union all select d.id, p.path || '/' || d.name from dirs d join paths p "
+			"on d.parent_id = p.id) select p.path from paths p where p.id not in (select id from temp.visited_dirs)"_s;
+
+	assert(m_conn != nullptr);
+	assert(m_trackDirStmt == nullptr);
+
+	// The temporary tables are stored in a file, so that they do not take memory.
+	const int result = readInt(m_conn, u8"pragma temp_store", m_trackingTempStore);
+	if (result != SQLITE_OK) {
+		throw sqlite3_errstr(result);
+	}
+	exec(u8"pragma temp_store = file");
+	exec(u8"create temp table if not exists visited_dirs (id integer primary key); "
+			"create temp table if not exists seen_files (dir_id integer not null, name text not null, "
+			"primary key (dir_id, name)) without rowid");
+
+	auto prepare = [this] (const char * const query, const std::size_t querySize, sqlite3_stmt *&dest)
+	{
+		logTrace("Preparing statement: "_s, query);
+		const int result = sqlite3_prepare_v2(m_conn, query, querySize, &dest, nullptr);
+		logTrace("Result code: "_s, result);
+
+		if (result != SQLITE_OK) {
+			dest = nullptr;
+			endTracking();
+			throw sqlite3_errstr(result);
+		}
+	};
+	prepare(trackDirQuery.value(), trackDirQuery.size(), m_trackDirStmt);
+	prepare(trackFileQuery.value(), trackFileQuery.size(), m_trackFileStmt);
+	prepare(untrackedFilesQuery.value(), untrackedFilesQuery.size(), m_untrackedFilesStmt);
+	prepare(untrackFilesQuery.value(), untrackFilesQuery.size(), m_untrackFilesStmt);
+	prepare(untrackedDirsQuery.value(), untrackedDirsQuery.size(), m_untrackedDirsStmt);
+
+	// The names are bound to the parameters ?2, ?3 and so on.
+	std::string nameParams("?2");
+	for (std::size_t i = 1; i < trackBatchSize; ++i) {
+		nameParams.append(", ?").append(std::to_string(i + 2));
+	}
+	const std::string getFileBatchQuery = u8"select name, type, size, last_modified, digest from files "
+			"where dir_id = ?1 and name in (" + nameParams + ')';
+	const std::string trackFileBatchQuery = u8"insert or ignore into temp.seen_files (dir_id, name) "
+			"select dir_id, name from files where dir_id = ?1 and name in (" + nameParams + ')';
+	prepare(getFileBatchQuery.data(), getFileBatchQuery.size(), m_getFileBatchStmt);
+	prepare(trackFileBatchQuery.data(), trackFileBatchQuery.size(), m_trackFileBatchStmt);
+
+	// The temporary tables are written in a single transaction.
+	beginTransaction();
+}
+
+void mirror::FileDB::endTracking(void)
+{
+	assert(m_conn != nullptr);
+
+	// TODO handle result codes.
+	for (sqlite3_stmt **stmt : {&m_trackDirStmt, &m_trackFileStmt, &m_untrackedFilesStmt, &m_untrackFilesStmt,
+			&m_untrackedDirsStmt, &m_getFileBatchStmt, &m_trackFileBatchStmt}) {
+		sqlite3_finalize(*stmt);
+		*stmt = nullptr;
+	}
+
+	if (sqlite3_get_autocommit(m_conn) == 0) {
+		exec(u8"commit");
+	}
+	exec(u8"drop table if exists temp.seen_files; drop table if exists temp.visited_dirs");
+	// Is set after the tables are dropped, since changing it drops the temporary tables as well.
+	exec(("pragma temp_store = " + std::to_string(m_trackingTempStore)).c_str());
+}
+
+void mirror::FileDB::trackDir(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_trackDirStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	int result;
+
+	result = sqlite3_bind_int64(m_trackDirStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_step(m_trackDirStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+	result = sqlite3_reset(m_trackDirStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_trackDirStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::trackFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_trackFileStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	int result;
+
+	result = sqlite3_bind_int64(m_trackFileStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_text(m_trackFileStmt, 2, fileNameU8, fileNameSize, SQLITE_STATIC);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_step(m_trackFileStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+	result = sqlite3_reset(m_trackFileStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_trackFileStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::trackFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		const std::vector<std::string> &fileNamesU8, DirFileMap &dest)
+{
+	assert(m_conn != nullptr);
+	assert(m_getFileBatchStmt != nullptr);
+	assert(fileNamesU8.size() <= trackBatchSize);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1 || fileNamesU8.empty()) {
+		return;
+	}
+
+	sqlite3_stmt *stmt = m_getFileBatchStmt;
+	int result;
+
+	for (sqlite3_stmt * const s : {m_getFileBatchStmt, m_trackFileBatchStmt}) {
+		stmt = s;
+		result = sqlite3_bind_int64(stmt, 1, dirId);
+		if (result != SQLITE_OK) {
+			goto handle_error;
+		}
+		for (std::size_t i = 0; i < fileNamesU8.size(); ++i) {
+			const std::string &name = fileNamesU8[i];
+			result = sqlite3_bind_text(stmt, static_cast<int>(i + 2), name.data(), name.size(), SQLITE_STATIC);
+			if (result != SQLITE_OK) {
+				goto handle_error;
+			}
+		}
+	}
+
+	logTrace("Executing statement..."_s);
+	stmt = m_getFileBatchStmt;
+	for (;;) {
+		result = sqlite3_step(stmt);
+		if (result == SQLITE_ROW) {
+			const char * const fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(stmt, 0));
+			const std::size_t fileNameU8Size = sqlite3_column_bytes(stmt, 0);
+			readFileRecord(stmt, 1, dest[PathKey(fileNameU8, fileNameU8Size)]);
+		} else if (result == SQLITE_DONE) {
+			break;
+		} else {
+			goto handle_error;
+		}
+	}
+
+	stmt = m_trackFileBatchStmt;
+	result = sqlite3_step(stmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+
+	// The names of the next batch can be fewer, so the parameters are reset to null.
+	for (sqlite3_stmt * const s : {m_getFileBatchStmt, m_trackFileBatchStmt}) {
+		stmt = s;
+		result = sqlite3_reset(stmt);
+		if (result != SQLITE_OK) {
+			goto handle_reset_error;
+		}
+		sqlite3_clear_bindings(stmt);
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statements without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	for (sqlite3_stmt * const s : {m_getFileBatchStmt, m_trackFileBatchStmt}) {
+		sqlite3_reset(s);
+		sqlite3_clear_bindings(s);
+	}
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+std::size_t mirror::FileDB::getUntrackedFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		std::string &lastNameU8, const std::size_t maxFiles, DirFileMap &dest)
+{
+	assert(m_conn != nullptr);
+	assert(m_untrackedFilesStmt != nullptr);
+	assert(maxFiles > 0);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return 0;
+	}
+
+	int result;
+	std::size_t count = 0;
+
+	result = sqlite3_bind_int64(m_untrackedFilesStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	// The name is overwritten while the rows are read, so it is copied.
+	result = sqlite3_bind_text(m_untrackedFilesStmt, 2, lastNameU8.data(), lastNameU8.size(), SQLITE_TRANSIENT);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_bind_int64(m_untrackedFilesStmt, 3, static_cast<sqlite3_int64>(maxFiles));
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+
+	logTrace("Executing statement..."_s);
+	for (;;) {
+		result = sqlite3_step(m_untrackedFilesStmt);
+		if (result == SQLITE_ROW) {
+			const char * const fileNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_untrackedFilesStmt, 0));
+			const std::size_t fileNameU8Size = sqlite3_column_bytes(m_untrackedFilesStmt, 0);
+			readFileRecord(m_untrackedFilesStmt, 1, dest[PathKey(fileNameU8, fileNameU8Size)]);
+			lastNameU8.assign(fileNameU8, fileNameU8Size);
+			++count;
+		} else if (result == SQLITE_DONE) {
+			break;
+		} else {
+			goto handle_error;
+		}
+	}
+
+	result = sqlite3_reset(m_untrackedFilesStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return count;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_untrackedFilesStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+void mirror::FileDB::untrackFiles(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_untrackFilesStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+
+	const sqlite3_int64 dirId = getDirId(dirNameU8, dirNameSize, false);
+	if (dirId == -1) {
+		return;
+	}
+
+	int result;
+
+	result = sqlite3_bind_int64(m_untrackFilesStmt, 1, dirId);
+	if (result != SQLITE_OK) {
+		goto handle_error;
+	}
+	result = sqlite3_step(m_untrackFilesStmt);
+	if (result != SQLITE_DONE) {
+		goto handle_error;
+	}
+	result = sqlite3_reset(m_untrackFilesStmt);
+	if (result != SQLITE_OK) {
+		goto handle_reset_error;
+	}
+	return;
+
+handle_error:
+	// Attempting to reset the statement without overwriting the error code.
+	// TODO handle sqlite3_reset error code.
+	sqlite3_reset(m_untrackFilesStmt);
+handle_reset_error:
+	throw sqlite3_errstr(result);
+}
+
+bool mirror::FileDB::nextUntrackedDir(const char *&dirNameU8, std::size_t &dirNameSize)
+{
+	assert(m_conn != nullptr);
+	assert(m_untrackedDirsStmt != nullptr);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	int result = sqlite3_step(m_untrackedDirsStmt);
+	if (result == SQLITE_ROW) {
+		dirNameU8 = reinterpret_cast<const char *>(sqlite3_column_text(m_untrackedDirsStmt, 0));
+		dirNameSize = sqlite3_column_bytes(m_untrackedDirsStmt, 0);
+		return true;
+	}
+	if (result == SQLITE_DONE) {
+		result = sqlite3_reset(m_untrackedDirsStmt);
+		if (result == SQLITE_OK) {
+			return false;
+		}
+	} else {
+		// TODO handle sqlite3_reset error code.
+		sqlite3_reset(m_untrackedDirsStmt);
+	}
+	throw sqlite3_errstr(result);
+}
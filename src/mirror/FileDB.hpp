@@ -22,114 +22,84 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/SimpleString.hpp>
 #include <algorithm>
 #include <cassert>
+#include <chrono>
 #include <cstddef>
 #include <cstdio>
+#include "digest.hpp"
 #include <numeric>
+#include "PathHashTable.hpp"
 #include <afc/string_util.hpp>
 #include <afc/utils.h>
 #include <sqlite3.h>
+#include "stats.hpp"
+#include <string>
 #include <sys/types.h>
-#include <unordered_map>
-#include <unordered_set>
+#include <vector>
 
 namespace mirror
 {
-	struct PathKey
+	enum FileType
 	{
-		explicit PathKey(const char * const valU8, const bool tmp = false) : hash(0), owner(!tmp)
-		{
-			// TODO check how memory reads/writes are issued by the compiler, optimise if needed.
-			if (tmp) {
-				data = valU8;
-				size = 0;
-
-				for (const char *p = valU8; *p != 0; ++p, ++size) {
-					hash = (hash << 7) + *p;
-				}
-			} else {
-				afc::U8String str(valU8);
-				data = str.data();
-				size = str.size();
-
-				const char *p = valU8;
-				for (std::size_t i = size; i > 0; --i) {
-					hash = (hash << 7) + *p++;
-				}
-
-				str.detach();
-			}
-		}
+		file = 0, dir = 1
+	};
 
-		PathKey(const char * const valU8, const std::size_t n, const bool tmp = false)
-				: size(n), hash(0), owner(!tmp)
-		{
-			// TODO check how memory reads/writes are issued by the compiler, optimise if needed.
-			if (tmp) {
-				data = valU8;
-			} else {
-				data = afc::U8String(valU8, n).detach();
-			}
+	struct FileRecord
+	{
+		FileType type;
+		// The digest of the algorithm of the DB, padded with zeros.
+		unsigned char digest[maxDigestSize];
+		afc::Timestamp lastModifiedTS;
+		off_t fileSize;
+	};
 
-			const char *p = valU8;
-			for (std::size_t i = n; i > 0; --i) {
-				hash = (hash << 7) + *p++;
-			}
-		}
+	using DirFileMap = PathMap<FileRecord>;
+	using DirSet = PathSet;
 
-		PathKey(const PathKey &) = delete;
-		PathKey(PathKey &&o) noexcept : data(o.data), size(o.size), hash(o.hash), owner(o.owner) { o.owner = false; }
+	/*
+	 * The DB contents of the directories being scanned, one map per depth. The maps (with their bucket arrays)
+	 * are reused by the directories of the same depth, and the keys are allocated in the arena which is
+	 * released when the directory is exited.
+	 */
+	class DirFileMapStack
+	{
+	public:
+		DirFileMapStack() noexcept : m_maps(), m_marks(), m_arena() {}
 
-		PathKey &operator=(const PathKey &) = delete;
-		PathKey &operator=(PathKey &&o) noexcept
+		DirFileMap &push()
 		{
-			data = o.data;
-			size = o.size;
-			hash = o.hash;
-			owner = o.owner;
-			o.owner = false;
-			return *this;
+			m_marks.push_back(m_arena.mark());
+			if (m_marks.size() > m_maps.size()) {
+				m_maps.emplace_back();
+			}
+			return m_maps[m_marks.size() - 1];
 		}
 
-		~PathKey() { if (owner) { std::free(const_cast<char *>(data)); } }
-
-		const char *data;
-		std::size_t size;
-		std::size_t hash;
-		bool owner;
-	};
-
-	struct PathHash
-	{
-		std::size_t operator()(const PathKey &val) const noexcept
+		void pop() noexcept
 		{
-			return val.hash;
-		}
-	};
+			assert(!m_marks.empty());
 
-	struct PathEquals
-	{
-		bool operator()(const PathKey &a, const PathKey &b) const noexcept
-		{
-			return a.size == b.size && std::equal(a.data, a.data + a.size, b.data);
+			m_maps[m_marks.size() - 1].clear();
+			m_arena.release(m_marks.back());
+			m_marks.pop_back();
 		}
-	};
-
-	enum FileType
-	{
-		file = 0, dir = 1
-	};
 
-	struct FileRecord
-	{
-		FileType type;
-		unsigned char crc64[8];
-		afc::Timestamp lastModifiedTS;
-		off_t fileSize;
+		DirFileMap &top() noexcept { assert(!empty()); return m_maps[m_marks.size() - 1]; }
+		bool empty() const noexcept { return m_marks.empty(); }
+		PathArena &arena() noexcept { return m_arena; }
+	private:
+		std::vector<DirFileMap> m_maps;
+		std::vector<PathArena::Mark> m_marks;
+		PathArena m_arena;
 	};
 
-	using DirFileMap = std::unordered_map<PathKey, FileRecord, PathHash, PathEquals>;
-	using DirSet = std::unordered_set<PathKey, PathHash, PathEquals>;
-
+	/*
+	 * Directories are stored in the table dirs (id, parent_id, name), the root directory has id 0 and
+	 * is not stored. Files (including subdirectories) are stored in the table files keyed by
+	 * (dir_id, name). The algorithm of the file digests is stored in the table metadata (key, value).
+	 * The checkpoint of create-db that is not finished is stored in the table completed_dirs (dir_id).
+	 * DBs of the older layouts, e.g. with the relative directory path stored with each file, are migrated
+	 * when they are opened.
+	 */
 	class FileDB
 	{
 	private:
@@ -140,7 +110,37 @@ namespace mirror
 		FileDB(const char * const dbPathInUtf8);
 	public:
 		FileDB(FileDB &&src) : m_conn(src.m_conn), m_addFileStmt(src.m_addFileStmt), m_getFileStmt(src.m_getFileStmt),
-				m_getDirFilesStmt(src.m_getDirFilesStmt), m_getDirsStmt(src.m_getDirsStmt) { src.m_conn = nullptr; }
+				m_getDirFilesStmt(src.m_getDirFilesStmt), m_getDirsStmt(src.m_getDirsStmt),
+				m_removeFileStmt(src.m_removeFileStmt), m_removeDirFilesStmt(src.m_removeDirFilesStmt),
+				m_removeDirsStmt(src.m_removeDirsStmt), m_getDirIdStmt(src.m_getDirIdStmt),
+				m_addDirStmt(src.m_addDirStmt), m_addFilesStmt(src.m_addFilesStmt), m_digest(src.m_digest),
+				m_bulkLoad(src.m_bulkLoad), m_bulkLoadCacheSize(src.m_bulkLoadCacheSize),
+				m_bulkLoadTempStore(src.m_bulkLoadTempStore),
+				m_commitInterval(src.m_commitInterval), m_uncommittedFiles(src.m_uncommittedFiles),
+				m_commitPeriod(src.m_commitPeriod), m_nextCommitTime(src.m_nextCommitTime),
+				m_batch(std::move(src.m_batch)), m_batchSize(src.m_batchSize),
+				m_cachedDirPath(std::move(src.m_cachedDirPath)), m_cachedDirEnds(std::move(src.m_cachedDirEnds)),
+				m_cachedDirIds(std::move(src.m_cachedDirIds)), m_sortedDirsStmt(src.m_sortedDirsStmt),
+				m_sortedFilesStmt(src.m_sortedFilesStmt), m_sortedDirPending(src.m_sortedDirPending),
+				m_completeDirStmt(src.m_completeDirStmt), m_trackDirStmt(src.m_trackDirStmt),
+				m_trackFileStmt(src.m_trackFileStmt), m_untrackedFilesStmt(src.m_untrackedFilesStmt),
+				m_untrackFilesStmt(src.m_untrackFilesStmt), m_untrackedDirsStmt(src.m_untrackedDirsStmt),
+				m_getFileBatchStmt(src.m_getFileBatchStmt), m_trackFileBatchStmt(src.m_trackFileBatchStmt),
+				m_trackingTempStore(src.m_trackingTempStore)
+		{
+			src.m_conn = nullptr;
+			src.m_addFilesStmt = nullptr;
+			src.m_sortedDirsStmt = nullptr;
+			src.m_sortedFilesStmt = nullptr;
+			src.m_completeDirStmt = nullptr;
+			src.m_trackDirStmt = nullptr;
+			src.m_trackFileStmt = nullptr;
+			src.m_untrackedFilesStmt = nullptr;
+			src.m_untrackFilesStmt = nullptr;
+			src.m_untrackedDirsStmt = nullptr;
+			src.m_getFileBatchStmt = nullptr;
+			src.m_trackFileBatchStmt = nullptr;
+		}
 
 		~FileDB()
 		{
@@ -154,7 +154,25 @@ namespace mirror
 
 		void close()
 		{
+			assert(!m_bulkLoad);
+
 			// TODO handle result codes.
+			sqlite3_finalize(m_trackFileBatchStmt);
+			sqlite3_finalize(m_getFileBatchStmt);
+			sqlite3_finalize(m_untrackedDirsStmt);
+			sqlite3_finalize(m_untrackFilesStmt);
+			sqlite3_finalize(m_untrackedFilesStmt);
+			sqlite3_finalize(m_trackFileStmt);
+			sqlite3_finalize(m_trackDirStmt);
+			sqlite3_finalize(m_completeDirStmt);
+			sqlite3_finalize(m_sortedFilesStmt);
+			sqlite3_finalize(m_sortedDirsStmt);
+			sqlite3_finalize(m_addFilesStmt);
+			sqlite3_finalize(m_addDirStmt);
+			sqlite3_finalize(m_getDirIdStmt);
+			sqlite3_finalize(m_removeDirsStmt);
+			sqlite3_finalize(m_removeDirFilesStmt);
+			sqlite3_finalize(m_removeFileStmt);
 			sqlite3_finalize(m_getDirsStmt);
 			sqlite3_finalize(m_getDirFilesStmt);
 			sqlite3_finalize(m_getFileStmt);
@@ -164,22 +182,218 @@ namespace mirror
 			m_conn = nullptr;
 		}
 
+		DigestAlgorithm digestAlgorithm() const noexcept { return m_digest; }
+		/*
+		 * Sets the algorithm of the digests of the files. Throws an error if the DB has files with digests
+		 * of another algorithm. Must be called outside the bulk load mode.
+		 */
+		void setDigestAlgorithm(DigestAlgorithm alg);
+
 		void beginTransaction(void);
+		// In the bulk load mode the files buffered are inserted before the transaction is committed.
 		void commit(void);
+		// In the bulk load mode the files buffered are discarded.
 		void rollback(void);
 
+		/*
+		 * Switches the connection to the bulk load mode, in which the DB is written with WAL journaling
+		 * and relaxed syncing, and added files are buffered and inserted in multi-row statements.
+		 * Files buffered are always inserted before the DB is read or files are removed.
+		 *
+		 * If commitInterval is not 0 then the current transaction is committed (and a new one is started)
+		 * each commitInterval files added, so that a failure does not roll all files back. If commitPeriod
+		 * is not 0 then it is committed as well when a file is added (or commitIfDue() is called) commitPeriod
+		 * seconds after the last commit.
+		 *
+		 * Must be called outside a transaction.
+		 */
+		void beginBulkLoad(std::size_t commitInterval, unsigned commitPeriod = 0);
+		// Restores the rollback journal and the cache and temp store settings. Must be called outside a transaction.
+		void endBulkLoad(void);
+		/*
+		 * Commits the current transaction (and starts a new one) if commitPeriod seconds have passed since
+		 * the last commit of the bulk load. Is called while no files are added, e.g. while they are hashed.
+		 */
+		void commitIfDue(void);
+
+		// The directory is added to the DB as well if the file is a directory.
 		void addFile(const char *fileNameU8, std::size_t fileNameSize,
 				const char *dirNameU8, std::size_t dirNameSize, const FileRecord &data);
-		void getFile(const char *fileNameU8, std::size_t fileNameSize,
+		// Returns false if there is no such file in the DB.
+		bool getFile(const char *fileNameU8, std::size_t fileNameSize,
 				const char *dirNameU8, std::size_t dirNameSize, FileRecord &dest);
-		void getFiles(const char *dirNameU8, std::size_t dirNameSize, DirFileMap &dest);
-		void getDirs(DirSet &dest);
+		/*
+		 * If the arena is specified then the keys are allocated there. If maxFiles is not 0 and the directory
+		 * has more files then dest is cleared and false is returned.
+		 */
+		bool getFiles(const char *dirNameU8, std::size_t dirNameSize, DirFileMap &dest,
+				PathArena *arena = nullptr, std::size_t maxFiles = 0);
+		// The root directory is always included.
+		void getDirs(DirSet &dest, PathArena *arena = nullptr);
+		void removeFile(const char *fileNameU8, std::size_t fileNameSize,
+				const char *dirNameU8, std::size_t dirNameSize);
+		/*
+		 * Removes the directory with all files and directories within it. The record of the directory
+		 * in its parent directory is kept.
+		 */
+		void removeDir(const char *dirNameU8, std::size_t dirNameSize);
+
+		struct SortedFile
+		{
+			/*
+			 * The names of the directories on the path from the root directory (which has an empty key),
+			 * each preceded by '\0'. Keys compared byte-wise order directories depth-first by name.
+			 */
+			const char *dirKey;
+			std::size_t dirKeySize;
+			const char *fileNameU8;
+			std::size_t fileNameSize;
+			FileRecord record;
+		};
+
+		/*
+		 * Reads all files of the DB in a single pass, ordered by the directory key and then by the file name
+		 * (byte-wise, as UTF-8). Returns false when all files are read, the next call starts over.
+		 * The strings of the file returned are valid until the next call.
+		 */
+		bool nextSortedFile(SortedFile &dest);
+
+		/*
+		 * Returns the query plans of nextSortedFile(), a step per line. Is used to check that the files
+		 * are streamed rather than sorted in a temporary B-tree.
+		 */
+		std::string sortedFilesPlan();
+
+		/*
+		 * The checkpoint of create-db is the set of the directories whose subtrees are added to the DB
+		 * completely. It is stored in the table completed_dirs, which exists only while create-db is
+		 * not finished, and is committed together with the files.
+		 *
+		 * Creates the checkpoint table if it is missing. The directories recorded there are kept if resume
+		 * is true and are discarded otherwise.
+		 */
+		void beginCheckpoint(bool resume);
+		// Records that the subtree of the directory is added completely. The root directory is not recorded.
+		void completeDir(const char *dirNameU8, std::size_t dirNameSize);
+		// Must be called between beginCheckpoint() and endCheckpoint().
+		void getCompletedDirs(DirSet &dest, PathArena *arena = nullptr);
+		// Drops the checkpoint table. Is called when create-db is finished.
+		void endCheckpoint(void);
+
+		/*
+		 * The directories visited by a verification and the files found in the directories that are checked
+		 * file by file can be tracked in the temporary tables instead of memory, so that the memory used
+		 * does not depend on the size of the DB. The tables are written in a transaction which is committed
+		 * (and the tables are dropped) by endTracking().
+		 */
+		void beginTracking(void);
+		void endTracking(void);
+		// The directories that are not in the DB are ignored.
+		void trackDir(const char *dirNameU8, std::size_t dirNameSize);
+		void trackFile(const char *fileNameU8, std::size_t fileNameSize,
+				const char *dirNameU8, std::size_t dirNameSize);
+		/*
+		 * Looks up the files of the directory with the given names (at most trackBatchSize of them) with a single
+		 * query, adds the ones found to dest and tracks them with another one. The names not in the DB are ignored.
+		 */
+		void trackFiles(const char *dirNameU8, std::size_t dirNameSize, const std::vector<std::string> &fileNamesU8,
+				DirFileMap &dest);
+		/*
+		 * Reads up to maxFiles files of the directory that are not tracked, in the order of their names (byte-wise,
+		 * as UTF-8), starting after the name lastNameU8. The name of the last file read is written there, so that
+		 * a directory is read in batches starting with an empty name. Returns the number of files read.
+		 */
+		std::size_t getUntrackedFiles(const char *dirNameU8, std::size_t dirNameSize, std::string &lastNameU8,
+				std::size_t maxFiles, DirFileMap &dest);
+		// Discards the files of the directory tracked.
+		void untrackFiles(const char *dirNameU8, std::size_t dirNameSize);
+		/*
+		 * Reads the paths of the directories that are not tracked one by one. Returns false when all of them
+		 * are read. The string returned is valid until the next call.
+		 */
+		bool nextUntrackedDir(const char *&dirNameU8, std::size_t &dirNameSize);
+
+		// The maximum number of files trackFiles() looks up at a time.
+		static constexpr std::size_t trackBatchSize = 256;
 	private:
+		using Clock = std::chrono::steady_clock;
+
+		// The number of files inserted by a single multi-row statement in the bulk load mode.
+		static constexpr std::size_t batchFileCount = 64;
+
+		struct BatchedFile
+		{
+			std::string fileNameU8;
+			sqlite3_int64 dirId;
+			FileRecord record;
+		};
+
+		void insertFile(const char *fileNameU8, std::size_t fileNameSize, sqlite3_int64 dirId, const FileRecord &data);
+		void flushBatch(void);
+		void exec(const char *query);
+		void migrateFromPathLayout(void);
+
+		/*
+		 * Returns the id of the directory with the relative path given, or -1 if there is no such directory
+		 * in the DB and create is false. Directories missing are added if create is true.
+		 */
+		sqlite3_int64 getDirId(const char *dirNameU8, std::size_t dirNameSize, bool create);
+		sqlite3_int64 getDirId(sqlite3_int64 parentId, const char *nameU8, std::size_t nameSize, bool create);
+
 		sqlite3 *m_conn;
 		sqlite3_stmt *m_addFileStmt;
 		sqlite3_stmt *m_getFileStmt;
 		sqlite3_stmt *m_getDirFilesStmt;
 		sqlite3_stmt *m_getDirsStmt;
+		sqlite3_stmt *m_removeFileStmt;
+		sqlite3_stmt *m_removeDirFilesStmt;
+		sqlite3_stmt *m_removeDirsStmt;
+		sqlite3_stmt *m_getDirIdStmt;
+		sqlite3_stmt *m_addDirStmt;
+		// Is prepared by beginBulkLoad().
+		sqlite3_stmt *m_addFilesStmt;
+
+		// Is read from the metadata table.
+		DigestAlgorithm m_digest;
+
+		bool m_bulkLoad;
+		// The cache_size and the temp_store of the connection before beginBulkLoad(), restored by endBulkLoad().
+		int m_bulkLoadCacheSize;
+		int m_bulkLoadTempStore;
+		std::size_t m_commitInterval;
+		std::size_t m_uncommittedFiles;
+		Clock::duration m_commitPeriod;
+		Clock::time_point m_nextCommitTime;
+		// The elements are reused so that their strings are not reallocated for each file.
+		std::vector<BatchedFile> m_batch;
+		std::size_t m_batchSize;
+
+		/*
+		 * The path of the directory resolved last, with the end offsets and the ids of its components.
+		 * Files are added and looked up directory by directory, so the parent is usually resolved already.
+		 */
+		std::string m_cachedDirPath;
+		std::vector<std::size_t> m_cachedDirEnds;
+		std::vector<sqlite3_int64> m_cachedDirIds;
+
+		// Are prepared by the first call of nextSortedFile(). The files are read for each directory listed.
+		sqlite3_stmt *m_sortedDirsStmt;
+		sqlite3_stmt *m_sortedFilesStmt;
+		// Tells if m_sortedFilesStmt is bound to the current row of m_sortedDirsStmt.
+		bool m_sortedDirPending;
+		// Is prepared by beginCheckpoint().
+		sqlite3_stmt *m_completeDirStmt;
+		// Are prepared by beginTracking().
+		sqlite3_stmt *m_trackDirStmt;
+		sqlite3_stmt *m_trackFileStmt;
+		sqlite3_stmt *m_untrackedFilesStmt;
+		sqlite3_stmt *m_untrackFilesStmt;
+		sqlite3_stmt *m_untrackedDirsStmt;
+		// Have trackBatchSize name parameters, the ones that are not bound are null.
+		sqlite3_stmt *m_getFileBatchStmt;
+		sqlite3_stmt *m_trackFileBatchStmt;
+		// The temp_store of the connection before beginTracking(), it is restored by endTracking().
+		int m_trackingTempStore;
 	};
 }
 
@@ -213,6 +427,14 @@ inline void mirror::FileDB::beginTransaction(void)
 inline void mirror::FileDB::commit(void)
 {
 	assert(m_conn != nullptr);
+	const PhaseTimer timer(StatPhase::dbWrite);
+	if (m_batchSize > 0) {
+		flushBatch();
+	}
+	m_uncommittedFiles = 0;
+	if (m_commitPeriod.count() > 0) {
+		m_nextCommitTime = Clock::now() + m_commitPeriod;
+	}
 	const int result = sqlite3_exec(m_conn, u8"commit", nullptr, nullptr, nullptr);
 	if (result != SQLITE_OK) {
 		throw sqlite3_errstr(result);
@@ -222,6 +444,12 @@ inline void mirror::FileDB::commit(void)
 inline void mirror::FileDB::rollback(void)
 {
 	assert(m_conn != nullptr);
+	m_batchSize = 0;
+	m_uncommittedFiles = 0;
+	// Ids of the directories added in the transaction are no longer valid.
+	m_cachedDirPath.clear();
+	m_cachedDirEnds.clear();
+	m_cachedDirIds.clear();
 	const int result = sqlite3_exec(m_conn, u8"rollback", nullptr, nullptr, nullptr);
 	if (result != SQLITE_OK) {
 		throw sqlite3_errstr(result);
@@ -0,0 +1,250 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_HASHINGPOOL_HPP_
+#define MIRROR_HASHINGPOOL_HPP_
+
+#include <cassert>
+#include <condition_variable>
+#include <cstddef>
+#include <deque>
+#include <chrono>
+#include <exception>
+#include "FileDB.hpp"
+#include <functional>
+#include "io.hpp"
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <thread>
+#include <unistd.h>
+#include <utility>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		void fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
+				const ReadOptions &options, mirror::FileRecord &dest);
+
+		/**
+		 * Calculates file records of regular files in worker threads. Tasks are submitted and results
+		 * are consumed by the same (traversal) thread, so that the event handlers and the DB are never
+		 * accessed concurrently. Results are delivered in the order the tasks are completed.
+		 *
+		 * The pool takes ownership of the file descriptor passed with each task. The number of tasks
+		 * in flight (and therefore of open file descriptors) is bounded.
+		 */
+		template<typename Payload>
+		class HashingPool
+		{
+		public:
+			struct Task
+			{
+				Task(const int fd, const struct stat &fileStat, std::string &&filePath, Payload &&payload)
+						: fd(fd), fileStat(fileStat), filePath(std::move(filePath)),
+						  payload(std::move(payload)), record(), error() {}
+
+				int fd;
+				struct stat fileStat;
+				std::string filePath;
+				Payload payload;
+				mirror::FileRecord record;
+				std::exception_ptr error;
+			};
+
+			HashingPool(const unsigned threadCount, const std::size_t maxTasksInFlight, const ReadOptions &readOptions)
+					: m_readOptions(readOptions), m_maxTasksInFlight(maxTasksInFlight), m_tasksInFlight(0),
+					  m_stopped(false), m_idleOp(), m_idleInterval()
+			{
+				assert(threadCount > 0);
+				assert(maxTasksInFlight >= threadCount);
+
+				m_workers.reserve(threadCount);
+				try {
+					for (unsigned i = 0; i < threadCount; ++i) {
+						m_workers.emplace_back(&HashingPool::work, this);
+					}
+				}
+				catch (...) {
+					stop();
+					throw;
+				}
+			}
+
+			HashingPool(const HashingPool &) = delete;
+			HashingPool(HashingPool &&) = delete;
+			HashingPool &operator=(const HashingPool &) = delete;
+			HashingPool &operator=(HashingPool &&) = delete;
+
+			~HashingPool() { stop(); }
+
+			/*
+			 * Makes submit() and finish() invoke idleOp each interval they wait for the tasks in flight,
+			 * so that the traversal thread can do periodic work while large files are hashed.
+			 */
+			void setIdleOp(std::function<void()> &&idleOp, const std::chrono::milliseconds interval)
+			{
+				m_idleOp = std::move(idleOp);
+				m_idleInterval = interval;
+			}
+
+			/*
+			 * Enqueues the task. If the limit of tasks in flight is reached then the function blocks
+			 * until some task is completed. Completed tasks are passed to resultOp.
+			 */
+			template<typename ResultOp>
+			void submit(Task &&task, ResultOp &resultOp)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				for (;;) {
+					deliverCompleted(lock, resultOp);
+					if (m_tasksInFlight < m_maxTasksInFlight) {
+						break;
+					}
+					waitCompleted(lock);
+				}
+				m_pending.emplace_back(std::move(task));
+				++m_tasksInFlight;
+				lock.unlock();
+
+				m_pendingCond.notify_one();
+			}
+
+			// Passes the tasks completed so far to resultOp without waiting for the other ones.
+			template<typename ResultOp>
+			void drain(ResultOp &resultOp)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				deliverCompleted(lock, resultOp);
+			}
+
+			// Waits for all tasks submitted to be completed and passes them to resultOp.
+			template<typename ResultOp>
+			void finish(ResultOp &resultOp)
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				for (;;) {
+					deliverCompleted(lock, resultOp);
+					if (m_tasksInFlight == 0) {
+						return;
+					}
+					waitCompleted(lock);
+				}
+			}
+		private:
+			void waitCompleted(std::unique_lock<std::mutex> &lock)
+			{
+				const auto completed = [this] { return !m_completed.empty(); };
+				if (!m_idleOp) {
+					m_completedCond.wait(lock, completed);
+					return;
+				}
+				while (!m_completedCond.wait_for(lock, m_idleInterval, completed)) {
+					lock.unlock();
+					m_idleOp();
+					lock.lock();
+				}
+			}
+
+			/*
+			 * Tasks are moved out of the queue before resultOp is invoked so that an exception thrown
+			 * by resultOp does not break the bookkeeping. A task that has failed is re-thrown here.
+			 */
+			template<typename ResultOp>
+			void deliverCompleted(std::unique_lock<std::mutex> &lock, ResultOp &resultOp)
+			{
+				while (!m_completed.empty()) {
+					Task task(std::move(m_completed.front()));
+					m_completed.pop_front();
+					--m_tasksInFlight;
+
+					lock.unlock();
+					if (task.error != nullptr) {
+						std::rethrow_exception(task.error);
+					}
+					resultOp(task);
+					lock.lock();
+				}
+			}
+
+			void work()
+			{
+				std::unique_lock<std::mutex> lock(m_mutex);
+				for (;;) {
+					m_pendingCond.wait(lock, [this] { return m_stopped || !m_pending.empty(); });
+					if (m_stopped) {
+						return;
+					}
+					Task task(std::move(m_pending.front()));
+					m_pending.pop_front();
+					lock.unlock();
+
+					try {
+						fillRegularFileRecord(task.fileStat, task.fd, task.filePath.c_str(), m_readOptions, task.record);
+					}
+					catch (...) {
+						task.error = std::current_exception();
+					}
+					if (close(task.fd) != 0 && task.error == nullptr) {
+						// TODO handle error.
+						task.error = std::make_exception_ptr(errno);
+					}
+
+					lock.lock();
+					m_completed.emplace_back(std::move(task));
+					m_completedCond.notify_one();
+				}
+			}
+
+			void stop() noexcept
+			{
+				{
+					std::lock_guard<std::mutex> lock(m_mutex);
+					m_stopped = true;
+				}
+				m_pendingCond.notify_all();
+				for (std::thread &worker : m_workers) {
+					worker.join();
+				}
+				m_workers.clear();
+
+				// Tasks that are not processed still own their file descriptors.
+				for (const Task &task : m_pending) {
+					close(task.fd);
+				}
+				m_pending.clear();
+				m_completed.clear();
+			}
+
+			std::mutex m_mutex;
+			std::condition_variable m_pendingCond;
+			std::condition_variable m_completedCond;
+			std::deque<Task> m_pending;
+			std::deque<Task> m_completed;
+			std::vector<std::thread> m_workers;
+			const ReadOptions m_readOptions;
+			const std::size_t m_maxTasksInFlight;
+			std::size_t m_tasksInFlight;
+			bool m_stopped;
+			// Is invoked by the traversal thread only.
+			std::function<void()> m_idleOp;
+			std::chrono::milliseconds m_idleInterval;
+		};
+	}
+}
+
+#endif // MIRROR_HASHINGPOOL_HPP_
@@ -0,0 +1,492 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_PATHHASHTABLE_HPP_
+#define MIRROR_PATHHASHTABLE_HPP_
+
+#include <afc/SimpleString.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include "hash.hpp"
+#include <memory>
+#include <new>
+#include <utility>
+#include <vector>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+namespace mirror
+{
+	/*
+	 * A bump allocator for the data of PathKeys. Memory is released in the LIFO order by rewinding
+	 * the arena to a mark, the chunks allocated are kept to be reused.
+	 */
+	class PathArena
+	{
+	public:
+		struct Mark
+		{
+			std::size_t chunk;
+			std::size_t offset;
+		};
+
+		PathArena() noexcept : m_chunks(), m_chunk(0), m_offset(0) {}
+
+		PathArena(const PathArena &) = delete;
+		PathArena(PathArena &&) = default;
+		PathArena &operator=(const PathArena &) = delete;
+		PathArena &operator=(PathArena &&) = default;
+
+		const char *copy(const char * const data, const std::size_t n)
+		{
+			if (m_chunks.empty() || n > m_chunks[m_chunk].size - m_offset) {
+				nextChunk(n);
+			}
+			char * const dest = m_chunks[m_chunk].data.get() + m_offset;
+			std::memcpy(dest, data, n);
+			m_offset += n;
+			return dest;
+		}
+
+		Mark mark() const noexcept { return Mark{m_chunk, m_offset}; }
+		void release(const Mark &mark) noexcept { m_chunk = mark.chunk; m_offset = mark.offset; }
+	private:
+		struct Chunk
+		{
+			std::unique_ptr<char[]> data;
+			std::size_t size;
+		};
+
+		static constexpr std::size_t chunkSize = 64 * 1024;
+
+		void nextChunk(const std::size_t minSize)
+		{
+			const std::size_t next = m_chunks.empty() ? 0 : m_chunk + 1;
+			// The chunks that are too small for the data are kept for the next rewinds.
+			if (next == m_chunks.size() || m_chunks[next].size < minSize) {
+				const std::size_t size = minSize > chunkSize ? minSize : chunkSize;
+				m_chunks.insert(m_chunks.begin() + next, Chunk{std::unique_ptr<char[]>(new char[size]), size});
+			}
+			m_chunk = next;
+			m_offset = 0;
+		}
+
+		std::vector<Chunk> m_chunks;
+		std::size_t m_chunk;
+		std::size_t m_offset;
+	};
+
+	struct PathKey
+	{
+		explicit PathKey(const char * const valU8, const bool tmp = false)
+				: PathKey(valU8, std::strlen(valU8), tmp) {}
+
+		PathKey(const char * const valU8, const std::size_t n, const bool tmp = false)
+				: data(tmp ? valU8 : afc::U8String(valU8, n).detach()), size(n), hash(hashBytes(valU8, n)),
+				  owner(!tmp) {}
+
+		// The data is copied to the arena and is valid until the arena is released.
+		PathKey(const char * const valU8, const std::size_t n, PathArena &arena)
+				: data(arena.copy(valU8, n)), size(n), hash(hashBytes(valU8, n)), owner(false) {}
+
+		PathKey(const PathKey &) = delete;
+		PathKey(PathKey &&o) noexcept : data(o.data), size(o.size), hash(o.hash), owner(o.owner) { o.owner = false; }
+
+		PathKey &operator=(const PathKey &) = delete;
+		PathKey &operator=(PathKey &&o) noexcept
+		{
+			data = o.data;
+			size = o.size;
+			hash = o.hash;
+			owner = o.owner;
+			o.owner = false;
+			return *this;
+		}
+
+		~PathKey() { if (owner) { std::free(const_cast<char *>(data)); } }
+
+		const char *data;
+		std::size_t size;
+		std::size_t hash;
+		bool owner;
+	};
+
+	struct PathHash
+	{
+		std::size_t operator()(const PathKey &val) const noexcept
+		{
+			return val.hash;
+		}
+	};
+
+	struct PathEquals
+	{
+		bool operator()(const PathKey &a, const PathKey &b) const noexcept
+		{
+			return a.hash == b.hash && a.size == b.size && std::equal(a.data, a.data + a.size, b.data);
+		}
+	};
+
+	namespace _helper
+	{
+		// Full slots have the control byte set to the 7 lowest bits of the hash of the key.
+		constexpr unsigned char ctrlEmpty = 0x80;
+		constexpr unsigned char ctrlDeleted = 0xfe;
+		constexpr std::size_t ctrlGroupSize = 16;
+
+		// Returns the mask of the control bytes of the group that are equal to the value.
+		inline unsigned matchCtrl(const unsigned char * const group, const unsigned char value) noexcept
+		{
+#ifdef __SSE2__
+			const __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i *>(group));
+			return static_cast<unsigned>(_mm_movemask_epi8(
+					_mm_cmpeq_epi8(ctrl, _mm_set1_epi8(static_cast<char>(value)))));
+#else
+			unsigned result = 0;
+			for (std::size_t i = 0; i < ctrlGroupSize; ++i) {
+				result |= unsigned(group[i] == value) << i;
+			}
+			return result;
+#endif
+		}
+
+		// Returns the mask of the control bytes of the group that are either empty or deleted.
+		inline unsigned matchFree(const unsigned char * const group) noexcept
+		{
+#ifdef __SSE2__
+			return static_cast<unsigned>(_mm_movemask_epi8(
+					_mm_loadu_si128(reinterpret_cast<const __m128i *>(group))));
+#else
+			unsigned result = 0;
+			for (std::size_t i = 0; i < ctrlGroupSize; ++i) {
+				result |= unsigned(group[i] >> 7) << i;
+			}
+			return result;
+#endif
+		}
+	}
+
+	/*
+	 * An open-addressing hash table of PathKeys with the slots stored in a flat array. Each slot has
+	 * a control byte with the 7 lowest bits of the hash of its key, and the control bytes of a group
+	 * of 16 slots are matched with the key at once (with SSE2 if available), so that a key is compared
+	 * only with the keys of the slots whose control bytes match. Groups are probed quadratically.
+	 *
+	 * Unlike std::unordered_map, clear() keeps the memory allocated, and iterators are invalidated
+	 * by insertion.
+	 */
+	template<typename Slot, typename KeyOf>
+	class PathHashTable
+	{
+		template<typename SlotType>
+		class Iterator
+		{
+			friend class PathHashTable;
+		public:
+			Iterator(const unsigned char * const ctrl, const unsigned char * const ctrlEnd,
+					SlotType * const slot) noexcept : m_ctrl(ctrl), m_ctrlEnd(ctrlEnd), m_slot(slot) { skipFree(); }
+
+			SlotType &operator*() const noexcept { return *m_slot; }
+			SlotType *operator->() const noexcept { return m_slot; }
+
+			Iterator &operator++() noexcept
+			{
+				++m_ctrl;
+				++m_slot;
+				skipFree();
+				return *this;
+			}
+
+			bool operator==(const Iterator &o) const noexcept { return m_slot == o.m_slot; }
+			bool operator!=(const Iterator &o) const noexcept { return m_slot != o.m_slot; }
+		private:
+			void skipFree() noexcept
+			{
+				while (m_ctrl != m_ctrlEnd && (*m_ctrl & 0x80) != 0) {
+					++m_ctrl;
+					++m_slot;
+				}
+			}
+
+			const unsigned char *m_ctrl;
+			const unsigned char *m_ctrlEnd;
+			SlotType *m_slot;
+		};
+	public:
+		using iterator = Iterator<Slot>;
+		using const_iterator = Iterator<const Slot>;
+
+		PathHashTable() noexcept : m_ctrl(nullptr), m_slots(nullptr), m_capacity(0), m_size(0), m_growthLeft(0) {}
+
+		PathHashTable(const PathHashTable &) = delete;
+		PathHashTable(PathHashTable &&o) noexcept : m_ctrl(o.m_ctrl), m_slots(o.m_slots), m_capacity(o.m_capacity),
+				m_size(o.m_size), m_growthLeft(o.m_growthLeft)
+		{
+			o.m_ctrl = nullptr;
+			o.m_slots = nullptr;
+			o.m_capacity = o.m_size = o.m_growthLeft = 0;
+		}
+
+		PathHashTable &operator=(const PathHashTable &) = delete;
+		PathHashTable &operator=(PathHashTable &&o) noexcept
+		{
+			if (this != &o) {
+				destroy();
+				m_ctrl = o.m_ctrl;
+				m_slots = o.m_slots;
+				m_capacity = o.m_capacity;
+				m_size = o.m_size;
+				m_growthLeft = o.m_growthLeft;
+				o.m_ctrl = nullptr;
+				o.m_slots = nullptr;
+				o.m_capacity = o.m_size = o.m_growthLeft = 0;
+			}
+			return *this;
+		}
+
+		~PathHashTable() { destroy(); }
+
+		bool empty() const noexcept { return m_size == 0; }
+		std::size_t size() const noexcept { return m_size; }
+
+		iterator begin() noexcept { return iterator(m_ctrl, m_ctrl + m_capacity, m_slots); }
+		iterator end() noexcept { return iterator(m_ctrl + m_capacity, m_ctrl + m_capacity, m_slots + m_capacity); }
+		const_iterator begin() const noexcept { return const_iterator(m_ctrl, m_ctrl + m_capacity, m_slots); }
+		const_iterator end() const noexcept
+		{
+			return const_iterator(m_ctrl + m_capacity, m_ctrl + m_capacity, m_slots + m_capacity);
+		}
+
+		iterator find(const PathKey &key) noexcept
+		{
+			const std::size_t i = findIndex(key);
+			return i == m_capacity ? end() : iterator(m_ctrl + i, m_ctrl + m_capacity, m_slots + i);
+		}
+
+		void erase(const iterator &pos) noexcept { eraseAt(static_cast<std::size_t>(pos.m_slot - m_slots)); }
+
+		std::size_t erase(const PathKey &key) noexcept
+		{
+			const std::size_t i = findIndex(key);
+			if (i == m_capacity) {
+				return 0;
+			}
+			eraseAt(i);
+			return 1;
+		}
+
+		// Removes all elements keeping the memory allocated.
+		void clear() noexcept
+		{
+			if (m_size > 0) {
+				for (std::size_t i = 0; i < m_capacity; ++i) {
+					if ((m_ctrl[i] & 0x80) == 0) {
+						m_slots[i].~Slot();
+					}
+				}
+				m_size = 0;
+			}
+			if (m_capacity > 0) {
+				std::memset(m_ctrl, _helper::ctrlEmpty, m_capacity);
+			}
+			m_growthLeft = maxLoad(m_capacity);
+		}
+	protected:
+		// Inserts the slot if there is no slot with the same key, otherwise the existing slot is returned.
+		template<typename... Args>
+		std::pair<iterator, bool> emplaceSlot(const PathKey &key, Args &&...args)
+		{
+			// The key can be moved to the slot.
+			const std::size_t hash = key.hash;
+			std::size_t i = findIndex(key);
+			if (i != m_capacity) {
+				return std::make_pair(iterator(m_ctrl + i, m_ctrl + m_capacity, m_slots + i), false);
+			}
+
+			if (m_growthLeft == 0) {
+				rehash();
+			}
+			i = findFreeIndex(hash);
+			::new (static_cast<void *>(m_slots + i)) Slot(std::forward<Args>(args)...);
+			if (m_ctrl[i] == _helper::ctrlEmpty) {
+				--m_growthLeft;
+			}
+			m_ctrl[i] = h2(hash);
+			++m_size;
+			return std::make_pair(iterator(m_ctrl + i, m_ctrl + m_capacity, m_slots + i), true);
+		}
+	private:
+		static constexpr std::size_t minCapacity = 16;
+
+		// At most 7/8 of slots are used (with the deleted ones) so that each probe sequence ends quickly.
+		static std::size_t maxLoad(const std::size_t capacity) noexcept { return capacity - capacity / 8; }
+		static unsigned char h2(const std::size_t hash) noexcept { return static_cast<unsigned char>(hash & 0x7f); }
+		static std::size_t h1(const std::size_t hash) noexcept { return hash >> 7; }
+
+		std::size_t findIndex(const PathKey &key) const noexcept
+		{
+			using namespace _helper;
+
+			if (m_capacity == 0) {
+				return 0;
+			}
+
+			const std::size_t groupMask = m_capacity / ctrlGroupSize - 1;
+			const unsigned char tag = h2(key.hash);
+			std::size_t group = h1(key.hash) & groupMask;
+			for (std::size_t step = 1;; ++step) {
+				const unsigned char * const ctrl = m_ctrl + group * ctrlGroupSize;
+				for (unsigned match = matchCtrl(ctrl, tag); match != 0; match &= match - 1) {
+					const std::size_t i = group * ctrlGroupSize + __builtin_ctz(match);
+					if (PathEquals()(KeyOf::key(m_slots[i]), key)) {
+						return i;
+					}
+				}
+				if (matchCtrl(ctrl, ctrlEmpty) != 0) {
+					return m_capacity;
+				}
+				group = (group + step) & groupMask;
+			}
+		}
+
+		std::size_t findFreeIndex(const std::size_t hash) const noexcept
+		{
+			using namespace _helper;
+
+			const std::size_t groupMask = m_capacity / ctrlGroupSize - 1;
+			std::size_t group = h1(hash) & groupMask;
+			for (std::size_t step = 1;; ++step) {
+				const unsigned match = matchFree(m_ctrl + group * ctrlGroupSize);
+				if (match != 0) {
+					return group * ctrlGroupSize + __builtin_ctz(match);
+				}
+				group = (group + step) & groupMask;
+			}
+		}
+
+		void eraseAt(const std::size_t i) noexcept
+		{
+			using namespace _helper;
+
+			m_slots[i].~Slot();
+			--m_size;
+
+			/*
+			 * Probing stops at the first group with an empty slot. If the group already has one then
+			 * no key is found past it, and the slot can be made empty rather than deleted.
+			 */
+			if (matchCtrl(m_ctrl + (i & ~(ctrlGroupSize - 1)), ctrlEmpty) != 0) {
+				m_ctrl[i] = ctrlEmpty;
+				++m_growthLeft;
+			} else {
+				m_ctrl[i] = ctrlDeleted;
+			}
+		}
+
+		// Doubles the capacity, or only drops the deleted slots if at most a half of the capacity is used.
+		void rehash()
+		{
+			const std::size_t oldCapacity = m_capacity;
+			unsigned char * const oldCtrl = m_ctrl;
+			Slot * const oldSlots = m_slots;
+
+			std::size_t capacity = oldCapacity == 0 ? minCapacity : oldCapacity;
+			if (m_size + 1 > maxLoad(capacity) / 2) {
+				capacity *= 2;
+			}
+
+			std::unique_ptr<unsigned char[]> ctrl(new unsigned char[capacity]);
+			m_slots = static_cast<Slot *>(::operator new(capacity * sizeof(Slot)));
+			m_ctrl = ctrl.release();
+			m_capacity = capacity;
+			std::memset(m_ctrl, _helper::ctrlEmpty, capacity);
+			m_growthLeft = maxLoad(capacity) - m_size;
+
+			for (std::size_t i = 0; i < oldCapacity; ++i) {
+				if ((oldCtrl[i] & 0x80) == 0) {
+					Slot &slot = oldSlots[i];
+					const std::size_t hash = KeyOf::key(slot).hash;
+					const std::size_t j = findFreeIndex(hash);
+					::new (static_cast<void *>(m_slots + j)) Slot(std::move(slot));
+					m_ctrl[j] = h2(hash);
+					slot.~Slot();
+				}
+			}
+
+			delete[] oldCtrl;
+			::operator delete(oldSlots);
+		}
+
+		void destroy() noexcept
+		{
+			clear();
+			delete[] m_ctrl;
+			::operator delete(m_slots);
+			m_ctrl = nullptr;
+			m_slots = nullptr;
+			m_capacity = m_growthLeft = 0;
+		}
+
+		unsigned char *m_ctrl;
+		Slot *m_slots;
+		std::size_t m_capacity;
+		std::size_t m_size;
+		std::size_t m_growthLeft;
+	};
+
+	namespace _helper
+	{
+		template<typename Value>
+		struct PairKeyOf
+		{
+			static const PathKey &key(const std::pair<PathKey, Value> &slot) noexcept { return slot.first; }
+		};
+
+		struct SelfKeyOf
+		{
+			static const PathKey &key(const PathKey &slot) noexcept { return slot; }
+		};
+	}
+
+	template<typename Value>
+	class PathMap : public PathHashTable<std::pair<PathKey, Value>, _helper::PairKeyOf<Value>>
+	{
+	public:
+		// A value-initialised value is inserted if the key is not found.
+		Value &operator[](PathKey &&key)
+		{
+			const PathKey &keyRef = key;
+			return this->emplaceSlot(keyRef, std::move(key), Value()).first->second;
+		}
+	};
+
+	class PathSet : public PathHashTable<PathKey, _helper::SelfKeyOf>
+	{
+	public:
+		std::pair<iterator, bool> emplace(PathKey &&key)
+		{
+			const PathKey &keyRef = key;
+			return emplaceSlot(keyRef, std::move(key));
+		}
+	};
+}
+
+#endif // MIRROR_PATHHASHTABLE_HPP_
@@ -0,0 +1,424 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <cassert>
+#include "blake3.hpp"
+#include <cstring>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+constexpr std::size_t mirror::Blake3Hasher::chunkSize;
+constexpr std::size_t mirror::Blake3Hasher::digestSize;
+constexpr std::size_t mirror::Blake3Hasher::blockSize;
+constexpr std::size_t mirror::Blake3Hasher::blocksPerChunk;
+constexpr std::size_t mirror::Blake3Hasher::maxDepth;
+
+namespace
+{
+	using ChainingValue = mirror::Blake3Hasher::ChainingValue;
+
+	constexpr std::size_t blockSize = 64;
+
+	constexpr std::uint32_t chunkStart = 1 << 0;
+	constexpr std::uint32_t chunkEnd = 1 << 1;
+	constexpr std::uint32_t parent = 1 << 2;
+	constexpr std::uint32_t root = 1 << 3;
+
+	const std::uint32_t iv[8] = {
+		0x6A09E667, 0xBB67AE85, 0x3C6EF372, 0xA54FF53A, 0x510E527F, 0x9B05688C, 0x1F83D9AB, 0x5BE0CD19
+	};
+
+	// The message words used by each round, the permutation applied to the previous round's ones.
+	const unsigned char schedule[7][16] = {
+		{0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15},
+		{2, 6, 3, 10, 7, 0, 4, 13, 1, 11, 12, 5, 9, 14, 15, 8},
+		{3, 4, 10, 12, 13, 2, 7, 14, 6, 5, 9, 0, 11, 15, 8, 1},
+		{10, 7, 12, 9, 14, 3, 13, 15, 4, 0, 11, 2, 5, 8, 1, 6},
+		{12, 13, 9, 11, 15, 10, 14, 8, 7, 2, 5, 3, 0, 1, 6, 4},
+		{9, 14, 11, 5, 8, 12, 15, 1, 13, 3, 0, 10, 2, 6, 4, 7},
+		{11, 15, 5, 0, 1, 9, 8, 6, 14, 10, 2, 12, 3, 4, 7, 13}
+	};
+
+	inline std::uint32_t load32(const unsigned char * const p) noexcept
+	{
+		std::uint32_t val;
+		std::memcpy(&val, p, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		val = __builtin_bswap32(val);
+#endif
+		return val;
+	}
+
+	inline void store32(const std::uint32_t val, unsigned char * const dest) noexcept
+	{
+		for (int i = 0; i < 4; ++i) {
+			dest[i] = static_cast<unsigned char>(val >> (8 * i));
+		}
+	}
+
+	inline std::uint32_t rotr32(const std::uint32_t val, const unsigned shift) noexcept
+	{
+		return (val >> shift) | (val << (32 - shift));
+	}
+
+	inline void g(std::uint32_t * const v, const int a, const int b, const int c, const int d,
+			const std::uint32_t mx, const std::uint32_t my) noexcept
+	{
+		v[a] = v[a] + v[b] + mx;
+		v[d] = rotr32(v[d] ^ v[a], 16);
+		v[c] = v[c] + v[d];
+		v[b] = rotr32(v[b] ^ v[c], 12);
+		v[a] = v[a] + v[b] + my;
+		v[d] = rotr32(v[d] ^ v[a], 8);
+		v[c] = v[c] + v[d];
+		v[b] = rotr32(v[b] ^ v[c], 7);
+	}
+
+	// Returns the whole state (the first 8 words of which are the new chaining value).
+	void compress(const ChainingValue &cv, const unsigned char * const block, const std::uint32_t blockLength,
+			const std::uint64_t counter, const std::uint32_t flags, std::uint32_t dest[16]) noexcept
+	{
+		std::uint32_t m[16];
+		for (int i = 0; i < 16; ++i) {
+			m[i] = load32(block + 4 * i);
+		}
+
+		std::uint32_t * const v = dest;
+		std::copy_n(cv.words, 8, v);
+		std::copy_n(iv, 4, v + 8);
+		v[12] = static_cast<std::uint32_t>(counter);
+		v[13] = static_cast<std::uint32_t>(counter >> 32);
+		v[14] = blockLength;
+		v[15] = flags;
+
+		for (const unsigned char * const s : schedule) {
+			g(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+			g(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+			g(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+			g(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+			g(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+			g(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+			g(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+			g(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+		}
+
+		for (int i = 0; i < 8; ++i) {
+			v[i] ^= v[i + 8];
+			v[i + 8] ^= cv.words[i];
+		}
+	}
+
+	inline void compressInPlace(ChainingValue &cv, const unsigned char * const block, const std::uint32_t blockLength,
+			const std::uint64_t counter, const std::uint32_t flags) noexcept
+	{
+		std::uint32_t state[16];
+		compress(cv, block, blockLength, counter, flags, state);
+		std::copy_n(state, 8, cv.words);
+	}
+
+	// The last compression of a node, which gives either its chaining value or, for the root node, the hash.
+	struct Output
+	{
+		ChainingValue cv;
+		unsigned char block[blockSize];
+		std::uint32_t blockLength;
+		std::uint64_t counter;
+		std::uint32_t flags;
+
+		ChainingValue chainingValue() const noexcept
+		{
+			ChainingValue result = cv;
+			compressInPlace(result, block, blockLength, counter, flags);
+			return result;
+		}
+
+		void rootBytes(unsigned char dest[mirror::Blake3Hasher::digestSize]) const noexcept
+		{
+			std::uint32_t state[16];
+			// Only the first block of the output is used, its counter is 0 whatever the node is.
+			compress(cv, block, blockLength, 0, flags | root, state);
+			for (int i = 0; i < 8; ++i) {
+				store32(state[i], dest + 4 * i);
+			}
+		}
+	};
+
+	Output chunkOutput(const ChainingValue &cv, const unsigned char * const block, const std::size_t blockLength,
+			const std::uint64_t counter, const std::uint32_t flags) noexcept
+	{
+		Output result;
+		result.cv = cv;
+		std::memcpy(result.block, block, blockLength);
+		std::fill(result.block + blockLength, result.block + blockSize, 0);
+		result.blockLength = static_cast<std::uint32_t>(blockLength);
+		result.counter = counter;
+		result.flags = flags;
+		return result;
+	}
+
+	Output parentOutput(const ChainingValue &left, const ChainingValue &right) noexcept
+	{
+		Output result;
+		std::copy_n(iv, 8, result.cv.words);
+		for (int i = 0; i < 8; ++i) {
+			store32(left.words[i], result.block + 4 * i);
+			store32(right.words[i], result.block + 32 + 4 * i);
+		}
+		result.blockLength = blockSize;
+		result.counter = 0;
+		result.flags = parent;
+		return result;
+	}
+
+	// The largest power of two that is less than n (n must be greater than 1).
+	inline std::size_t leftSubtreeSize(const std::size_t n) noexcept
+	{
+		assert(n > 1);
+		std::size_t result = 1;
+		while (result * 2 < n) {
+			result *= 2;
+		}
+		return result;
+	}
+
+	ChainingValue mergeTree(const ChainingValue * const subtrees, const std::size_t count) noexcept
+	{
+		if (count == 1) {
+			return subtrees[0];
+		}
+		const std::size_t leftCount = leftSubtreeSize(count);
+		return parentOutput(mergeTree(subtrees, leftCount),
+				mergeTree(subtrees + leftCount, count - leftCount)).chainingValue();
+	}
+
+#ifdef __SSE2__
+	constexpr std::size_t simdChunks = 4;
+
+	inline __m128i add(const __m128i a, const __m128i b) noexcept { return _mm_add_epi32(a, b); }
+	inline __m128i xorv(const __m128i a, const __m128i b) noexcept { return _mm_xor_si128(a, b); }
+
+	inline __m128i rotr16(const __m128i x) noexcept
+	{
+		return _mm_shufflehi_epi16(_mm_shufflelo_epi16(x, 0xb1), 0xb1);
+	}
+
+	template<int shift>
+	inline __m128i rotr(const __m128i x) noexcept
+	{
+		return _mm_or_si128(_mm_srli_epi32(x, shift), _mm_slli_epi32(x, 32 - shift));
+	}
+
+	inline void gSIMD(__m128i * const v, const int a, const int b, const int c, const int d,
+			const __m128i mx, const __m128i my) noexcept
+	{
+		v[a] = add(add(v[a], v[b]), mx);
+		v[d] = rotr16(xorv(v[d], v[a]));
+		v[c] = add(v[c], v[d]);
+		v[b] = rotr<12>(xorv(v[b], v[c]));
+		v[a] = add(add(v[a], v[b]), my);
+		v[d] = rotr<8>(xorv(v[d], v[a]));
+		v[c] = add(v[c], v[d]);
+		v[b] = rotr<7>(xorv(v[b], v[c]));
+	}
+
+	// Transposes the 4x4 matrix of words, so that the vector i holds the words i of the input vectors.
+	inline void transpose(__m128i * const v) noexcept
+	{
+		const __m128i ab01 = _mm_unpacklo_epi32(v[0], v[1]);
+		const __m128i cd01 = _mm_unpacklo_epi32(v[2], v[3]);
+		const __m128i ab23 = _mm_unpackhi_epi32(v[0], v[1]);
+		const __m128i cd23 = _mm_unpackhi_epi32(v[2], v[3]);
+		v[0] = _mm_unpacklo_epi64(ab01, cd01);
+		v[1] = _mm_unpackhi_epi64(ab01, cd01);
+		v[2] = _mm_unpacklo_epi64(ab23, cd23);
+		v[3] = _mm_unpackhi_epi64(ab23, cd23);
+	}
+
+	/*
+	 * Calculates the chaining values of simdChunks consecutive full chunks, each word of the state holds
+	 * the words of all chunks. None of the chunks can be the root node.
+	 */
+	void hashChunksSIMD(const unsigned char * const input, const std::uint64_t counter,
+			ChainingValue dest[simdChunks]) noexcept
+	{
+		__m128i h[8];
+		for (int i = 0; i < 8; ++i) {
+			h[i] = _mm_set1_epi32(static_cast<int>(iv[i]));
+		}
+		const __m128i counterLow = _mm_set_epi32(static_cast<int>(counter + 3), static_cast<int>(counter + 2),
+				static_cast<int>(counter + 1), static_cast<int>(counter));
+		const __m128i counterHigh = _mm_set_epi32(static_cast<int>((counter + 3) >> 32),
+				static_cast<int>((counter + 2) >> 32), static_cast<int>((counter + 1) >> 32),
+				static_cast<int>(counter >> 32));
+		const __m128i blockLength = _mm_set1_epi32(static_cast<int>(blockSize));
+
+		for (std::size_t block = 0; block < mirror::Blake3Hasher::chunkSize / blockSize; ++block) {
+			std::uint32_t flags = 0;
+			if (block == 0) {
+				flags |= chunkStart;
+			}
+			if (block == mirror::Blake3Hasher::chunkSize / blockSize - 1) {
+				flags |= chunkEnd;
+			}
+
+			__m128i m[16];
+			for (int k = 0; k < 4; ++k) {
+				for (std::size_t lane = 0; lane < simdChunks; ++lane) {
+					m[4 * k + lane] = _mm_loadu_si128(reinterpret_cast<const __m128i *>(
+							input + lane * mirror::Blake3Hasher::chunkSize + block * blockSize + 16 * k));
+				}
+				transpose(m + 4 * k);
+			}
+
+			__m128i v[16];
+			std::copy_n(h, 8, v);
+			for (int i = 0; i < 4; ++i) {
+				v[8 + i] = _mm_set1_epi32(static_cast<int>(iv[i]));
+			}
+			v[12] = counterLow;
+			v[13] = counterHigh;
+			v[14] = blockLength;
+			v[15] = _mm_set1_epi32(static_cast<int>(flags));
+
+			for (const unsigned char * const s : schedule) {
+				gSIMD(v, 0, 4, 8, 12, m[s[0]], m[s[1]]);
+				gSIMD(v, 1, 5, 9, 13, m[s[2]], m[s[3]]);
+				gSIMD(v, 2, 6, 10, 14, m[s[4]], m[s[5]]);
+				gSIMD(v, 3, 7, 11, 15, m[s[6]], m[s[7]]);
+				gSIMD(v, 0, 5, 10, 15, m[s[8]], m[s[9]]);
+				gSIMD(v, 1, 6, 11, 12, m[s[10]], m[s[11]]);
+				gSIMD(v, 2, 7, 8, 13, m[s[12]], m[s[13]]);
+				gSIMD(v, 3, 4, 9, 14, m[s[14]], m[s[15]]);
+			}
+			for (int i = 0; i < 8; ++i) {
+				h[i] = xorv(v[i], v[i + 8]);
+			}
+		}
+
+		transpose(h);
+		transpose(h + 4);
+		for (std::size_t lane = 0; lane < simdChunks; ++lane) {
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest[lane].words), h[lane]);
+			_mm_storeu_si128(reinterpret_cast<__m128i *>(dest[lane].words + 4), h[4 + lane]);
+		}
+	}
+#endif
+}
+
+mirror::Blake3Hasher::Blake3Hasher(const std::uint64_t firstChunk) noexcept
+		: m_stackSize(0), m_chunksDone(0), m_chunkCounter(firstChunk)
+{
+	startChunk();
+}
+
+void mirror::Blake3Hasher::startChunk() noexcept
+{
+	std::copy_n(iv, 8, m_chunkCV.words);
+	m_blocksDone = 0;
+	m_blockSize = 0;
+}
+
+void mirror::Blake3Hasher::compressBlock(const unsigned char * const block) noexcept
+{
+	compressInPlace(m_chunkCV, block, blockSize, m_chunkCounter, m_blocksDone == 0 ? chunkStart : 0);
+	++m_blocksDone;
+}
+
+void mirror::Blake3Hasher::addChunk(const ChainingValue &cv) noexcept
+{
+	// Each trailing zero bit of the number of chunks is a complete subtree to merge with its left neighbour.
+	ChainingValue merged = cv;
+	for (std::uint64_t chunks = ++m_chunksDone; (chunks & 1) == 0; chunks >>= 1) {
+		assert(m_stackSize > 0);
+		merged = parentOutput(m_stack[--m_stackSize], merged).chainingValue();
+	}
+	assert(m_stackSize < maxDepth);
+	m_stack[m_stackSize++] = merged;
+	++m_chunkCounter;
+}
+
+void mirror::Blake3Hasher::update(const unsigned char *data, std::size_t n) noexcept
+{
+	/*
+	 * A chunk, as well as a block, is compressed only when more data follows, since the last chunk
+	 * of the data is finished (and the last block of a chunk is compressed) differently.
+	 */
+	while (n > 0) {
+		if (m_blocksDone == blocksPerChunk - 1 && m_blockSize == blockSize) {
+			addChunk(chunkOutput(m_chunkCV, m_block, blockSize, m_chunkCounter, chunkEnd).chainingValue());
+			startChunk();
+		}
+#ifdef __SSE2__
+		if (m_blocksDone == 0 && m_blockSize == 0) {
+			for (; n > simdChunks * chunkSize; data += simdChunks * chunkSize, n -= simdChunks * chunkSize) {
+				ChainingValue cvs[simdChunks];
+				hashChunksSIMD(data, m_chunkCounter, cvs);
+				for (const ChainingValue &cv : cvs) {
+					addChunk(cv);
+				}
+			}
+		}
+#endif
+		if (m_blockSize == blockSize) {
+			compressBlock(m_block);
+			m_blockSize = 0;
+		}
+		for (; m_blockSize == 0 && n > blockSize && m_blocksDone < blocksPerChunk - 1; data += blockSize, n -= blockSize) {
+			compressBlock(data);
+		}
+		const std::size_t toCopy = std::min(blockSize - m_blockSize, n);
+		std::memcpy(m_block + m_blockSize, data, toCopy);
+		m_blockSize += toCopy;
+		data += toCopy;
+		n -= toCopy;
+	}
+}
+
+namespace
+{
+	// Folds the stack of the complete subtrees into the output of the root (or of the subtree) node.
+	Output foldStack(Output out, const ChainingValue * const stack, std::size_t stackSize) noexcept
+	{
+		while (stackSize > 0) {
+			out = parentOutput(stack[--stackSize], out.chainingValue());
+		}
+		return out;
+	}
+}
+
+void mirror::Blake3Hasher::finish(unsigned char dest[digestSize]) const noexcept
+{
+	const std::uint32_t flags = (m_blocksDone == 0 ? chunkStart : 0) | chunkEnd;
+	foldStack(chunkOutput(m_chunkCV, m_block, m_blockSize, m_chunkCounter, flags), m_stack, m_stackSize)
+			.rootBytes(dest);
+}
+
+mirror::Blake3Hasher::ChainingValue mirror::Blake3Hasher::finishSubtree() const noexcept
+{
+	const std::uint32_t flags = (m_blocksDone == 0 ? chunkStart : 0) | chunkEnd;
+	return foldStack(chunkOutput(m_chunkCV, m_block, m_blockSize, m_chunkCounter, flags), m_stack, m_stackSize)
+			.chainingValue();
+}
+
+void mirror::Blake3Hasher::mergeSubtrees(const ChainingValue * const subtrees, const std::size_t count,
+		unsigned char dest[digestSize]) noexcept
+{
+	assert(count > 1);
+	const std::size_t leftCount = leftSubtreeSize(count);
+	parentOutput(mergeTree(subtrees, leftCount), mergeTree(subtrees + leftCount, count - leftCount)).rootBytes(dest);
+}
@@ -0,0 +1,85 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_BLAKE3_HPP_
+#define MIRROR_BLAKE3_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mirror
+{
+	/*
+	 * Calculates the BLAKE3 hash (of 32 bytes, in the default, unkeyed, mode) of the data passed in any number
+	 * of parts.
+	 *
+	 * BLAKE3 splits the data into chunks of 1K that are the leaves of a binary tree, so parts of the data
+	 * can be hashed independently. A hasher constructed with firstChunk hashes the subtree that starts
+	 * with that chunk, its chaining value is returned by finishSubtree(). The chaining values
+	 * of the consecutive subtrees of the data are merged into the hash by mergeSubtrees().
+	 */
+	class Blake3Hasher
+	{
+	public:
+		static constexpr std::size_t chunkSize = 1024;
+		static constexpr std::size_t digestSize = 32;
+
+		struct ChainingValue
+		{
+			std::uint32_t words[8];
+		};
+
+		explicit Blake3Hasher(std::uint64_t firstChunk = 0) noexcept;
+
+		void update(const unsigned char *data, std::size_t n) noexcept;
+		void finish(unsigned char dest[digestSize]) const noexcept;
+
+		/*
+		 * Returns the chaining value of the subtree hashed. A subtree of the data consists of 2^k chunks
+		 * and starts with a multiple of 2^k chunks, only the last subtree of the data can be shorter.
+		 */
+		ChainingValue finishSubtree() const noexcept;
+
+		/*
+		 * Calculates the hash of the data that consists of the consecutive subtrees of 2^k chunks
+		 * (the last one can be shorter) given their chaining values. There must be at least two subtrees.
+		 */
+		static void mergeSubtrees(const ChainingValue *subtrees, std::size_t count,
+				unsigned char dest[digestSize]) noexcept;
+	private:
+		static constexpr std::size_t blockSize = 64;
+		static constexpr std::size_t blocksPerChunk = chunkSize / blockSize;
+		// The depth of the tree for 2^64 bytes of data.
+		static constexpr std::size_t maxDepth = 54;
+
+		void compressBlock(const unsigned char *block) noexcept;
+		void addChunk(const ChainingValue &cv) noexcept;
+		void startChunk() noexcept;
+
+		// The chaining values of the complete subtrees that are not merged yet, from the largest one.
+		ChainingValue m_stack[maxDepth];
+		std::size_t m_stackSize;
+		// The chunks added to the stack (relative to the first chunk) and the index of the current chunk.
+		std::uint64_t m_chunksDone;
+		std::uint64_t m_chunkCounter;
+
+		ChainingValue m_chunkCV;
+		std::size_t m_blocksDone;
+		unsigned char m_block[blockSize];
+		std::size_t m_blockSize;
+	};
+}
+
+#endif // MIRROR_BLAKE3_HPP_
@@ -0,0 +1,315 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "crc64.hpp"
+#include <afc/crc.hpp>
+#include <afc/logger.hpp>
+#include <afc/StringRef.hpp>
+#include <cstring>
+
+#if defined(__x86_64__)
+	#include <immintrin.h>
+	#define MIRROR_CRC64_PCLMUL
+#elif defined(__aarch64__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	#include <arm_neon.h>
+	#include <asm/hwcap.h>
+	#include <sys/auxv.h>
+	#define MIRROR_CRC64_PMULL
+#endif
+
+using afc::operator"" _s;
+using afc::logger::logDebug;
+
+namespace
+{
+	/*
+	 * CRC64 here is computed in the reversed (LSB-first) representation: bit j of a 64-bit value is
+	 * the coefficient of x^(63 - j). The polynomial itself is taken from afc::crc64ReversedUpdate().
+	 */
+	std::uint64_t table[16][256];
+
+	/*
+	 * Folding constants (x^(d + 63) mod P, x^(d - 1) mod P) for the distance d of 128 and 512 bits.
+	 * The extra x^-1 compensates for the product of two 64-bit reversed values being shifted
+	 * by one bit within the 128-bit register.
+	 */
+	std::uint64_t fold128[2];
+	std::uint64_t fold512[2];
+
+	inline std::uint64_t load64(const unsigned char * const p) noexcept
+	{
+		std::uint64_t val;
+		std::memcpy(&val, p, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		val = __builtin_bswap64(val);
+#endif
+		return val;
+	}
+
+	// Multiplies the polynomial by x^n modulo the CRC polynomial.
+	std::uint64_t xPowN(std::uint64_t val, const std::uint64_t poly, unsigned n) noexcept
+	{
+		for (; n > 0; --n) {
+			val = (val & 1) == 0 ? val >> 1 : (val >> 1) ^ poly;
+		}
+		return val;
+	}
+
+	void initTables(const std::uint64_t poly) noexcept
+	{
+		for (unsigned i = 0; i < 256; ++i) {
+			table[0][i] = xPowN(i, poly, 8);
+		}
+		for (unsigned k = 1; k < 16; ++k) {
+			for (unsigned i = 0; i < 256; ++i) {
+				const std::uint64_t prev = table[k - 1][i];
+				table[k][i] = (prev >> 8) ^ table[0][prev & 0xff];
+			}
+		}
+
+		constexpr std::uint64_t one = std::uint64_t(1) << 63;
+		fold128[0] = xPowN(one, poly, 128 + 63);
+		fold128[1] = xPowN(one, poly, 128 - 1);
+		fold512[0] = xPowN(one, poly, 512 + 63);
+		fold512[1] = xPowN(one, poly, 512 - 1);
+	}
+
+	std::uint_fast64_t slicingBy16Update(std::uint_fast64_t crc, const unsigned char *data, std::size_t n)
+	{
+		std::uint64_t c = crc;
+		for (; n >= 16; data += 16, n -= 16) {
+			const std::uint64_t a = c ^ load64(data);
+			const std::uint64_t b = load64(data + 8);
+			c = table[15][a & 0xff] ^ table[14][(a >> 8) & 0xff] ^
+					table[13][(a >> 16) & 0xff] ^ table[12][(a >> 24) & 0xff] ^
+					table[11][(a >> 32) & 0xff] ^ table[10][(a >> 40) & 0xff] ^
+					table[9][(a >> 48) & 0xff] ^ table[8][a >> 56] ^
+					table[7][b & 0xff] ^ table[6][(b >> 8) & 0xff] ^
+					table[5][(b >> 16) & 0xff] ^ table[4][(b >> 24) & 0xff] ^
+					table[3][(b >> 32) & 0xff] ^ table[2][(b >> 40) & 0xff] ^
+					table[1][(b >> 48) & 0xff] ^ table[0][b >> 56];
+		}
+		for (; n > 0; ++data, --n) {
+			c = table[0][(c ^ *data) & 0xff] ^ (c >> 8);
+		}
+		return c;
+	}
+
+	/*
+	 * Both SIMD implementations fold four 128-bit registers over the data, then fold them into one
+	 * and pass the remaining 128 bits and the tail to the slicing-by-16 implementation. That avoids
+	 * Barrett reduction and therefore any polynomial-specific constants besides the folding ones.
+	 */
+	constexpr std::size_t minSIMDSize = 64;
+
+#ifdef MIRROR_CRC64_PCLMUL
+	__attribute__((target("pclmul,sse2")))
+	inline __m128i pclmulFold(const __m128i x, const __m128i k, const __m128i data) noexcept
+	{
+		return _mm_xor_si128(_mm_xor_si128(_mm_clmulepi64_si128(x, k, 0x00), _mm_clmulepi64_si128(x, k, 0x11)), data);
+	}
+
+	__attribute__((target("pclmul,sse2")))
+	std::uint_fast64_t pclmulUpdate(const std::uint_fast64_t crc, const unsigned char *data, std::size_t n)
+	{
+		if (n < minSIMDSize) {
+			return slicingBy16Update(crc, data, n);
+		}
+
+		const __m128i k512 = _mm_set_epi64x(fold512[1], fold512[0]);
+		const __m128i k128 = _mm_set_epi64x(fold128[1], fold128[0]);
+		const __m128i *p = reinterpret_cast<const __m128i *>(data);
+
+		__m128i x0 = _mm_xor_si128(_mm_loadu_si128(p), _mm_cvtsi64_si128(static_cast<long long>(crc)));
+		__m128i x1 = _mm_loadu_si128(p + 1);
+		__m128i x2 = _mm_loadu_si128(p + 2);
+		__m128i x3 = _mm_loadu_si128(p + 3);
+		p += 4;
+		n -= 64;
+
+		for (; n >= 64; p += 4, n -= 64) {
+			x0 = pclmulFold(x0, k512, _mm_loadu_si128(p));
+			x1 = pclmulFold(x1, k512, _mm_loadu_si128(p + 1));
+			x2 = pclmulFold(x2, k512, _mm_loadu_si128(p + 2));
+			x3 = pclmulFold(x3, k512, _mm_loadu_si128(p + 3));
+		}
+
+		x0 = pclmulFold(x0, k128, x1);
+		x0 = pclmulFold(x0, k128, x2);
+		x0 = pclmulFold(x0, k128, x3);
+		for (; n >= 16; ++p, n -= 16) {
+			x0 = pclmulFold(x0, k128, _mm_loadu_si128(p));
+		}
+
+		unsigned char rest[16];
+		_mm_storeu_si128(reinterpret_cast<__m128i *>(rest), x0);
+		return slicingBy16Update(slicingBy16Update(0, rest, 16), reinterpret_cast<const unsigned char *>(p), n);
+	}
+
+	bool pclmulSupported() noexcept
+	{
+		__builtin_cpu_init();
+		return __builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse2");
+	}
+#endif
+
+#ifdef MIRROR_CRC64_PMULL
+	__attribute__((target("+crypto")))
+	inline uint64x2_t pmullFold(const uint64x2_t x, const uint64x2_t k, const uint64x2_t data) noexcept
+	{
+		const poly64x2_t px = vreinterpretq_p64_u64(x);
+		const poly64x2_t pk = vreinterpretq_p64_u64(k);
+		const uint64x2_t lo = vreinterpretq_u64_p128(vmull_p64(vgetq_lane_p64(px, 0), vgetq_lane_p64(pk, 0)));
+		const uint64x2_t hi = vreinterpretq_u64_p128(vmull_high_p64(px, pk));
+		return veorq_u64(veorq_u64(lo, hi), data);
+	}
+
+	__attribute__((target("+crypto")))
+	std::uint_fast64_t pmullUpdate(const std::uint_fast64_t crc, const unsigned char *data, std::size_t n)
+	{
+		if (n < minSIMDSize) {
+			return slicingBy16Update(crc, data, n);
+		}
+
+		const uint64x2_t k512 = vcombine_u64(vcreate_u64(fold512[0]), vcreate_u64(fold512[1]));
+		const uint64x2_t k128 = vcombine_u64(vcreate_u64(fold128[0]), vcreate_u64(fold128[1]));
+		const uint64x2_t crcVec = vcombine_u64(vcreate_u64(crc), vcreate_u64(0));
+
+		uint64x2_t x0 = veorq_u64(vld1q_u64(reinterpret_cast<const uint64_t *>(data)), crcVec);
+		uint64x2_t x1 = vld1q_u64(reinterpret_cast<const uint64_t *>(data + 16));
+		uint64x2_t x2 = vld1q_u64(reinterpret_cast<const uint64_t *>(data + 32));
+		uint64x2_t x3 = vld1q_u64(reinterpret_cast<const uint64_t *>(data + 48));
+		data += 64;
+		n -= 64;
+
+		for (; n >= 64; data += 64, n -= 64) {
+			x0 = pmullFold(x0, k512, vld1q_u64(reinterpret_cast<const uint64_t *>(data)));
+			x1 = pmullFold(x1, k512, vld1q_u64(reinterpret_cast<const uint64_t *>(data + 16)));
+			x2 = pmullFold(x2, k512, vld1q_u64(reinterpret_cast<const uint64_t *>(data + 32)));
+			x3 = pmullFold(x3, k512, vld1q_u64(reinterpret_cast<const uint64_t *>(data + 48)));
+		}
+
+		x0 = pmullFold(x0, k128, x1);
+		x0 = pmullFold(x0, k128, x2);
+		x0 = pmullFold(x0, k128, x3);
+		for (; n >= 16; data += 16, n -= 16) {
+			x0 = pmullFold(x0, k128, vld1q_u64(reinterpret_cast<const uint64_t *>(data)));
+		}
+
+		unsigned char rest[16];
+		vst1q_u8(rest, vreinterpretq_u8_u64(x0));
+		return slicingBy16Update(slicingBy16Update(0, rest, 16), data, n);
+	}
+
+	bool pmullSupported() noexcept
+	{
+		return (getauxval(AT_HWCAP) & HWCAP_PMULL) != 0;
+	}
+#endif
+
+	// Compares the implementation with afc::crc64ReversedUpdate() on chained updates of various sizes.
+	bool selfCheck(const mirror::crc64Update update) noexcept
+	{
+		constexpr std::size_t sizes[] = {0, 1, 7, 8, 15, 16, 17, 63, 64, 65, 127, 128, 129, 200, 511, 4096, 4099};
+		unsigned char buf[4099];
+
+		std::uint64_t seed = 0x9e3779b97f4a7c15;
+		for (unsigned char &c : buf) {
+			seed ^= seed << 13;
+			seed ^= seed >> 7;
+			seed ^= seed << 17;
+			c = static_cast<unsigned char>(seed);
+		}
+
+		std::uint_fast64_t expected = 0;
+		std::uint_fast64_t actual = 0;
+		for (const std::size_t size : sizes) {
+			expected = afc::crc64ReversedUpdate(expected, buf, size);
+			actual = update(actual, buf, size);
+			if (expected != actual) {
+				return false;
+			}
+		}
+		return afc::crc64ReversedUpdate(~expected, buf + 3, 1000) == update(~actual, buf + 3, 1000);
+	}
+}
+
+mirror::crc64Update mirror::crc64ReversedUpdate = nullptr;
+
+mirror::CRC64Engine mirror::initCRC64()
+{
+	const unsigned char topBit = 0x80;
+	// For the reversed CRC, the digest of the single byte 0x80 is the reversed polynomial itself.
+	initTables(afc::crc64ReversedUpdate(0, &topBit, 1));
+
+	CRC64Engine engine = CRC64Engine::afc;
+	crc64ReversedUpdate = afc::crc64ReversedUpdate;
+
+	if (selfCheck(slicingBy16Update)) {
+		engine = CRC64Engine::slicingBy16;
+		crc64ReversedUpdate = slicingBy16Update;
+
+#if defined(MIRROR_CRC64_PCLMUL)
+		if (pclmulSupported() && selfCheck(pclmulUpdate)) {
+			engine = CRC64Engine::pclmul;
+			crc64ReversedUpdate = pclmulUpdate;
+		}
+#elif defined(MIRROR_CRC64_PMULL)
+		if (pmullSupported() && selfCheck(pmullUpdate)) {
+			engine = CRC64Engine::pmull;
+			crc64ReversedUpdate = pmullUpdate;
+		}
+#endif
+	}
+
+	logDebug("CRC64 engine: "_s, crc64EngineName(engine));
+
+	return engine;
+}
+
+const char *mirror::crc64EngineName(const CRC64Engine engine) noexcept
+{
+	switch (engine) {
+	case CRC64Engine::afc:
+		return "afc";
+	case CRC64Engine::slicingBy16:
+		return "slicing-by-16";
+	case CRC64Engine::pclmul:
+		return "PCLMULQDQ";
+	case CRC64Engine::pmull:
+		return "PMULL";
+	default:
+		return "unknown";
+	}
+}
+
+mirror::crc64Update mirror::crc64EngineUpdate(const CRC64Engine engine) noexcept
+{
+	switch (engine) {
+	case CRC64Engine::afc:
+		return afc::crc64ReversedUpdate;
+	case CRC64Engine::slicingBy16:
+		return slicingBy16Update;
+#if defined(MIRROR_CRC64_PCLMUL)
+	case CRC64Engine::pclmul:
+		return pclmulSupported() ? pclmulUpdate : nullptr;
+#elif defined(MIRROR_CRC64_PMULL)
+	case CRC64Engine::pmull:
+		return pmullSupported() ? pmullUpdate : nullptr;
+#endif
+	default:
+		return nullptr;
+	}
+}
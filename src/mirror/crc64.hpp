@@ -0,0 +1,54 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_CRC64_HPP_
+#define MIRROR_CRC64_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mirror
+{
+	/*
+	 * Updates the reversed CRC64 digest. The result is bit-identical to afc::crc64ReversedUpdate()
+	 * so that the digests stored in the existing DBs stay valid.
+	 */
+	typedef std::uint_fast64_t (*crc64Update)(std::uint_fast64_t crc, const unsigned char *data, std::size_t n);
+
+	// Resolved by initCRC64(). Must not be used before it is called.
+	extern crc64Update crc64ReversedUpdate;
+
+	enum class CRC64Engine
+	{
+		afc, slicingBy16, pclmul, pmull
+	};
+
+	/*
+	 * Selects the fastest CRC64 implementation the CPU supports. The polynomial and the tables are derived
+	 * from afc::crc64ReversedUpdate(). Each implementation is checked against afc::crc64ReversedUpdate()
+	 * before it is selected, afc::crc64ReversedUpdate() is used itself if all checks fail.
+	 */
+	CRC64Engine initCRC64();
+
+	const char *crc64EngineName(CRC64Engine engine) noexcept;
+
+	/*
+	 * Returns the implementation of the engine, or nullptr if the CPU does not support it. Is used to compare
+	 * the engines, e.g. in the microbenchmarks. Must not be used before initCRC64() is called.
+	 */
+	crc64Update crc64EngineUpdate(CRC64Engine engine) noexcept;
+}
+
+#endif // MIRROR_CRC64_HPP_
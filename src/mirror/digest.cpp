@@ -0,0 +1,105 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <cassert>
+#include "crc64.hpp"
+#include <cstring>
+#include "digest.hpp"
+
+std::size_t mirror::digestSize(const DigestAlgorithm alg) noexcept
+{
+	switch (alg) {
+	case DigestAlgorithm::crc64:
+		return 8;
+	case DigestAlgorithm::xxh3:
+		return XXH3Hasher::digestSize;
+	case DigestAlgorithm::blake3:
+		return Blake3Hasher::digestSize;
+	default:
+		assert(false);
+		return 0;
+	}
+}
+
+const char *mirror::digestName(const DigestAlgorithm alg) noexcept
+{
+	switch (alg) {
+	case DigestAlgorithm::crc64:
+		return "crc64";
+	case DigestAlgorithm::xxh3:
+		return "xxh3-128";
+	case DigestAlgorithm::blake3:
+		return "blake3";
+	default:
+		assert(false);
+		return "";
+	}
+}
+
+bool mirror::parseDigestAlgorithm(const char * const name, DigestAlgorithm &dest) noexcept
+{
+	for (const DigestAlgorithm alg : {DigestAlgorithm::crc64, DigestAlgorithm::xxh3, DigestAlgorithm::blake3}) {
+		if (std::strcmp(name, digestName(alg)) == 0) {
+			dest = alg;
+			return true;
+		}
+	}
+	if (std::strcmp(name, "xxh3") == 0) {
+		dest = DigestAlgorithm::xxh3;
+		return true;
+	}
+	return false;
+}
+
+void mirror::Digest::update(const unsigned char * const data, const std::size_t n) noexcept
+{
+	switch (m_alg) {
+	case DigestAlgorithm::crc64:
+		m_crc64 = crc64ReversedUpdate(m_crc64, data, n);
+		break;
+	case DigestAlgorithm::xxh3:
+		m_xxh3.update(data, n);
+		break;
+	case DigestAlgorithm::blake3:
+		m_blake3.update(data, n);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+void mirror::Digest::finish(unsigned char dest[maxDigestSize]) const noexcept
+{
+	switch (m_alg) {
+	case DigestAlgorithm::crc64: {
+		std::uint_fast64_t crc64 = m_crc64;
+		for (std::size_t i = 0; i < 8; ++i) {
+			dest[i] = crc64 & 0xff;
+			crc64 >>= 8;
+		}
+		break;
+	}
+	case DigestAlgorithm::xxh3:
+		m_xxh3.finish(dest);
+		break;
+	case DigestAlgorithm::blake3:
+		m_blake3.finish(dest);
+		break;
+	default:
+		assert(false);
+	}
+	std::fill(dest + digestSize(m_alg), dest + maxDigestSize, 0);
+}
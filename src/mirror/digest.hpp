@@ -0,0 +1,97 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_DIGEST_HPP_
+#define MIRROR_DIGEST_HPP_
+
+#include <afc/logger.hpp>
+#include "blake3.hpp"
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include "xxh3.hpp"
+
+namespace mirror
+{
+	/*
+	 * The algorithms of the file digests stored in the DB. The algorithm is chosen when the DB is created
+	 * and is stored in the DB with the files.
+	 */
+	enum class DigestAlgorithm
+	{
+		crc64, xxh3, blake3
+	};
+
+	// The size of the largest digest. Digests of the other algorithms are padded with zeros.
+	constexpr std::size_t maxDigestSize = Blake3Hasher::digestSize;
+
+	std::size_t digestSize(DigestAlgorithm alg) noexcept;
+	const char *digestName(DigestAlgorithm alg) noexcept;
+	// Returns false if there is no algorithm with the name given.
+	bool parseDigestAlgorithm(const char *name, DigestAlgorithm &dest) noexcept;
+
+	/*
+	 * Calculates the digest of the data passed in any number of parts with the algorithm given.
+	 * The CRC64 digest is stored as 8 bytes in the little-endian order (as the DBs of the older versions have it).
+	 */
+	class Digest
+	{
+	public:
+		explicit Digest(const DigestAlgorithm alg) noexcept : m_alg(alg), m_crc64(0) {}
+
+		Digest(const Digest &) = delete;
+		Digest &operator=(const Digest &) = delete;
+
+		DigestAlgorithm algorithm() const noexcept { return m_alg; }
+
+		void update(const unsigned char *data, std::size_t n) noexcept;
+		// Writes digestSize(algorithm()) bytes of the digest, the rest of dest is filled with zeros.
+		void finish(unsigned char dest[maxDigestSize]) const noexcept;
+	private:
+		const DigestAlgorithm m_alg;
+		std::uint_fast64_t m_crc64;
+		XXH3Hasher m_xxh3;
+		Blake3Hasher m_blake3;
+	};
+
+	struct DigestView
+	{
+		DigestView(const unsigned char * const data, const std::size_t size) noexcept : data(data), size(size) {}
+
+		const unsigned char *data;
+		std::size_t size;
+	};
+}
+
+namespace afc
+{
+	namespace logger
+	{
+		template<>
+		inline bool logPrint<const mirror::DigestView &>(const mirror::DigestView &val, std::FILE * const dest)
+		{
+			static const char digits[] = "0123456789abcdef";
+
+			char buf[2 * mirror::maxDigestSize];
+			for (std::size_t i = 0; i < val.size; ++i) {
+				buf[2 * i] = digits[val.data[i] >> 4];
+				buf[2 * i + 1] = digits[val.data[i] & 0xf];
+			}
+			return logText(buf, 2 * val.size, dest);
+		}
+	}
+}
+
+#endif // MIRROR_DIGEST_HPP_
@@ -14,9 +14,166 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include "encoding.hpp"
+#include <cerrno>
+#include <iconv.h>
+#include <new>
+
+namespace
+{
+	const iconv_t noDescriptor = reinterpret_cast<iconv_t>(-1);
+
+	// The descriptors are not shared by threads since iconv() keeps the conversion state in them.
+	struct ThreadConverters
+	{
+		ThreadConverters() noexcept : toUtf8(noDescriptor), fromUtf8(noDescriptor) {}
+		~ThreadConverters()
+		{
+			if (toUtf8 != noDescriptor) {
+				iconv_close(toUtf8);
+			}
+			if (fromUtf8 != noDescriptor) {
+				iconv_close(fromUtf8);
+			}
+		}
+
+		iconv_t toUtf8;
+		iconv_t fromUtf8;
+	};
+
+	thread_local ThreadConverters threadConverters;
+
+	iconv_t openDescriptor(iconv_t &cd, const char * const to, const char * const from)
+	{
+		if (cd == noDescriptor) {
+			cd = iconv_open(to, from);
+			if (cd == noDescriptor) {
+				// TODO handle error.
+				throw errno;
+			}
+		}
+		return cd;
+	}
+
+	void iconvAppend(const iconv_t cd, const char * const src, const std::size_t srcSize, std::string &dest)
+	{
+		// Resetting the conversion state, which a failed conversion could leave not initial.
+		iconv(cd, nullptr, nullptr, nullptr, nullptr);
+
+		const std::size_t initialSize = dest.size();
+		std::size_t destSize = initialSize;
+		char *in = const_cast<char *>(src);
+		std::size_t inLeft = srcSize;
+		std::size_t room = srcSize + srcSize / 2 + 16;
+		bool flushed = false;
+		while (!flushed) {
+			dest.resize(destSize + room);
+			char *out = &dest[destSize];
+			std::size_t outLeft = room;
+			std::size_t result;
+			if (inLeft > 0) {
+				result = iconv(cd, &in, &inLeft, &out, &outLeft);
+			} else {
+				// Writing the shift sequence that returns to the initial state (for stateful encodings).
+				result = iconv(cd, nullptr, nullptr, &out, &outLeft);
+				flushed = result != static_cast<std::size_t>(-1);
+			}
+			destSize += room - outLeft;
+			if (result == static_cast<std::size_t>(-1)) {
+				const int errorCode = errno;
+				if (errorCode != E2BIG) {
+					dest.resize(initialSize);
+					// TODO handle error.
+					throw errorCode;
+				}
+				room *= 2;
+			}
+		}
+		dest.resize(destSize);
+	}
+
+	mirror::TextHolder holdCopy(const std::string &text)
+	{
+		char * const copy = static_cast<char *>(std::malloc(text.size() + 1));
+		if (copy == nullptr) {
+			throw std::bad_alloc();
+		}
+		std::memcpy(copy, text.data(), text.size());
+		copy[text.size()] = '\0';
+		return mirror::TextHolder(copy, text.size(), true);
+	}
+}
 
 namespace mirror
 {
+	afc::String systemEncoding;
+
 	convert convertToUtf8 = nullptr;
 	convert convertFromUtf8 = nullptr;
+
+	namespace _helper
+	{
+		bool utf8System = false;
+		bool asciiCompatible = false;
+	}
+}
+
+void mirror::_helper::iconvToUtf8(const char * const src, const std::size_t srcSize, std::string &dest)
+{
+	iconvAppend(openDescriptor(threadConverters.toUtf8, "UTF-8", systemEncoding.c_str()), src, srcSize, dest);
+}
+
+void mirror::_helper::iconvFromUtf8(const char * const src, const std::size_t srcSize, std::string &dest)
+{
+	iconvAppend(openDescriptor(threadConverters.fromUtf8, systemEncoding.c_str(), "UTF-8"), src, srcSize, dest);
+}
+
+mirror::TextHolder mirror::trueConvertToUtf8(const char * const src, const std::size_t srcSize)
+{
+	if (!_helper::needsConversion(src, srcSize)) {
+		return TextHolder(src, srcSize, false);
+	}
+	const PhaseTimer timer(StatPhase::encoding);
+	std::string result;
+	_helper::iconvToUtf8(src, srcSize, result);
+	return holdCopy(result);
+}
+
+mirror::TextHolder mirror::trueConvertFromUtf8(const char * const src, const std::size_t srcSize)
+{
+	if (!_helper::needsConversion(src, srcSize)) {
+		return TextHolder(src, srcSize, false);
+	}
+	const PhaseTimer timer(StatPhase::encoding);
+	std::string result;
+	_helper::iconvFromUtf8(src, srcSize, result);
+	return holdCopy(result);
+}
+
+void mirror::initConverters()
+{
+	systemEncoding = afc::systemCharset();
+	_helper::utf8System = std::strcmp("UTF-8", systemEncoding.c_str()) == 0;
+	if (_helper::utf8System) {
+		convertToUtf8 = nopConverter;
+		convertFromUtf8 = nopConverter;
+		return;
+	}
+	convertToUtf8 = trueConvertToUtf8;
+	convertFromUtf8 = trueConvertFromUtf8;
+
+	// ASCII text is passed as is only if all ASCII characters are converted to themselves both ways.
+	char ascii[127];
+	for (std::size_t i = 0; i < sizeof(ascii); ++i) {
+		ascii[i] = static_cast<char>(i + 1);
+	}
+	try {
+		std::string utf8, back;
+		_helper::iconvToUtf8(ascii, sizeof(ascii), utf8);
+		_helper::iconvFromUtf8(ascii, sizeof(ascii), back);
+		_helper::asciiCompatible = utf8.size() == sizeof(ascii) && std::memcmp(utf8.data(), ascii, sizeof(ascii)) == 0 &&
+				back.size() == sizeof(ascii) && std::memcmp(back.data(), ascii, sizeof(ascii)) == 0;
+	}
+	catch (...) {
+		_helper::asciiCompatible = false;
+	}
 }
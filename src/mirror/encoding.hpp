@@ -1,5 +1,5 @@
 /* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
-Copyright (C) 2017 Dźmitry Laŭčuk
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
 
 This program is free software: you can redistribute it and/or modify
 it under the terms of the GNU General Public License as published by
@@ -22,11 +22,17 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <cstddef>
 #include <cstdlib>
 #include <cstring>
+#include "stats.hpp"
+#include <string>
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
 
 namespace mirror
 {
-	// TODO think of caching C string directry so save a few CPU ticks.
-	static afc::String systemEncoding;
+	// Is set by initConverters().
+	extern afc::String systemEncoding;
 
 	struct TextHolder
 	{
@@ -52,46 +58,101 @@ namespace mirror
 		bool owner;
 	};
 
-	// TODO implement conversion to mirror::PathKey to minimise copying/moving data.
+	// The result of a conversion. It refers either to the source, if no conversion is needed, or to a buffer.
+	struct TextView
+	{
+		const char *value;
+		std::size_t size;
+	};
+
 	typedef TextHolder (*convert)(const char *src, std::size_t srcSize);
 
 	extern convert convertToUtf8;
 	extern convert convertFromUtf8;
 
+	namespace _helper
+	{
+		// Is set by initConverters().
+		extern bool utf8System;
+		/*
+		 * Tells if the system encoding represents ASCII characters as the same single bytes, as ISO-8859-x
+		 * and most other encodings do, so that pure ASCII text needs no conversion. Is set by initConverters().
+		 */
+		extern bool asciiCompatible;
+
+		// Convert with iconv appending the result to dest. The iconv descriptors are opened once per thread.
+		void iconvToUtf8(const char *src, std::size_t srcSize, std::string &dest);
+		void iconvFromUtf8(const char *src, std::size_t srcSize, std::string &dest);
+
+		inline bool isAscii(const char * const src, const std::size_t n) noexcept
+		{
+			std::size_t i = 0;
+#ifdef __SSE2__
+			for (; i + 16 <= n; i += 16) {
+				if (_mm_movemask_epi8(_mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i))) != 0) {
+					return false;
+				}
+			}
+#endif
+			unsigned char highBits = 0;
+			for (; i < n; ++i) {
+				highBits |= static_cast<unsigned char>(src[i]);
+			}
+			return (highBits & 0x80) == 0;
+		}
+
+		inline bool needsConversion(const char * const src, const std::size_t n) noexcept
+		{
+			return !utf8System && !(asciiCompatible && isAscii(src, n));
+		}
+	}
+
 	inline TextHolder nopConverter(const char * const src, std::size_t srcSize)
 	{
-		assert(std::strcmp("UTF-8", systemEncoding.c_str()) == 0);
+		assert(_helper::utf8System);
 		return TextHolder(src, srcSize, false);
 	}
 
-	inline TextHolder trueConvertToUtf8(const char * const src, std::size_t srcSize)
-	{
-		afc::U8String result(afc::convertToUtf8(src, srcSize, systemEncoding.c_str()));
-		const std::size_t size = result.size();
+	// Return the source itself if it is pure ASCII, otherwise the text converted is allocated.
+	TextHolder trueConvertToUtf8(const char *src, std::size_t srcSize);
+	TextHolder trueConvertFromUtf8(const char *src, std::size_t srcSize);
 
-		return TextHolder(result.detach(), size, true);
+	// The buffer is overwritten if the text needs conversion, so that no memory is allocated per text.
+	inline TextView toUtf8(const char * const src, const std::size_t srcSize, std::string &buf)
+	{
+		if (!_helper::needsConversion(src, srcSize)) {
+			return TextView{src, srcSize};
+		}
+		const PhaseTimer timer(StatPhase::encoding);
+		buf.clear();
+		_helper::iconvToUtf8(src, srcSize, buf);
+		return TextView{buf.data(), buf.size()};
 	}
 
-	inline TextHolder trueConvertFromUtf8(const char * const src, std::size_t srcSize)
+	inline TextView fromUtf8(const char * const src, const std::size_t srcSize, std::string &buf)
 	{
-		afc::String result(afc::convertFromUtf8(src, srcSize, systemEncoding.c_str()));
-		const std::size_t size = result.size();
-
-		return TextHolder(result.detach(), size, true);
+		if (!_helper::needsConversion(src, srcSize)) {
+			return TextView{src, srcSize};
+		}
+		const PhaseTimer timer(StatPhase::encoding);
+		buf.clear();
+		_helper::iconvFromUtf8(src, srcSize, buf);
+		return TextView{buf.data(), buf.size()};
 	}
 
-	inline void initConverters()
+	// Appends the text converted to UTF-8 to dest.
+	inline void appendUtf8(const char * const src, const std::size_t srcSize, std::string &dest)
 	{
-		systemEncoding = afc::systemCharset();
-		if (std::strcmp("UTF-8", systemEncoding.c_str()) == 0) {
-			convertToUtf8 = nopConverter;
-			convertFromUtf8 = nopConverter;
-		} else {
-			convertToUtf8 = trueConvertToUtf8;
-			convertFromUtf8 = trueConvertFromUtf8;
+		if (!_helper::needsConversion(src, srcSize)) {
+			dest.append(src, srcSize);
+			return;
 		}
+		const PhaseTimer timer(StatPhase::encoding);
+		_helper::iconvToUtf8(src, srcSize, dest);
 	}
 
+	void initConverters();
+
 	struct Utf8ToSystemView
 	{
 		Utf8ToSystemView(const char * const strU8, std::size_t n) noexcept : text(strU8), size(n) {}
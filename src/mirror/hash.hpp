@@ -0,0 +1,120 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_HASH_HPP_
+#define MIRROR_HASH_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		inline void multiply128(std::uint64_t &lo, std::uint64_t &hi) noexcept
+		{
+#ifdef __SIZEOF_INT128__
+			const unsigned __int128 r = static_cast<unsigned __int128>(lo) * hi;
+			lo = static_cast<std::uint64_t>(r);
+			hi = static_cast<std::uint64_t>(r >> 64);
+#else
+			const std::uint64_t aLo = lo & 0xffffffff, aHi = lo >> 32, bLo = hi & 0xffffffff, bHi = hi >> 32;
+			const std::uint64_t ll = aLo * bLo, lh = aLo * bHi, hl = aHi * bLo, hh = aHi * bHi;
+			const std::uint64_t mid = (ll >> 32) + (lh & 0xffffffff) + (hl & 0xffffffff);
+			lo = (mid << 32) | (ll & 0xffffffff);
+			hi = hh + (lh >> 32) + (hl >> 32) + (mid >> 32);
+#endif
+		}
+
+		inline std::uint64_t mix(std::uint64_t a, std::uint64_t b) noexcept
+		{
+			multiply128(a, b);
+			return a ^ b;
+		}
+
+		// Little-endian loads are not required, the hash is never persisted.
+		inline std::uint64_t read64(const unsigned char * const p) noexcept
+		{
+			std::uint64_t result;
+			std::memcpy(&result, p, sizeof(result));
+			return result;
+		}
+
+		inline std::uint64_t read32(const unsigned char * const p) noexcept
+		{
+			std::uint32_t result;
+			std::memcpy(&result, p, sizeof(result));
+			return result;
+		}
+	}
+
+	/*
+	 * A fast 64-bit hash of a byte string, derived from wyhash (public domain). All bytes of the string
+	 * affect all bits of the result, so that the paths that share a long prefix or suffix do not collide.
+	 * The result is not stable between platforms and must not be stored.
+	 */
+	inline std::uint64_t hashBytes(const char * const data, const std::size_t n) noexcept
+	{
+		using namespace _helper;
+
+		constexpr std::uint64_t secret0 = 0x2d358dccaa6c78a5, secret1 = 0x8bb84b93962eacc9,
+				secret2 = 0x4b33a62ed433d4a3, secret3 = 0x4d5a2da51de1aa47;
+
+		const unsigned char *p = reinterpret_cast<const unsigned char *>(data);
+		std::uint64_t seed = mix(secret0, secret1);
+		std::uint64_t a, b;
+
+		if (n <= 16) {
+			if (n >= 4) {
+				const std::size_t shift = (n >> 3) << 2;
+				a = (read32(p) << 32) | read32(p + shift);
+				b = (read32(p + n - 4) << 32) | read32(p + n - 4 - shift);
+			} else if (n > 0) {
+				a = (std::uint64_t(p[0]) << 16) | (std::uint64_t(p[n >> 1]) << 8) | p[n - 1];
+				b = 0;
+			} else {
+				a = b = 0;
+			}
+		} else {
+			std::size_t i = n;
+			if (i >= 48) {
+				std::uint64_t seed1 = seed, seed2 = seed;
+				do {
+					seed = mix(read64(p) ^ secret1, read64(p + 8) ^ seed);
+					seed1 = mix(read64(p + 16) ^ secret2, read64(p + 24) ^ seed1);
+					seed2 = mix(read64(p + 32) ^ secret3, read64(p + 40) ^ seed2);
+					p += 48;
+					i -= 48;
+				} while (i >= 48);
+				seed ^= seed1 ^ seed2;
+			}
+			while (i > 16) {
+				seed = mix(read64(p) ^ secret1, read64(p + 8) ^ seed);
+				p += 16;
+				i -= 16;
+			}
+			a = read64(p + i - 16);
+			b = read64(p + i - 8);
+		}
+
+		a ^= secret1;
+		b ^= seed;
+		multiply128(a, b);
+		return mix(a ^ secret0 ^ n, b ^ secret1);
+	}
+}
+
+#endif // MIRROR_HASH_HPP_
@@ -0,0 +1,345 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdlib>
+#include <fcntl.h>
+#include "io.hpp"
+#include <new>
+#include "stats.hpp"
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include "throttle.hpp"
+#include <unistd.h>
+#include "uring.hpp"
+
+#ifdef __linux__
+	#include <linux/fs.h> // FICLONE
+#endif
+
+constexpr std::size_t mirror::ReadOptions::minBufferSize;
+constexpr std::size_t mirror::ReadOptions::maxBufferSize;
+constexpr std::size_t mirror::ReadOptions::defaultBufferSize;
+constexpr off_t mirror::ReadOptions::defaultMmapThreshold;
+constexpr unsigned mirror::ReadOptions::defaultQueueDepth;
+constexpr unsigned mirror::ReadOptions::maxQueueDepth;
+constexpr unsigned mirror::ReadOptions::maxHashThreads;
+constexpr off_t mirror::ReadOptions::parallelHashThreshold;
+constexpr std::size_t mirror::ReadOptions::hashSegmentSize;
+constexpr std::size_t mirror::ReadOptions::smallFileSize;
+
+namespace
+{
+	constexpr std::size_t bufferAlignment = 4096;
+
+	struct ThreadBuffer
+	{
+		ThreadBuffer() noexcept : data(nullptr), size(0) {}
+		~ThreadBuffer() { std::free(data); }
+
+		void *data;
+		std::size_t size;
+	};
+
+	thread_local ThreadBuffer threadBuffer;
+
+	// copy_file_range() and sendfile() are asked to copy at most this number of bytes per call.
+	constexpr std::size_t maxKernelCopyChunk = 1024 * 1024 * 1024;
+
+	// Tells if the error means that the files cannot be copied this way, though they can be copied otherwise.
+	inline bool isCopyUnsupported(const int errorCode) noexcept
+	{
+		return errorCode == ENOSYS || errorCode == EXDEV || errorCode == EINVAL || errorCode == EOPNOTSUPP;
+	}
+
+	/*
+	 * Copies up to size bytes with copy_file_range(), which advances both file offsets, in calls of at most
+	 * maxChunk bytes. Returns the number of bytes copied (0 if copy_file_range() is not supported for these
+	 * files) or -1 if an I/O error has occurred.
+	 */
+	off_t copyWithCopyFileRange(const int srcFd, const int destFd, const off_t size, const std::size_t maxChunk) noexcept
+	{
+#ifdef __NR_copy_file_range
+		off_t copied = 0;
+		while (copied < size) {
+			const std::size_t n = static_cast<std::size_t>(std::min<off_t>(size - copied, maxChunk));
+			mirror::countStat(mirror::StatCounter::copyCalls);
+			const ssize_t result = syscall(__NR_copy_file_range, srcFd, nullptr, destFd, nullptr, n, 0u);
+			if (result == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				// The offsets are not changed by a call that fails, so the rest can be copied otherwise.
+				return isCopyUnsupported(errno) ? copied : -1;
+			}
+			if (result == 0) {
+				// End of file (the file has been truncated, or the file system reports the data as missing).
+				break;
+			}
+			mirror::throttleRead(static_cast<std::uint_fast64_t>(result));
+			mirror::throttleWrite(static_cast<std::uint_fast64_t>(result));
+			copied += result;
+		}
+		return copied;
+#else
+		return 0;
+#endif
+	}
+
+	// The same as copyWithCopyFileRange() but sendfile() is used.
+	off_t copyWithSendfile(const int srcFd, const int destFd, const off_t size, const std::size_t maxChunk) noexcept
+	{
+		off_t copied = 0;
+		while (copied < size) {
+			const std::size_t n = static_cast<std::size_t>(std::min<off_t>(size - copied, maxChunk));
+			mirror::countStat(mirror::StatCounter::copyCalls);
+			const ssize_t result = sendfile(destFd, srcFd, nullptr, n);
+			if (result == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				return isCopyUnsupported(errno) ? copied : -1;
+			}
+			if (result == 0) {
+				break;
+			}
+			mirror::throttleRead(static_cast<std::uint_fast64_t>(result));
+			mirror::throttleWrite(static_cast<std::uint_fast64_t>(result));
+			copied += result;
+		}
+		return copied;
+	}
+
+	// Copies the rest of the file starting from the current file offsets.
+	bool copyWithReadWrite(const int srcFd, const int destFd, const std::size_t bufSize)
+	{
+		unsigned char * const buf = mirror::_helper::threadReadBuffer(bufSize);
+		for (;;) {
+			mirror::countStat(mirror::StatCounter::readCalls);
+			const ssize_t n = read(srcFd, buf, bufSize);
+			if (n == 0) {
+				return true;
+			} else if (n == -1) {
+				if (errno == EINTR) {
+					continue;
+				}
+				// TODO handle error.
+				return false;
+			}
+			mirror::throttleRead(static_cast<std::uint_fast64_t>(n));
+			if (!mirror::_helper::writeFully(destFd, buf, static_cast<std::size_t>(n))) {
+				// TODO handle error
+				return false;
+			}
+		}
+	}
+}
+
+const char *mirror::copyStrategyName(const CopyStrategy strategy) noexcept
+{
+	switch (strategy) {
+	case CopyStrategy::clone:
+		return "reflink";
+	case CopyStrategy::copyFileRange:
+		return "copy_file_range";
+	case CopyStrategy::sendfile:
+		return "sendfile";
+	case CopyStrategy::uring:
+		return "io_uring";
+	case CopyStrategy::readWrite:
+		return "read/write";
+	default:
+		assert(false);
+		return "";
+	}
+}
+
+unsigned char *mirror::_helper::threadReadBuffer(const std::size_t size)
+{
+	assert(size > 0);
+
+	if (threadBuffer.size < size) {
+		void *buf;
+		if (posix_memalign(&buf, bufferAlignment, size) != 0) {
+			throw std::bad_alloc();
+		}
+		std::free(threadBuffer.data);
+		threadBuffer.data = buf;
+		threadBuffer.size = size;
+	}
+	return static_cast<unsigned char *>(threadBuffer.data);
+}
+
+void mirror::_helper::abandonThreadReadBuffer() noexcept
+{
+	// The buffer is leaked on purpose.
+	threadBuffer.data = nullptr;
+	threadBuffer.size = 0;
+}
+
+const unsigned char *mirror::_helper::mapFile(const int fd, const std::size_t size) noexcept
+{
+	assert(size > 0);
+
+	countStat(StatCounter::mmapCalls);
+	void * const addr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED) {
+		return nullptr;
+	}
+	// The advice is only a hint so its result is ignored.
+	madvise(addr, size, MADV_SEQUENTIAL);
+
+	return static_cast<const unsigned char *>(addr);
+}
+
+void mirror::_helper::dropFileCache(const int fd) noexcept
+{
+	// The advice is only a hint so its result is ignored.
+	posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+}
+
+void mirror::_helper::unmapFile(const unsigned char * const addr, const std::size_t size) noexcept
+{
+	// TODO log error.
+	munmap(const_cast<unsigned char *>(addr), size);
+}
+
+bool mirror::_helper::writeFully(const int fd, const unsigned char * const data, const std::size_t n) noexcept
+{
+	for (std::size_t written = 0; written < n;) {
+		countStat(StatCounter::writeCalls);
+		const ssize_t m = write(fd, data + written, n - written);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		throttleWrite(static_cast<std::uint_fast64_t>(m));
+		written += static_cast<std::size_t>(m);
+	}
+	return true;
+}
+
+ssize_t mirror::_helper::readFullyAt(const int fd, unsigned char * const dest, const std::size_t n,
+		const off_t offset) noexcept
+{
+	std::size_t done = 0;
+	while (done < n) {
+		countStat(StatCounter::readCalls);
+		const ssize_t m = pread(fd, dest + done, n - done, offset + static_cast<off_t>(done));
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		if (m == 0) {
+			break;
+		}
+		throttleRead(static_cast<std::uint_fast64_t>(m));
+		done += static_cast<std::size_t>(m);
+	}
+	return static_cast<ssize_t>(done);
+}
+
+bool mirror::_helper::writeFullyAt(const int fd, const unsigned char * const data, const std::size_t n,
+		const off_t offset) noexcept
+{
+	for (std::size_t written = 0; written < n;) {
+		countStat(StatCounter::writeCalls);
+		const ssize_t m = pwrite(fd, data + written, n - written, offset + static_cast<off_t>(written));
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		throttleWrite(static_cast<std::uint_fast64_t>(m));
+		written += static_cast<std::size_t>(m);
+	}
+	return true;
+}
+
+bool mirror::_helper::copyFileData(const int srcFd, const int destFd, const off_t srcSize,
+		const ReadOptions &options, CopyStrategy &strategy)
+{
+#ifdef FICLONE
+	// The whole file is cloned at once, so there is nothing left to copy even if the file is being appended to.
+	if (srcSize > 0) {
+		countStat(StatCounter::copyCalls);
+		if (ioctl(destFd, FICLONE, srcFd) == 0) {
+			strategy = CopyStrategy::clone;
+			return true;
+		}
+	}
+#endif
+
+	CopyStrategy used = CopyStrategy::readWrite;
+	off_t copied = 0;
+
+#ifdef MIRROR_IO_URING
+	if (options.backend == IOBackend::uring && srcSize > 0) {
+		URing * const ring = threadURing(options.queueDepth);
+		if (ring != nullptr) {
+			copied = ring->copyFile(srcFd, destFd, srcSize, options.bufferSize);
+			if (copied == -1) {
+				// TODO handle error.
+				return false;
+			}
+			// Positional I/O does not move the file offsets.
+			if (lseek(srcFd, copied, SEEK_SET) == -1 || lseek(destFd, copied, SEEK_SET) == -1) {
+				// TODO handle error.
+				return false;
+			}
+			used = CopyStrategy::uring;
+		}
+	}
+#endif
+
+	if (used == CopyStrategy::readWrite && srcSize > 0) {
+		// The in-kernel copies are made in smaller calls if the I/O is throttled, so that it is not bursty.
+		const std::size_t maxChunk = ioThrottled() ? options.bufferSize : maxKernelCopyChunk;
+		off_t n = copyWithCopyFileRange(srcFd, destFd, srcSize, maxChunk);
+		if (n == -1) {
+			// TODO handle error.
+			return false;
+		}
+		if (n > 0) {
+			used = CopyStrategy::copyFileRange;
+			copied = n;
+		}
+		if (copied < srcSize) {
+			n = copyWithSendfile(srcFd, destFd, srcSize - copied, maxChunk);
+			if (n == -1) {
+				// TODO handle error.
+				return false;
+			}
+			if (n > 0 && used == CopyStrategy::readWrite) {
+				used = CopyStrategy::sendfile;
+			}
+		}
+	}
+
+	if (!copyWithReadWrite(srcFd, destFd, options.bufferSize)) {
+		return false;
+	}
+	strategy = used;
+	return true;
+}
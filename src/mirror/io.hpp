@@ -0,0 +1,159 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_IO_HPP_
+#define MIRROR_IO_HPP_
+
+#include <cstddef>
+#include "digest.hpp"
+#include <sys/types.h>
+
+#if !defined(MIRROR_NO_IO_URING) && defined(__linux__) && defined(__has_include)
+	#if __has_include(<linux/io_uring.h>)
+		#define MIRROR_IO_URING
+	#endif
+#endif
+
+namespace mirror
+{
+	enum class IOBackend
+	{
+		// Blocking read()/write() or mmap().
+		sync,
+		// io_uring (if supported by the kernel, otherwise the blocking I/O is used).
+		uring
+	};
+
+	// The ways a regular file can be copied, from the cheapest one.
+	enum class CopyStrategy
+	{
+		// A reflink made with ioctl(FICLONE), so that the copy shares the data extents (btrfs, XFS).
+		clone,
+		// copy_file_range(), an in-kernel copy (a server-side copy on NFS 4.2).
+		copyFileRange,
+		// sendfile(), an in-kernel copy through the page cache.
+		sendfile,
+		// io_uring reads and writes (if it is the I/O backend selected).
+		uring,
+		// read() and write() through a large user-space buffer.
+		readWrite
+	};
+
+	const char *copyStrategyName(CopyStrategy strategy) noexcept;
+
+	struct ReadOptions
+	{
+		ReadOptions() noexcept : bufferSize(defaultBufferSize), mmapThreshold(defaultMmapThreshold),
+				sequentialAdvice(true), backend(IOBackend::sync), queueDepth(defaultQueueDepth),
+				digest(DigestAlgorithm::crc64), hashThreads(1), dropCache(false) {}
+
+		static constexpr std::size_t minBufferSize = 4096;
+		static constexpr std::size_t maxBufferSize = 64 * 1024 * 1024;
+		static constexpr std::size_t defaultBufferSize = 1024 * 1024;
+		static constexpr off_t defaultMmapThreshold = 0;
+		static constexpr unsigned defaultQueueDepth = 8;
+		static constexpr unsigned maxQueueDepth = 256;
+		static constexpr unsigned maxHashThreads = 64;
+		// Files smaller than this are hashed by a single thread whatever hashThreads is.
+		static constexpr off_t parallelHashThreshold = 64 * 1024 * 1024;
+		// The part of a file hashed by a thread at a time. Is a power of two BLAKE3 chunks.
+		static constexpr std::size_t hashSegmentSize = 8 * 1024 * 1024;
+
+		/*
+		 * Files that fit into a buffer of this size are read into the stack with plain read().
+		 * No readahead advice is given for them since it is not worth an extra syscall.
+		 */
+		static constexpr std::size_t smallFileSize = 16 * 1024;
+
+		// The size of the page-aligned per-thread buffer files are read into. Must be a multiple of 4096.
+		std::size_t bufferSize;
+		/*
+		 * Files of this size or larger are mapped into memory (with MADV_SEQUENTIAL). Mapping is disabled
+		 * if it is 0, which is the default: a mapped file that is truncated by another process while it is
+		 * read causes SIGBUS, which kills the process, whereas read() just returns less data.
+		 */
+		off_t mmapThreshold;
+		// Tells the kernel with posix_fadvise(POSIX_FADV_SEQUENTIAL) that a file is to be read sequentially.
+		bool sequentialAdvice;
+		/*
+		 * With io_uring, files are read (and copied) in queueDepth requests of bufferSize bytes kept
+		 * in flight, so each thread uses a buffer of queueDepth * bufferSize bytes. Files are never
+		 * mapped into memory.
+		 */
+		IOBackend backend;
+		unsigned queueDepth;
+		DigestAlgorithm digest;
+		/*
+		 * The number of threads a single large file is hashed with. Only BLAKE3 digests can be calculated
+		 * in parts: each thread reads the segments of the file with pread() and hashes them as subtrees.
+		 */
+		unsigned hashThreads;
+		/*
+		 * Tells the kernel with posix_fadvise(POSIX_FADV_DONTNEED) that the files hashed or copied are not
+		 * needed in the page cache anymore, so that a scan does not evict the pages of other processes.
+		 * The dirty pages of the copies are kept until they are written back.
+		 */
+		bool dropCache;
+	};
+
+	namespace _helper
+	{
+		/*
+		 * Returns a page-aligned buffer of at least the given size that is owned by the calling thread.
+		 * The buffer is reused by subsequent calls made by the same thread.
+		 */
+		unsigned char *threadReadBuffer(std::size_t size);
+		/*
+		 * Gives up the buffer owned by the calling thread without freeing it, so that it is never reused.
+		 * Is used when the kernel may still write to the buffer. The next call allocates a new one.
+		 */
+		void abandonThreadReadBuffer() noexcept;
+
+		/*
+		 * Maps the file read-only into memory and advises the kernel to read it sequentially.
+		 * Returns nullptr if the file cannot be mapped. The mapping must be released with unmapFile().
+		 */
+		const unsigned char *mapFile(int fd, std::size_t size) noexcept;
+		void unmapFile(const unsigned char *addr, std::size_t size) noexcept;
+
+		// Drops the clean cached pages of the file, see ReadOptions::dropCache.
+		void dropFileCache(int fd) noexcept;
+
+		// Writes all n bytes, resuming partial writes. Returns false if an I/O error has occurred.
+		bool writeFully(int fd, const unsigned char *data, std::size_t n) noexcept;
+
+		/*
+		 * Reads up to n bytes at the offset, resuming partial reads. Returns the number of bytes read,
+		 * which is less than n only at the end of the file, or -1 if an I/O error has occurred.
+		 */
+		ssize_t readFullyAt(int fd, unsigned char *dest, std::size_t n, off_t offset) noexcept;
+
+		// Writes all n bytes at the offset. Returns false if an I/O error has occurred.
+		bool writeFullyAt(int fd, const unsigned char *data, std::size_t n, off_t offset) noexcept;
+
+		/*
+		 * Copies the content of srcFd, which is srcSize bytes as stat'ed, to the empty file destFd.
+		 * Both file offsets must be 0. A reflink is tried first, then copy_file_range() and sendfile()
+		 * (io_uring instead of them if it is selected), and whatever is left (e.g. if the file has grown
+		 * or if no in-kernel copy is supported) is copied with read() and write().
+		 *
+		 * Returns false if an I/O error has occurred. Otherwise strategy is set to the one that has made
+		 * the copy (or its first part).
+		 */
+		bool copyFileData(int srcFd, int destFd, off_t srcSize, const ReadOptions &options, CopyStrategy &strategy);
+	}
+}
+
+#endif // MIRROR_IO_HPP_
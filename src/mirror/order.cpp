@@ -0,0 +1,50 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "order.hpp"
+#include <fcntl.h>
+#include <linux/fiemap.h>
+#include <linux/fs.h>
+#include "stats.hpp"
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+bool mirror::_helper::physicalOffset(const int dirFd, const char * const name, std::uint_fast64_t &dest) noexcept
+{
+	countStat(StatCounter::openCalls);
+	const int fd = openat(dirFd, name, O_RDONLY);
+	if (fd == -1) {
+		return false;
+	}
+
+	// A single extent is requested, the first one.
+	union
+	{
+		struct fiemap map;
+		unsigned char buf[sizeof(struct fiemap) + sizeof(struct fiemap_extent)];
+	} request = {};
+	request.map.fm_start = 0;
+	request.map.fm_length = FIEMAP_MAX_OFFSET;
+	request.map.fm_extent_count = 1;
+
+	countStat(StatCounter::fiemapCalls);
+	const bool success = ioctl(fd, FS_IOC_FIEMAP, &request.map) == 0;
+	close(fd);
+	if (!success) {
+		return false;
+	}
+	dest = request.map.fm_mapped_extents == 0 ? 0 : request.map.fm_extents[0].fe_physical;
+	return true;
+}
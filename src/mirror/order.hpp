@@ -0,0 +1,47 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_ORDER_HPP_
+#define MIRROR_ORDER_HPP_
+
+#include <cstdint>
+
+namespace mirror
+{
+	// The order the regular files of a directory are passed to the event handlers (and so are read) in.
+	enum class FileOrder
+	{
+		// The order of the directory entries returned by getdents64().
+		directory,
+		// By the inode number, which approximates the placement of the files on disk.
+		inode,
+		/*
+		 * By the physical offset of the first extent of the file as reported by FIEMAP. The inode order
+		 * is used for the directories the file system does not report the extents of.
+		 */
+		physical
+	};
+
+	namespace _helper
+	{
+		/*
+		 * Gets the physical offset of the first extent of the file relative to the directory. The offset of
+		 * a file without extents (e.g. an empty one) is 0. Returns false if the offset cannot be got.
+		 */
+		bool physicalOffset(int dirFd, const char *name, std::uint_fast64_t &dest) noexcept;
+	}
+}
+
+#endif // MIRROR_ORDER_HPP_
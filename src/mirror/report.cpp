@@ -0,0 +1,199 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <cerrno>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include "encoding.hpp"
+#include <fcntl.h>
+#include "report.hpp"
+#include <unistd.h>
+
+namespace
+{
+	// The records are written when the buffer reaches this size.
+	constexpr std::size_t bufferSize = 1024 * 1024;
+
+	// Appends the text as the body of a JSON string.
+	void appendEscaped(const char * const text, const std::size_t size, std::string &dest)
+	{
+		static const char digits[] = "0123456789abcdef";
+
+		const char *chunk = text;
+		const char * const end = text + size;
+		for (const char *p = text; p != end; ++p) {
+			const unsigned char c = static_cast<unsigned char>(*p);
+			if (c >= 0x20 && c != '"' && c != '\\') {
+				continue;
+			}
+			dest.append(chunk, p);
+			switch (c) {
+			case '"':
+				dest.append("\\\"", 2);
+				break;
+			case '\\':
+				dest.append("\\\\", 2);
+				break;
+			case '\n':
+				dest.append("\\n", 2);
+				break;
+			case '\t':
+				dest.append("\\t", 2);
+				break;
+			default:
+				const char escape[] = {'\\', 'u', '0', '0', digits[c >> 4], digits[c & 0xf]};
+				dest.append(escape, sizeof(escape));
+			}
+			chunk = p + 1;
+		}
+		dest.append(chunk, end);
+	}
+}
+
+mirror::ReportWriter::ReportWriter(const char * const path, const DigestAlgorithm digest)
+		: m_fd(-1), m_digest(digest), m_buf(), m_pathBuf()
+{
+	if (std::strcmp(path, "-") == 0) {
+		m_fd = STDOUT_FILENO;
+	} else {
+		m_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (m_fd == -1) {
+			// TODO handle error.
+			throw errno;
+		}
+	}
+	m_buf.reserve(bufferSize + 4096);
+
+	m_buf.append("{\"kind\":\"start\",\"digest\":\"");
+	m_buf.append(digestName(digest));
+	m_buf.append("\"}\n");
+}
+
+mirror::ReportWriter::~ReportWriter()
+{
+	if (m_fd != -1 && m_fd != STDOUT_FILENO) {
+		::close(m_fd);
+	}
+}
+
+void mirror::ReportWriter::fileNotFound(const FileType type, const char * const path, const std::size_t pathSize,
+		const FileRecord &expected)
+{
+	startRecord("not_found", path, pathSize);
+	if (type == FileType::file) {
+		appendFileRecord("expected", expected);
+	} else {
+		appendType("expected", type);
+	}
+	endRecord();
+}
+
+void mirror::ReportWriter::newFileFound(const FileType type, const char * const path, const std::size_t pathSize)
+{
+	startRecord("new", path, pathSize);
+	appendType("actual", type);
+	endRecord();
+}
+
+void mirror::ReportWriter::fileMismatch(const char * const path, const std::size_t pathSize,
+		const FileRecord &expected, const FileRecord &actual)
+{
+	startRecord("mismatch", path, pathSize);
+	appendFileRecord("expected", expected);
+	appendFileRecord("actual", actual);
+	endRecord();
+}
+
+void mirror::ReportWriter::close()
+{
+	flush();
+
+	const int fd = m_fd;
+	m_fd = -1;
+	if (fd != STDOUT_FILENO && ::close(fd) != 0) {
+		// TODO handle error.
+		throw errno;
+	}
+}
+
+void mirror::ReportWriter::startRecord(const char * const kind, const char * const path, const std::size_t pathSize)
+{
+	m_buf.append("{\"kind\":\"");
+	m_buf.append(kind);
+	m_buf.append("\",\"path\":\"");
+	m_pathBuf.clear();
+	appendUtf8(path, pathSize, m_pathBuf);
+	appendEscaped(m_pathBuf.data(), m_pathBuf.size(), m_buf);
+	m_buf.push_back('"');
+}
+
+void mirror::ReportWriter::appendFileRecord(const char * const name, const FileRecord &record)
+{
+	if (record.type != FileType::file) {
+		appendType(name, record.type);
+		return;
+	}
+
+	static const char digits[] = "0123456789abcdef";
+
+	char buf[128];
+	const int n = std::snprintf(buf, sizeof(buf), ",\"%s\":{\"type\":\"file\",\"size\":%" PRIdMAX
+			",\"mtime_ms\":%" PRIdMAX, name, static_cast<std::intmax_t>(record.fileSize),
+			static_cast<std::intmax_t>(record.lastModifiedTS.millis()));
+	m_buf.append(buf, static_cast<std::size_t>(n));
+
+	m_buf.append(",\"digest\":\"");
+	const std::size_t size = digestSize(m_digest);
+	for (std::size_t i = 0; i < size; ++i) {
+		m_buf.push_back(digits[record.digest[i] >> 4]);
+		m_buf.push_back(digits[record.digest[i] & 0xf]);
+	}
+	m_buf.append("\"}");
+}
+
+void mirror::ReportWriter::appendType(const char * const name, const FileType type)
+{
+	m_buf.append(",\"");
+	m_buf.append(name);
+	m_buf.append(type == FileType::file ? "\":{\"type\":\"file\"}" : "\":{\"type\":\"dir\"}");
+}
+
+void mirror::ReportWriter::endRecord()
+{
+	m_buf.append("}\n");
+	if (m_buf.size() >= bufferSize) {
+		flush();
+	}
+}
+
+void mirror::ReportWriter::flush()
+{
+	const char *data = m_buf.data();
+	std::size_t n = m_buf.size();
+	while (n > 0) {
+		const ssize_t m = write(m_fd, data, n);
+		if (m == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			// TODO handle error.
+			throw errno;
+		}
+		data += m;
+		n -= static_cast<std::size_t>(m);
+	}
+	m_buf.clear();
+}
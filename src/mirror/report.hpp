@@ -0,0 +1,73 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_REPORT_HPP_
+#define MIRROR_REPORT_HPP_
+
+#include <cstddef>
+#include "digest.hpp"
+#include "FileDB.hpp"
+#include <string>
+
+namespace mirror
+{
+	/*
+	 * Writes the mismatches found by verify-dir and merge-dir to a file, one JSON object per line, e.g.:
+	 * {"kind":"start","digest":"crc64"}
+	 * {"kind":"not_found","path":"a/b","expected":{"type":"file","size":12,"mtime_ms":1500000000000,"digest":"..."}}
+	 * {"kind":"new","path":"a/c","actual":{"type":"dir"}}
+	 * {"kind":"mismatch","path":"a/d","expected":{...},"actual":{...}}
+	 *
+	 * The paths are relative to the directory scanned and are converted to UTF-8. The records are collected
+	 * in a large buffer which is written when it is full, so that the scan is not slowed down by the output.
+	 * Must be used by one thread only.
+	 */
+	class ReportWriter
+	{
+	public:
+		// The path "-" stands for standard output. Throws errno if the file cannot be created.
+		ReportWriter(const char *path, DigestAlgorithm digest);
+
+		ReportWriter(const ReportWriter &) = delete;
+		ReportWriter(ReportWriter &&) = delete;
+		ReportWriter &operator=(const ReportWriter &) = delete;
+		ReportWriter &operator=(ReportWriter &&) = delete;
+
+		// Closes the file if close() has not been called. The records that are not written yet are lost.
+		~ReportWriter();
+
+		void fileNotFound(FileType type, const char *path, std::size_t pathSize, const FileRecord &expected);
+		void newFileFound(FileType type, const char *path, std::size_t pathSize);
+		void fileMismatch(const char *path, std::size_t pathSize, const FileRecord &expected,
+				const FileRecord &actual);
+
+		// Writes the records buffered and closes the file. Throws errno if an I/O error has occurred.
+		void close();
+	private:
+		void startRecord(const char *kind, const char *path, std::size_t pathSize);
+		void appendFileRecord(const char *name, const FileRecord &record);
+		void appendType(const char *name, FileType type);
+		void endRecord();
+		void flush();
+
+		int m_fd;
+		const DigestAlgorithm m_digest;
+		std::string m_buf;
+		// The paths converted are written here, so that no memory is allocated per record.
+		std::string m_pathBuf;
+	};
+}
+
+#endif // MIRROR_REPORT_HPP_
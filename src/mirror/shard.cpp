@@ -0,0 +1,42 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <cstdint>
+#include "shard.hpp"
+
+constexpr unsigned mirror::ShardOptions::maxCount;
+constexpr unsigned mirror::ShardOptions::maxDepth;
+
+mirror::ShardMatch mirror::ShardOptions::match(const char * const relPath, const std::size_t relPathSize) const noexcept
+{
+	if (!enabled()) {
+		return ShardMatch::owned;
+	}
+
+	// FNV-1a of the first depth components, so that the shards are stable between runs and platforms.
+	std::uint_fast64_t hash = 0xcbf29ce484222325;
+	unsigned components = 1;
+	for (std::size_t i = 0; i < relPathSize; ++i) {
+		if (relPath[i] == '/' && ++components > depth) {
+			break;
+		}
+		hash = ((hash ^ static_cast<unsigned char>(relPath[i])) * 0x100000001b3) & 0xffffffffffffffff;
+	}
+
+	if (components < depth) {
+		return index == 0 ? ShardMatch::owned : ShardMatch::ancestor;
+	}
+	return hash % count == index ? ShardMatch::owned : ShardMatch::foreign;
+}
@@ -0,0 +1,62 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_SHARD_HPP_
+#define MIRROR_SHARD_HPP_
+
+#include <cstddef>
+
+namespace mirror
+{
+	enum class ShardMatch
+	{
+		// The entry belongs to the shard, and so does its subtree unless the entry is above the shard depth.
+		owned,
+		/*
+		 * The entry is above the shard depth and belongs to the first shard. If it is a directory then
+		 * the other shards enter it (without recording it) to reach their subtrees.
+		 */
+		ancestor,
+		// The entry (and all its subtree) belongs to another shard.
+		foreign
+	};
+
+	/*
+	 * Splits a tree into count deterministic shards. The directories (and files) at the given depth,
+	 * i.e. with this number of components in their relative paths, are assigned to the shards by the hash
+	 * of their relative paths, and their subtrees come along. The entries above the depth belong
+	 * to the first shard. The paths are hashed as they are in the file system (not converted to UTF-8),
+	 * so all shards of a run must see the tree with the same names.
+	 */
+	struct ShardOptions
+	{
+		ShardOptions() noexcept : index(0), count(1), depth(1) {}
+
+		static constexpr unsigned maxCount = 65536;
+		static constexpr unsigned maxDepth = 64;
+
+		bool enabled() const noexcept { return count > 1; }
+
+		// The relative path must not have a trailing slash.
+		ShardMatch match(const char *relPath, std::size_t relPathSize) const noexcept;
+
+		// Starts with 0.
+		unsigned index;
+		unsigned count;
+		unsigned depth;
+	};
+}
+
+#endif // MIRROR_SHARD_HPP_
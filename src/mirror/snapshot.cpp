@@ -0,0 +1,629 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <afc/logger.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <memory>
+#include <numeric>
+#include "snapshot.hpp"
+#include "stats.hpp"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utility>
+
+namespace
+{
+	using mirror::_helper::SnapshotDir;
+	using mirror::_helper::SnapshotFile;
+	using mirror::_helper::SnapshotHeader;
+
+	const char snapshotMagic[8] = {'M', 'I', 'R', 'S', 'N', 'A', 'P', '\0'};
+	constexpr std::uint32_t snapshotVersion = 1;
+	// Is read back as another value on a machine with another byte order.
+	constexpr std::uint32_t byteOrderMark = 0x01020304;
+	constexpr std::size_t sectionAlignment = 8;
+	constexpr std::size_t writeBufferSize = 1024 * 1024;
+
+	// Compares byte strings as memcmp() does, a string is less than the strings it is a prefix of.
+	inline int compareBytes(const char * const s1, const std::size_t s1Size, const char * const s2,
+			const std::size_t s2Size) noexcept
+	{
+		const int result = std::memcmp(s1, s2, std::min(s1Size, s2Size));
+		if (result != 0) {
+			return result;
+		}
+		return s1Size < s2Size ? -1 : (s1Size == s2Size ? 0 : 1);
+	}
+
+	// The key of a directory with the names each preceded by '\0' is converted to the path a/b/c.
+	std::string keyToPath(const std::string &key)
+	{
+		if (key.empty()) {
+			return std::string();
+		}
+		std::string path(key, 1);
+		std::replace(path.begin(), path.end(), '\0', '/');
+		return path;
+	}
+
+	struct FileCloser
+	{
+		void operator()(std::FILE * const file) const noexcept { std::fclose(file); }
+	};
+
+	using FileHolder = std::unique_ptr<std::FILE, FileCloser>;
+
+	// A stream written sequentially through a large buffer which throws errno if an I/O error has occurred.
+	class Output
+	{
+	public:
+		explicit Output(std::FILE * const file) : m_file(file), m_position(0)
+		{
+			if (std::setvbuf(m_file.get(), nullptr, _IOFBF, writeBufferSize) != 0) {
+				// TODO handle error.
+				throw errno;
+			}
+		}
+
+		void write(const void * const data, const std::size_t n)
+		{
+			if (n > 0 && std::fwrite(data, 1, n, m_file.get()) != n) {
+				// TODO handle error.
+				throw errno;
+			}
+			m_position += n;
+		}
+
+		template<typename T>
+		void write(const T &val) { write(&val, sizeof(T)); }
+
+		// Pads the stream with zeros up to the alignment of the sections.
+		void align()
+		{
+			static const char zeros[sectionAlignment] = {};
+			write(zeros, (sectionAlignment - m_position % sectionAlignment) % sectionAlignment);
+		}
+
+		std::uint64_t position() const noexcept { return m_position; }
+
+		// Writes the data at the offset given, the stream continues from its end afterwards.
+		void writeAt(const void * const data, const std::size_t n, const std::uint64_t offset)
+		{
+			if (std::fseek(m_file.get(), static_cast<long>(offset), SEEK_SET) != 0 ||
+					std::fwrite(data, 1, n, m_file.get()) != n || std::fseek(m_file.get(), 0, SEEK_END) != 0) {
+				// TODO handle error.
+				throw errno;
+			}
+		}
+
+		void close()
+		{
+			std::FILE * const file = m_file.release();
+			if (std::fclose(file) != 0) {
+				// TODO handle error.
+				throw errno;
+			}
+		}
+	private:
+		FileHolder m_file;
+		std::uint64_t m_position;
+	};
+
+	struct ExportedDir
+	{
+		std::string key;
+		std::uint64_t firstFile;
+		std::uint64_t fileCount;
+	};
+}
+
+void mirror::exportSnapshot(FileDB &db, const char * const path)
+{
+	using afc::operator"" _s;
+	using afc::logger::logDebug;
+
+	std::FILE * const file = std::fopen(path, "wb");
+	if (file == nullptr) {
+		// TODO handle error.
+		throw errno;
+	}
+	Output out(file);
+
+	// The names of the files are collected here while the files are written, they start the strings section.
+	const FileHolder names(std::tmpfile());
+	if (names == nullptr) {
+		// TODO handle error.
+		throw errno;
+	}
+
+	SnapshotHeader header;
+	std::memset(&header, 0, sizeof(header));
+	out.write(header);
+	out.align();
+	header.filesOffset = out.position();
+
+	std::vector<ExportedDir> dirs;
+	// The directories found as files, so that the empty ones are added too.
+	std::vector<std::string> subdirKeys;
+	std::uint64_t fileCount = 0;
+	std::uint64_t namesSize = 0;
+
+	FileDB::SortedFile row;
+	while (db.nextSortedFile(row)) {
+		if (dirs.empty() || dirs.back().key.compare(0, std::string::npos, row.dirKey, row.dirKeySize) != 0) {
+			dirs.push_back(ExportedDir{std::string(row.dirKey, row.dirKeySize), fileCount, 0});
+		}
+		++dirs.back().fileCount;
+
+		SnapshotFile entry;
+		std::memset(&entry, 0, sizeof(entry));
+		entry.nameOffset = namesSize;
+		entry.nameSize = static_cast<std::uint32_t>(row.fileNameSize);
+		entry.type = static_cast<std::uint32_t>(row.record.type);
+		if (row.record.type == FileType::file) {
+			entry.size = row.record.fileSize;
+			entry.lastModifiedMillis = row.record.lastModifiedTS.millis();
+			std::copy_n(row.record.digest, maxDigestSize, entry.digest);
+		} else {
+			std::string key(row.dirKey, row.dirKeySize);
+			key.push_back('\0');
+			key.append(row.fileNameU8, row.fileNameSize);
+			subdirKeys.emplace_back(std::move(key));
+		}
+		out.write(entry);
+
+		if (std::fwrite(row.fileNameU8, 1, row.fileNameSize, names.get()) != row.fileNameSize) {
+			// TODO handle error.
+			throw errno;
+		}
+		namesSize += row.fileNameSize;
+		++fileCount;
+	}
+
+	// The files are sorted by the directory key, so are the directories that have files.
+	subdirKeys.emplace_back();
+	const std::size_t dirsWithFiles = dirs.size();
+	for (std::string &key : subdirKeys) {
+		const auto pos = std::lower_bound(dirs.begin(), dirs.begin() + dirsWithFiles, key,
+				[] (const ExportedDir &dir, const std::string &key) { return dir.key < key; });
+		if (pos == dirs.begin() + dirsWithFiles || pos->key != key) {
+			dirs.push_back(ExportedDir{std::move(key), 0, 0});
+		}
+	}
+	subdirKeys.clear();
+	subdirKeys.shrink_to_fit();
+	std::sort(dirs.begin(), dirs.end(), [] (const ExportedDir &d1, const ExportedDir &d2) { return d1.key < d2.key; });
+	dirs.erase(std::unique(dirs.begin(), dirs.end(),
+			[] (const ExportedDir &d1, const ExportedDir &d2) { return d1.key == d2.key; }), dirs.end());
+	// The empty directories get the position of the next directory so that the ranges of files are ordered.
+	std::uint64_t nextFile = fileCount;
+	for (auto it = dirs.rbegin(); it != dirs.rend(); ++it) {
+		if (it->fileCount == 0) {
+			it->firstFile = nextFile;
+		}
+		nextFile = it->firstFile;
+	}
+
+	logDebug("Writing "_s, fileCount, " files and "_s, dirs.size(), " dirs to the snapshot..."_s);
+
+	out.align();
+	header.dirsOffset = out.position();
+	std::uint64_t stringOffset = namesSize;
+	for (const ExportedDir &dir : dirs) {
+		SnapshotDir entry;
+		std::memset(&entry, 0, sizeof(entry));
+		entry.keyOffset = stringOffset;
+		entry.keySize = static_cast<std::uint32_t>(dir.key.size());
+		entry.pathOffset = stringOffset + dir.key.size();
+		entry.pathSize = dir.key.empty() ? 0 : static_cast<std::uint32_t>(dir.key.size() - 1);
+		entry.firstFile = dir.firstFile;
+		entry.fileCount = dir.fileCount;
+		out.write(entry);
+		stringOffset += entry.keySize + entry.pathSize;
+	}
+
+	out.align();
+	header.dirIndexOffset = out.position();
+	{
+		std::vector<std::string> paths;
+		paths.reserve(dirs.size());
+		for (const ExportedDir &dir : dirs) {
+			paths.emplace_back(keyToPath(dir.key));
+		}
+		std::vector<std::uint64_t> index(dirs.size());
+		std::iota(index.begin(), index.end(), 0);
+		std::sort(index.begin(), index.end(),
+				[&paths] (const std::uint64_t i1, const std::uint64_t i2) { return paths[i1] < paths[i2]; });
+		out.write(index.data(), index.size() * sizeof(std::uint64_t));
+	}
+
+	out.align();
+	header.stringsOffset = out.position();
+	if (std::fflush(names.get()) != 0 || std::fseek(names.get(), 0, SEEK_SET) != 0) {
+		// TODO handle error.
+		throw errno;
+	}
+	{
+		std::unique_ptr<char[]> buf(new char[writeBufferSize]);
+		std::size_t n;
+		while ((n = std::fread(buf.get(), 1, writeBufferSize, names.get())) > 0) {
+			out.write(buf.get(), n);
+		}
+		if (std::ferror(names.get())) {
+			// TODO handle error.
+			throw errno;
+		}
+	}
+	for (const ExportedDir &dir : dirs) {
+		const std::string path = keyToPath(dir.key);
+		out.write(dir.key.data(), dir.key.size());
+		out.write(path.data(), path.size());
+	}
+	header.stringsSize = stringOffset;
+
+	std::memcpy(header.magic, snapshotMagic, sizeof(snapshotMagic));
+	header.version = snapshotVersion;
+	header.byteOrder = byteOrderMark;
+	std::strncpy(header.digest, digestName(db.digestAlgorithm()), sizeof(header.digest) - 1);
+	header.fileCount = fileCount;
+	header.dirCount = dirs.size();
+	out.writeAt(&header, sizeof(header), 0);
+	out.close();
+}
+
+mirror::Snapshot::Snapshot() noexcept : m_data(nullptr), m_size(0), m_digest(DigestAlgorithm::crc64),
+		m_files(nullptr), m_fileCount(0), m_dirs(nullptr), m_dirCount(0), m_dirIndex(nullptr), m_strings(nullptr),
+		m_stringsSize(0), m_nextFile(0), m_nextFileDir(0), m_nextUntrackedDir(0), m_trackedDirs(), m_trackedFiles() {}
+
+mirror::Snapshot::Snapshot(Snapshot &&src) noexcept : m_data(src.m_data), m_size(src.m_size),
+		m_digest(src.m_digest), m_files(src.m_files), m_fileCount(src.m_fileCount), m_dirs(src.m_dirs),
+		m_dirCount(src.m_dirCount), m_dirIndex(src.m_dirIndex), m_strings(src.m_strings),
+		m_stringsSize(src.m_stringsSize), m_nextFile(src.m_nextFile), m_nextFileDir(src.m_nextFileDir),
+		m_nextUntrackedDir(src.m_nextUntrackedDir), m_trackedDirs(std::move(src.m_trackedDirs)),
+		m_trackedFiles(std::move(src.m_trackedFiles))
+{
+	src.m_data = nullptr;
+}
+
+mirror::Snapshot::~Snapshot()
+{
+	if (m_data != nullptr) {
+		// TODO log error.
+		munmap(const_cast<unsigned char *>(m_data), m_size);
+	}
+}
+
+mirror::Snapshot mirror::Snapshot::open(const char * const path)
+{
+	const int fd = ::open(path, O_RDONLY | O_CLOEXEC);
+	if (fd == -1) {
+		// TODO handle error.
+		throw errno;
+	}
+	struct stat fileStat;
+	if (fstat(fd, &fileStat) != 0) {
+		const int errorCode = errno;
+		close(fd);
+		// TODO handle error.
+		throw errorCode;
+	}
+	if (static_cast<std::uint64_t>(fileStat.st_size) < sizeof(SnapshotHeader)) {
+		close(fd);
+		throw "The file is not a snapshot.";
+	}
+
+	Snapshot snapshot;
+	snapshot.m_size = static_cast<std::size_t>(fileStat.st_size);
+	void * const data = mmap(nullptr, snapshot.m_size, PROT_READ, MAP_SHARED, fd, 0);
+	// The mapping stays valid after the file is closed.
+	close(fd);
+	if (data == MAP_FAILED) {
+		// TODO handle error.
+		throw errno;
+	}
+	snapshot.m_data = static_cast<const unsigned char *>(data);
+
+	SnapshotHeader header;
+	std::memcpy(&header, snapshot.m_data, sizeof(header));
+	if (std::memcmp(header.magic, snapshotMagic, sizeof(snapshotMagic)) != 0) {
+		throw "The file is not a snapshot.";
+	}
+	if (header.byteOrder != byteOrderMark) {
+		throw "The snapshot is written on a machine with another byte order.";
+	}
+	if (header.version > snapshotVersion) {
+		throw "The snapshot is created by a newer version of the program.";
+	}
+	if (header.version != snapshotVersion) {
+		throw "The snapshot is corrupted.";
+	}
+	header.digest[sizeof(header.digest) - 1] = '\0';
+	if (!parseDigestAlgorithm(header.digest, snapshot.m_digest)) {
+		throw "The snapshot uses an unknown digest algorithm.";
+	}
+
+	const std::uint64_t size = snapshot.m_size;
+	auto sectionFits = [size] (const std::uint64_t offset, const std::uint64_t count, const std::size_t entrySize)
+	{
+		return offset % sectionAlignment == 0 && offset <= size && count <= (size - offset) / entrySize;
+	};
+	if (!sectionFits(header.filesOffset, header.fileCount, sizeof(File)) ||
+			!sectionFits(header.dirsOffset, header.dirCount, sizeof(Dir)) ||
+			!sectionFits(header.dirIndexOffset, header.dirCount, sizeof(std::uint64_t)) ||
+			!sectionFits(header.stringsOffset, header.stringsSize, 1) || header.dirCount == 0) {
+		throw "The snapshot is corrupted.";
+	}
+
+	snapshot.m_files = reinterpret_cast<const File *>(snapshot.m_data + header.filesOffset);
+	snapshot.m_fileCount = static_cast<std::size_t>(header.fileCount);
+	snapshot.m_dirs = reinterpret_cast<const Dir *>(snapshot.m_data + header.dirsOffset);
+	snapshot.m_dirCount = static_cast<std::size_t>(header.dirCount);
+	snapshot.m_dirIndex = reinterpret_cast<const std::uint64_t *>(snapshot.m_data + header.dirIndexOffset);
+	snapshot.m_strings = reinterpret_cast<const char *>(snapshot.m_data + header.stringsOffset);
+	snapshot.m_stringsSize = static_cast<std::size_t>(header.stringsSize);
+
+	// The files are checked when they are read, the directories (which are fewer) are checked here.
+	for (std::size_t i = 0; i < snapshot.m_dirCount; ++i) {
+		const Dir &dir = snapshot.m_dirs[i];
+		snapshot.string(dir.keyOffset, dir.keySize);
+		snapshot.string(dir.pathOffset, dir.pathSize);
+		if (dir.firstFile > snapshot.m_fileCount || dir.fileCount > snapshot.m_fileCount - dir.firstFile ||
+				snapshot.m_dirIndex[i] >= snapshot.m_dirCount) {
+			throw "The snapshot is corrupted.";
+		}
+	}
+
+	return snapshot;
+}
+
+bool mirror::Snapshot::getFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize, FileRecord &dest)
+{
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir == nullptr) {
+		return false;
+	}
+	const File * const file = lowerBound(*dir, fileNameU8, fileNameSize);
+	if (file == m_files + dir->firstFile + dir->fileCount ||
+			compareBytes(name(*file), file->nameSize, fileNameU8, fileNameSize) != 0) {
+		return false;
+	}
+	readFileRecord(*file, dest);
+	return true;
+}
+
+bool mirror::Snapshot::getFiles(const char * const dirNameU8, const std::size_t dirNameSize, DirFileMap &dest,
+		PathArena *, const std::size_t maxFiles)
+{
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir == nullptr) {
+		return true;
+	}
+	if (maxFiles > 0 && dir->fileCount > maxFiles) {
+		return false;
+	}
+	const File * const end = m_files + dir->firstFile + dir->fileCount;
+	for (const File *file = m_files + dir->firstFile; file != end; ++file) {
+		readFileRecord(*file, dest[PathKey(name(*file), file->nameSize, true)]);
+	}
+	return true;
+}
+
+void mirror::Snapshot::getDirs(DirSet &dest, PathArena *)
+{
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	for (std::size_t i = 0; i < m_dirCount; ++i) {
+		const Dir &dir = m_dirs[i];
+		dest.emplace(PathKey(string(dir.pathOffset, dir.pathSize), dir.pathSize, true));
+	}
+}
+
+bool mirror::Snapshot::nextSortedFile(SortedFile &dest)
+{
+	if (m_nextFile == m_fileCount) {
+		m_nextFile = 0;
+		m_nextFileDir = 0;
+		return false;
+	}
+
+	// The directories are sorted by the key as the files are, so the directory of the file is never behind.
+	while (m_nextFile >= m_dirs[m_nextFileDir].firstFile + m_dirs[m_nextFileDir].fileCount) {
+		if (++m_nextFileDir == m_dirCount) {
+			throw "The snapshot is corrupted.";
+		}
+	}
+	const Dir &dir = m_dirs[m_nextFileDir];
+	const File &file = m_files[m_nextFile++];
+
+	dest.dirKey = string(dir.keyOffset, dir.keySize);
+	dest.dirKeySize = dir.keySize;
+	dest.fileNameU8 = name(file);
+	dest.fileNameSize = file.nameSize;
+	readFileRecord(file, dest.record);
+	return true;
+}
+
+void mirror::Snapshot::beginTracking()
+{
+	m_trackedDirs.assign(m_dirCount, false);
+	m_trackedFiles.assign(m_fileCount, false);
+	m_nextUntrackedDir = 0;
+}
+
+void mirror::Snapshot::endTracking()
+{
+	std::vector<bool>().swap(m_trackedDirs);
+	std::vector<bool>().swap(m_trackedFiles);
+}
+
+void mirror::Snapshot::trackDir(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir != nullptr) {
+		m_trackedDirs[static_cast<std::size_t>(dir - m_dirs)] = true;
+	}
+}
+
+void mirror::Snapshot::trackFile(const char * const fileNameU8, const std::size_t fileNameSize,
+		const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir == nullptr) {
+		return;
+	}
+	const File * const file = lowerBound(*dir, fileNameU8, fileNameSize);
+	if (file != m_files + dir->firstFile + dir->fileCount &&
+			compareBytes(name(*file), file->nameSize, fileNameU8, fileNameSize) == 0) {
+		m_trackedFiles[static_cast<std::size_t>(file - m_files)] = true;
+	}
+}
+
+void mirror::Snapshot::trackFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		const std::vector<std::string> &fileNamesU8, DirFileMap &dest)
+{
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir == nullptr) {
+		return;
+	}
+	const File * const end = m_files + dir->firstFile + dir->fileCount;
+	for (const std::string &fileNameU8 : fileNamesU8) {
+		const File * const file = lowerBound(*dir, fileNameU8.data(), fileNameU8.size());
+		if (file != end && compareBytes(name(*file), file->nameSize, fileNameU8.data(), fileNameU8.size()) == 0) {
+			m_trackedFiles[static_cast<std::size_t>(file - m_files)] = true;
+			readFileRecord(*file, dest[PathKey(name(*file), file->nameSize, true)]);
+		}
+	}
+}
+
+std::size_t mirror::Snapshot::getUntrackedFiles(const char * const dirNameU8, const std::size_t dirNameSize,
+		std::string &lastNameU8, const std::size_t maxFiles, DirFileMap &dest)
+{
+	assert(maxFiles > 0);
+	const PhaseTimer timer(StatPhase::dbLookup);
+
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir == nullptr) {
+		return 0;
+	}
+
+	std::size_t count = 0;
+	const File * const end = m_files + dir->firstFile + dir->fileCount;
+	for (const File *file = upperBound(*dir, lastNameU8.data(), lastNameU8.size());
+			file != end && count < maxFiles; ++file) {
+		if (m_trackedFiles[static_cast<std::size_t>(file - m_files)]) {
+			continue;
+		}
+		const char * const fileNameU8 = name(*file);
+		readFileRecord(*file, dest[PathKey(fileNameU8, file->nameSize, true)]);
+		lastNameU8.assign(fileNameU8, file->nameSize);
+		++count;
+	}
+	return count;
+}
+
+void mirror::Snapshot::untrackFiles(const char * const dirNameU8, const std::size_t dirNameSize)
+{
+	const Dir * const dir = findDir(dirNameU8, dirNameSize);
+	if (dir != nullptr) {
+		const auto first = m_trackedFiles.begin() + static_cast<std::ptrdiff_t>(dir->firstFile);
+		std::fill(first, first + static_cast<std::ptrdiff_t>(dir->fileCount), false);
+	}
+}
+
+bool mirror::Snapshot::nextUntrackedDir(const char *&dirNameU8, std::size_t &dirNameSize)
+{
+	while (m_nextUntrackedDir < m_dirCount) {
+		const std::size_t i = m_nextUntrackedDir++;
+		if (!m_trackedDirs[i]) {
+			dirNameU8 = string(m_dirs[i].pathOffset, m_dirs[i].pathSize);
+			dirNameSize = m_dirs[i].pathSize;
+			return true;
+		}
+	}
+	m_nextUntrackedDir = 0;
+	return false;
+}
+
+auto mirror::Snapshot::findDir(const char * const dirNameU8, const std::size_t dirNameSize) const -> const Dir *
+{
+	const std::uint64_t * const end = m_dirIndex + m_dirCount;
+	const std::uint64_t * const pos = std::lower_bound(m_dirIndex, end, 0,
+			[&] (const std::uint64_t i, int) {
+				const Dir &dir = m_dirs[i];
+				return compareBytes(string(dir.pathOffset, dir.pathSize), dir.pathSize, dirNameU8, dirNameSize) < 0;
+			});
+	if (pos == end) {
+		return nullptr;
+	}
+	const Dir &dir = m_dirs[*pos];
+	if (compareBytes(string(dir.pathOffset, dir.pathSize), dir.pathSize, dirNameU8, dirNameSize) != 0) {
+		return nullptr;
+	}
+	return &dir;
+}
+
+auto mirror::Snapshot::lowerBound(const Dir &dir, const char * const fileNameU8, const std::size_t fileNameSize) const
+		-> const File *
+{
+	return std::lower_bound(m_files + dir.firstFile, m_files + dir.firstFile + dir.fileCount, 0,
+			[&] (const File &file, int) {
+				return compareBytes(name(file), file.nameSize, fileNameU8, fileNameSize) < 0;
+			});
+}
+
+auto mirror::Snapshot::upperBound(const Dir &dir, const char * const fileNameU8, const std::size_t fileNameSize) const
+		-> const File *
+{
+	return std::upper_bound(m_files + dir.firstFile, m_files + dir.firstFile + dir.fileCount, 0,
+			[&] (int, const File &file) {
+				return compareBytes(fileNameU8, fileNameSize, name(file), file.nameSize) < 0;
+			});
+}
+
+const char *mirror::Snapshot::string(const std::uint64_t offset, const std::uint64_t size) const
+{
+	if (size > m_stringsSize || offset > m_stringsSize - size) {
+		throw "The snapshot is corrupted.";
+	}
+	return m_strings + offset;
+}
+
+void mirror::Snapshot::readFileRecord(const File &file, FileRecord &dest) const
+{
+	if (file.type != static_cast<std::uint32_t>(FileType::file) &&
+			file.type != static_cast<std::uint32_t>(FileType::dir)) {
+		throw "The snapshot is corrupted.";
+	}
+
+	dest.type = static_cast<FileType>(file.type);
+	if (dest.type == FileType::file) {
+		dest.fileSize = file.size;
+		dest.lastModifiedTS.setMillis(file.lastModifiedMillis);
+		std::copy_n(file.digest, maxDigestSize, dest.digest);
+	}
+}
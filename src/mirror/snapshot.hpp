@@ -0,0 +1,162 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_SNAPSHOT_HPP_
+#define MIRROR_SNAPSHOT_HPP_
+
+#include <cstddef>
+#include <cstdint>
+#include "digest.hpp"
+#include "FileDB.hpp"
+#include "PathHashTable.hpp"
+#include <string>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		/*
+		 * The layout of a snapshot file. All integers have the byte order of the machine that has written it.
+		 * The header is followed by the sections, each aligned to 8 bytes:
+		 * - the files, sorted by the directory key (see FileDB::SortedFile) and then by the name;
+		 * - the directories, sorted by the key, each referring to the range of its files;
+		 * - the directory index, the numbers of the directories sorted by the path;
+		 * - the strings (the names of the files, the keys and the paths of the directories), in UTF-8.
+		 */
+		struct SnapshotHeader
+		{
+			char magic[8];
+			std::uint32_t version;
+			std::uint32_t byteOrder;
+			char digest[16];
+			std::uint64_t fileCount;
+			std::uint64_t dirCount;
+			std::uint64_t stringsSize;
+			std::uint64_t filesOffset;
+			std::uint64_t dirsOffset;
+			std::uint64_t dirIndexOffset;
+			std::uint64_t stringsOffset;
+		};
+
+		struct SnapshotFile
+		{
+			// The offsets of the strings are relative to the strings section.
+			std::uint64_t nameOffset;
+			std::int64_t size;
+			std::int64_t lastModifiedMillis;
+			std::uint32_t nameSize;
+			std::uint32_t type;
+			unsigned char digest[maxDigestSize];
+		};
+
+		struct SnapshotDir
+		{
+			std::uint64_t keyOffset;
+			std::uint64_t pathOffset;
+			std::uint64_t firstFile;
+			std::uint64_t fileCount;
+			std::uint32_t keySize;
+			std::uint32_t pathSize;
+		};
+
+		static_assert(sizeof(SnapshotFile) == 32 + maxDigestSize, "SnapshotFile has padding.");
+		static_assert(sizeof(SnapshotDir) == 40, "SnapshotDir has padding.");
+	}
+
+	/*
+	 * Writes the files of the DB to a snapshot, an immutable file that verify-dir and merge-dir can map into
+	 * memory instead of querying the DB. The DB is read in a single pass.
+	 */
+	void exportSnapshot(FileDB &db, const char *path);
+
+	/*
+	 * A snapshot of a DB mapped into memory (see exportSnapshot()). It has the read-only part of the FileDB
+	 * interface that checkFileSystem() uses, so the lookups need neither system calls nor SQLite.
+	 * The strings returned point into the mapping and are valid until the snapshot is closed.
+	 */
+	class Snapshot
+	{
+	public:
+		using SortedFile = FileDB::SortedFile;
+
+		// Throws errno if the file cannot be mapped and a const char * message if it is not a valid snapshot.
+		static Snapshot open(const char *path);
+
+		Snapshot(const Snapshot &) = delete;
+		Snapshot(Snapshot &&src) noexcept;
+		Snapshot &operator=(const Snapshot &) = delete;
+		Snapshot &operator=(Snapshot &&) = delete;
+
+		~Snapshot();
+
+		DigestAlgorithm digestAlgorithm() const noexcept { return m_digest; }
+
+		// The keys added are not copied, so the arenas are not used.
+		bool getFile(const char *fileNameU8, std::size_t fileNameSize,
+				const char *dirNameU8, std::size_t dirNameSize, FileRecord &dest);
+		bool getFiles(const char *dirNameU8, std::size_t dirNameSize, DirFileMap &dest,
+				PathArena *arena = nullptr, std::size_t maxFiles = 0);
+		void getDirs(DirSet &dest, PathArena *arena = nullptr);
+		bool nextSortedFile(SortedFile &dest);
+
+		// The tracking is kept in bit sets of the directories and of the files of the snapshot.
+		void beginTracking(void);
+		void endTracking(void);
+		void trackDir(const char *dirNameU8, std::size_t dirNameSize);
+		void trackFile(const char *fileNameU8, std::size_t fileNameSize,
+				const char *dirNameU8, std::size_t dirNameSize);
+		void trackFiles(const char *dirNameU8, std::size_t dirNameSize, const std::vector<std::string> &fileNamesU8,
+				DirFileMap &dest);
+		std::size_t getUntrackedFiles(const char *dirNameU8, std::size_t dirNameSize, std::string &lastNameU8,
+				std::size_t maxFiles, DirFileMap &dest);
+		void untrackFiles(const char *dirNameU8, std::size_t dirNameSize);
+		bool nextUntrackedDir(const char *&dirNameU8, std::size_t &dirNameSize);
+	private:
+		using File = _helper::SnapshotFile;
+		using Dir = _helper::SnapshotDir;
+
+		Snapshot() noexcept;
+
+		// Returns nullptr if the directory is not in the snapshot.
+		const Dir *findDir(const char *dirNameU8, std::size_t dirNameSize) const;
+		// Returns the first file of the directory whose name is not less than (or is greater than) the name.
+		const File *lowerBound(const Dir &dir, const char *fileNameU8, std::size_t fileNameSize) const;
+		const File *upperBound(const Dir &dir, const char *fileNameU8, std::size_t fileNameSize) const;
+		const char *string(std::uint64_t offset, std::uint64_t size) const;
+		const char *name(const File &file) const { return string(file.nameOffset, file.nameSize); }
+		void readFileRecord(const File &file, FileRecord &dest) const;
+
+		const unsigned char *m_data;
+		std::size_t m_size;
+		DigestAlgorithm m_digest;
+		const File *m_files;
+		std::size_t m_fileCount;
+		const Dir *m_dirs;
+		std::size_t m_dirCount;
+		const std::uint64_t *m_dirIndex;
+		const char *m_strings;
+		std::size_t m_stringsSize;
+
+		// The position of nextSortedFile() and nextUntrackedDir().
+		std::size_t m_nextFile;
+		std::size_t m_nextFileDir;
+		std::size_t m_nextUntrackedDir;
+		std::vector<bool> m_trackedDirs;
+		std::vector<bool> m_trackedFiles;
+	};
+}
+
+#endif // MIRROR_SNAPSHOT_HPP_
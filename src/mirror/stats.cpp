@@ -0,0 +1,119 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "stats.hpp"
+
+namespace
+{
+	std::chrono::steady_clock::time_point statsStart;
+
+	const char * const counterNames[static_cast<std::size_t>(mirror::StatCounter::count)] = {
+		"files visited", "directories visited", "bytes hashed", "bytes copied", "hard links reused",
+		"getdents64", "fstatat", "open", "read", "write", "mmap", "io_uring_enter", "in-kernel copy",
+		"FIEMAP"
+	};
+
+	const char * const phaseNames[static_cast<std::size_t>(mirror::StatPhase::count)] = {
+		"listing directories", "stat", "hashing", "DB lookups", "DB writes", "encoding conversion",
+		"throttling"
+	};
+
+	inline unsigned long long elapsedMillis() noexcept
+	{
+		return static_cast<unsigned long long>(std::chrono::duration_cast<std::chrono::milliseconds>(
+				std::chrono::steady_clock::now() - statsStart).count());
+	}
+
+	inline unsigned long long value(const mirror::StatCounter counter) noexcept
+	{
+		return static_cast<unsigned long long>(mirror::statValue(counter));
+	}
+}
+
+namespace mirror
+{
+	namespace _helper
+	{
+		bool statsEnabled = false;
+		StatCell statCounters[static_cast<std::size_t>(StatCounter::count)];
+		StatCell statPhaseTimes[static_cast<std::size_t>(StatPhase::count)];
+		thread_local unsigned activeStatPhases = 0;
+	}
+}
+
+void mirror::enableStats() noexcept
+{
+	statsStart = std::chrono::steady_clock::now();
+	_helper::statsEnabled = true;
+}
+
+std::uint_fast64_t mirror::statValue(const StatCounter counter) noexcept
+{
+	return _helper::statCounters[static_cast<std::size_t>(counter)].value.load(std::memory_order_relaxed);
+}
+
+std::uint_fast64_t mirror::statTime(const StatPhase phase) noexcept
+{
+	return _helper::statPhaseTimes[static_cast<std::size_t>(phase)].value.load(std::memory_order_relaxed);
+}
+
+void mirror::printStats(std::FILE * const dest)
+{
+	const unsigned long long elapsed = elapsedMillis();
+	std::fprintf(dest, "Statistics:\n  %-22s %llu.%03llu s\n", "elapsed", elapsed / 1000, elapsed % 1000);
+
+	constexpr std::size_t firstSyscall = static_cast<std::size_t>(StatCounter::getdentsCalls);
+	for (std::size_t i = 0; i < firstSyscall; ++i) {
+		std::fprintf(dest, "  %-22s %llu\n", counterNames[i], value(static_cast<StatCounter>(i)));
+	}
+
+	// The phases can overlap, e.g. files are hashed in worker threads while the walk goes on.
+	std::fputs("Time (summed over threads):\n", dest);
+	for (std::size_t i = 0; i < static_cast<std::size_t>(StatPhase::count); ++i) {
+		const unsigned long long micros = statTime(static_cast<StatPhase>(i)) / 1000;
+		std::fprintf(dest, "  %-22s %llu.%06llu s\n", phaseNames[i], micros / 1000000, micros % 1000000);
+	}
+
+	std::fputs("System calls:\n", dest);
+	for (std::size_t i = firstSyscall; i < static_cast<std::size_t>(StatCounter::count); ++i) {
+		std::fprintf(dest, "  %-22s %llu\n", counterNames[i], value(static_cast<StatCounter>(i)));
+	}
+	std::fflush(dest);
+}
+
+mirror::ProgressReporter::ProgressReporter(const unsigned interval, std::FILE * const dest)
+		: m_interval(interval), m_dest(dest), m_stopped(false), m_thread(&ProgressReporter::run, this) {}
+
+mirror::ProgressReporter::~ProgressReporter()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_stopped = true;
+	}
+	m_stopCond.notify_one();
+	m_thread.join();
+}
+
+void mirror::ProgressReporter::run()
+{
+	std::unique_lock<std::mutex> lock(m_mutex);
+	while (!m_stopCond.wait_for(lock, m_interval, [this] { return m_stopped; })) {
+		std::fprintf(m_dest, "{\"progress\":{\"elapsed_ms\":%llu,\"files\":%llu,\"dirs\":%llu,"
+				"\"bytes_hashed\":%llu,\"bytes_copied\":%llu}}\n",
+				elapsedMillis(), value(StatCounter::filesVisited), value(StatCounter::dirsVisited),
+				value(StatCounter::bytesHashed), value(StatCounter::bytesCopied));
+		std::fflush(m_dest);
+	}
+}
@@ -0,0 +1,170 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_STATS_HPP_
+#define MIRROR_STATS_HPP_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <thread>
+
+namespace mirror
+{
+	enum class StatCounter
+	{
+		// Regular files and directories found by the walk (the root directory is not counted).
+		filesVisited, dirsVisited,
+		// The bytes passed to the digest function and the bytes written to copies (or cloned).
+		bytesHashed, bytesCopied,
+		// The files whose digests or copies are reused from another hard link of the same inode.
+		hardLinksReused,
+		// The system calls made, by type. Calls made by SQLite are not counted.
+		getdentsCalls, fstatatCalls, openCalls, readCalls, writeCalls, mmapCalls, uringEnterCalls, copyCalls,
+		fiemapCalls,
+		count
+	};
+
+	enum class StatPhase
+	{
+		// Reading directory entries.
+		listing,
+		// Getting the metadata of directory entries.
+		stat,
+		// Reading regular files and calculating their digests.
+		hashing,
+		// Reading the DB (FileDB::getFiles(), getDirs() and nextSortedFile()).
+		dbLookup,
+		// Writing the DB (FileDB::addFile(), the removals and the commits).
+		dbWrite,
+		// Converting file names between the system encoding and UTF-8.
+		encoding,
+		// Sleeping to keep the file I/O within the limits set.
+		throttled,
+		count
+	};
+
+	namespace _helper
+	{
+		// Each value has its own cache line so that the threads updating different values do not contend.
+		struct alignas(64) StatCell
+		{
+			std::atomic<std::uint_fast64_t> value;
+		};
+
+		extern bool statsEnabled;
+		extern StatCell statCounters[static_cast<std::size_t>(StatCounter::count)];
+		// In nanoseconds, summed over all threads.
+		extern StatCell statPhaseTimes[static_cast<std::size_t>(StatPhase::count)];
+		// The phases being timed by the calling thread, one bit per phase.
+		extern thread_local unsigned activeStatPhases;
+	}
+
+	/*
+	 * Turns the collection of the statistics on. Until then counting and timing cost a single branch.
+	 * Must be called before the threads that update the statistics are started.
+	 */
+	void enableStats() noexcept;
+
+	inline bool statsEnabled() noexcept { return _helper::statsEnabled; }
+
+	inline void countStat(const StatCounter counter, const std::uint_fast64_t n = 1) noexcept
+	{
+		if (_helper::statsEnabled) {
+			_helper::statCounters[static_cast<std::size_t>(counter)].value.fetch_add(n, std::memory_order_relaxed);
+		}
+	}
+
+	std::uint_fast64_t statValue(StatCounter counter) noexcept;
+	// In nanoseconds.
+	std::uint_fast64_t statTime(StatPhase phase) noexcept;
+
+	/*
+	 * Adds the time of its lifetime to the phase. A nested timer of the phase that is already being timed
+	 * by the same thread is ignored, so that e.g. a commit made by FileDB::addFile() is not counted twice.
+	 */
+	class PhaseTimer
+	{
+	public:
+		explicit PhaseTimer(const StatPhase phase) noexcept : m_phase(phase), m_active(false)
+		{
+			if (_helper::statsEnabled) {
+				const unsigned bit = 1u << static_cast<unsigned>(phase);
+				if ((_helper::activeStatPhases & bit) == 0) {
+					_helper::activeStatPhases |= bit;
+					m_active = true;
+					m_start = std::chrono::steady_clock::now();
+				}
+			}
+		}
+
+		PhaseTimer(const PhaseTimer &) = delete;
+		PhaseTimer(PhaseTimer &&) = delete;
+		PhaseTimer &operator=(const PhaseTimer &) = delete;
+		PhaseTimer &operator=(PhaseTimer &&) = delete;
+
+		~PhaseTimer()
+		{
+			if (m_active) {
+				const auto elapsed = std::chrono::steady_clock::now() - m_start;
+				_helper::activeStatPhases &= ~(1u << static_cast<unsigned>(m_phase));
+				_helper::statPhaseTimes[static_cast<std::size_t>(m_phase)].value.fetch_add(
+						std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count(),
+						std::memory_order_relaxed);
+			}
+		}
+	private:
+		const StatPhase m_phase;
+		bool m_active;
+		std::chrono::steady_clock::time_point m_start;
+	};
+
+	// Prints the statistics collected since enableStats() is called in the human-readable form.
+	void printStats(std::FILE *dest);
+
+	/*
+	 * Prints a progress line to dest each interval seconds in a background thread until it is destroyed.
+	 * Each line is a JSON object, e.g.:
+	 * {"progress":{"elapsed_ms":5000,"files":1200,"dirs":40,"bytes_hashed":73400320,"bytes_copied":0}}
+	 * The statistics must be enabled.
+	 */
+	class ProgressReporter
+	{
+	public:
+		ProgressReporter(unsigned interval, std::FILE *dest);
+
+		ProgressReporter(const ProgressReporter &) = delete;
+		ProgressReporter(ProgressReporter &&) = delete;
+		ProgressReporter &operator=(const ProgressReporter &) = delete;
+		ProgressReporter &operator=(ProgressReporter &&) = delete;
+
+		~ProgressReporter();
+	private:
+		void run();
+
+		const std::chrono::seconds m_interval;
+		std::FILE * const m_dest;
+		std::mutex m_mutex;
+		std::condition_variable m_stopCond;
+		bool m_stopped;
+		std::thread m_thread;
+	};
+}
+
+#endif // MIRROR_STATS_HPP_
@@ -0,0 +1,74 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "stats.hpp"
+#include "throttle.hpp"
+#include <thread>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		bool throttlingEnabled = false;
+		TokenBucket readBucket;
+		TokenBucket writeBucket;
+		TokenBucket opBucket;
+	}
+}
+
+void mirror::_helper::TokenBucket::setRate(const std::uint_fast64_t tokensPerSecond) noexcept
+{
+	std::lock_guard<std::mutex> lock(m_mutex);
+
+	m_nanosPerToken = tokensPerSecond == 0 ? 0 : 1e9 / static_cast<double>(tokensPerSecond);
+	m_burst = std::chrono::milliseconds(100);
+	m_next = Clock::now() - m_burst;
+}
+
+void mirror::_helper::TokenBucket::acquire(const std::uint_fast64_t tokens) noexcept
+{
+	if (m_nanosPerToken == 0) {
+		return;
+	}
+
+	const Clock::duration cost = std::chrono::duration_cast<Clock::duration>(
+			std::chrono::duration<double, std::nano>(m_nanosPerToken * static_cast<double>(tokens)));
+
+	Clock::time_point wakeUp;
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		const Clock::time_point now = Clock::now();
+		// The tokens accumulated while the bucket is idle are limited by the burst.
+		if (m_next < now - m_burst) {
+			m_next = now - m_burst;
+		}
+		m_next += cost;
+		if (m_next <= now) {
+			return;
+		}
+		wakeUp = m_next;
+	}
+
+	const PhaseTimer timer(StatPhase::throttled);
+	std::this_thread::sleep_until(wakeUp);
+}
+
+void mirror::setIOLimits(const IOLimits &limits) noexcept
+{
+	_helper::readBucket.setRate(limits.readRate);
+	_helper::writeBucket.setRate(limits.writeRate);
+	_helper::opBucket.setRate(limits.iops);
+	_helper::throttlingEnabled = limits.readRate > 0 || limits.writeRate > 0 || limits.iops > 0;
+}
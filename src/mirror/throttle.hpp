@@ -0,0 +1,100 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_THROTTLE_HPP_
+#define MIRROR_THROTTLE_HPP_
+
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace mirror
+{
+	// The limits of the file data I/O of the process. A limit that is 0 is not enforced.
+	struct IOLimits
+	{
+		IOLimits() noexcept : readRate(0), writeRate(0), iops(0) {}
+
+		// In bytes per second.
+		std::uint_fast64_t readRate;
+		std::uint_fast64_t writeRate;
+		// The read and write requests (e.g. system calls) per second.
+		std::uint_fast64_t iops;
+	};
+
+	namespace _helper
+	{
+		/*
+		 * A token bucket that is charged after an operation is made: the calling thread sleeps until
+		 * the operation fits into the rate. Up to a tenth of a second of the rate is allowed as a burst
+		 * after the bucket has been idle. Can be used by multiple threads.
+		 */
+		class TokenBucket
+		{
+		public:
+			TokenBucket() noexcept : m_mutex(), m_nanosPerToken(0), m_burst(), m_next() {}
+
+			TokenBucket(const TokenBucket &) = delete;
+			TokenBucket(TokenBucket &&) = delete;
+			TokenBucket &operator=(const TokenBucket &) = delete;
+			TokenBucket &operator=(TokenBucket &&) = delete;
+
+			void setRate(std::uint_fast64_t tokensPerSecond) noexcept;
+			void acquire(std::uint_fast64_t tokens) noexcept;
+		private:
+			using Clock = std::chrono::steady_clock;
+
+			std::mutex m_mutex;
+			double m_nanosPerToken;
+			Clock::duration m_burst;
+			// The time when all tokens acquired so far are paid for.
+			Clock::time_point m_next;
+		};
+
+		extern bool throttlingEnabled;
+		extern TokenBucket readBucket;
+		extern TokenBucket writeBucket;
+		extern TokenBucket opBucket;
+	}
+
+	/*
+	 * Sets the limits of the file data I/O. Until then throttling costs a single branch.
+	 * Must be called before the threads that read or write files are started.
+	 */
+	void setIOLimits(const IOLimits &limits) noexcept;
+
+	inline bool ioThrottled() noexcept { return _helper::throttlingEnabled; }
+
+	// Is called after a request has read n bytes of file data.
+	inline void throttleRead(const std::uint_fast64_t n) noexcept
+	{
+		if (_helper::throttlingEnabled) {
+			_helper::readBucket.acquire(n);
+			_helper::opBucket.acquire(1);
+		}
+	}
+
+	// Is called after a request has written n bytes of file data.
+	inline void throttleWrite(const std::uint_fast64_t n) noexcept
+	{
+		if (_helper::throttlingEnabled) {
+			_helper::writeBucket.acquire(n);
+			_helper::opBucket.acquire(1);
+		}
+	}
+}
+
+#endif // MIRROR_THROTTLE_HPP_
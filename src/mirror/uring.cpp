@@ -0,0 +1,430 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include "uring.hpp"
+
+#ifdef MIRROR_IO_URING
+
+#include <afc/logger.hpp>
+#include <afc/StringRef.hpp>
+#include <algorithm>
+#include <cassert>
+#include <cerrno>
+#include <cstring>
+#include <memory>
+#include <new>
+#include "stats.hpp"
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include "throttle.hpp"
+#include <unistd.h>
+#include "utils.hpp"
+
+using afc::operator"" _s;
+using afc::logger::logDebug;
+
+namespace
+{
+	inline int ioUringSetup(const unsigned entries, struct io_uring_params * const params) noexcept
+	{
+		return static_cast<int>(syscall(__NR_io_uring_setup, entries, params));
+	}
+
+	inline int ioUringEnter(const int ringFd, const unsigned toSubmit, const unsigned minComplete,
+			const unsigned flags) noexcept
+	{
+		mirror::countStat(mirror::StatCounter::uringEnterCalls);
+		return static_cast<int>(syscall(__NR_io_uring_enter, ringFd, toSubmit, minComplete, flags, nullptr, 0));
+	}
+
+	template<typename T>
+	inline T *ringPtr(void * const ring, const unsigned offset) noexcept
+	{
+		return reinterpret_cast<T *>(static_cast<unsigned char *>(ring) + offset);
+	}
+
+	struct ThreadURing
+	{
+		ThreadURing() noexcept : ring(), unsupported(false) {}
+
+		std::unique_ptr<mirror::_helper::URing> ring;
+		bool unsupported;
+	};
+
+	thread_local ThreadURing threadRing;
+}
+
+mirror::_helper::URing::URing() noexcept
+		: m_ringFd(-1), m_sqRing(MAP_FAILED), m_sqRingSize(0), m_cqRing(MAP_FAILED), m_cqRingSize(0),
+		  m_sqes(static_cast<struct io_uring_sqe *>(MAP_FAILED)), m_sqesSize(0), m_sqHead(nullptr),
+		  m_sqTail(nullptr), m_sqMask(0), m_sqArray(nullptr), m_sqEntries(0), m_sqLocalTail(0), m_toSubmit(0),
+		  m_cqHead(nullptr), m_cqTail(nullptr), m_cqMask(0), m_cqes(nullptr), m_inFlight(0), m_slots(),
+		  m_broken(false) {}
+
+mirror::_helper::URing::~URing()
+{
+	if (m_sqes != MAP_FAILED) {
+		munmap(m_sqes, m_sqesSize);
+	}
+	if (m_cqRing != MAP_FAILED && m_cqRing != m_sqRing) {
+		munmap(m_cqRing, m_cqRingSize);
+	}
+	if (m_sqRing != MAP_FAILED) {
+		munmap(m_sqRing, m_sqRingSize);
+	}
+	if (m_ringFd != -1) {
+		close(m_ringFd);
+	}
+}
+
+mirror::_helper::URing *mirror::_helper::URing::create(const unsigned queueDepth) noexcept
+{
+	std::unique_ptr<URing> ring(new (std::nothrow) URing());
+	if (ring == nullptr || !ring->init(queueDepth)) {
+		return nullptr;
+	}
+	return ring.release();
+}
+
+bool mirror::_helper::URing::init(const unsigned queueDepth) noexcept
+{
+	assert(queueDepth > 0);
+
+	struct io_uring_params params;
+	std::memset(&params, 0, sizeof(params));
+
+	m_ringFd = ioUringSetup(queueDepth, &params);
+	if (m_ringFd == -1) {
+		logDebug("io_uring is not available: "_s, errno);
+		return false;
+	}
+
+	m_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	m_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	const bool singleMmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+	if (singleMmap) {
+		m_sqRingSize = m_cqRingSize = std::max(m_sqRingSize, m_cqRingSize);
+	}
+
+	m_sqRing = mmap(nullptr, m_sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			m_ringFd, IORING_OFF_SQ_RING);
+	if (m_sqRing == MAP_FAILED) {
+		return false;
+	}
+	if (singleMmap) {
+		m_cqRing = m_sqRing;
+	} else {
+		m_cqRing = mmap(nullptr, m_cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				m_ringFd, IORING_OFF_CQ_RING);
+		if (m_cqRing == MAP_FAILED) {
+			return false;
+		}
+	}
+	m_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+	m_sqes = static_cast<struct io_uring_sqe *>(mmap(nullptr, m_sqesSize, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, m_ringFd, IORING_OFF_SQES));
+	if (m_sqes == MAP_FAILED) {
+		return false;
+	}
+
+	m_sqHead = ringPtr<unsigned>(m_sqRing, params.sq_off.head);
+	m_sqTail = ringPtr<unsigned>(m_sqRing, params.sq_off.tail);
+	m_sqMask = *ringPtr<unsigned>(m_sqRing, params.sq_off.ring_mask);
+	m_sqArray = ringPtr<unsigned>(m_sqRing, params.sq_off.array);
+	m_sqEntries = params.sq_entries;
+	m_sqLocalTail = *m_sqTail;
+
+	m_cqHead = ringPtr<unsigned>(m_cqRing, params.cq_off.head);
+	m_cqTail = ringPtr<unsigned>(m_cqRing, params.cq_off.tail);
+	m_cqMask = *ringPtr<unsigned>(m_cqRing, params.cq_off.ring_mask);
+	m_cqes = ringPtr<struct io_uring_cqe>(m_cqRing, params.cq_off.cqes);
+
+	// Each slot has at most one request in flight so the submission queue never overflows.
+	m_slots.resize(std::min(queueDepth, m_sqEntries));
+
+	return true;
+}
+
+void mirror::_helper::URing::prepare(const unsigned slotIndex, const int fd, const bool write) noexcept
+{
+	Slot &slot = m_slots[slotIndex];
+	assert(slot.done < slot.length);
+
+	slot.iov.iov_base = slot.buf + slot.done;
+	slot.iov.iov_len = slot.length - slot.done;
+	slot.writing = write;
+
+	/*
+	 * The requests in flight are not waited for, so the request is accounted before it is submitted.
+	 * The rest of a short transfer is resubmitted without being accounted again.
+	 */
+	if (slot.done == 0) {
+		if (write) {
+			throttleWrite(slot.length);
+		} else {
+			throttleRead(slot.length);
+		}
+	}
+
+	const unsigned index = m_sqLocalTail & m_sqMask;
+	struct io_uring_sqe &sqe = m_sqes[index];
+	std::memset(&sqe, 0, sizeof(sqe));
+	sqe.opcode = write ? IORING_OP_WRITEV : IORING_OP_READV;
+	sqe.fd = fd;
+	sqe.off = static_cast<__u64>(slot.offset + slot.done);
+	sqe.addr = reinterpret_cast<__u64>(&slot.iov);
+	sqe.len = 1;
+	sqe.user_data = slotIndex;
+	m_sqArray[index] = index;
+
+	++m_sqLocalTail;
+	++m_toSubmit;
+	++m_inFlight;
+}
+
+void mirror::_helper::URing::submit()
+{
+	__atomic_store_n(m_sqTail, m_sqLocalTail, __ATOMIC_RELEASE);
+	while (m_toSubmit > 0) {
+		const int submitted = ioUringEnter(m_ringFd, m_toSubmit, 0, 0);
+		if (submitted == -1) {
+			if (errno == EINTR || errno == EAGAIN) {
+				continue;
+			}
+			// TODO handle error.
+			throw errno;
+		}
+		m_toSubmit -= static_cast<unsigned>(submitted);
+	}
+}
+
+void mirror::_helper::URing::wait(struct io_uring_cqe &dest)
+{
+	assert(m_inFlight > 0);
+
+	for (;;) {
+		const unsigned head = *m_cqHead;
+		if (head != __atomic_load_n(m_cqTail, __ATOMIC_ACQUIRE)) {
+			dest = m_cqes[head & m_cqMask];
+			__atomic_store_n(m_cqHead, head + 1, __ATOMIC_RELEASE);
+			--m_inFlight;
+			return;
+		}
+		if (ioUringEnter(m_ringFd, 0, 1, IORING_ENTER_GETEVENTS) == -1 && errno != EINTR) {
+			// TODO handle error.
+			throw errno;
+		}
+	}
+}
+
+void mirror::_helper::URing::drain() noexcept
+{
+	/* The kernel must not write to the buffers after they are handed back to the caller,
+	 * so all requests in flight are waited for.
+	 */
+	try {
+		submit();
+		struct io_uring_cqe cqe;
+		while (m_inFlight > 0) {
+			wait(cqe);
+		}
+	}
+	catch (...) {
+		/*
+		 * The requests in flight can still complete into the buffer, so it is leaked rather than reused,
+		 * and the ring is destroyed by threadURing() (closing its file descriptor cancels the requests).
+		 */
+		m_broken = true;
+		abandonThreadReadBuffer();
+		afc::logger::logError("Unable to wait for io_uring requests, falling back to blocking I/O."_s);
+	}
+}
+
+off_t mirror::_helper::URing::readFile(const int fd, const off_t size, const std::size_t blockSize,
+		const ChunkCallback op, void * const ctx)
+{
+	assert(m_inFlight == 0);
+
+	const unsigned depth = static_cast<unsigned>(m_slots.size());
+	unsigned char * const buf = threadReadBuffer(depth * blockSize);
+	off_t nextOffset = 0;
+	off_t consumed = 0;
+	int error = 0;
+
+	// Slots are assigned to consecutive blocks round-robin so that they are consumed in the same order.
+	auto assign = [&] (const unsigned i)
+	{
+		Slot &slot = m_slots[i];
+		slot.busy = nextOffset < size;
+		if (slot.busy) {
+			slot.offset = nextOffset;
+			slot.length = static_cast<std::size_t>(std::min<off_t>(blockSize, size - nextOffset));
+			slot.done = 0;
+			slot.complete = false;
+			nextOffset += slot.length;
+			prepare(i, fd, false);
+		}
+	};
+
+	try {
+		for (unsigned i = 0; i < depth; ++i) {
+			m_slots[i].buf = buf + i * blockSize;
+			assign(i);
+		}
+
+		for (unsigned current = 0; m_slots[current].busy; current = (current + 1) % depth) {
+			Slot &slot = m_slots[current];
+
+			while (!slot.complete) {
+				submit();
+
+				struct io_uring_cqe cqe;
+				wait(cqe);
+
+				Slot &completed = m_slots[cqe.user_data];
+				if (cqe.res < 0) {
+					error = -cqe.res;
+					completed.complete = true;
+				} else if (cqe.res == 0) { // The file is truncated.
+					completed.complete = true;
+				} else {
+					completed.done += static_cast<std::size_t>(cqe.res);
+					completed.complete = completed.done == completed.length;
+					if (!completed.complete) {
+						prepare(static_cast<unsigned>(cqe.user_data), fd, false);
+					}
+				}
+			}
+
+			if (error != 0) {
+				drain();
+				handleReadFileError(error);
+			}
+
+			op(ctx, slot.buf, slot.done);
+			consumed += slot.done;
+
+			if (slot.done < slot.length) {
+				break;
+			}
+			assign(current);
+		}
+	}
+	catch (...) {
+		drain();
+		throw;
+	}
+
+	drain();
+	return consumed;
+}
+
+off_t mirror::_helper::URing::copyFile(const int srcFd, const int destFd, const off_t size,
+		const std::size_t blockSize)
+{
+	assert(m_inFlight == 0);
+
+	const unsigned depth = static_cast<unsigned>(m_slots.size());
+	unsigned char * const buf = threadReadBuffer(depth * blockSize);
+	off_t nextOffset = 0;
+	off_t copied = 0;
+	bool eof = false;
+	bool failed = false;
+
+	auto assign = [&] (const unsigned i)
+	{
+		Slot &slot = m_slots[i];
+		slot.busy = !eof && !failed && nextOffset < size;
+		if (slot.busy) {
+			slot.offset = nextOffset;
+			slot.length = static_cast<std::size_t>(std::min<off_t>(blockSize, size - nextOffset));
+			slot.done = 0;
+			nextOffset += slot.length;
+			prepare(i, srcFd, false);
+		}
+	};
+
+	try {
+		for (unsigned i = 0; i < depth; ++i) {
+			m_slots[i].buf = buf + i * blockSize;
+			assign(i);
+		}
+
+		// Writes are queued as soon as the corresponding reads complete, in any order.
+		while (m_inFlight > 0) {
+			submit();
+
+			struct io_uring_cqe cqe;
+			wait(cqe);
+
+			const unsigned i = static_cast<unsigned>(cqe.user_data);
+			Slot &slot = m_slots[i];
+			if (cqe.res < 0 || (cqe.res == 0 && slot.writing)) {
+				// TODO log error.
+				failed = true;
+			}
+			if (failed) { // The requests in flight are waited for but no new ones are issued.
+				slot.busy = false;
+				continue;
+			}
+
+			if (!slot.writing) {
+				if (cqe.res == 0) { // The file is truncated.
+					eof = true;
+					slot.length = slot.done;
+				} else {
+					slot.done += static_cast<std::size_t>(cqe.res);
+				}
+				if (slot.done < slot.length) {
+					prepare(i, srcFd, false);
+				} else if (slot.length == 0) {
+					slot.busy = false;
+				} else {
+					slot.done = 0;
+					prepare(i, destFd, true);
+				}
+			} else {
+				slot.done += static_cast<std::size_t>(cqe.res);
+				if (slot.done < slot.length) {
+					prepare(i, destFd, true);
+				} else {
+					copied += slot.length;
+					assign(i);
+				}
+			}
+		}
+	}
+	catch (...) {
+		drain();
+		throw;
+	}
+
+	return failed ? -1 : copied;
+}
+
+mirror::_helper::URing *mirror::_helper::threadURing(const unsigned queueDepth) noexcept
+{
+	if (threadRing.ring != nullptr && threadRing.ring->broken()) {
+		threadRing.ring.reset();
+		threadRing.unsupported = true;
+	}
+	if (threadRing.ring == nullptr && !threadRing.unsupported) {
+		threadRing.ring.reset(URing::create(queueDepth));
+		threadRing.unsupported = threadRing.ring == nullptr;
+	}
+	return threadRing.ring.get();
+}
+
+#endif // MIRROR_IO_URING
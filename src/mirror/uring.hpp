@@ -0,0 +1,130 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_URING_HPP_
+#define MIRROR_URING_HPP_
+
+#include <cstddef>
+#include "io.hpp"
+#include <sys/types.h>
+
+#ifdef MIRROR_IO_URING
+
+#include <linux/io_uring.h>
+#include <sys/uio.h>
+#include <vector>
+
+namespace mirror
+{
+	namespace _helper
+	{
+		/*
+		 * A minimal io_uring wrapper built on the raw syscalls (liburing is not required).
+		 * It keeps up to queueDepth block-sized requests of a single file in flight.
+		 * An instance must be used by one thread only.
+		 */
+		class URing
+		{
+		public:
+			typedef void (*ChunkCallback)(void *ctx, const unsigned char *data, std::size_t n);
+
+			// Returns nullptr if io_uring is not supported by the kernel or is not permitted.
+			static URing *create(unsigned queueDepth) noexcept;
+
+			URing(const URing &) = delete;
+			URing(URing &&) = delete;
+			URing &operator=(const URing &) = delete;
+			URing &operator=(URing &&) = delete;
+
+			~URing();
+
+			unsigned queueDepth() const noexcept { return m_sqEntries; }
+			/*
+			 * Tells that the requests in flight could not be waited for, so the kernel can still write
+			 * to the buffers. Such a ring must not be used anymore.
+			 */
+			bool broken() const noexcept { return m_broken; }
+
+			/*
+			 * Reads the first size bytes of the file and passes them to op in order, in blocks of
+			 * at most blockSize bytes. Returns the number of bytes read, which is less than size only
+			 * if the file is truncated meanwhile. Read errors are thrown by handleReadFileError().
+			 */
+			off_t readFile(int fd, off_t size, std::size_t blockSize, ChunkCallback op, void *ctx);
+
+			/*
+			 * Copies the first size bytes of srcFd to destFd using positional reads and writes.
+			 * Returns the number of bytes copied or -1 if an I/O error has occurred.
+			 */
+			off_t copyFile(int srcFd, int destFd, off_t size, std::size_t blockSize);
+		private:
+			struct Slot
+			{
+				off_t offset;
+				std::size_t length;
+				std::size_t done;
+				unsigned char *buf;
+				struct iovec iov;
+				bool busy;
+				bool writing;
+				bool complete;
+			};
+
+			URing() noexcept;
+
+			bool init(unsigned queueDepth) noexcept;
+			void prepare(unsigned slotIndex, int fd, bool write) noexcept;
+			void submit();
+			void wait(struct io_uring_cqe &dest);
+			void drain() noexcept;
+
+			int m_ringFd;
+			void *m_sqRing;
+			std::size_t m_sqRingSize;
+			void *m_cqRing;
+			std::size_t m_cqRingSize;
+			struct io_uring_sqe *m_sqes;
+			std::size_t m_sqesSize;
+
+			unsigned *m_sqHead;
+			unsigned *m_sqTail;
+			unsigned m_sqMask;
+			unsigned *m_sqArray;
+			unsigned m_sqEntries;
+			unsigned m_sqLocalTail;
+			unsigned m_toSubmit;
+
+			unsigned *m_cqHead;
+			unsigned *m_cqTail;
+			unsigned m_cqMask;
+			struct io_uring_cqe *m_cqes;
+
+			unsigned m_inFlight;
+			std::vector<Slot> m_slots;
+			bool m_broken;
+		};
+
+		/*
+		 * Returns the io_uring instance owned by the calling thread. It is created on the first call.
+		 * Returns nullptr if io_uring cannot be used, in which case the blocking I/O is to be used.
+		 * A broken instance is destroyed and io_uring is not used by the thread afterwards.
+		 */
+		URing *threadURing(unsigned queueDepth) noexcept;
+	}
+}
+
+#endif // MIRROR_IO_URING
+
+#endif // MIRROR_URING_HPP_
@@ -14,12 +14,29 @@ GNU General Public License for more details.
 You should have received a copy of the GNU General Public License
 along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include "utils.hpp"
-#include <afc/crc.hpp>
 #include <afc/number.h>
 #include <algorithm>
+#include <atomic>
+#include "blake3.hpp"
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include "digest.hpp"
 #include <fcntl.h>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <new>
 #include <stdexcept>
+#include "stats.hpp"
+#include <string>
 #include <sys/stat.h>
+#include <sys/syscall.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <utility>
+#include <vector>
 
 using afc::operator"" _s;
 using afc::logger::logDebug;
@@ -39,6 +56,341 @@ namespace
 
 		throw std::runtime_error(msgBuf);
 	}
+
+	// A regular file that is added to the DB when its digest is calculated by the hashing pool.
+	struct PendingFile
+	{
+		std::string fileNameU8;
+		std::string relDirU8;
+		// Is used by createDB() to complete the directory of the file when the file is added.
+		std::size_t dirNode;
+	};
+
+	// The parent of the root directory node in createDB().
+	constexpr std::size_t noDirNode = static_cast<std::size_t>(-1);
+
+	using FilePool = mirror::_helper::HashingPool<PendingFile>;
+
+	inline void addPendingFile(mirror::FileDB &db, FilePool::Task &task)
+	{
+		const PendingFile &f = task.payload;
+		db.addFile(f.fileNameU8.data(), f.fileNameU8.size(), f.relDirU8.data(), f.relDirU8.size(), task.record);
+	}
+
+	// Opens the source file and creates the destination one. Nothing is left open if false is returned.
+	bool openFilesToCopy(const int srcDirFd, const int destDirFd, const char * const relPath,
+			int &srcFd, int &destFd)
+	{
+		// TODO support fsync
+		// TODO support copying symlinks
+		srcFd = openat(srcDirFd, relPath, O_NOFOLLOW | O_RDONLY);
+		if (srcFd == -1) {
+			// TODO log error.
+			return false;
+		}
+		// TODO preserve timestamps, sticky flags, permissions, ownership
+		destFd = openat(destDirFd, relPath, O_CREAT | O_EXCL | O_RDWR, S_IRWXU);
+		if (destFd == -1) {
+			if (close(srcFd) == -1) {
+				// TODO log error.
+			}
+			// TODO log error.
+			return false;
+		}
+		return true;
+	}
+
+	bool closeCopiedFiles(const int srcFd, const int destFd) noexcept
+	{
+		bool success = true;
+		if (close(srcFd) == -1) {
+			// TODO log error.
+			success = false;
+		}
+		if (close(destFd) == -1) {
+			// TODO log error.
+			success = false;
+		}
+		return success;
+	}
+
+	void removeCopiedFile(const int destDirFd, const char * const relPath) noexcept
+	{
+		if (unlinkat(destDirFd, relPath, 0) == -1) {
+			// TODO report the cause of the error (errno).
+			afc::logger::logError("Unable to remove the file '"_s, relPath, "'!"_s);
+		}
+	}
+
+	/*
+	 * The digests of the files with several hard links, by the inode. An entry is dropped when all
+	 * the other links of the inode are seen, so only the inodes with links still to be scanned are kept.
+	 * The links outside the tree (or the shard) are never seen, so the least recently used entries are
+	 * evicted once there are maxEntries of them. The entries are validated against the size and
+	 * the modification time of the file seen. The cache is used within an InodeDigestScope only.
+	 */
+	class InodeDigestCache
+	{
+	public:
+		static constexpr std::size_t maxEntries = 256 * 1024;
+
+		InodeDigestCache() : m_mutex(), m_entries(), m_lru(), m_scopes(0) {}
+
+		void enter()
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			++m_scopes;
+		}
+
+		void exit() noexcept
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (--m_scopes == 0) {
+				// The memory is released, too.
+				Map().swap(m_entries);
+				m_lru.clear();
+			}
+		}
+
+		bool find(const struct stat &fileStat, const mirror::DigestAlgorithm digest,
+				unsigned char dest[mirror::maxDigestSize])
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			const auto it = m_entries.find(key(fileStat));
+			if (it == m_entries.end()) {
+				return false;
+			}
+			Entry &entry = it->second;
+			if (!matches(entry, fileStat, digest)) {
+				erase(it);
+				return false;
+			}
+			std::copy_n(entry.digest, mirror::maxDigestSize, dest);
+			if (--entry.linksLeft == 0) {
+				erase(it);
+			} else {
+				m_lru.splice(m_lru.begin(), m_lru, entry.lruPos);
+			}
+			return true;
+		}
+
+		void add(const struct stat &fileStat, const mirror::DigestAlgorithm digest,
+				const unsigned char src[mirror::maxDigestSize])
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_scopes == 0) {
+				return;
+			}
+			const mirror::_helper::InodeKey k = key(fileStat);
+			auto it = m_entries.find(k);
+			if (it == m_entries.end()) {
+				if (m_entries.size() == maxEntries) {
+					erase(m_entries.find(m_lru.back()));
+				}
+				m_lru.push_front(k);
+				try {
+					it = m_entries.emplace(k, Entry()).first;
+				}
+				catch (...) {
+					m_lru.pop_front();
+					throw;
+				}
+				it->second.lruPos = m_lru.begin();
+			} else {
+				m_lru.splice(m_lru.begin(), m_lru, it->second.lruPos);
+			}
+			Entry &entry = it->second;
+			entry.size = fileStat.st_size;
+			entry.mtime = fileStat.st_mtim;
+			entry.linksLeft = fileStat.st_nlink - 1;
+			entry.algorithm = digest;
+			std::copy_n(src, mirror::maxDigestSize, entry.digest);
+		}
+	private:
+		struct Entry
+		{
+			off_t size;
+			struct timespec mtime;
+			nlink_t linksLeft;
+			mirror::DigestAlgorithm algorithm;
+			unsigned char digest[mirror::maxDigestSize];
+			std::list<mirror::_helper::InodeKey>::iterator lruPos;
+		};
+
+		using Map = std::unordered_map<mirror::_helper::InodeKey, Entry, mirror::_helper::InodeKeyHash>;
+
+		static mirror::_helper::InodeKey key(const struct stat &fileStat) noexcept
+		{
+			return mirror::_helper::InodeKey{fileStat.st_dev, fileStat.st_ino};
+		}
+
+		static bool matches(const Entry &entry, const struct stat &fileStat,
+				const mirror::DigestAlgorithm digest) noexcept
+		{
+			return entry.size == fileStat.st_size && entry.mtime.tv_sec == fileStat.st_mtim.tv_sec &&
+					entry.mtime.tv_nsec == fileStat.st_mtim.tv_nsec && entry.algorithm == digest;
+		}
+
+		void erase(const Map::iterator it) noexcept
+		{
+			m_lru.erase(it->second.lruPos);
+			m_entries.erase(it);
+		}
+
+		std::mutex m_mutex;
+		Map m_entries;
+		// The keys of the entries, the most recently used first.
+		std::list<mirror::_helper::InodeKey> m_lru;
+		std::size_t m_scopes;
+	};
+
+	InodeDigestCache inodeDigests;
+
+	// Hashes the file from the current offset and compares it with the record.
+	bool matchesRecord(const int fd, const char * const path, const off_t fileSize,
+			const mirror::FileRecord &expectedFileRecord, const mirror::ReadOptions &options)
+	{
+		mirror::Digest digest(options.digest);
+		off_t size = 0;
+		auto hashChunk = [&] (const unsigned char buf[], const std::size_t n)
+		{
+			digest.update(buf, n);
+			mirror::countStat(mirror::StatCounter::bytesHashed, n);
+			size += n;
+		};
+		mirror::_helper::processFile(fd, path, fileSize, options, hashChunk);
+
+		unsigned char actualDigest[mirror::maxDigestSize];
+		digest.finish(actualDigest);
+		return size == expectedFileRecord.fileSize &&
+				std::equal(actualDigest, actualDigest + mirror::maxDigestSize, expectedFileRecord.digest);
+	}
+
+	inline bool hashInParallel(const off_t fileSize, const mirror::ReadOptions &options) noexcept
+	{
+		return options.digest == mirror::DigestAlgorithm::blake3 && options.hashThreads > 1 &&
+				fileSize >= mirror::ReadOptions::parallelHashThreshold;
+	}
+
+	/*
+	 * Calculates the BLAKE3 digest of the first fileSize bytes of the file in options.hashThreads threads
+	 * (including the calling one). The file is split into segments of hashSegmentSize bytes which are
+	 * read with pread() and hashed as independent subtrees. Returns false if the file size is not fileSize
+	 * (the file is modified while it is hashed), in which case the file is to be hashed as a whole.
+	 */
+	bool hashFileInParallel(const int fd, const off_t fileSize, const mirror::ReadOptions &options,
+			unsigned char dest[mirror::maxDigestSize])
+	{
+		using mirror::Blake3Hasher;
+		using mirror::ReadOptions;
+
+		constexpr std::uint64_t segmentChunks = ReadOptions::hashSegmentSize / Blake3Hasher::chunkSize;
+		static_assert(ReadOptions::hashSegmentSize % Blake3Hasher::chunkSize == 0 &&
+				(segmentChunks & (segmentChunks - 1)) == 0, "A segment must be a power of two chunks.");
+
+		const std::size_t segmentCount = static_cast<std::size_t>(
+				(fileSize + ReadOptions::hashSegmentSize - 1) / ReadOptions::hashSegmentSize);
+		assert(segmentCount > 1);
+
+		std::vector<Blake3Hasher::ChainingValue> subtrees(segmentCount);
+		std::atomic<std::size_t> nextSegment(0);
+		// errno of the first error, -1 if the file is shorter than fileSize.
+		std::atomic<int> error(0);
+
+		auto work = [&] () noexcept
+		{
+			unsigned char *buf;
+			try {
+				buf = mirror::_helper::threadReadBuffer(options.bufferSize);
+			}
+			catch (const std::bad_alloc &) {
+				int expected = 0;
+				error.compare_exchange_strong(expected, ENOMEM);
+				return;
+			}
+
+			for (std::size_t i; error.load(std::memory_order_relaxed) == 0 &&
+					(i = nextSegment.fetch_add(1, std::memory_order_relaxed)) < segmentCount;) {
+				const off_t segmentStart = static_cast<off_t>(i) * ReadOptions::hashSegmentSize;
+				const off_t segmentEnd = std::min(segmentStart + static_cast<off_t>(ReadOptions::hashSegmentSize),
+						fileSize);
+
+				Blake3Hasher hasher(i * segmentChunks);
+				for (off_t offset = segmentStart; offset < segmentEnd;) {
+					const std::size_t toRead = static_cast<std::size_t>(
+							std::min(static_cast<off_t>(options.bufferSize), segmentEnd - offset));
+					const ssize_t n = mirror::_helper::readFullyAt(fd, buf, toRead, offset);
+					if (n != static_cast<ssize_t>(toRead)) {
+						int expected = 0;
+						error.compare_exchange_strong(expected, n == -1 ? errno : -1);
+						return;
+					}
+					hasher.update(buf, toRead);
+					mirror::countStat(mirror::StatCounter::bytesHashed, toRead);
+					offset += static_cast<off_t>(toRead);
+				}
+				subtrees[i] = hasher.finishSubtree();
+			}
+		};
+
+		if (options.sequentialAdvice) {
+			// The segments are read in order, at most hashThreads ones at a time.
+			posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+		}
+
+		const unsigned threadCount = static_cast<unsigned>(
+				std::min(static_cast<std::size_t>(options.hashThreads), segmentCount));
+		std::vector<std::thread> workers;
+		workers.reserve(threadCount - 1);
+		try {
+			for (unsigned i = 1; i < threadCount; ++i) {
+				workers.emplace_back(work);
+			}
+		}
+		catch (...) {
+			// The segments are hashed by the threads started.
+		}
+		work();
+		for (std::thread &worker : workers) {
+			worker.join();
+		}
+
+		const int errorCode = error.load();
+		if (errorCode > 0) {
+			mirror::_helper::handleReadFileError(errorCode);
+		}
+		if (errorCode == -1) {
+			return false;
+		}
+		// The file could have grown since it was stat'ed.
+		unsigned char probe;
+		const ssize_t n = mirror::_helper::readFullyAt(fd, &probe, 1, fileSize);
+		if (n == -1) {
+			mirror::_helper::handleReadFileError(errno);
+		}
+		if (n != 0) {
+			return false;
+		}
+
+		Blake3Hasher::mergeSubtrees(subtrees.data(), segmentCount, dest);
+		std::fill(dest + Blake3Hasher::digestSize, dest + mirror::maxDigestSize, 0);
+		return true;
+	}
+}
+
+bool mirror::VerifyOptions::inSample(const char * const relPath, const std::size_t relPathSize) const noexcept
+{
+	constexpr unsigned bucketCount = 100;
+
+	// FNV-1a, so that the buckets are stable between runs and platforms.
+	std::uint_fast64_t hash = 0xcbf29ce484222325;
+	for (std::size_t i = 0; i < relPathSize; ++i) {
+		hash = ((hash ^ static_cast<unsigned char>(relPath[i])) * 0x100000001b3) & 0xffffffffffffffff;
+	}
+	const unsigned bucket = static_cast<unsigned>(hash % bucketCount);
+	const unsigned firstBucket = static_cast<unsigned>((sampleRotation % bucketCount) * samplePercent % bucketCount);
+
+	return (bucket + bucketCount - firstBucket) % bucketCount < samplePercent;
 }
 
 [[noreturn]]
@@ -178,93 +530,742 @@ throw_static_msg:
 	throw std::runtime_error(msg);
 }
 
-void mirror::_helper::fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
+void mirror::_helper::DirReader::open(const int dirFd)
+{
+	assert(m_fd == -1);
+
+	if (m_buf == nullptr) {
+		m_buf.reset(new char[bufferSize]);
+	}
+	m_fd = dirFd;
+	m_size = 0;
+	m_offset = 0;
+}
+
+void mirror::_helper::DirReader::close()
+{
+	if (m_fd != -1) {
+		const int fd = m_fd;
+		m_fd = -1;
+		if (::close(fd) != 0) {
+			// TODO handle error.
+			throw errno;
+		}
+	}
+}
+
+bool mirror::_helper::DirReader::fill()
+{
+	mirror::countStat(StatCounter::getdentsCalls);
+	const PhaseTimer timer(StatPhase::listing);
+	const long n = syscall(__NR_getdents64, m_fd, m_buf.get(), bufferSize);
+	if (n == -1) {
+		handleReadDirError(errno);
+	}
+	m_size = static_cast<std::size_t>(n);
+	m_offset = 0;
+	return n > 0;
+}
+
+bool mirror::_helper::statDirEntry(const int dirFd, const char * const name, const unsigned char type,
+		const char * const path, const std::size_t pathSize, struct stat &dest)
+{
+	switch (type) {
+	case DT_REG:
+	case DT_DIR:
+	case DT_LNK:
+	case DT_UNKNOWN:
+		break;
+	default:
+		// TODO support non-regular and non-directory files.
+		logDebug("The file '"_s, std::make_pair(path, path + pathSize),
+				"' is neither a directory or a regular file. Skipping it..."_s);
+		return false;
+	}
+
+	mirror::countStat(StatCounter::fstatatCalls);
+	const PhaseTimer timer(StatPhase::stat);
+	if (fstatat(dirFd, name, &dest, 0) != 0) {
+		switch (errno) {
+		case EACCES:
+			// TODO make the behaviour configurable.
+			logDebug("No access to '"_s, std::make_pair(path, path + pathSize), '\'');
+			return false;
+		default:
+			// The same errors were reported when the files were opened to be stat'ed.
+			handleOpenFileError(errno);
+		}
+	}
+
+	if (S_ISREG(dest.st_mode)) {
+		mirror::countStat(StatCounter::filesVisited);
+		return true;
+	}
+	if (S_ISDIR(dest.st_mode)) {
+		mirror::countStat(StatCounter::dirsVisited);
+		return true;
+	}
+	// TODO support non-regular and non-directory files.
+	logDebug("The file '"_s, std::make_pair(path, path + pathSize),
+			"' is neither a directory or a regular file. Skipping it..."_s);
+	return false;
+}
+
+void mirror::_helper::hashScannedFile(const struct stat &fileStat, const int dirFd,
+		const afc::FastStringBuffer<char> &path, const std::size_t fileNameOffset, const ReadOptions &options,
 		mirror::FileRecord &dest)
+{
+	const int fd = openScannedFile(dirFd, path, fileNameOffset);
+	try {
+		fillRegularFileRecord(fileStat, fd, path.c_str(), options, dest);
+	}
+	catch (...) {
+		::close(fd);
+		throw;
+	}
+	if (::close(fd) != 0) {
+		// TODO handle error.
+		throw errno;
+	}
+}
+
+mirror::_helper::InodeDigestScope::InodeDigestScope()
+{
+	inodeDigests.enter();
+}
+
+mirror::_helper::InodeDigestScope::~InodeDigestScope()
+{
+	inodeDigests.exit();
+}
+
+void mirror::_helper::fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
+		const ReadOptions &options, mirror::FileRecord &dest)
 {
 	dest.type = FileType::file;
 	dest.fileSize = fileStat.st_size;
 	dest.lastModifiedTS.setMillis(static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000);
 
-	std::uint_fast64_t crc64 = 0;
-	auto calcCRC64 = [&crc64] (const unsigned char buf[], const std::size_t n)
-	{
-		crc64 = afc::crc64ReversedUpdate(crc64, buf, n);
-	};
+	const bool hardLinked = fileStat.st_nlink > 1;
+	if (hardLinked && inodeDigests.find(fileStat, options.digest, dest.digest)) {
+		mirror::countStat(StatCounter::hardLinksReused);
+		logDebug("The digest of '"_s, filePath, "' is reused from another hard link."_s);
+		return;
+	}
 
-	mirror::_helper::processFile(fd, filePath, calcCRC64);
+	const PhaseTimer timer(StatPhase::hashing);
+	if (!(hashInParallel(fileStat.st_size, options) &&
+			hashFileInParallel(fd, fileStat.st_size, options, dest.digest))) {
+		// pread() does not move the file offset, so the file is read from the beginning if it is modified meanwhile.
+		Digest digest(options.digest);
+		auto calcDigest = [&digest] (const unsigned char buf[], const std::size_t n)
+		{
+			digest.update(buf, n);
+			mirror::countStat(StatCounter::bytesHashed, n);
+		};
 
-	for (int i = 0; i < 8; ++i) {
-		dest.crc64[i] = crc64 & 0xff;
-		crc64 >>= 8;
+		mirror::_helper::processFile(fd, filePath, fileStat.st_size, options, calcDigest);
+		digest.finish(dest.digest);
+	}
+	if (options.dropCache) {
+		dropFileCache(fd);
+	}
+	if (hardLinked) {
+		inodeDigests.add(fileStat, options.digest, dest.digest);
 	}
 }
 
-void mirror::createDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db)
+void mirror::_helper::readSortedDir(const int dirFd, const char * const path, SortedDir &dest)
 {
+	logDebug("Scanning '"_s, path, "'..."_s);
+
+	dest.reader.open(dirFd);
+	dest.names.clear();
+	dest.entries.clear();
+	dest.subdirs.clear();
+	dest.nextSubdir = 0;
+
+	const char *name;
+	unsigned char type;
+	while (dest.reader.next(name, type)) {
+		if (name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'))) {
+			// Either the current dir or the parent dir. Skipping it.
+			continue;
+		}
+
+		const std::size_t nameSize = std::strlen(name);
+
+		SortedDir::Entry entry;
+		entry.nameOffset = dest.names.size();
+		entry.nameSize = nameSize;
+		dest.names.append(name, nameSize + 1);
+		entry.nameU8Offset = dest.names.size();
+		// The name is converted straight into the buffer.
+		appendUtf8(name, nameSize, dest.names);
+		entry.nameU8Size = dest.names.size() - entry.nameU8Offset;
+		entry.type = type;
+		dest.entries.push_back(entry);
+	}
+
+	const std::string &names = dest.names;
+	std::sort(dest.entries.begin(), dest.entries.end(),
+			[&names] (const SortedDir::Entry &e1, const SortedDir::Entry &e2)
+			{
+				return compareBytes(names.data() + e1.nameU8Offset, e1.nameU8Size,
+						names.data() + e2.nameU8Offset, e2.nameU8Size) < 0;
+			});
+}
+
+void mirror::createDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
+		const ScanOptions &options)
+{
+	using Pool = FilePool;
+
+	// Outlives the hashing pool.
+	const mirror::_helper::InodeDigestScope inodeDigestScope;
+
 	struct EventHandler
 	{
-		EventHandler(mirror::FileDB &db) noexcept : m_db(db) {}
+		EventHandler(mirror::FileDB &db, const ScanOptions &options, DirSet * const completedDirs,
+				Pool * const pool)
+				: m_relDirsU8(), m_nameBuf(), m_dirNodes(), m_openDirNodes(), m_nextDirNode(0), m_db(db),
+				  m_readOptions(options.read), m_completedDirs(completedDirs), m_pool(pool) {}
 
-		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset) const noexcept {}
-		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset) const noexcept {}
+		void operator()(Pool::Task &task)
+		{
+			addPendingFile(m_db, task);
+			releaseDirNode(task.payload.dirNode);
+		}
 
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
-				const std::size_t relDirOffset, const std::size_t fileNameOffset) const
+		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
-			const char * const relPath = path.begin() + relDirOffset;
+			m_relDirsU8.push(path.begin() + relDirOffset, path.size() - relDirOffset);
 
-			logDebug("Adding the file '"_s, std::make_pair(relPath, path.end()), "' to the DB..."_s);
+			const TextView relDirU8 = m_relDirsU8.top();
+			const std::size_t parent = m_openDirNodes.empty() ? noDirNode : m_openDirNodes.back();
+			m_dirNodes.emplace(m_nextDirNode, DirNode{std::string(relDirU8.value, relDirU8.size), parent, 1});
+			if (parent != noDirNode) {
+				++m_dirNodes.at(parent).pending;
+			}
+			m_openDirNodes.push_back(m_nextDirNode++);
+		}
 
+		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			m_relDirsU8.pop();
+
+			const std::size_t node = m_openDirNodes.back();
+			m_openDirNodes.pop_back();
+			releaseDirNode(node);
+		}
+
+		bool file(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
+				const std::size_t relDirOffset, const std::size_t fileNameOffset)
+		{
+			const char * const relPath = path.begin() + relDirOffset;
+
+			const bool hashInline = m_pool == nullptr || !S_ISREG(fileStat.st_mode);
 			mirror::FileRecord fileRecord;
 
+			const char * const fileName = path.begin() + fileNameOffset;
+			const std::size_t fileNameSize = path.size() - fileNameOffset;
+			const TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, m_nameBuf);
+			const TextView relDirU8 = m_relDirsU8.top();
+
 			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
+			if (S_ISDIR(fileStat.st_mode) && isCompleted(relDirU8, fileNameU8)) {
+				logDebug("Skipping the completed directory '"_s, std::make_pair(relPath, path.end()), "'..."_s);
+				return false;
+			}
+
+			logDebug("Adding the file '"_s, std::make_pair(relPath, path.end()), "' to the DB..."_s);
+
 			if (S_ISREG(fileStat.st_mode)) {
-				mirror::_helper::fillRegularFileRecord(fileStat, fd, path.c_str(), fileRecord);
+				if (hashInline) {
+					mirror::_helper::hashScannedFile(fileStat, dirFd, path, fileNameOffset, m_readOptions, fileRecord);
+				}
 			} else {
 				fileRecord.type = FileType::dir;
 			}
 
+			if (hashInline) {
+				m_db.addFile(fileNameU8.value, fileNameU8.size, relDirU8.value, relDirU8.size, fileRecord);
+			} else {
+				const std::size_t node = m_openDirNodes.back();
+				const int taskFd = mirror::_helper::openScannedFile(dirFd, path, fileNameOffset);
+				Pool::Task task(taskFd, fileStat, std::string(path.data(), path.size()), PendingFile{
+						std::string(fileNameU8.value, fileNameU8.size), std::string(relDirU8.value, relDirU8.size),
+						node});
+
+				// The file is added to the DB when its digest is calculated, and its directory is not completed until then.
+				++m_dirNodes.at(node).pending;
+				m_pool->submit(std::move(task), *this);
+			}
+
+			return true;
+		}
+	private:
+		/*
+		 * A directory whose subtree is not added to the DB completely. It is pending while it is being walked,
+		 * while any of its subdirectories is pending and while any of its files is being hashed.
+		 */
+		struct DirNode
+		{
+			std::string relDirU8;
+			std::size_t parent;
+			std::size_t pending;
+		};
+
+		void releaseDirNode(std::size_t node)
+		{
+			while (node != noDirNode) {
+				const auto n = m_dirNodes.find(node);
+				assert(n != m_dirNodes.end());
+				if (--n->second.pending > 0) {
+					return;
+				}
+				m_db.completeDir(n->second.relDirU8.data(), n->second.relDirU8.size());
+				node = n->second.parent;
+				m_dirNodes.erase(n);
+			}
+		}
+
+		bool isCompleted(const TextView relDirU8, const TextView fileNameU8)
+		{
+			if (m_completedDirs == nullptr) {
+				return false;
+			}
+			if (relDirU8.size == 0) {
+				return m_completedDirs->find(PathKey(fileNameU8.value, fileNameU8.size, true)) != m_completedDirs->end();
+			}
+			m_dirBuf.assign(relDirU8.value, relDirU8.size).append(1, '/').append(fileNameU8.value, fileNameU8.size);
+			return m_completedDirs->find(PathKey(m_dirBuf.data(), m_dirBuf.size(), true)) != m_completedDirs->end();
+		}
+
+		mirror::_helper::Utf8DirStack m_relDirsU8;
+		// The names converted are written here, so that no memory is allocated per file.
+		std::string m_nameBuf;
+		// The relative paths of the directories looked up in the checkpoint.
+		std::string m_dirBuf;
+		std::unordered_map<std::size_t, DirNode> m_dirNodes;
+		// The nodes of the directories being walked, from the root one.
+		std::vector<std::size_t> m_openDirNodes;
+		std::size_t m_nextDirNode;
+		mirror::FileDB &m_db;
+		const ReadOptions &m_readOptions;
+		// The subtrees that are not walked, or nullptr if the run is not resumed.
+		DirSet * const m_completedDirs;
+		Pool * const m_pool;
+	};
+
+	std::unique_ptr<Pool> pool;
+	if (options.jobs > 1) {
+		pool.reset(new Pool(options.jobs, options.jobs * mirror::_helper::hashingTasksPerThread, options.read));
+		// No file is added while the traversal waits for large files to be hashed, so the period is checked here.
+		if (options.commitPeriod > 0) {
+			pool->setIdleOp([&db] { db.commitIfDue(); }, std::chrono::seconds(1));
+		}
+	}
+
+	db.beginBulkLoad(options.commitInterval, options.commitPeriod);
+	mirror::DirSet completedDirs;
+	try {
+		db.beginCheckpoint(options.resume);
+		if (options.resume) {
+			db.getCompletedDirs(completedDirs);
+			logDebug("Resuming with the completed directories: "_s, completedDirs.size());
+		}
+	}
+	catch (...) {
+		db.endBulkLoad();
+		throw;
+	}
+
+	EventHandler eventHandler(db, options, options.resume ? &completedDirs : nullptr, pool.get());
+
+	db.beginTransaction();
+	try {
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walkers, options.shard,
+				options.order);
+		if (pool != nullptr) {
+			pool->finish(eventHandler);
+		}
+		db.endCheckpoint();
+	}
+	catch (...) {
+		// The files added so far are kept with the checkpoint, so that the run can be resumed.
+		try {
+			db.commit();
+		}
+		catch (...) {
+			db.rollback();
+		}
+		db.endBulkLoad();
+		throw;
+	}
+	db.commit();
+	db.endBulkLoad();
+}
+
+void mirror::updateDB(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
+		const ScanOptions &options)
+{
+	using Pool = FilePool;
+
+	// Outlives the hashing pool.
+	const mirror::_helper::InodeDigestScope inodeDigestScope;
+
+	struct EventHandler
+	{
+		EventHandler(mirror::FileDB &db, const ScanOptions &options, Pool * const pool)
+				: ctxs(), relDirsU8(), nameBuf(), m_db(db), m_readOptions(options.read), m_shard(options.shard),
+				  m_pool(pool) {}
+
+		void operator()(Pool::Task &task) const
+		{
+			addPendingFile(m_db, task);
+		}
+
+		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			const char * const relDir = path.begin() + relDirOffset;
+			logDebug("Entering '"_s, std::pair<const char *, const char *>(relDir, path.end()), "'..."_s);
+
+			relDirsU8.push(relDir, path.size() - relDirOffset);
+			const TextView relDirU8 = relDirsU8.top();
+			m_db.getFiles(relDirU8.value, relDirU8.size, ctxs.push(), &ctxs.arena());
+		}
+
+		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
+		{
+			const TextView relDirU8 = relDirsU8.top();
+
+			// The files and directories that are left are not found in the file system.
+			for (const auto &e : ctxs.top()) {
+				if (!mirror::_helper::shardOwnsDBEntry(m_shard, path, relDirOffset, e.first.data, e.first.size,
+						nameBuf)) {
+					continue;
+				}
+				logDebug("Removing the "_s, e.second.type, " '"_s, RelPathView(relDirU8.value, relDirU8.size,
+						e.first.data, e.first.size), "' from the DB..."_s);
+
+				if (e.second.type == FileType::dir) {
+					removeDirContent(relDirU8, e.first.data, e.first.size);
+				}
+				m_db.removeFile(e.first.data, e.first.size, relDirU8.value, relDirU8.size);
+			}
+
+			ctxs.pop();
+			relDirsU8.pop();
+		}
+
+		bool file(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
+				const std::size_t relPathOffset, const std::size_t fileNameOffset)
+		{
+			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
+
+			const char * const relPath = path.begin() + relPathOffset;
 			const char * const fileName = path.begin() + fileNameOffset;
 			const std::size_t fileNameSize = path.size() - fileNameOffset;
-			const TextHolder fileNameU8 = mirror::convertToUtf8(fileName, fileNameSize);
+			const FileType type = S_ISDIR(fileStat.st_mode) ? FileType::dir : FileType::file;
+			const TextView relDirU8 = relDirsU8.top();
+
+			const TextView fileNameU8 = mirror::toUtf8(fileName, fileNameSize, nameBuf);
+			DirFileMap &ctx = ctxs.top();
+			const auto dbEntry = ctx.find(PathKey(fileNameU8.value, fileNameU8.size, true));
+
+			if (dbEntry != ctx.end()) {
+				const FileRecord &dbRecord = dbEntry->second;
+
+				if (dbRecord.type == type && (type == FileType::dir ||
+						(dbRecord.fileSize == fileStat.st_size && dbRecord.lastModifiedTS.millis() ==
+								static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000))) {
+					logDebug("Keeping the "_s, type, " '"_s, std::make_pair(relPath, path.end()), "' unchanged..."_s);
+					ctx.erase(dbEntry);
+					return true;
+				}
+
+				if (dbRecord.type == FileType::dir) { // The directory is replaced with a file.
+					removeDirContent(relDirU8, fileNameU8.value, fileNameU8.size);
+				}
+				ctx.erase(dbEntry);
+
+				logDebug("Updating the "_s, type, " '"_s, std::make_pair(relPath, path.end()), "' in the DB..."_s);
+			} else {
+				logDebug("Adding the "_s, type, " '"_s, std::make_pair(relPath, path.end()), "' to the DB..."_s);
+			}
+
+			mirror::FileRecord fileRecord;
+
+			if (type == FileType::file) {
+				if (m_pool != nullptr) {
+					const int taskFd = mirror::_helper::openScannedFile(dirFd, path, fileNameOffset);
+					Pool::Task task(taskFd, fileStat, std::string(path.data(), path.size()), PendingFile{
+							std::string(fileNameU8.value, fileNameU8.size), std::string(relDirU8.value, relDirU8.size)});
 
-			std::size_t relDirSize = fileNameOffset - relDirOffset;
-			if (relDirSize > 0) {
-				--relDirSize; // removing separator between dir and file.
+					// The file is added to the DB when its digest is calculated.
+					m_pool->submit(std::move(task), *this);
+					return true;
+				}
+				mirror::_helper::hashScannedFile(fileStat, dirFd, path, fileNameOffset, m_readOptions, fileRecord);
+			} else {
+				fileRecord.type = FileType::dir;
 			}
-			// TODO do not convert relative dir again and again for every file in the directory.
-			const TextHolder relDirU8 = mirror::convertToUtf8(relPath, relDirSize);
 
 			m_db.addFile(fileNameU8.value, fileNameU8.size, relDirU8.value, relDirU8.size, fileRecord);
 
 			return true;
 		}
+
+		void removeDirContent(const TextView parentDirU8, const char * const dirNameU8, const std::size_t dirNameSize)
+		{
+			if (parentDirU8.size == 0) {
+				m_db.removeDir(dirNameU8, dirNameSize);
+			} else {
+				std::string dirU8;
+				dirU8.reserve(parentDirU8.size + 1 + dirNameSize);
+				dirU8.append(parentDirU8.value, parentDirU8.size).append(1, '/').append(dirNameU8, dirNameSize);
+				m_db.removeDir(dirU8.data(), dirU8.size());
+			}
+		}
+
+		mirror::DirFileMapStack ctxs;
+		// The relative paths of the directories being scanned in UTF-8 (converted once per directory).
+		mirror::_helper::Utf8DirStack relDirsU8;
+		// The names converted are written here, so that no memory is allocated per file.
+		std::string nameBuf;
 	private:
 		mirror::FileDB &m_db;
-	} eventHandler(db);
+		const ReadOptions &m_readOptions;
+		const ShardOptions &m_shard;
+		Pool * const m_pool;
+	};
+
+	std::unique_ptr<Pool> pool;
+	if (options.jobs > 1) {
+		pool.reset(new Pool(options.jobs, options.jobs * mirror::_helper::hashingTasksPerThread, options.read));
+	}
 
+	EventHandler eventHandler(db, options, pool.get());
+
+	db.beginBulkLoad(0);
 	db.beginTransaction();
 	try {
-		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler);
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walkers, options.shard,
+				options.order);
+		if (pool != nullptr) {
+			pool->finish(eventHandler);
+		}
 	}
 	catch (...) {
 		db.rollback();
+		db.endBulkLoad();
 		throw;
 	}
 	db.commit();
+	db.endBulkLoad();
+
+	assert(eventHandler.ctxs.empty());
 }
 
-bool mirror::copyFile(const int srcDirFd, const int destDirFd, const char * const relPath)
+void mirror::mergeDB(mirror::FileDB &db, mirror::FileDB &src, const std::size_t commitInterval)
 {
-	// TODO support fsync
-	// TODO support copying symlinks
+	db.setDigestAlgorithm(src.digestAlgorithm());
+
+	// The directory key is converted to the relative path of the directory here.
+	std::string dirU8;
+
+	db.beginBulkLoad(commitInterval);
+	db.beginTransaction();
+	try {
+		mirror::FileDB::SortedFile file;
+		while (src.nextSortedFile(file)) {
+			// The key is the names of the directories each preceded by '\0'.
+			dirU8.assign(file.dirKey + (file.dirKeySize == 0 ? 0 : 1), file.dirKeySize == 0 ? 0 : file.dirKeySize - 1);
+			std::replace(dirU8.begin(), dirU8.end(), '\0', '/');
+
+			logDebug("Adding the "_s, file.record.type, " '"_s, RelPathView(dirU8.data(), dirU8.size(),
+					file.fileNameU8, file.fileNameSize), "' to the DB..."_s);
+
+			db.addFile(file.fileNameU8, file.fileNameSize, dirU8.data(), dirU8.size(), file.record);
+		}
+	}
+	catch (...) {
+		db.rollback();
+		db.endBulkLoad();
+		throw;
+	}
+	db.commit();
+	db.endBulkLoad();
+}
+
+bool mirror::copyFile(const int srcDirFd, const int destDirFd, const char * const relPath,
+		const ReadOptions &options)
+{
+	int srcFd, destFd;
+	if (!openFilesToCopy(srcDirFd, destDirFd, relPath, srcFd, destFd)) {
+		return false;
+	}
+
+	bool success = true;
+	struct stat srcStat;
+	mirror::CopyStrategy strategy;
+
+	if (fstat(srcFd, &srcStat) != 0) {
+		// TODO log error.
+		success = false;
+		goto end;
+	}
+	if (!mirror::_helper::copyFileData(srcFd, destFd, srcStat.st_size, options, strategy)) {
+		success = false;
+		goto end;
+	}
+	mirror::countStat(StatCounter::bytesCopied, static_cast<std::uint_fast64_t>(srcStat.st_size));
+	logDebug("The file '"_s, relPath, "' is copied using "_s, mirror::copyStrategyName(strategy), "."_s);
+	if (options.dropCache) {
+		mirror::_helper::dropFileCache(srcFd);
+		mirror::_helper::dropFileCache(destFd);
+	}
+
+end:
+	return closeCopiedFiles(srcFd, destFd) && success;
+}
+
+bool mirror::copyAndVerifyFile(const int srcDirFd, const int destDirFd, const char * const relPath,
+		const FileRecord &expectedFileRecord, const ReadOptions &options, _helper::HardLinks * const links)
+{
+	if (links != nullptr) {
+		struct stat linkStat;
+		if (fstatat(srcDirFd, relPath, &linkStat, AT_SYMLINK_NOFOLLOW) == 0 && linkStat.st_nlink > 1 &&
+				links->link(linkStat, destDirFd, relPath, &expectedFileRecord)) {
+			return true;
+		}
+	}
+
+	int srcFd, destFd;
+	if (!openFilesToCopy(srcDirFd, destDirFd, relPath, srcFd, destFd)) {
+		return false;
+	}
+
+	Digest digest(options.digest);
+	off_t copiedSize = 0;
+	bool writeFailed = false;
+	auto copyChunk = [&] (const unsigned char buf[], const std::size_t n)
+	{
+		digest.update(buf, n);
+		mirror::countStat(StatCounter::bytesHashed, n);
+		copiedSize += n;
+		// The rest of the file is still read to keep processFile() simple; the copy is removed anyway.
+		if (!writeFailed && !mirror::_helper::writeFully(destFd, buf, n)) {
+			writeFailed = true;
+		}
+	};
+
+	bool success = true;
+	struct stat srcStat;
+
+	try {
+		if (fstat(srcFd, &srcStat) != 0) {
+			// TODO handle error.
+			throw errno;
+		}
+		mirror::_helper::processFile(srcFd, relPath, srcStat.st_size, options, copyChunk);
+		if (options.dropCache) {
+			mirror::_helper::dropFileCache(srcFd);
+			mirror::_helper::dropFileCache(destFd);
+		}
+	}
+	catch (...) {
+		closeCopiedFiles(srcFd, destFd);
+		removeCopiedFile(destDirFd, relPath);
+		throw;
+	}
+
+	if (!closeCopiedFiles(srcFd, destFd) || writeFailed) {
+		// TODO log error.
+		success = false;
+	} else {
+		mirror::countStat(StatCounter::bytesCopied, static_cast<std::uint_fast64_t>(copiedSize));
+
+		unsigned char actualDigest[maxDigestSize];
+		digest.finish(actualDigest);
+		const bool digestMatch = std::equal(actualDigest, actualDigest + maxDigestSize, expectedFileRecord.digest);
+		if (copiedSize != expectedFileRecord.fileSize || !digestMatch) {
+			afc::logger::logError("The copy of the file '"_s, relPath,
+					"' does not match the DB and is removed! DB size: "_s, expectedFileRecord.fileSize,
+					", copied size: "_s, copiedSize, digestMatch ? "."_s : ", digest mismatch."_s);
+			success = false;
+		}
+	}
+
+	if (!success) {
+		removeCopiedFile(destDirFd, relPath);
+		return false;
+	}
+	if (links != nullptr) {
+		links->add(srcStat, relPath, &expectedFileRecord);
+	}
+	logDebug("The file '"_s, relPath, "' is copied and verified."_s);
+	return true;
+}
+
+bool mirror::_helper::HardLinks::link(const struct stat &srcStat, const int destDirFd, const char * const destPath,
+		const FileRecord * const expectedFileRecord)
+{
+	const auto it = m_copies.find(InodeKey{srcStat.st_dev, srcStat.st_ino});
+	if (it == m_copies.end()) {
+		return false;
+	}
+	const Copy &copy = it->second;
+	if (expectedFileRecord != nullptr && !(copy.verified && copy.size == expectedFileRecord->fileSize &&
+			std::equal(copy.digest, copy.digest + maxDigestSize, expectedFileRecord->digest))) {
+		return false;
+	}
+	if (linkat(destDirFd, copy.path.c_str(), destDirFd, destPath, 0) != 0) {
+		// The file is copied instead, e.g. if the destination file system does not support hard links.
+		logDebug("Unable to link '"_s, destPath, "' to '"_s, copy.path.c_str(), "'."_s);
+		return false;
+	}
+	mirror::countStat(StatCounter::hardLinksReused);
+	logDebug("The file '"_s, destPath, "' is linked to '"_s, copy.path.c_str(), "'."_s);
+	return true;
+}
+
+void mirror::_helper::HardLinks::add(const struct stat &srcStat, const char * const destPath,
+		const FileRecord * const verifiedFileRecord)
+{
+	if (srcStat.st_nlink < 2) {
+		return;
+	}
+	const auto result = m_copies.emplace(InodeKey{srcStat.st_dev, srcStat.st_ino}, Copy());
+	Copy &copy = result.first->second;
+	if (!result.second && (copy.verified || verifiedFileRecord == nullptr)) {
+		// The first copy is kept unless this one is verified and the first one is not.
+		return;
+	}
+	copy.path = destPath;
+	copy.verified = verifiedFileRecord != nullptr;
+	if (copy.verified) {
+		copy.size = verifiedFileRecord->fileSize;
+		std::copy_n(verifiedFileRecord->digest, maxDigestSize, copy.digest);
+	} else {
+		copy.size = 0;
+		std::fill_n(copy.digest, maxDigestSize, 0);
+	}
+}
+
+bool mirror::repairFile(const int srcDirFd, const int destDirFd, const char * const relPath,
+		const FileRecord &expectedFileRecord, const ReadOptions &options)
+{
+	// Blocks of this size are compared and rewritten if they differ.
+	constexpr std::size_t repairBlockSize = 64 * 1024;
+
 	const int srcFd = openat(srcDirFd, relPath, O_NOFOLLOW | O_RDONLY);
 	if (srcFd == -1) {
 		// TODO log error.
 		return false;
 	}
-	// TODO preserve timestamps, sticky flags, permissions, ownership
-	const int destFd = openat(destDirFd, relPath, O_CREAT | O_EXCL | O_RDWR, S_IRWXU);
+	const int destFd = openat(destDirFd, relPath, O_NOFOLLOW | O_RDWR);
 	if (destFd == -1) {
 		if (close(srcFd) == -1) {
 			// TODO log error.
@@ -273,44 +1274,111 @@ bool mirror::copyFile(const int srcDirFd, const int destDirFd, const char * cons
 		return false;
 	}
 
-	bool success = true;
-
-	constexpr std::size_t bufSize = 4096;
-	unsigned char buf[bufSize];
-	for (;;) {
-		const ssize_t n = read(srcFd, buf, bufSize);
-		if (n == 0) {
-			break;
-		} else if (n == -1) {
+	/*
+	 * The source file is checked against the DB before the destination one is touched, so that a source file
+	 * that is corrupted or is changed does not overwrite a good copy. The source file is read twice then.
+	 */
+	struct stat srcStat;
+	try {
+		if (fstat(srcFd, &srcStat) != 0) {
 			// TODO handle error.
-			success = false;
-			goto end;
-		} else {
-			const ssize_t m = write(destFd, buf, n);
-			if (m < n) {
-				// TODO handle error
-				success = false;
-				goto end;
+			throw errno;
+		}
+		if (!matchesRecord(srcFd, relPath, srcStat.st_size, expectedFileRecord, options)) {
+			closeCopiedFiles(srcFd, destFd);
+			afc::logger::logError("The source file '"_s, relPath, "' does not match the DB!"_s);
+			return false;
+		}
+		if (lseek(srcFd, 0, SEEK_SET) == -1) {
+			// TODO handle error.
+			throw errno;
+		}
+	}
+	catch (...) {
+		closeCopiedFiles(srcFd, destFd);
+		throw;
+	}
+
+	// processFile() passes chunks of at most this size.
+	const std::size_t destBufSize = std::max(options.bufferSize, ReadOptions::smallFileSize);
+	std::unique_ptr<unsigned char[]> destBuf(new unsigned char[destBufSize]);
+
+	// The blocks are rewritten only from the data up to the size checked.
+	Digest digest(options.digest);
+	off_t offset = 0;
+	off_t rewrittenSize = 0;
+	bool ioFailed = false;
+	auto repairChunk = [&] (const unsigned char buf[], const std::size_t n)
+	{
+		assert(n <= destBufSize);
+
+		digest.update(buf, n);
+		mirror::countStat(StatCounter::bytesHashed, n);
+		if (offset + static_cast<off_t>(n) > expectedFileRecord.fileSize) {
+			// The source file has grown since it was checked.
+			ioFailed = true;
+		}
+		if (!ioFailed) {
+			const ssize_t destSize = mirror::_helper::readFullyAt(destFd, destBuf.get(), n, offset);
+			if (destSize == -1) {
+				ioFailed = true;
+			}
+			for (std::size_t i = 0; !ioFailed && i < n; i += repairBlockSize) {
+				const std::size_t blockSize = std::min(repairBlockSize, n - i);
+				// The blocks beyond the end of the destination file always differ.
+				if (static_cast<std::size_t>(destSize) < i + blockSize ||
+						std::memcmp(buf + i, destBuf.get() + i, blockSize) != 0) {
+					if (!mirror::_helper::writeFullyAt(destFd, buf + i, blockSize, offset + static_cast<off_t>(i))) {
+						ioFailed = true;
+					}
+					rewrittenSize += blockSize;
+				}
 			}
 		}
+		offset += n;
+	};
+
+	try {
+		mirror::_helper::processFile(srcFd, relPath, srcStat.st_size, options, repairChunk);
+		if (options.dropCache) {
+			mirror::_helper::dropFileCache(srcFd);
+			mirror::_helper::dropFileCache(destFd);
+		}
+	}
+	catch (...) {
+		closeCopiedFiles(srcFd, destFd);
+		throw;
 	}
 
-end:
-	if (close(srcFd) == -1) {
-		// TODO log error.
-		success = false;
+	if (!ioFailed && ftruncate(destFd, offset) != 0) {
+		ioFailed = true;
 	}
-	if (close(destFd) == -1) {
-		// TODO log error.
-		success = false;
+	if (!closeCopiedFiles(srcFd, destFd) || ioFailed) {
+		// TODO report the cause of the error (errno).
+		afc::logger::logError("Unable to repair the file '"_s, relPath, "'!"_s);
+		return false;
+	}
+	mirror::countStat(StatCounter::bytesCopied, static_cast<std::uint_fast64_t>(rewrittenSize));
+
+	unsigned char actualDigest[maxDigestSize];
+	digest.finish(actualDigest);
+	const bool digestMatch = offset == expectedFileRecord.fileSize &&
+			std::equal(actualDigest, actualDigest + maxDigestSize, expectedFileRecord.digest);
+	if (!digestMatch) {
+		afc::logger::logError("The source file '"_s, relPath, "' has changed while the file was repaired!"_s);
+		return false;
 	}
-	return success;
+
+	logDebug("The file '"_s, relPath, "' is repaired, "_s, rewrittenSize, " of "_s, offset,
+			" bytes are rewritten."_s);
+	return true;
 }
 
 // TODO get relPathSize, too.
 bool mirror::copyDir(const int srcDirFd, const char * const srcDir, const std::size_t srcDirSize,
 		const int destDirFd, const char * const destDir, const std::size_t destDirSize,
-		const char * const relPath, const std::size_t relPathSize)
+		const char * const relPath, const std::size_t relPathSize, const ReadOptions &options,
+		_helper::HardLinks * const links)
 {
 	// TODO support fsync
 	// TODO support copying symlinks
@@ -321,7 +1389,7 @@ bool mirror::copyDir(const int srcDirFd, const char * const srcDir, const std::s
 	}
 
 	// TODO close srcFd.
-	CopyDirHandler handler(dirToCopyFd, destDirFd, relPath, relPathSize);
+	CopyDirHandler handler(dirToCopyFd, destDirFd, relPath, relPathSize, options, links);
 
 	afc::FastStringBuffer<char> dirToCopyBuf(srcDirSize + 1 + relPathSize);
 	dirToCopyBuf.append(srcDir, srcDirSize);
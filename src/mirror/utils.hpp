@@ -22,32 +22,198 @@ along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 #include <afc/logger.hpp>
 #include <afc/number.h>
 #include <afc/StringRef.hpp>
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstddef>
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include "digest.hpp"
 #include <dirent.h>
+#include "DirPrefetcher.hpp"
 #include "encoding.hpp"
 #include <fcntl.h>
 #include "FileDB.hpp"
-#include <stack>
+#include <functional>
+#include "HashingPool.hpp"
+#include "io.hpp"
+#include "uring.hpp"
+#include <memory>
+#include "order.hpp"
+#include "report.hpp"
+#include <set>
+#include "shard.hpp"
+#include "stats.hpp"
+#include <string>
 #include <string.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include "throttle.hpp"
+#include <unordered_map>
 #include <utility>
+#include <vector>
 
 namespace mirror
 {
-	void createDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db);
+	enum class VerifyMode
+	{
+		// Every regular file is hashed.
+		full,
+		// Only files whose size or last modified timestamp do not match the DB are hashed.
+		quick,
+		// As quick, but a rotating sample of the files is hashed, too.
+		sample
+	};
+
+	enum class VerifyEngine
+	{
+		// The files of each directory are queried from the DB when the directory is entered.
+		perDir,
+		/*
+		 * Directory entries are visited in sorted order and matched with the files read from the DB
+		 * in the same order through a single cursor.
+		 */
+		mergeJoin
+	};
+
+	struct VerifyOptions
+	{
+		VerifyOptions() noexcept : mode(VerifyMode::full), samplePercent(0), sampleRotation(0),
+				engine(VerifyEngine::perDir), dirBatchSize(0) {}
+
+		/*
+		 * Tells if the file is in the sample to hash. Files are assigned to one of 100 buckets by
+		 * the hash of their relative path, and each rotation selects the next samplePercent buckets,
+		 * which makes all files covered in 100 / samplePercent rotations.
+		 */
+		bool inSample(const char *relPath, std::size_t relPathSize) const noexcept;
+
+		VerifyMode mode;
+		// The percentage of files to hash in the sample mode.
+		unsigned samplePercent;
+		// The number of the run (e.g. the day number) that defines which files are in the sample.
+		unsigned long sampleRotation;
+		VerifyEngine engine;
+		/*
+		 * If it is not 0 then the per-dir engine uses the memory that depends on the depth of the tree and on
+		 * dirBatchSize rather than on the size of the DB: the directories visited are tracked in the DB, and
+		 * the directories with more than dirBatchSize files in the DB are checked file by file (their regular
+		 * files are looked up FileDB::trackBatchSize at a time), the files that are not found being read
+		 * in sorted batches of dirBatchSize files.
+		 */
+		std::size_t dirBatchSize;
+	};
 
+	struct ScanOptions
+	{
+		ScanOptions() noexcept : jobs(1), walkers(1), order(FileOrder::directory), read(), verify(), commitInterval(0),
+				commitPeriod(0), resume(false), shard() {}
+
+		// The number of threads that calculate digests of files. If it is 1 then files are hashed inline.
+		unsigned jobs;
+		/*
+		 * The number of threads that list directories ahead of the walk. If it is 1 then directories are
+		 * listed by the walk itself. The merge-join verify engine always lists directories by itself.
+		 */
+		unsigned walkers;
+		/*
+		 * Unless it is FileOrder::directory, the regular files of each directory are walked in this order
+		 * before its subdirectories, so that the files are read with fewer seeks on rotating disks.
+		 * The directories are listed ahead of the walk then even if walkers is 1. Is not supported by
+		 * the merge-join verify engine, which walks the entries in the order of their names.
+		 */
+		FileOrder order;
+		ReadOptions read;
+		// Is used by checkFileSystem() only.
+		VerifyOptions verify;
+		/*
+		 * Is used by createDB() only. The DB transaction is committed each commitInterval files added.
+		 * If it is 0 then a single transaction is used. updateDB() always uses a single transaction.
+		 */
+		std::size_t commitInterval;
+		// Is used by createDB() only. If it is not 0 then the DB is committed each commitPeriod seconds.
+		unsigned commitPeriod;
+		/*
+		 * Is used by createDB() only. The subtrees recorded as completed by the checkpoint of the previous
+		 * run are not walked again (the other files are hashed again). The tree and the shard must be the same.
+		 */
+		bool resume;
+		/*
+		 * The part of the tree to walk. The DB files of the other shards are neither checked nor removed,
+		 * so that the shards can be verified against a single DB.
+		 */
+		ShardOptions shard;
+	};
+
+	/*
+	 * Adds the files of the tree to the DB. The directories whose subtrees are added completely are recorded
+	 * in the checkpoint of the DB which is committed together with the files, and the files added are kept
+	 * if the walk fails, so that the run can be resumed. The checkpoint is dropped when the run is finished.
+	 */
+	void createDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
+			const ScanOptions &options = ScanOptions());
+
+	/*
+	 * Brings the DB in line with the file system. Files whose size and last modified timestamp are unchanged
+	 * are not read, new and changed files are hashed, and the records of the files and directories
+	 * that are no longer found are removed. All changes are made in a single transaction, so that nothing
+	 * is written on failure; commitInterval and commitPeriod are ignored.
+	 */
+	void updateDB(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
+			const ScanOptions &options = ScanOptions());
+
+	// The DB is either a FileDB or a Snapshot of it.
+	template<typename DB, typename MismatchHandler>
+	void checkFileSystem(const char *rootDir, std::size_t rootDirSize, DB &db,
+			MismatchHandler &mismatchHandler, const ScanOptions &options = ScanOptions());
+
+	/*
+	 * Adds all files and directories of src to the DB, replacing the ones that are already there, e.g. to combine
+	 * the DBs created by the shards of a tree. The digests of both DBs must be of the same algorithm (the DB gets
+	 * the algorithm of src if it has no files). The DB is committed each commitInterval files added.
+	 */
+	void mergeDB(mirror::FileDB &db, mirror::FileDB &src, std::size_t commitInterval = 0);
+
+	/*
+	 * Compares the files of two DBs without reading the file systems, in a single pass over each DB sorted by path.
+	 * The files of the first DB are the expected ones: the files that are only in it are passed to fileNotFound(),
+	 * the files that are only in the second DB to newFileFound() and the files that are in both to
+	 * checkFileMismatch(). The contents of a directory that is in one DB only are not reported.
+	 */
 	template<typename MismatchHandler>
-	void checkFileSystem(const char *rootDir, std::size_t rootDirSize, mirror::FileDB &db,
-			MismatchHandler &mismatchHandler);
+	void diffDB(mirror::FileDB &first, mirror::FileDB &second, MismatchHandler &mismatchHandler);
+
+	namespace _helper
+	{
+		class HardLinks;
+	}
 
-	bool copyFile(int srcDirFd, int destDirFd, const char *relPath);
+	bool copyFile(int srcDirFd, int destDirFd, const char *relPath, const ReadOptions &options);
+	/*
+	 * Copies the file calculating its digest on the way, in a single pass over the data. If the size or
+	 * the digest of the copy do not match the expected file record then the copy is removed and false
+	 * is returned. Timestamps are not compared since they are not preserved by copying.
+	 *
+	 * If links are given and the source file has several hard links then the file is linked to the copy
+	 * of another link made before (if it matches the record) instead of being copied.
+	 */
+	bool copyAndVerifyFile(int srcDirFd, int destDirFd, const char *relPath,
+			const FileRecord &expectedFileRecord, const ReadOptions &options, _helper::HardLinks *links = nullptr);
+	/*
+	 * Brings the existing destination file in line with the source one in place. The source file is checked
+	 * against the expected file record first and the destination file is left intact if it does not match.
+	 * Then both files are read block by block and only the blocks that differ are rewritten, and
+	 * the destination file is truncated to the size of the source one. Returns false if an I/O error
+	 * has occurred or if the source file does not match the record.
+	 */
+	bool repairFile(int srcDirFd, int destDirFd, const char *relPath, const FileRecord &expectedFileRecord,
+			const ReadOptions &options);
+	// The hard links within the directory and to the files in links are recreated if links are given.
 	bool copyDir(int srcDirFd, const char *srcDir, std::size_t srcDirSize,
 			int destDirFd, const char *destDir, std::size_t destDirSize,
-			const char *relPath, std::size_t relPathSize);
+			const char *relPath, std::size_t relPathSize, const ReadOptions &options,
+			_helper::HardLinks *links = nullptr);
 
 	namespace _helper
 	{
@@ -62,48 +228,177 @@ namespace mirror
 		[[noreturn]]
 		void handleReadDirError(int errorCode);
 
+		/*
+		 * Reads the file and passes its content to chunkOp in contiguous blocks. The strategy depends on
+		 * the file size: small files are read into a stack buffer, large ones are mapped into memory
+		 * if mapping is enabled, and all others are read into the per-thread buffer.
+		 */
 		template<typename ChunkOp>
-		void processFile(int fd, const char * const path, ChunkOp &chunkOp);
+		void processFile(int fd, const char * const path, off_t fileSize, const ReadOptions &options,
+				ChunkOp &chunkOp);
 
-		template<typename EventHandler>
-		inline DIR *startDirScanning(afc::FastStringBuffer<char> &path, std::size_t relPathOffset,
-				const int fd, EventHandler &eventHandler)
+		template<typename ChunkOp>
+		void readFile(int fd, unsigned char *buf, std::size_t bufSize, ChunkOp &chunkOp);
+
+		/*
+		 * Reads the entries of a directory in batches with getdents64(). The directory file descriptor
+		 * is owned by the reader. Instances are reused for the directories of the same depth so that
+		 * the buffer is allocated once.
+		 */
+		class DirReader
 		{
-			logDebug("Scanning '"_s, path, "'..."_s);
+		public:
+			static constexpr std::size_t bufferSize = 32 * 1024;
 
-			DIR * const dir = fdopendir(fd);
+			DirReader() noexcept : m_fd(-1), m_buf(), m_size(0), m_offset(0) {}
 
-			if (dir == nullptr) {
-				switch (errno) {
-				case EACCES:
-					// TODO make the behaviour configurable (ignorable).
-					logDebug("No access to '"_s, path, '\'');
-					throw errno;
-				case ENOENT:
-					logError("Directory not found: '"_s, path, '\'');
-					throw errno;
-				default:
-					// TODO handle error
-					throw errno;
+			DirReader(const DirReader &) = delete;
+			DirReader(DirReader &&o) noexcept : m_fd(o.m_fd), m_buf(std::move(o.m_buf)), m_size(o.m_size),
+					m_offset(o.m_offset) { o.m_fd = -1; }
+			DirReader &operator=(const DirReader &) = delete;
+			DirReader &operator=(DirReader &&) = delete;
+
+			~DirReader() { if (m_fd != -1) { ::close(m_fd); } }
+
+			// Takes ownership of the directory file descriptor.
+			void open(int dirFd);
+			void close();
+
+			int fd() const noexcept { return m_fd; }
+
+			/*
+			 * Returns false if all entries are read. The entries '.' and '..' are returned, too.
+			 * The name is valid until the next call. The type is one of the DT_* constants,
+			 * DT_UNKNOWN if the file system does not report file types.
+			 */
+			bool next(const char *&name, unsigned char &type)
+			{
+				if (m_offset == m_size && !fill()) {
+					return false;
 				}
+				const char * const entry = m_buf.get() + m_offset;
+				// struct linux_dirent64: ino64_t d_ino, off64_t d_off, unsigned short d_reclen, unsigned char d_type, d_name.
+				unsigned short recordSize;
+				std::memcpy(&recordSize, entry + 16, sizeof(recordSize));
+				type = static_cast<unsigned char>(entry[18]);
+				name = entry + 19;
+				m_offset += recordSize;
+				return true;
 			}
+		private:
+			bool fill();
+
+			int m_fd;
+			std::unique_ptr<char[]> m_buf;
+			std::size_t m_size;
+			std::size_t m_offset;
+		};
+
+		/*
+		 * Gets the metadata of the directory entry relative to the directory, without opening it.
+		 * Symbolic links are followed. Returns false if the entry is neither a regular file nor a directory,
+		 * or if it is not accessible. The path is used for logging only.
+		 */
+		bool statDirEntry(int dirFd, const char *name, unsigned char type, const char *path, std::size_t pathSize,
+				struct stat &dest);
+
+		// Opens the regular file found by scanFiles() relative to its directory.
+		inline int openScannedFile(const int dirFd, const afc::FastStringBuffer<char> &path,
+				const std::size_t fileNameOffset)
+		{
+			countStat(StatCounter::openCalls);
+			const int fd = openat(dirFd, path.c_str() + fileNameOffset, O_RDONLY);
+			if (fd == -1) {
+				handleOpenFileError(errno);
+			}
+			return fd;
+		}
+
+		// Opens the regular file found by scanFiles() and calculates its record.
+		void hashScannedFile(const struct stat &fileStat, int dirFd, const afc::FastStringBuffer<char> &path,
+				std::size_t fileNameOffset, const ReadOptions &options, mirror::FileRecord &dest);
+
+		template<typename EventHandler>
+		inline void startDirScanning(afc::FastStringBuffer<char> &path, std::size_t relPathOffset,
+				const int fd, DirReader &dest, EventHandler &eventHandler)
+		{
+			logDebug("Scanning '"_s, path, "'..."_s);
+
+			dest.open(fd);
 
 			eventHandler.dirStart(path, relPathOffset);
 
 			path.reserveForOne();
 			path.append('/');
-
-			return dir;
 		}
 
+		/*
+		 * Walks the directory tree passing regular files and directories to eventHandler.file() with
+		 * the file descriptor of the directory that contains them. Files are not opened by the walk,
+		 * the handler opens the regular files it reads with openScannedFile().
+		 *
+		 * Only the entries the shard owns are passed to eventHandler. The subtrees of the other shards
+		 * are not entered, and the directories above the shard depth are entered without being passed.
+		 */
 		template<typename EventHandler>
-		void scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler);
+		void scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler,
+				const ShardOptions &shard = ShardOptions());
 
 		template<typename EventHandler>
-		void scanFiles(afc::FastStringBuffer<char> &path, int dirFd, EventHandler &eventHandler);
+		void scanFiles(afc::FastStringBuffer<char> &path, int dirFd, EventHandler &eventHandler,
+				const ShardOptions &shard = ShardOptions());
+
+		/*
+		 * Does the same as scanFiles() with the directories listed and their entries stat'ed ahead of the walk
+		 * in walkers threads. The events are passed to eventHandler in the calling thread in the same order,
+		 * except that the regular files of each directory are passed first in the given order unless it is
+		 * FileOrder::directory.
+		 */
+		template<typename EventHandler>
+		void scanFilesParallel(afc::FastStringBuffer<char> &path, EventHandler &eventHandler, unsigned walkers,
+				const ShardOptions &shard, FileOrder order = FileOrder::directory);
+
+		/*
+		 * Tells how the walk treats the entry of the directory of the given depth (the root directory
+		 * has depth 0). The entries below the shard depth are owned since their ancestors are.
+		 */
+		inline ShardMatch matchScannedEntry(const ShardOptions &shard, const std::size_t dirDepth,
+				const char * const relPath, const std::size_t relPathSize) noexcept
+		{
+			if (!shard.enabled() || dirDepth >= shard.depth) {
+				return ShardMatch::owned;
+			}
+			return shard.match(relPath, relPathSize);
+		}
+
+		/*
+		 * Tells if the shard owns the DB entry with the UTF-8 name given of the directory being scanned. The path
+		 * of the directory (which ends with a slash unless it is empty) is restored before returning.
+		 */
+		inline bool shardOwnsDBEntry(const ShardOptions &shard, afc::FastStringBuffer<char> &path,
+				const std::size_t relDirOffset, const char * const nameU8, const std::size_t nameSize,
+				std::string &nameBuf)
+		{
+			if (!shard.enabled()) {
+				return true;
+			}
+			const std::size_t pathSize = path.size();
+			const TextView name = mirror::fromUtf8(nameU8, nameSize, nameBuf);
+			path.reserve(pathSize + name.size);
+			path.append(name.value, name.size);
+			const bool result = shard.match(path.data() + relDirOffset, path.size() - relDirOffset) == ShardMatch::owned;
+			path.resize(pathSize);
+			return result;
+		}
 
+		/*
+		 * If walkers is greater than 1 or the files are ordered then directories are listed in parallel
+		 * by DirPrefetcher.
+		 */
 		template<typename EventHandler>
-		inline void scanFiles(const char * const rootDir, const std::size_t rootDirSize, EventHandler &eventHandler)
+		inline void scanFiles(const char * const rootDir, const std::size_t rootDirSize, EventHandler &eventHandler,
+				const unsigned walkers = 1, const ShardOptions &shard = ShardOptions(),
+				const FileOrder order = FileOrder::directory)
 		{
 			std::size_t normalisedSize = rootDirSize;
 			if (rootDir[rootDirSize - 1] == '/') {
@@ -111,11 +406,195 @@ namespace mirror
 			}
 			afc::FastStringBuffer<char> dirBuf(normalisedSize);
 			dirBuf.append(rootDir, normalisedSize);
-			scanFiles(dirBuf, eventHandler);
+			if (walkers > 1 || order != FileOrder::directory) {
+				scanFilesParallel(dirBuf, eventHandler, walkers, shard, order);
+			} else {
+				scanFiles(dirBuf, eventHandler, shard);
+			}
 		}
 
+		/*
+		 * Calculates the record of the regular file. Within an InodeDigestScope, the digests of the files with
+		 * several hard links are cached by the inode, so that each inode is read once however many of its
+		 * links are scanned.
+		 */
 		void fillRegularFileRecord(const struct stat &fileStat, const int fd, const char * const filePath,
-				mirror::FileRecord &dest);
+				const ReadOptions &options, mirror::FileRecord &dest);
+
+		/*
+		 * Enables the cache of the digests of hard-linked files for the lifetime of the scope. The cache
+		 * is cleared once the outermost scope is exited. Each tool that walks a tree opens a scope.
+		 */
+		struct InodeDigestScope
+		{
+			InodeDigestScope();
+			~InodeDigestScope();
+
+			InodeDigestScope(const InodeDigestScope &) = delete;
+			InodeDigestScope &operator=(const InodeDigestScope &) = delete;
+		};
+
+		struct InodeKey
+		{
+			bool operator==(const InodeKey &o) const noexcept { return dev == o.dev && ino == o.ino; }
+
+			dev_t dev;
+			ino_t ino;
+		};
+
+		struct InodeKeyHash
+		{
+			std::size_t operator()(const InodeKey &key) const noexcept
+			{
+				return std::hash<std::uint_fast64_t>()(static_cast<std::uint_fast64_t>(key.ino) ^
+						(static_cast<std::uint_fast64_t>(key.dev) << 32));
+			}
+		};
+
+		/*
+		 * The copies made of the source files that have several hard links, by the source inode, so that
+		 * the other links of an inode are linked to its first copy with linkat() rather than copied again.
+		 * The paths are relative to the destination directory of merge-dir.
+		 */
+		class HardLinks
+		{
+		public:
+			HardLinks() : m_copies() {}
+
+			/*
+			 * Links destPath to the copy of the inode of the source file made before, if any. If the record
+			 * is given then only a copy verified against the same size and digest is linked to.
+			 * Returns false if the file is to be copied.
+			 */
+			bool link(const struct stat &srcStat, int destDirFd, const char *destPath,
+					const FileRecord *expectedFileRecord = nullptr);
+			// Records the copy of the source file if it has several hard links.
+			void add(const struct stat &srcStat, const char *destPath,
+					const FileRecord *verifiedFileRecord = nullptr);
+		private:
+			struct Copy
+			{
+				std::string path;
+				bool verified;
+				off_t size;
+				unsigned char digest[maxDigestSize];
+			};
+
+			std::unordered_map<InodeKey, Copy, InodeKeyHash> m_copies;
+		};
+
+		/*
+		 * The number of tasks a hashing pool can have in flight per worker thread.
+		 * It bounds the number of open file descriptors.
+		 */
+		constexpr std::size_t hashingTasksPerThread = 4;
+
+		/*
+		 * The relative paths of the directories being scanned, each converted to UTF-8 once, when the directory
+		 * is entered. The paths share a single buffer so that no memory is allocated per directory.
+		 */
+		class Utf8DirStack
+		{
+		public:
+			Utf8DirStack() : m_paths(), m_starts() {}
+
+			void push(const char * const relDir, const std::size_t relDirSize)
+			{
+				m_starts.push_back(m_paths.size());
+				appendUtf8(relDir, relDirSize, m_paths);
+			}
+
+			void pop() noexcept
+			{
+				assert(!m_starts.empty());
+				m_paths.resize(m_starts.back());
+				m_starts.pop_back();
+			}
+
+			// Is valid until the next push().
+			TextView top() const noexcept
+			{
+				assert(!m_starts.empty());
+				return TextView{m_paths.data() + m_starts.back(), m_paths.size() - m_starts.back()};
+			}
+		private:
+			std::string m_paths;
+			std::vector<std::size_t> m_starts;
+		};
+
+		// The record is matched with the DB file when the task is submitted.
+		struct PendingCheck
+		{
+			mirror::FileRecord expectedFileRecord;
+			std::size_t relPathOffset;
+		};
+
+		inline bool mustBeHashed(const VerifyOptions &options, const struct stat &fileStat,
+				const mirror::FileRecord &expectedFileRecord, const char * const relPath,
+				const std::size_t relPathSize) noexcept
+		{
+			if (options.mode == VerifyMode::full || expectedFileRecord.type != FileType::file) {
+				return true;
+			}
+			if (expectedFileRecord.fileSize != fileStat.st_size || expectedFileRecord.lastModifiedTS.millis() !=
+					static_cast<afc::Timestamp::time_type>(fileStat.st_mtime) * 1000) {
+				return true;
+			}
+			return options.mode == VerifyMode::sample && options.inSample(relPath, relPathSize);
+		}
+
+		// Compares byte strings as memcmp() does, a string is less than the strings it is a prefix of.
+		inline int compareBytes(const char * const s1, const std::size_t s1Size, const char * const s2,
+				const std::size_t s2Size) noexcept
+		{
+			const int result = std::memcmp(s1, s2, std::min(s1Size, s2Size));
+			if (result != 0) {
+				return result;
+			}
+			return s1Size < s2Size ? -1 : (s1Size == s2Size ? 0 : 1);
+		}
+
+		/*
+		 * The entries of a directory ordered by their UTF-8 names, i.e. in the order
+		 * FileDB::nextSortedFile() returns files. Instances are reused for directories of the same depth
+		 * so that no memory is allocated once the buffers are large enough.
+		 */
+		struct SortedDir
+		{
+			struct Entry
+			{
+				std::size_t nameOffset;
+				std::size_t nameSize;
+				std::size_t nameU8Offset;
+				std::size_t nameU8Size;
+				unsigned char type;
+			};
+
+			SortedDir() noexcept : names(), entries(), subdirs(), nextSubdir(0), reader(),
+					pathSize(0), keySize(0) {}
+
+			const char *name(const Entry &entry) const noexcept { return names.data() + entry.nameOffset; }
+			const char *nameU8(const Entry &entry) const noexcept { return names.data() + entry.nameU8Offset; }
+
+			// Both system and UTF-8 names of the entries. System names are terminated with '\0'.
+			std::string names;
+			std::vector<Entry> entries;
+			// The indices of the matched directories to descend into.
+			std::vector<std::size_t> subdirs;
+			std::size_t nextSubdir;
+			DirReader reader;
+			// The size of the path of the directory, including the trailing slash.
+			std::size_t pathSize;
+			// The size of the DB directory key (see FileDB::SortedFile).
+			std::size_t keySize;
+		};
+
+		// Reads and sorts the entries of the directory. The file descriptor is owned by dest afterwards.
+		void readSortedDir(int dirFd, const char *path, SortedDir &dest);
+
+		template<typename DB, typename MismatchHandler>
+		void checkFileSystemSorted(const char *rootDir, std::size_t rootDirSize, DB &db,
+				MismatchHandler &mismatchHandler, const ScanOptions &options);
 	}
 
 	struct RelPathView
@@ -132,9 +611,19 @@ namespace mirror
 
 	struct VerifyDirMismatchHandler
 	{
-		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		// If the report is given then the mismatches are written to it rather than logged.
+		explicit VerifyDirMismatchHandler(const DigestAlgorithm digest, ReportWriter * const report = nullptr) noexcept
+				: digest(digest), report(report) {}
+
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
 		{
 			using afc::operator"" _s;
+
+			if (report != nullptr) {
+				report->fileNotFound(type, path, pathSize, expectedFileRecord);
+				return;
+			}
 			afc::logger::logError(type, " not found in the file system: '"_s,
 					std::make_pair(path, path + pathSize), "'!"_s);
 		}
@@ -142,6 +631,11 @@ namespace mirror
 		void newFileFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
 		{
 			using afc::operator"" _s;
+
+			if (report != nullptr) {
+				report->newFileFound(type, path, pathSize);
+				return;
+			}
 			afc::logger::logError("New "_s, type == mirror::FileType::file ? "file"_s : "dir"_s,
 					" found in the file system: '"_s, std::make_pair(path, path + pathSize), "'!"_s);
 		}
@@ -150,11 +644,25 @@ namespace mirror
 				const mirror::FileRecord expectedFileRecord, const mirror::FileRecord actualFileRecord)
 		{
 			using afc::operator"" _s;
-			using CRC64View = afc::logger::HexEncodedN<sizeof(mirror::FileRecord::crc64)>;
 			using afc::logger::logError;
 
 			bool fullMatch = true;
 
+			if (report != nullptr) {
+				if (expectedFileRecord.type != actualFileRecord.type) {
+					fullMatch = false;
+				} else if (actualFileRecord.type == mirror::FileType::file) {
+					fullMatch = expectedFileRecord.fileSize == actualFileRecord.fileSize &&
+							expectedFileRecord.lastModifiedTS.millis() == actualFileRecord.lastModifiedTS.millis() &&
+							std::equal(actualFileRecord.digest, actualFileRecord.digest + maxDigestSize,
+									expectedFileRecord.digest);
+				}
+				if (!fullMatch) {
+					report->fileMismatch(path, pathSize, expectedFileRecord, actualFileRecord);
+				}
+				return fullMatch;
+			}
+
 			if (expectedFileRecord.type != actualFileRecord.type) {
 				logError("File type mismatch for the file '"_s, std::make_pair(path, path + pathSize),
 						"'! DB file type: '"_s, expectedFileRecord.type, "', file system file type: '"_s,
@@ -166,8 +674,8 @@ namespace mirror
 				const bool sizeMismatch = expectedFileRecord.fileSize != actualFileRecord.fileSize;
 				const bool lastModMismatch =
 						expectedFileRecord.lastModifiedTS.millis() != actualFileRecord.lastModifiedTS.millis();
-				const bool digestMismatch = !std::equal(actualFileRecord.crc64,
-						actualFileRecord.crc64 + sizeof(actualFileRecord.crc64), expectedFileRecord.crc64);
+				const bool digestMismatch = !std::equal(actualFileRecord.digest,
+						actualFileRecord.digest + maxDigestSize, expectedFileRecord.digest);
 
 				fullMatch = !sizeMismatch && !lastModMismatch && !digestMismatch;
 
@@ -184,22 +692,27 @@ namespace mirror
 							afc::ISODateTimeView(actualFileRecord.lastModifiedTS));
 					}
 					if (digestMismatch) {
-						logError("\tDB CRC64 digest: '"_s, CRC64View(expectedFileRecord.crc64),
-								"'\n\tFS CRC64 digest: '"_s, CRC64View(actualFileRecord.crc64), '\'');
+						const std::size_t size = digestSize(digest);
+						logError("\tDB digest ("_s, digestName(digest), "): '"_s,
+								DigestView(expectedFileRecord.digest, size), "'\n\tFS digest ("_s, digestName(digest),
+								"): '"_s, DigestView(actualFileRecord.digest, size), '\'');
 					}
 				}
 			}
 
 			return fullMatch;
 		}
+
+		const DigestAlgorithm digest;
+		ReportWriter * const report;
 	};
 
 	struct MergeDirMismatchHandler
 	{
 		MergeDirMismatchHandler(const char * const srcDirRef, const std::size_t srcDirSize,
-				const char * const destDirRef, const std::size_t destDirSize) :
-						srcDirRef(srcDirRef), srcDirSize(srcDirSize),
-						destDirRef(destDirRef), destDirSize(destDirSize)
+				const char * const destDirRef, const std::size_t destDirSize, const ReadOptions &readOptions,
+				ReportWriter * const report = nullptr) : srcDirRef(srcDirRef), srcDirSize(srcDirSize),
+						destDirRef(destDirRef), destDirSize(destDirSize), readOptions(readOptions), report(report)
 		{
 			// TODO avoid copying relpath into a buffer
 			srcDirFd = open(std::string(srcDirRef, srcDirSize).c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW);
@@ -220,24 +733,35 @@ namespace mirror
 			closeDir(srcDirRef, srcDirSize, srcDirFd);
 		}
 
-		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
 		{
 			using afc::operator"" _s;
 
+			if (report != nullptr) {
+				report->fileNotFound(type, path, pathSize, expectedFileRecord);
+			}
 			// TODO Add verbose info logging
 			switch (type) {
 			case mirror::FileType::file:
-				afc::logger::logError(type, " not found in the destination file system: '"_s,
-										std::make_pair(path, path + pathSize), "'!"_s);
+				if (report == nullptr) {
+					afc::logger::logError(type, " not found in the destination file system: '"_s,
+											std::make_pair(path, path + pathSize), "'!"_s);
+				}
 				afc::logger::logDebug("Copying '", std::make_pair(path, path + pathSize), "'..."_s);
 				// TODO avoid copying relpath into a buffer
-				mirror::copyFile(srcDirFd, destDirFd, std::string(path, pathSize).c_str());
+				// The copy is verified against the DB record while it is made.
+				mirror::copyAndVerifyFile(srcDirFd, destDirFd, std::string(path, pathSize).c_str(),
+						expectedFileRecord, readOptions, &links);
 				return;
 			case mirror::FileType::dir:
-				afc::logger::logError(type, " not found in the destination file system: '"_s,
-										std::make_pair(path, path + pathSize), "'!"_s);
+				if (report == nullptr) {
+					afc::logger::logError(type, " not found in the destination file system: '"_s,
+											std::make_pair(path, path + pathSize), "'!"_s);
+				}
 				afc::logger::logDebug("Copying directory '", std::make_pair(path, path + pathSize), "'..."_s);
-				mirror::copyDir(srcDirFd, srcDirRef, srcDirSize, destDirFd, destDirRef, destDirSize, path, pathSize);
+				mirror::copyDir(srcDirFd, srcDirRef, srcDirSize, destDirFd, destDirRef, destDirSize, path, pathSize,
+						readOptions, &links);
 				return;
 			default:
 				assert(false);
@@ -249,6 +773,10 @@ namespace mirror
 			using afc::operator"" _s;
 
 			// TODO think of adding an option to wipe new files out.
+			if (report != nullptr) {
+				report->newFileFound(type, path, pathSize);
+				return;
+			}
 			afc::logger::logError("New "_s, type == mirror::FileType::file ? "file"_s : "dir"_s,
 					" found in the destination file system: '"_s, std::make_pair(path, path + pathSize), "'!"_s);
 		}
@@ -256,8 +784,32 @@ namespace mirror
 		bool checkFileMismatch(const char * const path, const std::size_t pathSize,
 				const mirror::FileRecord expectedFileRecord, const mirror::FileRecord actualFileRecord)
 		{
-			// TODO implement me
-			return true;
+			using afc::operator"" _s;
+
+			// The mismatch is reported the same way as verify-dir does.
+			const bool fullMatch = VerifyDirMismatchHandler(readOptions.digest, report).checkFileMismatch(
+					path, pathSize, expectedFileRecord, actualFileRecord);
+			if (fullMatch) {
+				return true;
+			}
+
+			// TODO repair file type mismatches.
+			if (expectedFileRecord.type != mirror::FileType::file || actualFileRecord.type != mirror::FileType::file) {
+				return false;
+			}
+			// The content is fine if only the last modified timestamp differs.
+			if (expectedFileRecord.fileSize == actualFileRecord.fileSize && std::equal(actualFileRecord.digest,
+					actualFileRecord.digest + maxDigestSize, expectedFileRecord.digest)) {
+				return false;
+			}
+
+			afc::logger::logDebug("Repairing '"_s, std::make_pair(path, path + pathSize), "'..."_s);
+			// TODO avoid copying relpath into a buffer
+			if (!mirror::repairFile(srcDirFd, destDirFd, std::string(path, pathSize).c_str(), expectedFileRecord,
+					readOptions)) {
+				afc::logger::logError("The file '"_s, std::make_pair(path, path + pathSize), "' is not repaired!"_s);
+			}
+			return false;
 		}
 	private:
 		static void closeDir(const char * const path, const std::size_t pathSize, const int fd)
@@ -276,8 +828,100 @@ namespace mirror
 		std::size_t srcDirSize;
 		const char *destDirRef;
 		std::size_t destDirSize;
+		const ReadOptions readOptions;
+		ReportWriter * const report;
 		int srcDirFd;
 		int destDirFd;
+		mirror::_helper::HardLinks links;
+	};
+
+	struct DiffDBMismatchHandler
+	{
+		// If the report is given then the differences are written to it rather than logged.
+		explicit DiffDBMismatchHandler(const DigestAlgorithm digest, ReportWriter * const report = nullptr) noexcept
+				: digest(digest), report(report) {}
+
+		void fileNotFound(const mirror::FileType type, const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord &expectedFileRecord)
+		{
+			using afc::operator"" _s;
+
+			if (report != nullptr) {
+				report->fileNotFound(type, path, pathSize, expectedFileRecord);
+				return;
+			}
+			afc::logger::logError(type, " found in the first DB only: '"_s,
+					std::make_pair(path, path + pathSize), "'!"_s);
+		}
+
+		void newFileFound(const mirror::FileType type, const char * const path, const std::size_t pathSize)
+		{
+			using afc::operator"" _s;
+
+			if (report != nullptr) {
+				report->newFileFound(type, path, pathSize);
+				return;
+			}
+			afc::logger::logError(type, " found in the second DB only: '"_s,
+					std::make_pair(path, path + pathSize), "'!"_s);
+		}
+
+		bool checkFileMismatch(const char * const path, const std::size_t pathSize,
+				const mirror::FileRecord expectedFileRecord, const mirror::FileRecord actualFileRecord)
+		{
+			using afc::operator"" _s;
+			using afc::logger::logError;
+
+			if (expectedFileRecord.type != actualFileRecord.type) {
+				if (report != nullptr) {
+					report->fileMismatch(path, pathSize, expectedFileRecord, actualFileRecord);
+				} else {
+					logError("File type mismatch for the file '"_s, std::make_pair(path, path + pathSize),
+							"'! First DB file type: '"_s, expectedFileRecord.type, "', second DB file type: '"_s,
+							actualFileRecord.type, "'."_s);
+				}
+				return false;
+			}
+			if (actualFileRecord.type != mirror::FileType::file) {
+				return true;
+			}
+
+			const bool sizeMismatch = expectedFileRecord.fileSize != actualFileRecord.fileSize;
+			const bool lastModMismatch =
+					expectedFileRecord.lastModifiedTS.millis() != actualFileRecord.lastModifiedTS.millis();
+			const bool digestMismatch = !std::equal(actualFileRecord.digest,
+					actualFileRecord.digest + maxDigestSize, expectedFileRecord.digest);
+
+			if (!sizeMismatch && !lastModMismatch && !digestMismatch) {
+				return true;
+			}
+			if (report != nullptr) {
+				report->fileMismatch(path, pathSize, expectedFileRecord, actualFileRecord);
+				return false;
+			}
+
+			logError("Mismatch for the file '"_s, std::make_pair(path, path + pathSize), "':"_s);
+			if (sizeMismatch) {
+				logError("\tFirst DB size: "_s, expectedFileRecord.fileSize,
+						"\n\tSecond DB size: "_s, actualFileRecord.fileSize);
+			}
+			if (lastModMismatch) {
+				logError("\tFirst DB last modified timestamp: "_s,
+					afc::ISODateTimeView(expectedFileRecord.lastModifiedTS),
+					"\n\tSecond DB last modified timestamp: "_s,
+					afc::ISODateTimeView(actualFileRecord.lastModifiedTS));
+			}
+			if (digestMismatch) {
+				const std::size_t size = digestSize(digest);
+				logError("\tFirst DB digest ("_s, digestName(digest), "): '"_s,
+						DigestView(expectedFileRecord.digest, size), "'\n\tSecond DB digest ("_s, digestName(digest),
+						"): '"_s, DigestView(actualFileRecord.digest, size), '\'');
+			}
+			return false;
+		}
+
+		const DigestAlgorithm digest;
+		ReportWriter * const report;
 	};
 
 	// TODO make logging readable (especially make paths absolute and relative to src and dest parent dirs)
@@ -285,8 +929,10 @@ namespace mirror
 	{
 		// TODO don't use srcDirFd
 		CopyDirHandler(const int dirToCopyFd, const int destDirFd, const char * const relPath,
-				const std::size_t relPathSize) : srcFd(dirToCopyFd), destFd(-1), destDirFd(destDirFd),
-						destPath(relPath), destPathSize(relPathSize) {}
+				const std::size_t relPathSize, const ReadOptions &readOptions,
+				mirror::_helper::HardLinks * const links = nullptr) : srcFd(dirToCopyFd), destFd(-1),
+						destDirFd(destDirFd), destPath(relPath), destPathSize(relPathSize), readOptions(readOptions),
+						links(links), linkPath() {}
 
 		~CopyDirHandler() = default;
 
@@ -337,7 +983,7 @@ namespace mirror
 		}
 
 		// TODO support symbolic links.
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
+		bool file(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
 				const std::size_t relPathOffset, const std::size_t fileNameOffset)
 		{
 			using afc::logger::logDebug;
@@ -353,9 +999,24 @@ namespace mirror
 			// Ensuring also that the string is terminated with '\0'.
 			const char * const relPath = path.c_str() + relPathOffset;
 
-			logDebug("Copying the file '"_s, std::make_pair(relPath, path.end()), "'..."_s);
+			if (links == nullptr || fileStat.st_nlink < 2) {
+				logDebug("Copying the file '"_s, std::make_pair(relPath, path.end()), "'..."_s);
+				return mirror::copyFile(srcFd, destFd, relPath, readOptions);
+			}
 
-			return mirror::copyFile(srcFd, destFd, relPath);
+			// The links are recorded by the paths relative to destDirFd.
+			linkPath.assign(destPath, destPathSize);
+			linkPath.push_back('/');
+			linkPath.append(relPath, path.end());
+			if (links->link(fileStat, destDirFd, linkPath.c_str())) {
+				return true;
+			}
+			logDebug("Copying the file '"_s, std::make_pair(relPath, path.end()), "'..."_s);
+			if (!mirror::copyFile(srcFd, destFd, relPath, readOptions)) {
+				return false;
+			}
+			links->add(fileStat, linkPath.c_str());
+			return true;
 		}
 
 		int srcFd;
@@ -363,6 +1024,9 @@ namespace mirror
 		int destDirFd;
 		const char *destPath;
 		std::size_t destPathSize;
+		const ReadOptions &readOptions;
+		mirror::_helper::HardLinks * const links;
+		std::string linkPath;
 	};
 }
 
@@ -385,59 +1049,143 @@ namespace afc
 	}
 }
 
-template<typename MismatchHandler>
-void mirror::checkFileSystem(const char * const rootDir, const std::size_t rootDirSize, mirror::FileDB &db,
-		MismatchHandler &mismatchHandler)
+template<typename DB, typename MismatchHandler>
+void mirror::checkFileSystem(const char * const rootDir, const std::size_t rootDirSize, DB &db,
+		MismatchHandler &mismatchHandler, const ScanOptions &options)
 {
 	using afc::operator"" _s;
 	using afc::logger::logDebug;
+	using mirror::_helper::PendingCheck;
+
+	const mirror::_helper::InodeDigestScope inodeDigestScope;
+
+	if (options.verify.engine == VerifyEngine::mergeJoin) {
+		mirror::_helper::checkFileSystemSorted(rootDir, rootDirSize, db, mismatchHandler, options);
+		return;
+	}
+
+	using Pool = mirror::_helper::HashingPool<PendingCheck>;
 
 	struct EventHandler
 	{
-		EventHandler(mirror::FileDB &db, MismatchHandler &mismatchHandler)
-				: dbDirs(), ctxs(), dbRef(db), handler(mismatchHandler) { db.getDirs(dbDirs); }
+		EventHandler(DB &db, MismatchHandler &mismatchHandler, const ScanOptions &options,
+				Pool * const pool) : dbDirs(), dbDirsArena(), ctxs(), batchedDirs(), relDirsU8(), nameBuf(),
+						lastNameU8(), pendingDirFd(-1), pendingPath(), pendingFileNameOffset(0),
+						pendingRelPathOffset(0), pendingStats(), pendingNames(), pendingNamesU8(),
+						pendingRecords(), dbRef(db), handler(mismatchHandler), readOptions(options.read),
+						verifyOptions(options.verify), shard(options.shard), pool(pool),
+						batchSize(options.verify.dirBatchSize)
+		{
+			if (batchSize == 0) {
+				db.getDirs(dbDirs, &dbDirsArena);
+			}
+		}
+
+		~EventHandler()
+		{
+			if (pendingDirFd != -1) {
+				close(pendingDirFd);
+			}
+		}
+
+		EventHandler(const EventHandler &) = delete;
+		EventHandler &operator=(const EventHandler &) = delete;
+
+		void operator()(typename Pool::Task &task)
+		{
+			const char * const relPath = task.filePath.data() + task.payload.relPathOffset;
+			handler.checkFileMismatch(relPath, task.filePath.size() - task.payload.relPathOffset,
+					task.payload.expectedFileRecord, task.record);
+		}
 
 		void dirStart(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
 			const char * const relDir = path.begin() + relDirOffset;
 			logDebug("Entering '"_s, std::pair<const char *, const char *>(relDir, path.end()), "'..."_s);
 
-			const TextHolder relDirU8 = mirror::convertToUtf8(relDir, path.size() - relDirOffset);
+			// The files deferred belong to the parent directory, so they are checked before it is left.
+			flushFiles();
+
+			if (batchSize == 0) {
+				const TextView relDirU8 = mirror::toUtf8(relDir, path.size() - relDirOffset, nameBuf);
 
-			dbDirs.erase(PathKey(relDirU8.value, relDirU8.size, true));
+				dbDirs.erase(PathKey(relDirU8.value, relDirU8.size, true));
 
-			ctxs.emplace();
-			dbRef.getFiles(relDirU8.value, relDirU8.size, ctxs.top());
+				dbRef.getFiles(relDirU8.value, relDirU8.size, ctxs.push(), &ctxs.arena());
+				return;
+			}
+
+			relDirsU8.push(relDir, path.size() - relDirOffset);
+			const TextView relDirU8 = relDirsU8.top();
+			dbRef.trackDir(relDirU8.value, relDirU8.size);
+
+			// The files of a large directory are looked up one by one.
+			const bool batched = !dbRef.getFiles(relDirU8.value, relDirU8.size, ctxs.push(), &ctxs.arena(), batchSize);
+			if (batched) {
+				logDebug("The directory has more than "_s, batchSize, " files, checking them one by one..."_s);
+			}
+			batchedDirs.push_back(batched);
 		}
 
 		void dirEnd(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset)
 		{
-			const auto &ctx = ctxs.top();
-			if (!ctx.empty()) {
-				const std::size_t pathSize = path.size();
+			reportNotFound(path, relDirOffset, ctxs.top());
+			ctxs.pop();
+
+			if (batchSize == 0) {
+				return;
+			}
 
-				if (pathSize == 0) {
-					path.reserveForOne();
-					path.append('/');
+			const TextView relDirU8 = relDirsU8.top();
+			if (batchedDirs.back()) {
+				flushFiles();
+
+				// The files that are not found are the files that are not tracked.
+				mirror::DirFileMap batch;
+				lastNameU8.clear();
+				while (dbRef.getUntrackedFiles(relDirU8.value, relDirU8.size, lastNameU8, batchSize, batch) > 0) {
+					reportNotFound(path, relDirOffset, batch);
+					batch.clear();
 				}
+				dbRef.untrackFiles(relDirU8.value, relDirU8.size);
+			}
+			batchedDirs.pop_back();
+			relDirsU8.pop();
+		}
 
-				for (auto &e : ctx) {
-					const TextHolder buf = mirror::convertFromUtf8(e.first.data, e.first.size);
-					path.reserve(path.size() + buf.size);
-					path.append(buf.value, buf.size);
+		void reportNotFound(afc::FastStringBuffer<char> &path, const std::size_t relDirOffset,
+				const mirror::DirFileMap &files)
+		{
+			if (files.empty()) {
+				return;
+			}
 
-					const char * const relPath = path.data() + relDirOffset;
-					handler.fileNotFound(e.second.type, relPath, path.end() - relPath);
+			const std::size_t pathSize = path.size();
 
-					path.resize(path.size() - buf.size);
+			if (pathSize == 0) {
+				path.reserveForOne();
+				path.append('/');
+			}
+
+			for (auto &e : files) {
+				if (!mirror::_helper::shardOwnsDBEntry(shard, path, relDirOffset, e.first.data, e.first.size,
+						nameBuf)) {
+					continue;
 				}
+				const TextView buf = mirror::fromUtf8(e.first.data, e.first.size, nameBuf);
+				path.reserve(path.size() + buf.size);
+				path.append(buf.value, buf.size);
+
+				const char * const relPath = path.data() + relDirOffset;
+				handler.fileNotFound(e.second.type, relPath, path.end() - relPath, e.second);
 
-				path.resize(pathSize);
+				path.resize(path.size() - buf.size);
 			}
-			ctxs.pop();
+
+			path.resize(pathSize);
 		}
 
-		bool file(const struct stat &fileStat, const int fd, const afc::FastStringBuffer<char> &path,
+		bool file(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
 				const std::size_t relPathOffset, const std::size_t fileNameOffset)
 		{
 			assert(S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode));
@@ -449,60 +1197,578 @@ void mirror::checkFileSystem(const char * const rootDir, const std::size_t rootD
 			const char * const fileName = path.begin() + fileNameOffset;
 			const std::size_t fileNameSize = path.size() - fileNameOffset;
 
-			const TextHolder buf = mirror::convertToUtf8(fileName, fileNameSize);
-			const auto dbEntry = ctxs.top().find(PathKey(buf.value, buf.size, true));
+			const TextView buf = mirror::toUtf8(fileName, fileNameSize, nameBuf);
+
+			if (batchSize > 0 && batchedDirs.back()) {
+				if (S_ISREG(fileStat.st_mode)) {
+					deferFile(fileStat, dirFd, path, relPathOffset, fileNameOffset, buf);
+					return true;
+				}
+
+				// The walk needs to know right away if the directory is entered.
+				const TextView relDirU8 = relDirsU8.top();
+				mirror::FileRecord dbRecord;
+				if (!dbRef.getFile(buf.value, buf.size, relDirU8.value, relDirU8.size, dbRecord)) {
+					handler.newFileFound(FileType::dir, relPath, path.end() - relPath);
+					return false;
+				}
+				dbRef.trackFile(buf.value, buf.size, relDirU8.value, relDirU8.size);
+				return checkFile(fileStat, dirFd, path, relPathOffset, fileNameOffset, dbRecord);
+			}
 
-			if (dbEntry == ctxs.top().end()) {
+			mirror::DirFileMap &ctx = ctxs.top();
+			const auto dbEntry = ctx.find(PathKey(buf.value, buf.size, true));
+			if (dbEntry == ctx.end()) {
 				const FileType type = S_ISDIR(fileStat.st_mode) ? FileType::dir : FileType::file;
 				handler.newFileFound(type, relPath, path.end() - relPath);
 				return false;
 			}
 
-			const mirror::FileRecord &expectedFileRecord = dbEntry->second;
+			const bool fullMatch = checkFile(fileStat, dirFd, path, relPathOffset, fileNameOffset, dbEntry->second);
+			ctx.erase(dbEntry);
+			return fullMatch;
+		}
+
+		bool checkFile(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
+				const std::size_t relPathOffset, const std::size_t fileNameOffset,
+				const mirror::FileRecord &expectedFileRecord)
+		{
+			const char * const relPath = path.begin() + relPathOffset;
+
+			if (S_ISREG(fileStat.st_mode) && !mirror::_helper::mustBeHashed(verifyOptions, fileStat,
+					expectedFileRecord, relPath, path.end() - relPath)) {
+				logDebug("The size and the last modified timestamp match. Skipping the digest check..."_s);
+				return true;
+			}
+
+			if (pool != nullptr && S_ISREG(fileStat.st_mode)) {
+				const int taskFd = mirror::_helper::openScannedFile(dirFd, path, fileNameOffset);
+				typename Pool::Task task(taskFd, fileStat, std::string(path.data(), path.size()),
+						PendingCheck{expectedFileRecord, relPathOffset});
+
+				pool->submit(std::move(task), *this);
+
+				// The result is reported when the digest is calculated.
+				return true;
+			}
+
 			mirror::FileRecord fileRecord;
 
 			if (S_ISREG(fileStat.st_mode)) {
-				mirror::_helper::fillRegularFileRecord(fileStat, fd, path.c_str(), fileRecord);
+				mirror::_helper::hashScannedFile(fileStat, dirFd, path, fileNameOffset, readOptions, fileRecord);
 			} else {
 				fileRecord.type = FileType::dir;
 			}
 
-			const bool fullMatch = handler.checkFileMismatch(
-					relPath, path.end() - relPath, expectedFileRecord, fileRecord);
+			return handler.checkFileMismatch(relPath, path.end() - relPath, expectedFileRecord, fileRecord);
+		}
 
-			ctxs.top().erase(dbEntry);
+		/*
+		 * Remembers the regular file of a directory checked file by file, so that the files are looked up
+		 * in the DB FileDB::trackBatchSize at a time instead of one by one.
+		 */
+		void deferFile(const struct stat &fileStat, const int dirFd, const afc::FastStringBuffer<char> &path,
+				const std::size_t relPathOffset, const std::size_t fileNameOffset, const TextView fileNameU8)
+		{
+			if (pendingNames.empty()) {
+				// The walk closes the directory before dirEnd() is called.
+				pendingDirFd = dup(dirFd);
+				if (pendingDirFd == -1) {
+					// TODO handle error.
+					throw errno;
+				}
+				pendingPath.resize(0);
+				pendingPath.reserve(fileNameOffset);
+				pendingPath.append(path.data(), fileNameOffset);
+				pendingFileNameOffset = fileNameOffset;
+				pendingRelPathOffset = relPathOffset;
+			}
 
-			return fullMatch;
+			pendingStats.push_back(fileStat);
+			pendingNames.emplace_back(path.data() + fileNameOffset, path.size() - fileNameOffset);
+			pendingNamesU8.emplace_back(fileNameU8.value, fileNameU8.size);
+
+			if (pendingNames.size() == mirror::FileDB::trackBatchSize) {
+				flushFiles();
+			}
 		}
 
+		// Checks the files deferred with a single DB lookup.
+		void flushFiles()
+		{
+			if (pendingNames.empty()) {
+				return;
+			}
+
+			const TextView relDirU8 = relDirsU8.top();
+			dbRef.trackFiles(relDirU8.value, relDirU8.size, pendingNamesU8, pendingRecords);
+
+			for (std::size_t i = 0; i < pendingNames.size(); ++i) {
+				const std::string &name = pendingNames[i];
+				pendingPath.resize(pendingFileNameOffset);
+				pendingPath.reserve(pendingFileNameOffset + name.size());
+				pendingPath.append(name.data(), name.size());
+
+				const std::string &nameU8 = pendingNamesU8[i];
+				const auto dbEntry = pendingRecords.find(PathKey(nameU8.data(), nameU8.size(), true));
+				if (dbEntry == pendingRecords.end()) {
+					const char * const relPath = pendingPath.begin() + pendingRelPathOffset;
+					handler.newFileFound(FileType::file, relPath, pendingPath.end() - relPath);
+					continue;
+				}
+				checkFile(pendingStats[i], pendingDirFd, pendingPath, pendingRelPathOffset, pendingFileNameOffset,
+						dbEntry->second);
+			}
+
+			const int fd = pendingDirFd;
+			pendingDirFd = -1;
+			pendingStats.clear();
+			pendingNames.clear();
+			pendingNamesU8.clear();
+			pendingRecords.clear();
+			if (close(fd) != 0) {
+				// TODO handle error.
+				throw errno;
+			}
+		}
+
+		// Is not used if batchSize is not 0.
 		mirror::DirSet dbDirs;
-		std::stack<mirror::DirFileMap> ctxs;
-		mirror::FileDB &dbRef;
+		mirror::PathArena dbDirsArena;
+		mirror::DirFileMapStack ctxs;
+		// Are used if batchSize is not 0. Tells for each directory being scanned if it is checked file by file.
+		std::vector<bool> batchedDirs;
+		mirror::_helper::Utf8DirStack relDirsU8;
+		// The names converted are written here, so that no memory is allocated per file.
+		std::string nameBuf;
+		std::string lastNameU8;
+		// The regular files of the directory checked file by file that are not looked up yet.
+		int pendingDirFd;
+		afc::FastStringBuffer<char> pendingPath;
+		std::size_t pendingFileNameOffset;
+		std::size_t pendingRelPathOffset;
+		std::vector<struct stat> pendingStats;
+		std::vector<std::string> pendingNames;
+		std::vector<std::string> pendingNamesU8;
+		mirror::DirFileMap pendingRecords;
+		DB &dbRef;
 		MismatchHandler &handler;
-	} eventHandler(db, mismatchHandler);
+		const ReadOptions &readOptions;
+		const VerifyOptions &verifyOptions;
+		const ShardOptions &shard;
+		Pool * const pool;
+		const std::size_t batchSize;
+	};
+
+	std::unique_ptr<Pool> pool;
+	if (options.jobs > 1) {
+		pool.reset(new Pool(options.jobs, options.jobs * mirror::_helper::hashingTasksPerThread, options.read));
+	}
 
-	mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler);
+	EventHandler eventHandler(db, mismatchHandler, options, pool.get());
 
 	// TODO pass errors to the caller.
-	for (const PathKey &missingDir : eventHandler.dbDirs) {
-		logDebug("DB dir not found in the file system: '"_s,
-				Utf8ToSystemView(missingDir.data, missingDir.size), "'..."_s);
+	auto logMissingDir = [&] (const char * const dirU8, const std::size_t dirSize)
+	{
+		if (options.shard.enabled()) {
+			const TextView dir = mirror::fromUtf8(dirU8, dirSize, eventHandler.nameBuf);
+			if (options.shard.match(dir.value, dir.size) == ShardMatch::foreign) {
+				return;
+			}
+		}
+		logDebug("DB dir not found in the file system: '"_s, Utf8ToSystemView(dirU8, dirSize), "'..."_s);
+	};
+
+	if (options.verify.dirBatchSize == 0) {
+		mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walkers, options.shard,
+				options.order);
+
+		if (pool != nullptr) {
+			pool->finish(eventHandler);
+		}
+
+		for (const PathKey &missingDir : eventHandler.dbDirs) {
+			logMissingDir(missingDir.data, missingDir.size);
+		}
+	} else {
+		db.beginTracking();
+		try {
+			mirror::_helper::scanFiles(rootDir, rootDirSize, eventHandler, options.walkers, options.shard,
+					options.order);
+
+			if (pool != nullptr) {
+				pool->finish(eventHandler);
+			}
+
+			const char *missingDir;
+			std::size_t missingDirSize;
+			while (db.nextUntrackedDir(missingDir, missingDirSize)) {
+				logMissingDir(missingDir, missingDirSize);
+			}
+		}
+		catch (...) {
+			db.endTracking();
+			throw;
+		}
+		db.endTracking();
 	}
 
 	assert(eventHandler.ctxs.empty());
 }
 
+template<typename DB, typename MismatchHandler>
+void mirror::_helper::checkFileSystemSorted(const char * const rootDir, const std::size_t rootDirSize,
+		DB &db, MismatchHandler &mismatchHandler, const ScanOptions &options)
+{
+	using Pool = HashingPool<PendingCheck>;
+	using Entry = SortedDir::Entry;
+
+	struct ResultOp
+	{
+		void operator()(typename Pool::Task &task)
+		{
+			const char * const relPath = task.filePath.data() + task.payload.relPathOffset;
+			handler.checkFileMismatch(relPath, task.filePath.size() - task.payload.relPathOffset,
+					task.payload.expectedFileRecord, task.record);
+		}
+
+		MismatchHandler &handler;
+	} resultOp{mismatchHandler};
+
+	std::unique_ptr<Pool> pool;
+	if (options.jobs > 1) {
+		pool.reset(new Pool(options.jobs, options.jobs * hashingTasksPerThread, options.read));
+	}
+
+	std::size_t normalisedSize = rootDirSize;
+	if (rootDir[rootDirSize - 1] == '/') {
+		--normalisedSize;
+	}
+	std::string path(rootDir, normalisedSize);
+	path.push_back('/');
+	const std::size_t relPathOffset = path.size();
+
+	// The DB key of the current directory.
+	std::string key;
+	// The key of the last directory that is found in the DB but not in the file system.
+	std::string missingKey;
+	// The names of the files not found are converted here.
+	std::string nameBuf;
+
+	typename DB::SortedFile row;
+	bool rowAvailable = db.nextSortedFile(row);
+
+	auto nextRow = [&] () { rowAvailable = db.nextSortedFile(row); };
+
+	auto rowInDir = [&] () -> int
+	{
+		return rowAvailable ? compareBytes(row.dirKey, row.dirKeySize, key.data(), key.size()) : 1;
+	};
+
+	// The files of the directories that are not visited precede the files of the current directory.
+	auto skipMissingDirs = [&] ()
+	{
+		while (rowInDir() < 0) {
+			// TODO pass errors to the caller.
+			if (compareBytes(row.dirKey, row.dirKeySize, missingKey.data(), missingKey.size()) != 0) {
+				missingKey.assign(row.dirKey, row.dirKeySize);
+				std::string missingDir(missingKey, missingKey.empty() ? 0 : 1);
+				std::replace(missingDir.begin(), missingDir.end(), '\0', '/');
+				const TextView dir = mirror::fromUtf8(missingDir.data(), missingDir.size(), nameBuf);
+				if (options.shard.match(dir.value, dir.size) != ShardMatch::foreign) {
+					logDebug("DB dir not found in the file system: '"_s,
+							Utf8ToSystemView(missingDir.data(), missingDir.size()), "'..."_s);
+				}
+			}
+			nextRow();
+		}
+	};
+
+	auto reportNotFound = [&] ()
+	{
+		const TextView name = mirror::fromUtf8(row.fileNameU8, row.fileNameSize, nameBuf);
+		path.append(name.value, name.size);
+		if (options.shard.match(path.data() + relPathOffset, path.size() - relPathOffset) == ShardMatch::owned) {
+			mismatchHandler.fileNotFound(row.record.type, path.data() + relPathOffset, path.size() - relPathOffset,
+					row.record);
+		}
+	};
+
+	// Returns true if the entry is a regular file or a directory, and fills fileStat.
+	auto statEntry = [&] (const SortedDir &dir, const Entry &entry, struct stat &fileStat) -> bool
+	{
+		return statDirEntry(dir.reader.fd(), dir.name(entry), entry.type, path.data(), path.size(), fileStat);
+	};
+
+	// Returns true if the entry is a directory that fully matches the DB record.
+	auto checkEntry = [&] (const SortedDir &dir, const Entry &entry, const mirror::FileRecord &expectedFileRecord)
+			-> bool
+	{
+		const char * const relPath = path.data() + relPathOffset;
+		const std::size_t relPathSize = path.size() - relPathOffset;
+
+		struct stat fileStat;
+		if (!statEntry(dir, entry, fileStat)) {
+			mismatchHandler.fileNotFound(expectedFileRecord.type, relPath, relPathSize, expectedFileRecord);
+			return false;
+		}
+
+		logDebug("Checking the file '"_s, std::make_pair(relPath, relPath + relPathSize), "'..."_s);
+
+		mirror::FileRecord fileRecord;
+
+		if (S_ISDIR(fileStat.st_mode)) {
+			fileRecord.type = FileType::dir;
+			return mismatchHandler.checkFileMismatch(relPath, relPathSize, expectedFileRecord, fileRecord);
+		}
+
+		if (!mustBeHashed(options.verify, fileStat, expectedFileRecord, relPath, relPathSize)) {
+			logDebug("The size and the last modified timestamp match. Skipping the digest check..."_s);
+			return false;
+		}
+
+		countStat(StatCounter::openCalls);
+		const int fd = openat(dir.reader.fd(), dir.name(entry), O_RDONLY);
+		if (fd == -1) {
+			handleOpenFileError(errno);
+		}
+
+		if (pool != nullptr) {
+			// The pool closes the file descriptor. The result is reported when the digest is calculated.
+			pool->submit(typename Pool::Task(fd, fileStat, std::string(path),
+					PendingCheck{expectedFileRecord, relPathOffset}), resultOp);
+			return false;
+		}
+
+		try {
+			fillRegularFileRecord(fileStat, fd, path.c_str(), options.read, fileRecord);
+		}
+		catch (...) {
+			close(fd);
+			throw;
+		}
+		if (close(fd) != 0) {
+			// TODO handle error.
+			throw errno;
+		}
+		mismatchHandler.checkFileMismatch(relPath, relPathSize, expectedFileRecord, fileRecord);
+		return false;
+	};
+
+	auto checkNewEntry = [&] (const SortedDir &dir, const Entry &entry)
+	{
+		struct stat fileStat;
+		if (statEntry(dir, entry, fileStat)) {
+			const FileType type = S_ISDIR(fileStat.st_mode) ? FileType::dir : FileType::file;
+			mismatchHandler.newFileFound(type, path.data() + relPathOffset, path.size() - relPathOffset);
+		}
+	};
+
+	std::vector<SortedDir> dirs(1);
+	// The depth of the directory being merged.
+	std::size_t depth = 0;
+
+	// Merges the entries of the directory with the files of the DB directory that has the current key.
+	auto mergeDir = [&] (SortedDir &dir)
+	{
+		const char * const relDir = path.data() + std::min(relPathOffset, dir.pathSize - 1);
+		logDebug("Entering '"_s, std::make_pair(relDir, path.data() + dir.pathSize - 1), "'..."_s);
+
+		skipMissingDirs();
+
+		std::size_t i = 0;
+		for (;;) {
+			const bool rowMatches = rowInDir() == 0;
+			if (i == dir.entries.size() && !rowMatches) {
+				break;
+			}
+			int order;
+			if (!rowMatches) {
+				order = -1;
+			} else if (i == dir.entries.size()) {
+				order = 1;
+			} else {
+				const Entry &entry = dir.entries[i];
+				order = compareBytes(dir.nameU8(entry), entry.nameU8Size, row.fileNameU8, row.fileNameSize);
+			}
+
+			if (order > 0) {
+				reportNotFound();
+				nextRow();
+			} else {
+				const Entry &entry = dir.entries[i];
+				path.append(dir.name(entry), entry.nameSize);
+				const ShardMatch shardMatch = matchScannedEntry(options.shard, depth, path.data() + relPathOffset,
+						path.size() - relPathOffset);
+				if (shardMatch != ShardMatch::owned) {
+					// The directories above the shard depth are entered without being checked.
+					struct stat fileStat;
+					if (order == 0 && shardMatch == ShardMatch::ancestor && row.record.type == FileType::dir &&
+							statEntry(dir, entry, fileStat) && S_ISDIR(fileStat.st_mode)) {
+						dir.subdirs.push_back(i);
+					}
+					if (order == 0) {
+						nextRow();
+					}
+				} else if (order < 0) {
+					checkNewEntry(dir, entry);
+				} else {
+					if (checkEntry(dir, entry, row.record)) {
+						dir.subdirs.push_back(i);
+					}
+					nextRow();
+				}
+				++i;
+			}
+			path.resize(dir.pathSize);
+		}
+
+		if (pool != nullptr) {
+			pool->drain(resultOp);
+		}
+	};
+
+	const int rootFd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+	if (rootFd == -1) {
+		// TODO handle error
+		throw errno;
+	}
+
+	// The directories are closed by their readers if an exception is thrown.
+	readSortedDir(rootFd, path.c_str(), dirs[0]);
+	dirs[0].pathSize = path.size();
+	dirs[0].keySize = 0;
+	mergeDir(dirs[0]);
+
+	for (;;) {
+		SortedDir &dir = dirs[depth];
+		if (dir.nextSubdir == dir.subdirs.size()) {
+			dir.reader.close();
+			if (depth == 0) {
+				break;
+			}
+			--depth;
+			continue;
+		}
+
+		const Entry &entry = dir.entries[dir.subdirs[dir.nextSubdir++]];
+
+		path.resize(dir.pathSize);
+		path.append(dir.name(entry), entry.nameSize);
+		key.resize(dir.keySize);
+		key.push_back('\0');
+		key.append(dir.nameU8(entry), entry.nameU8Size);
+
+		countStat(StatCounter::openCalls);
+		const int fd = openat(dir.reader.fd(), dir.name(entry), O_RDONLY | O_DIRECTORY);
+		if (fd == -1) {
+			// TODO handle error
+			throw errno;
+		}
+		path.push_back('/');
+
+		if (++depth == dirs.size()) {
+			dirs.emplace_back(); // Invalidates dir.
+		}
+		SortedDir &subdir = dirs[depth];
+		readSortedDir(fd, path.c_str(), subdir);
+		subdir.pathSize = path.size();
+		subdir.keySize = key.size();
+		mergeDir(subdir);
+	}
+
+	/*
+	 * All remaining files belong to the directories that are not visited. No key starts with '\xff',
+	 * which is not a valid UTF-8 byte, so that all of them are skipped.
+	 */
+	key.assign(1, '\xff');
+	skipMissingDirs();
+
+	if (pool != nullptr) {
+		pool->finish(resultOp);
+	}
+}
+
+template<typename ChunkOp>
+inline void mirror::_helper::processFile(const int fd, const char * const path, const off_t fileSize,
+		const ReadOptions &options, ChunkOp &chunkOp)
+{
+	if (fileSize <= static_cast<off_t>(ReadOptions::smallFileSize)) {
+		unsigned char buf[ReadOptions::smallFileSize];
+		readFile(fd, buf, sizeof(buf), chunkOp);
+		return;
+	}
+
+	if (options.sequentialAdvice) {
+		// The advice is only a hint so its result is ignored.
+		posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+
+#ifdef MIRROR_IO_URING
+	if (options.backend == IOBackend::uring) {
+		URing * const ring = threadURing(options.queueDepth);
+		if (ring != nullptr) {
+			auto op = [] (void * const ctx, const unsigned char * const data, const std::size_t n)
+			{
+				(*static_cast<ChunkOp *>(ctx))(data, n);
+			};
+			if (ring->readFile(fd, fileSize, options.bufferSize, op, &chunkOp) == fileSize) {
+				// The file could have grown since it was stat'ed. The rest of it is read as usual.
+				if (lseek(fd, fileSize, SEEK_SET) == -1) {
+					handleReadFileError(errno);
+				}
+				readFile(fd, threadReadBuffer(options.bufferSize), options.bufferSize, chunkOp);
+			}
+			return;
+		}
+	}
+#endif
+
+	if (options.mmapThreshold > 0 && fileSize >= options.mmapThreshold) {
+		const std::size_t mapSize = static_cast<std::size_t>(fileSize);
+		const unsigned char * const data = mapFile(fd, mapSize);
+		if (data != nullptr) {
+			struct MappingGuard
+			{
+				~MappingGuard() { unmapFile(data, size); }
+
+				const unsigned char * const data;
+				const std::size_t size;
+			} guard{data, mapSize};
+
+			for (std::size_t offset = 0; offset < mapSize;) {
+				const std::size_t n = std::min(options.bufferSize, mapSize - offset);
+				// The pages are read by the first access, so the chunk is accounted before it is processed.
+				throttleRead(n);
+				chunkOp(data + offset, n);
+				offset += n;
+			}
+
+			// The file could have grown since it was stat'ed. The rest of it is read as usual.
+			if (lseek(fd, fileSize, SEEK_SET) == -1) {
+				handleReadFileError(errno);
+			}
+		} else {
+			// TODO log that the file could not be mapped and is read instead.
+		}
+	}
+
+	readFile(fd, threadReadBuffer(options.bufferSize), options.bufferSize, chunkOp);
+}
+
 template<typename ChunkOp>
-inline void mirror::_helper::processFile(const int fd, const char * const path, ChunkOp &chunkOp)
+inline void mirror::_helper::readFile(const int fd, unsigned char * const buf, const std::size_t bufSize,
+		ChunkOp &chunkOp)
 {
-	unsigned char buf[4096];
 	for (;;) {
-		const ssize_t n = read(fd, buf, 4096);
+		countStat(StatCounter::readCalls);
+		const ssize_t n = read(fd, buf, bufSize);
 		if (n == 0) {
 			break;
 		} else if (n == -1) {
 			handleReadFileError(errno);
 		} else {
+			throttleRead(static_cast<std::uint_fast64_t>(n));
 			chunkOp(buf, n);
 		}
 	}
@@ -510,7 +1776,8 @@ inline void mirror::_helper::processFile(const int fd, const char * const path,
 
 // TODO think of using char[PATH_MAX] for path instead of dynamic buffer
 template<typename EventHandler>
-void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler)
+void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler &eventHandler,
+		const ShardOptions &shard)
 {
 	int dirFd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
 	if (dirFd == -1) {
@@ -518,118 +1785,328 @@ void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, EventHandler
 		throw errno;
 	}
 
-	scanFiles(path, dirFd, eventHandler); // dirFd is closed here.
+	scanFiles(path, dirFd, eventHandler, shard); // dirFd is closed here.
 }
 
 // TODO think of using char[PATH_MAX] for path instead of dynamic buffer
 template<typename EventHandler>
-void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, const int fd, EventHandler &eventHandler)
+void mirror::_helper::scanFiles(afc::FastStringBuffer<char> &path, const int fd, EventHandler &eventHandler,
+		const ShardOptions &shard)
 {
-	struct Ctx
-	{
-		Ctx(DIR * const dir, const int fd, const std::size_t dirNameSize) : dir(dir), fd(fd), dirNameSize(dirNameSize) {}
-
-		DIR *dir;
-		int fd;
-		std::size_t dirNameSize;
-	};
+	// The readers of the directories being scanned, one per depth. They close their directories on unwinding.
+	std::vector<DirReader> dirs(1);
+	// The name sizes of the directories being scanned, except the root one.
+	std::vector<std::size_t> dirNameSizes;
+	std::size_t depth = 0;
 
-	std::stack<Ctx> ctxs;
-
-	int dirFd = fd;
-	DIR *dir = startDirScanning(path, path.size(), dirFd, eventHandler);
-	std::size_t dirNameSize;
+	startDirScanning(path, path.size(), fd, dirs[0], eventHandler);
 
 	// Must follow the first invocation of startDirScanning() to skip slash this function appends to path.
 	const std::size_t relPathOffset = path.size();
 
-	dirStart: for (;;) {
-		dirent file;
-		dirent *readdirEnd;
-		int status;
-		while ((status = readdir_r(dir, &file, &readdirEnd)) == 0) {
-			if (readdirEnd == nullptr) {
-				goto end;
-			}
+	for (;;) {
+		DirReader &dir = dirs[depth];
 
-			register const char * const name = file.d_name;
+		const char *name;
+		unsigned char type;
+		if (!dir.next(name, type)) {
+			dir.close();
 
-			if (name[0] == '.') {
-				if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) {
-					// Either the current dir or the parent dir. Skipping it.
-					continue;
-				}
+			eventHandler.dirEnd(path, relPathOffset);
+
+			if (depth == 0) {
+				break;
 			}
+			--depth;
 
-			const int fd = openat(dirFd, name, O_RDONLY);
-			if (fd == -1) {
-				mirror::_helper::handleOpenFileError(errno);
+			// Removing the trailing slash.
+			path.resize(path.size() - dirNameSizes[depth] - 1);
+			continue;
+		}
+
+		if (name[0] == '.') {
+			if (name[1] == '\0' || (name[1] == '.' && name[2] == '\0')) {
+				// Either the current dir or the parent dir. Skipping it.
+				continue;
 			}
-			const std::size_t nameSize = std::strlen(name);
-			path.reserve(path.size() + nameSize);
-			path.append(name, nameSize);
+		}
 
-			struct stat fileStat;
-			const int result = fstat(fd, &fileStat);
-			if (result != 0) {
-				switch (errno) {
-				case EACCES:
-					// TODO make the behaviour configurable.
-					logDebug("No access to '"_s, path, '\'');
-					continue;
-				default:
-					// TODO handle error
-					logDebug(errno);
-					throw errno;
+		const std::size_t nameSize = std::strlen(name);
+		path.reserve(path.size() + nameSize);
+		path.append(name, nameSize);
+
+		const ShardMatch shardMatch = matchScannedEntry(shard, depth, path.data() + relPathOffset,
+				path.size() - relPathOffset);
+
+		// Only the regular files that are to be read are opened, by the event handler.
+		struct stat fileStat;
+		if (shardMatch != ShardMatch::foreign &&
+				statDirEntry(dir.fd(), name, type, path.data(), path.size(), fileStat)) {
+			// TODO handle error
+			const bool success = shardMatch == ShardMatch::owned ?
+					eventHandler.file(fileStat, dir.fd(), path, relPathOffset, path.size() - nameSize) : true;
+
+			// If the dir is invalid for some reason then there's no need to go deeper.
+			if (S_ISDIR(fileStat.st_mode) && success) {
+				countStat(StatCounter::openCalls);
+				const int subdirFd = openat(dir.fd(), name, O_RDONLY | O_DIRECTORY);
+				if (subdirFd == -1) {
+					mirror::_helper::handleOpenFileError(errno);
+				}
+
+				if (depth == dirNameSizes.size()) {
+					dirNameSizes.push_back(nameSize);
+					dirs.emplace_back(); // Invalidates dir and name.
+				} else {
+					dirNameSizes[depth] = nameSize;
 				}
+				++depth;
+
+				startDirScanning(path, relPathOffset, subdirFd, dirs[depth], eventHandler);
+				continue;
 			}
+		}
 
-			if (S_ISREG(fileStat.st_mode) || S_ISDIR(fileStat.st_mode)) {
-				// TODO handle error
-				const bool success = eventHandler.file(fileStat, fd, path, relPathOffset, path.size() - nameSize);
+		// Rolling back the dir path buffer to the current dir with slash.
+		path.resize(path.size() - nameSize);
+	}
+}
 
-				if (S_ISDIR(fileStat.st_mode)) {
-					if (success) { // If the dir is invalid for some reason then there's no need to go deeper.
-						ctxs.emplace(dir, dirFd, dirNameSize);
+template<typename EventHandler>
+void mirror::_helper::scanFilesParallel(afc::FastStringBuffer<char> &path, EventHandler &eventHandler,
+		const unsigned walkers, const ShardOptions &shard, const FileOrder order)
+{
+	using Dir = DirPrefetcher::Dir;
 
-						dir = startDirScanning(path, relPathOffset, fd, eventHandler);
-						dirFd = fd;
-						dirNameSize = nameSize;
+	struct Frame
+	{
+		std::shared_ptr<Dir> dir;
+		std::size_t nextEntry;
+		int fd;
+		std::size_t dirNameSize;
+	};
 
-						goto dirStart;
-					}
-				}
-			} else {
-				// TODO support non-regular and non-directory files.
-				logDebug("The file '"_s, name, "' is neither a directory or a regular file. Skipping it..."_s);
+	// The directories being scanned. Their file descriptors are opened by the walk for the event handler.
+	struct Frames : std::vector<Frame>
+	{
+		~Frames()
+		{
+			for (const Frame &frame : *this) {
+				close(frame.fd);
 			}
+		}
+	} frames;
+
+	// Is destroyed (and so the workers are stopped) before the frames are.
+	DirPrefetcher prefetcher(walkers, shard, path.size() + 1, order);
+
+	std::shared_ptr<Dir> root = prefetcher.root(path.data(), path.size());
+	prefetcher.acquire(*root);
+
+	const int rootFd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_DIRECTORY);
+	if (rootFd == -1) {
+		// TODO handle error
+		throw errno;
+	}
+	frames.push_back(Frame{std::move(root), 0, rootFd, 0});
 
-			if (close(fd) != 0) { // directory file descriptors are closed by closedir().
+	logDebug("Scanning '"_s, path, "'..."_s);
+	eventHandler.dirStart(path, path.size());
+	path.reserveForOne();
+	path.append('/');
+
+	// Must follow the first invocation of dirStart() to skip slash appended to path.
+	const std::size_t relPathOffset = path.size();
+
+	for (;;) {
+		Frame &frame = frames.back();
+		Dir &dir = *frame.dir;
+
+		if (frame.nextEntry == dir.entries.size()) {
+			const int fd = frame.fd;
+			const std::size_t dirNameSize = frame.dirNameSize;
+			prefetcher.release(dir);
+			frames.pop_back();
+			if (close(fd) != 0) {
 				// TODO handle error.
 				throw errno;
 			}
 
-			// Rolling back the dir path buffer to the current dir with slash.
-			path.resize(path.size() - nameSize);
+			eventHandler.dirEnd(path, relPathOffset);
+
+			if (frames.empty()) {
+				break;
+			}
+
+			// Removing the trailing slash.
+			path.resize(path.size() - dirNameSize - 1);
+			continue;
 		}
 
-	end:
-		// TODO call closedir even if an error occurs.
-		closedir(dir); // closes the file descriptor, too.
+		const DirPrefetcher::Entry &entry = dir.entries[frame.nextEntry++];
+		const char * const name = dir.name(entry);
+		path.reserve(path.size() + entry.nameSize);
+		path.append(name, entry.nameSize);
 
-		eventHandler.dirEnd(path, relPathOffset);
+		const ShardMatch shardMatch = matchScannedEntry(shard, frames.size() - 1, path.data() + relPathOffset,
+				path.size() - relPathOffset);
 
-		if (ctxs.empty()) {
-			break;
+		// TODO handle error
+		const bool success = shardMatch == ShardMatch::owned ? eventHandler.file(entry.fileStat, frame.fd, path,
+				relPathOffset, path.size() - entry.nameSize) : shardMatch == ShardMatch::ancestor;
+
+		if (S_ISDIR(entry.fileStat.st_mode)) {
+			// If the dir is invalid for some reason then there's no need to go deeper.
+			if (success) {
+				prefetcher.acquire(*entry.subdir);
+
+				countStat(StatCounter::openCalls);
+				const int subdirFd = openat(frame.fd, name, O_RDONLY | O_DIRECTORY);
+				if (subdirFd == -1) {
+					mirror::_helper::handleOpenFileError(errno);
+				}
+				frames.push_back(Frame{entry.subdir, 0, subdirFd, entry.nameSize}); // Invalidates frame.
+
+				logDebug("Scanning '"_s, path, "'..."_s);
+				eventHandler.dirStart(path, relPathOffset);
+				path.reserveForOne();
+				path.append('/');
+				continue;
+			}
+			prefetcher.cancel(*entry.subdir);
+		}
+
+		// Rolling back the dir path buffer to the current dir with slash.
+		path.resize(path.size() - entry.nameSize);
+	}
+}
+
+template<typename MismatchHandler>
+void mirror::diffDB(mirror::FileDB &first, mirror::FileDB &second, MismatchHandler &mismatchHandler)
+{
+	using mirror::_helper::compareBytes;
+
+	if (first.digestAlgorithm() != second.digestAlgorithm()) {
+		throw "The DBs have digests of different algorithms.";
+	}
+
+	/*
+	 * Reads the files of a DB in order, skipping the contents of the directories that are reported as a whole.
+	 * The contents of a directory follow the other files of its parent, so several ones can be pending.
+	 */
+	struct Cursor
+	{
+		explicit Cursor(mirror::FileDB &db) : db(db), row(), available(false), skippedDirs() {}
+
+		void next()
+		{
+			do {
+				available = db.nextSortedFile(row);
+			} while (available && !skippedDirs.empty() && inSkippedDir());
+		}
+
+		// The directory of the current row is skipped.
+		void skipDir()
+		{
+			std::string key(row.dirKey, row.dirKeySize);
+			key.push_back('\0');
+			key.append(row.fileNameU8, row.fileNameSize);
+			skippedDirs.emplace(std::move(key));
+		}
+
+		bool inSkippedDir()
+		{
+			/*
+			 * The keys of a subtree are contiguous, so the directories before the current key that are not
+			 * its ancestors are passed. The first one left is then either an ancestor or is not reached yet.
+			 */
+			while (!skippedDirs.empty()) {
+				const std::string &key = *skippedDirs.begin();
+				if (isAncestor(key)) {
+					return true;
+				}
+				if (compareBytes(key.data(), key.size(), row.dirKey, row.dirKeySize) > 0) {
+					return false;
+				}
+				skippedDirs.erase(skippedDirs.begin());
+			}
+			return false;
+		}
+
+		// Tells if the directory is the directory of the row or one of its parents.
+		bool isAncestor(const std::string &key) const noexcept
+		{
+			return row.dirKeySize >= key.size() && std::memcmp(row.dirKey, key.data(), key.size()) == 0 &&
+					(row.dirKeySize == key.size() || row.dirKey[key.size()] == '\0');
 		}
 
-		// Removing the trailing slash.
-		path.resize(path.size() - dirNameSize - 1);
+		mirror::FileDB &db;
+		mirror::FileDB::SortedFile row;
+		bool available;
+		std::set<std::string> skippedDirs;
+	};
+
+	// The relative path of the file of the row, converted to the system encoding.
+	std::string pathU8;
+	std::string pathBuf;
+	auto path = [&] (const mirror::FileDB::SortedFile &row) -> TextView
+	{
+		// The key is the names of the directories each preceded by '\0'.
+		pathU8.clear();
+		if (row.dirKeySize > 0) {
+			pathU8.append(row.dirKey + 1, row.dirKeySize - 1);
+			std::replace(pathU8.begin(), pathU8.end(), '\0', '/');
+			pathU8.push_back('/');
+		}
+		pathU8.append(row.fileNameU8, row.fileNameSize);
+		return mirror::fromUtf8(pathU8.data(), pathU8.size(), pathBuf);
+	};
 
-		dir = ctxs.top().dir;
-		dirFd = ctxs.top().fd;
-		dirNameSize = ctxs.top().dirNameSize;
-		ctxs.pop();
+	Cursor a(first);
+	Cursor b(second);
+	a.next();
+	b.next();
+	while (a.available || b.available) {
+		int order;
+		if (!b.available) {
+			order = -1;
+		} else if (!a.available) {
+			order = 1;
+		} else {
+			order = compareBytes(a.row.dirKey, a.row.dirKeySize, b.row.dirKey, b.row.dirKeySize);
+			if (order == 0) {
+				order = compareBytes(a.row.fileNameU8, a.row.fileNameSize, b.row.fileNameU8, b.row.fileNameSize);
+			}
+		}
+
+		if (order < 0) {
+			const TextView p = path(a.row);
+			mismatchHandler.fileNotFound(a.row.record.type, p.value, p.size, a.row.record);
+			if (a.row.record.type == FileType::dir) {
+				a.skipDir();
+			}
+			a.next();
+		} else if (order > 0) {
+			const TextView p = path(b.row);
+			mismatchHandler.newFileFound(b.row.record.type, p.value, p.size);
+			if (b.row.record.type == FileType::dir) {
+				b.skipDir();
+			}
+			b.next();
+		} else {
+			const TextView p = path(a.row);
+			mismatchHandler.checkFileMismatch(p.value, p.size, a.row.record, b.row.record);
+			// A directory that is a file in the other DB is reported as a whole.
+			if (a.row.record.type != b.row.record.type) {
+				if (a.row.record.type == FileType::dir) {
+					a.skipDir();
+				} else {
+					b.skipDir();
+				}
+			}
+			a.next();
+			b.next();
+		}
 	}
 }
 
@@ -0,0 +1,424 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#include <cstring>
+#include "xxh3.hpp"
+
+#ifdef __SSE2__
+	#include <emmintrin.h>
+#endif
+
+constexpr std::size_t mirror::XXH3Hasher::digestSize;
+constexpr std::size_t mirror::XXH3Hasher::bufferSize;
+
+namespace
+{
+	constexpr std::uint32_t prime32_1 = 0x9E3779B1U;
+	constexpr std::uint32_t prime32_2 = 0x85EBCA77U;
+	constexpr std::uint32_t prime32_3 = 0xC2B2AE3DU;
+	constexpr std::uint64_t prime64_1 = 0x9E3779B185EBCA87ULL;
+	constexpr std::uint64_t prime64_2 = 0xC2B2AE3D27D4EB4FULL;
+	constexpr std::uint64_t prime64_3 = 0x165667B19E3779F9ULL;
+	constexpr std::uint64_t prime64_4 = 0x85EBCA77C2B2AE63ULL;
+	constexpr std::uint64_t prime64_5 = 0x27D4EB2F165667C5ULL;
+
+	constexpr std::size_t stripeSize = 64;
+	constexpr std::size_t secretConsumeRate = 8;
+	constexpr std::size_t secretSize = 192;
+	// The accumulators are scrambled each this number of stripes.
+	constexpr std::size_t stripesPerBlock = (secretSize - stripeSize) / secretConsumeRate;
+	constexpr std::size_t secretMergeAccsStart = 11;
+	constexpr std::size_t secretLastAccStart = 7;
+	constexpr std::size_t midSizeMax = 240;
+	constexpr std::size_t secretSizeMin = 136;
+
+	alignas(64) const unsigned char secret[secretSize] = {
+		0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+		0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+		0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+		0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+		0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+		0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+		0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+		0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+		0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+		0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+		0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+		0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e
+	};
+
+	struct Hash128
+	{
+		std::uint64_t low;
+		std::uint64_t high;
+	};
+
+	inline std::uint64_t read64(const unsigned char * const p) noexcept
+	{
+		std::uint64_t val;
+		std::memcpy(&val, p, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		val = __builtin_bswap64(val);
+#endif
+		return val;
+	}
+
+	inline std::uint32_t read32(const unsigned char * const p) noexcept
+	{
+		std::uint32_t val;
+		std::memcpy(&val, p, sizeof(val));
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+		val = __builtin_bswap32(val);
+#endif
+		return val;
+	}
+
+	inline void writeBigEndian64(const std::uint64_t val, unsigned char * const dest) noexcept
+	{
+		for (int i = 0; i < 8; ++i) {
+			dest[i] = static_cast<unsigned char>(val >> (56 - 8 * i));
+		}
+	}
+
+	inline Hash128 mul64To128(const std::uint64_t a, const std::uint64_t b) noexcept
+	{
+		const unsigned __int128 product = static_cast<unsigned __int128>(a) * b;
+		return Hash128{static_cast<std::uint64_t>(product), static_cast<std::uint64_t>(product >> 64)};
+	}
+
+	inline std::uint64_t mul128Fold64(const std::uint64_t a, const std::uint64_t b) noexcept
+	{
+		const Hash128 product = mul64To128(a, b);
+		return product.low ^ product.high;
+	}
+
+	inline std::uint64_t mul32To64(const std::uint64_t a, const std::uint64_t b) noexcept
+	{
+		return (a & 0xffffffff) * (b & 0xffffffff);
+	}
+
+	inline std::uint64_t xorShift64(const std::uint64_t val, const unsigned shift) noexcept
+	{
+		return val ^ (val >> shift);
+	}
+
+	inline std::uint64_t rotl64(const std::uint64_t val, const unsigned shift) noexcept
+	{
+		return (val << shift) | (val >> (64 - shift));
+	}
+
+	inline std::uint32_t rotl32(const std::uint32_t val, const unsigned shift) noexcept
+	{
+		return (val << shift) | (val >> (32 - shift));
+	}
+
+	inline std::uint64_t xxh64Avalanche(std::uint64_t val) noexcept
+	{
+		val ^= val >> 33;
+		val *= prime64_2;
+		val ^= val >> 29;
+		val *= prime64_3;
+		return val ^ (val >> 32);
+	}
+
+	inline std::uint64_t avalanche(std::uint64_t val) noexcept
+	{
+		val = xorShift64(val, 37);
+		val *= 0x165667919E3779F9ULL;
+		return xorShift64(val, 32);
+	}
+
+	// The seed is always 0, so it is omitted from all functions below.
+
+	Hash128 hash1To3(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		const std::uint32_t c1 = input[0];
+		const std::uint32_t c2 = input[n >> 1];
+		const std::uint32_t c3 = input[n - 1];
+		const std::uint32_t combinedLow = (c1 << 16) | (c2 << 24) | c3 | (static_cast<std::uint32_t>(n) << 8);
+		const std::uint32_t combinedHigh = rotl32(__builtin_bswap32(combinedLow), 13);
+		const std::uint64_t flipLow = static_cast<std::uint64_t>(read32(secret) ^ read32(secret + 4));
+		const std::uint64_t flipHigh = static_cast<std::uint64_t>(read32(secret + 8) ^ read32(secret + 12));
+		return Hash128{xxh64Avalanche(combinedLow ^ flipLow), xxh64Avalanche(combinedHigh ^ flipHigh)};
+	}
+
+	Hash128 hash4To8(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		const std::uint64_t low = read32(input);
+		const std::uint64_t high = read32(input + n - 4);
+		const std::uint64_t input64 = low + (high << 32);
+		const std::uint64_t flip = read64(secret + 16) ^ read64(secret + 24);
+		const std::uint64_t keyed = input64 ^ flip;
+
+		Hash128 m = mul64To128(keyed, prime64_1 + (static_cast<std::uint64_t>(n) << 2));
+		m.high += m.low << 1;
+		m.low ^= m.high >> 3;
+		m.low = xorShift64(m.low, 35);
+		m.low *= 0x9FB21C651E98DF25ULL;
+		m.low = xorShift64(m.low, 28);
+		m.high = avalanche(m.high);
+		return m;
+	}
+
+	Hash128 hash9To16(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		const std::uint64_t flipLow = read64(secret + 32) ^ read64(secret + 40);
+		const std::uint64_t flipHigh = read64(secret + 48) ^ read64(secret + 56);
+		const std::uint64_t inputLow = read64(input);
+		std::uint64_t inputHigh = read64(input + n - 8);
+
+		Hash128 m = mul64To128(inputLow ^ inputHigh ^ flipLow, prime64_1);
+		m.low += static_cast<std::uint64_t>(n - 1) << 54;
+		inputHigh ^= flipHigh;
+		m.high += inputHigh + mul32To64(inputHigh, prime32_2 - 1);
+		m.low ^= __builtin_bswap64(m.high);
+
+		Hash128 h = mul64To128(m.low, prime64_2);
+		h.high += m.high * prime64_2;
+		return Hash128{avalanche(h.low), avalanche(h.high)};
+	}
+
+	Hash128 hash0To16(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		if (n > 8) {
+			return hash9To16(input, n);
+		} else if (n >= 4) {
+			return hash4To8(input, n);
+		} else if (n > 0) {
+			return hash1To3(input, n);
+		}
+		const std::uint64_t flipLow = read64(secret + 64) ^ read64(secret + 72);
+		const std::uint64_t flipHigh = read64(secret + 80) ^ read64(secret + 88);
+		return Hash128{xxh64Avalanche(flipLow), xxh64Avalanche(flipHigh)};
+	}
+
+	inline std::uint64_t mix16B(const unsigned char * const input, const unsigned char * const key) noexcept
+	{
+		return mul128Fold64(read64(input) ^ read64(key), read64(input + 8) ^ read64(key + 8));
+	}
+
+	inline void mix32B(Hash128 &acc, const unsigned char * const input1, const unsigned char * const input2,
+			const unsigned char * const key) noexcept
+	{
+		acc.low += mix16B(input1, key);
+		acc.low ^= read64(input2) + read64(input2 + 8);
+		acc.high += mix16B(input2, key + 16);
+		acc.high ^= read64(input1) + read64(input1 + 8);
+	}
+
+	inline Hash128 finishMidSize(const Hash128 &acc, const std::size_t n) noexcept
+	{
+		return Hash128{avalanche(acc.low + acc.high), 0 - avalanche(acc.low * prime64_1 + acc.high * prime64_4 +
+				static_cast<std::uint64_t>(n) * prime64_2)};
+	}
+
+	Hash128 hash17To128(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		Hash128 acc{static_cast<std::uint64_t>(n) * prime64_1, 0};
+		if (n > 32) {
+			if (n > 64) {
+				if (n > 96) {
+					mix32B(acc, input + 48, input + n - 64, secret + 96);
+				}
+				mix32B(acc, input + 32, input + n - 48, secret + 64);
+			}
+			mix32B(acc, input + 16, input + n - 32, secret + 32);
+		}
+		mix32B(acc, input, input + n - 16, secret);
+		return finishMidSize(acc, n);
+	}
+
+	Hash128 hash129To240(const unsigned char * const input, const std::size_t n) noexcept
+	{
+		constexpr std::size_t startOffset = 3;
+		constexpr std::size_t lastOffset = 17;
+
+		const std::size_t rounds = n / 32;
+		Hash128 acc{static_cast<std::uint64_t>(n) * prime64_1, 0};
+		std::size_t i = 0;
+		for (; i < 4; ++i) {
+			mix32B(acc, input + 32 * i, input + 32 * i + 16, secret + 32 * i);
+		}
+		acc.low = avalanche(acc.low);
+		acc.high = avalanche(acc.high);
+		for (; i < rounds; ++i) {
+			mix32B(acc, input + 32 * i, input + 32 * i + 16, secret + startOffset + 32 * (i - 4));
+		}
+		mix32B(acc, input + n - 16, input + n - 32, secret + secretSizeMin - lastOffset - 16);
+		return finishMidSize(acc, n);
+	}
+
+	inline void accumulate512(std::uint64_t * const acc, const unsigned char * const input,
+			const unsigned char * const key) noexcept
+	{
+#ifdef __SSE2__
+		__m128i * const xacc = reinterpret_cast<__m128i *>(acc);
+		for (int i = 0; i < 4; ++i) {
+			const __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i *>(input) + i);
+			const __m128i dataKey = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i *>(key) + i));
+			// The high halves of both 64-bit lanes are multiplied by the low ones.
+			const __m128i dataKeyHigh = _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1));
+			const __m128i product = _mm_mul_epu32(dataKey, dataKeyHigh);
+			// The lanes of the data are swapped, so that each is added to the neighbour accumulator.
+			const __m128i dataSwap = _mm_shuffle_epi32(data, _MM_SHUFFLE(1, 0, 3, 2));
+			xacc[i] = _mm_add_epi64(product, _mm_add_epi64(xacc[i], dataSwap));
+		}
+#else
+		for (std::size_t i = 0; i < 8; ++i) {
+			const std::uint64_t data = read64(input + 8 * i);
+			const std::uint64_t dataKey = data ^ read64(key + 8 * i);
+			acc[i ^ 1] += data;
+			acc[i] += mul32To64(dataKey, dataKey >> 32);
+		}
+#endif
+	}
+
+	inline void scrambleAcc(std::uint64_t * const acc, const unsigned char * const key) noexcept
+	{
+#ifdef __SSE2__
+		__m128i * const xacc = reinterpret_cast<__m128i *>(acc);
+		const __m128i prime = _mm_set1_epi32(static_cast<int>(prime32_1));
+		for (int i = 0; i < 4; ++i) {
+			const __m128i data = _mm_xor_si128(xacc[i], _mm_srli_epi64(xacc[i], 47));
+			const __m128i dataKey = _mm_xor_si128(data, _mm_loadu_si128(reinterpret_cast<const __m128i *>(key) + i));
+			const __m128i dataKeyHigh = _mm_shuffle_epi32(dataKey, _MM_SHUFFLE(0, 3, 0, 1));
+			const __m128i productLow = _mm_mul_epu32(dataKey, prime);
+			const __m128i productHigh = _mm_mul_epu32(dataKeyHigh, prime);
+			xacc[i] = _mm_add_epi64(productLow, _mm_slli_epi64(productHigh, 32));
+		}
+#else
+		for (std::size_t i = 0; i < 8; ++i) {
+			acc[i] = (xorShift64(acc[i], 47) ^ read64(key + 8 * i)) * prime32_1;
+		}
+#endif
+	}
+
+	inline void accumulate(std::uint64_t * const acc, const unsigned char * const input,
+			const unsigned char * const key, const std::size_t stripes) noexcept
+	{
+		for (std::size_t i = 0; i < stripes; ++i) {
+			accumulate512(acc, input + i * stripeSize, key + i * secretConsumeRate);
+		}
+	}
+
+	// Accumulates the stripes, scrambling the accumulators at the end of each block.
+	void consumeStripes(std::uint64_t * const acc, std::size_t &blockStripes, const unsigned char *input,
+			std::size_t stripes) noexcept
+	{
+		while (blockStripes + stripes >= stripesPerBlock) {
+			const std::size_t toEnd = stripesPerBlock - blockStripes;
+			accumulate(acc, input, secret + blockStripes * secretConsumeRate, toEnd);
+			scrambleAcc(acc, secret + secretSize - stripeSize);
+			input += toEnd * stripeSize;
+			stripes -= toEnd;
+			blockStripes = 0;
+		}
+		accumulate(acc, input, secret + blockStripes * secretConsumeRate, stripes);
+		blockStripes += stripes;
+	}
+
+	inline std::uint64_t mergeAccs(const std::uint64_t * const acc, const unsigned char * const key,
+			std::uint64_t start) noexcept
+	{
+		for (std::size_t i = 0; i < 4; ++i) {
+			start += mul128Fold64(acc[2 * i] ^ read64(key + 16 * i), acc[2 * i + 1] ^ read64(key + 16 * i + 8));
+		}
+		return avalanche(start);
+	}
+}
+
+void mirror::XXH3Hasher::reset() noexcept
+{
+	m_acc[0] = prime32_3;
+	m_acc[1] = prime64_1;
+	m_acc[2] = prime64_2;
+	m_acc[3] = prime64_3;
+	m_acc[4] = prime64_4;
+	m_acc[5] = prime32_2;
+	m_acc[6] = prime64_5;
+	m_acc[7] = prime32_1;
+	m_bufSize = 0;
+	m_blockStripes = 0;
+	m_totalSize = 0;
+}
+
+void mirror::XXH3Hasher::update(const unsigned char *data, std::size_t n) noexcept
+{
+	constexpr std::size_t bufferStripes = bufferSize / stripeSize;
+
+	m_totalSize += n;
+	if (m_bufSize + n <= bufferSize) {
+		std::memcpy(m_buf + m_bufSize, data, n);
+		m_bufSize += n;
+		return;
+	}
+
+	/*
+	 * The buffer is consumed only when more data follows, since the last stripe is processed differently.
+	 * For the same reason data is consumed in place only while more than bufferSize bytes are left.
+	 */
+	if (m_bufSize > 0) {
+		const std::size_t fillSize = bufferSize - m_bufSize;
+		std::memcpy(m_buf + m_bufSize, data, fillSize);
+		data += fillSize;
+		n -= fillSize;
+		consumeStripes(m_acc, m_blockStripes, m_buf, bufferStripes);
+		m_bufSize = 0;
+	}
+	if (n > bufferSize) {
+		const std::size_t stripes = (n - 1) / stripeSize / bufferStripes * bufferStripes;
+		consumeStripes(m_acc, m_blockStripes, data, stripes);
+		data += stripes * stripeSize;
+		n -= stripes * stripeSize;
+		// The last stripe consumed is kept in case the rest is shorter than a stripe (see finish()).
+		std::memcpy(m_buf + bufferSize - stripeSize, data - stripeSize, stripeSize);
+	}
+	std::memcpy(m_buf, data, n);
+	m_bufSize = n;
+}
+
+void mirror::XXH3Hasher::finish(unsigned char dest[digestSize]) const noexcept
+{
+	Hash128 h;
+	if (m_totalSize <= midSizeMax) {
+		if (m_totalSize <= 16) {
+			h = hash0To16(m_buf, m_bufSize);
+		} else if (m_totalSize <= 128) {
+			h = hash17To128(m_buf, m_bufSize);
+		} else {
+			h = hash129To240(m_buf, m_bufSize);
+		}
+	} else {
+		alignas(16) std::uint64_t acc[8];
+		std::memcpy(acc, m_acc, sizeof(acc));
+		const unsigned char * const lastStripeKey = secret + secretSize - stripeSize - secretLastAccStart;
+		if (m_bufSize >= stripeSize) {
+			std::size_t blockStripes = m_blockStripes;
+			consumeStripes(acc, blockStripes, m_buf, (m_bufSize - 1) / stripeSize);
+			accumulate512(acc, m_buf + m_bufSize - stripeSize, lastStripeKey);
+		} else {
+			// The last stripe is made up of the end of the data consumed before and the data buffered.
+			unsigned char lastStripe[stripeSize];
+			const std::size_t catchUpSize = stripeSize - m_bufSize;
+			std::memcpy(lastStripe, m_buf + bufferSize - catchUpSize, catchUpSize);
+			std::memcpy(lastStripe + catchUpSize, m_buf, m_bufSize);
+			accumulate512(acc, lastStripe, lastStripeKey);
+		}
+		h.low = mergeAccs(acc, secret + secretMergeAccsStart, m_totalSize * prime64_1);
+		h.high = mergeAccs(acc, secret + secretSize - sizeof(acc) - secretMergeAccsStart, ~(m_totalSize * prime64_2));
+	}
+	writeBigEndian64(h.high, dest);
+	writeBigEndian64(h.low, dest + 8);
+}
@@ -0,0 +1,52 @@
+/* mirror - a tool to make mirrors of files or directories and to check consistency of the existing mirrors.
+Copyright (C) 2017-2019 Dźmitry Laŭčuk
+
+This program is free software: you can redistribute it and/or modify
+it under the terms of the GNU General Public License as published by
+the Free Software Foundation, either version 3 of the License, or
+(at your option) any later version.
+
+This program is distributed in the hope that it will be useful,
+but WITHOUT ANY WARRANTY; without even the implied warranty of
+MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+GNU General Public License for more details.
+
+You should have received a copy of the GNU General Public License
+along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+#ifndef MIRROR_XXH3_HPP_
+#define MIRROR_XXH3_HPP_
+
+#include <cstddef>
+#include <cstdint>
+
+namespace mirror
+{
+	/*
+	 * Calculates the 128-bit XXH3 hash (with the seed 0 and the default secret) of the data passed in any
+	 * number of parts. The result is bit-identical to XXH3_128bits() of xxHash 0.8 for the whole data.
+	 */
+	class XXH3Hasher
+	{
+	public:
+		static constexpr std::size_t digestSize = 16;
+
+		XXH3Hasher() noexcept { reset(); }
+
+		void reset() noexcept;
+		void update(const unsigned char *data, std::size_t n) noexcept;
+		// Writes the canonical (big-endian) representation of the hash, as XXH128_canonicalFromHash() does.
+		void finish(unsigned char dest[digestSize]) const noexcept;
+	private:
+		// Four stripes of 64 bytes. Inputs of up to 240 bytes are hashed as a whole, so they must fit, too.
+		static constexpr std::size_t bufferSize = 256;
+
+		alignas(16) std::uint64_t m_acc[8];
+		alignas(16) unsigned char m_buf[bufferSize];
+		std::size_t m_bufSize;
+		// The number of stripes accumulated since the accumulators are scrambled last.
+		std::size_t m_blockStripes;
+		std::uint64_t m_totalSize;
+	};
+}
+
+#endif // MIRROR_XXH3_HPP_